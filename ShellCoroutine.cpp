@@ -0,0 +1,277 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Commands written as C++20 coroutines.
+ *
+ * This is the implementation. See `"ShellCoroutine.h"` for documentation.
+ */
+#include "ShellCoroutine.h"
+
+#if SHELL_HAVE_COROUTINES
+
+#include <string.h>
+
+#include <Arduino.h>
+
+#if defined(ARDUINO_ARCH_ESP32)
+#include <freertos/timers.h>
+#else
+#include <timers.h>
+#endif
+
+struct Coroutine {
+  ShellTask::Handle handle;
+  Stream *out;
+  int argc;
+  const char *argv[SHELL_COROUTINE_ARGS + 1];
+  char line[SHELL_COROUTINE_LINE];
+};
+
+static Coroutine coroutines[SHELL_COROUTINE_MAX];
+static unsigned long (*now_ms)() = millis;
+static Shell *owner;
+static TimerHandle_t wakeup;
+static Coroutine *active; // the one running, which cannot be destroyed
+
+void shellCoroutineClock(unsigned long (*clock)()) {
+  now_ms = clock;
+}
+
+void ShellAwaiter::await_suspend(std::coroutine_handle<> handle) {
+  // only coroutine commands wait on these
+  ShellTask::promise_type &promise =
+      ShellTask::Handle::from_address(handle.address()).promise();
+  promise.waiting = this;
+  promise.deadline = now_ms() + timeout;
+}
+
+bool ShellRead::ready(ShellAwaiter *self) {
+  ShellRead *read = (ShellRead *)self;
+  if (read->stream->available() <= 0) return false;
+  read->c = read->stream->read();
+  return read->c >= 0;
+}
+
+bool ShellReceive::ready(ShellAwaiter *self) {
+  ShellReceive *receive = (ShellReceive *)self;
+  return xQueueReceive(receive->queue, receive->item, 0) == pdTRUE;
+}
+
+bool ShellEvent::Wait::ready(ShellAwaiter *self) {
+  Wait *wait = (Wait *)self;
+  return atomic_exchange(&wait->event->f_set, 0);
+}
+
+void ShellEvent::signal() {
+  atomic_store(&f_set, 1);
+  Shell *shell = __atomic_load_n(&owner, __ATOMIC_ACQUIRE);
+  if (shell) shell->wake();
+}
+
+static void release(Coroutine &co) {
+  co.handle.destroy();
+  co.handle = nullptr;
+}
+
+/*
+ * Run a coroutine until it waits or ends. Returns true if it ended, with
+ * its result in `result`.
+ */
+static bool step(Coroutine &co, int *result) {
+  co.handle.promise().waiting = nullptr;
+  active = &co;
+  co.handle.resume();
+  active = nullptr;
+  if (!co.handle.done()) return false;
+  *result = co.handle.promise().result;
+  release(co);
+  return true;
+}
+
+static void ring(TimerHandle_t) {
+  Shell *shell = __atomic_load_n(&owner, __ATOMIC_ACQUIRE);
+  if (shell) shell->wake();
+}
+
+/*
+ * Resume every coroutine whose wait is over, then arm the timer for the
+ * nearest deadline, so delays are not rounded up to the shell's polling.
+ */
+static void run(Shell &, void *) {
+  for (size_t i = 0; i < SHELL_COROUTINE_MAX; i++) {
+    Coroutine &co = coroutines[i];
+    if (!co.handle) continue;
+
+    ShellTask::promise_type &promise = co.handle.promise();
+    ShellAwaiter *waiting = promise.waiting;
+    bool resume = !waiting;
+    if (waiting && waiting->check) {
+      waiting->f_done = waiting->check(waiting);
+      resume = waiting->f_done;
+    }
+    if (!resume && waiting->timeout != SHELL_FOREVER) {
+      resume = (long)(now_ms() - promise.deadline) >= 0;
+    }
+
+    int result;
+    if (resume && step(co, &result) && result != 0) {
+      co.out->printf("[%u] Exit %d\n", (unsigned)i, result);
+    }
+  }
+
+  if (!wakeup || now_ms != millis) return;
+  unsigned long now = now_ms();
+  long nearest = 20;
+  for (const Coroutine &co : coroutines) {
+    if (!co.handle) continue;
+    const ShellTask::promise_type &promise = co.handle.promise();
+    if (!promise.waiting || promise.waiting->timeout == SHELL_FOREVER) continue;
+    long left = (long)(promise.deadline - now);
+    if (left < nearest) nearest = left;
+  }
+  if (nearest < 20) {
+    TickType_t ticks = nearest > 0 ? pdMS_TO_TICKS(nearest) : 0;
+    xTimerChangePeriod(wakeup, ticks ? ticks : 1, 0);
+  }
+}
+
+/*
+ * The shell running the coroutines stops: end them, as `kill all` would,
+ * and let the next shell to spawn one take over.
+ */
+static void stop(Shell &, void *) {
+  __atomic_store_n(&owner, nullptr, __ATOMIC_RELEASE);
+  for (Coroutine &co : coroutines) {
+    if (co.handle) release(co);
+  }
+  if (wakeup) xTimerDelete(wakeup, 0);
+  wakeup = nullptr;
+}
+
+int shellSpawn(ShellCoroutineEntry entry, int argc, const char *const *argv,
+               Stream *serial) {
+  Shell *shell = Shell::current();
+  if (!shell) {
+    serial->printf("%s: Not running in a shell\n", argv[0]);
+    return 1;
+  }
+  if (owner && owner != shell) {
+    serial->printf("%s: Coroutines belong to another shell\n", argv[0]);
+    return 1;
+  }
+  if (!owner) {
+    if (!shell->addService(run, nullptr, stop)) {
+      serial->printf("%s: Too many shell services\n", argv[0]);
+      return 1;
+    }
+    wakeup = xTimerCreate("shell-co", 1, pdFALSE, nullptr, ring);
+    __atomic_store_n(&owner, shell, __ATOMIC_RELEASE);
+  }
+
+  size_t id = 0;
+  while (id < SHELL_COROUTINE_MAX && coroutines[id].handle)
+    id++;
+  if (id == SHELL_COROUTINE_MAX) {
+    serial->printf("%s: At most %d coroutines can run\n", argv[0],
+                   SHELL_COROUTINE_MAX);
+    return 1;
+  }
+  Coroutine &co = coroutines[id];
+
+  // the line is reused once the command returns; keep a copy
+  if (argc > SHELL_COROUTINE_ARGS) {
+    serial->printf("%s: Too many arguments\n", argv[0]);
+    return 1;
+  }
+  size_t len = 0;
+  for (int i = 0; i < argc; i++) {
+    size_t n = strlen(argv[i]) + 1;
+    if (len + n > sizeof(co.line)) {
+      serial->printf("%s: Command line too long\n", argv[0]);
+      return 1;
+    }
+    memcpy(&co.line[len], argv[i], n);
+    co.argv[i] = &co.line[len];
+    len += n;
+  }
+  co.argv[argc] = nullptr;
+  co.argc = argc;
+  co.out = serial;
+
+  co.handle = entry(argc, co.argv, serial).release();
+  if (!co.handle) {
+    serial->printf("%s: Out of memory\n", argv[0]);
+    return 1;
+  }
+  int result;
+  if (step(co, &result)) return result;
+  serial->printf("[%u]\n", (unsigned)id);
+  return 0;
+}
+
+int cmdPs(int, const char *const *, Stream *serial) {
+  unsigned long now = now_ms();
+  for (size_t i = 0; i < SHELL_COROUTINE_MAX; i++) {
+    const Coroutine &co = coroutines[i];
+    if (!co.handle) continue;
+
+    serial->printf("[%u]", (unsigned)i);
+    for (int j = 0; j < co.argc; j++)
+      serial->printf(" %s", co.argv[j]);
+    const ShellTask::promise_type &promise = co.handle.promise();
+    if (promise.waiting && promise.waiting->timeout != SHELL_FOREVER) {
+      long left = (long)(promise.deadline - now);
+      serial->printf(", %lums left", (unsigned long)(left > 0 ? left : 0));
+    }
+    serial->print('\n');
+  }
+  return 0;
+}
+
+int cmdKill(int argc, const char *const *argv, Stream *serial) {
+  if (argc != 2) {
+    serial->print("usage: kill id|all\n");
+    return 1;
+  }
+
+  if (!strcmp(argv[1], "all")) {
+    for (Coroutine &co : coroutines) {
+      if (co.handle && &co != active) release(co);
+    }
+    return 0;
+  }
+
+  char *end;
+  unsigned long id = strtoul(argv[1], &end, 0);
+  if (*end != '\0' || id >= SHELL_COROUTINE_MAX || !coroutines[id].handle) {
+    serial->printf("kill: No such coroutine: %s\n", argv[1]);
+    return 1;
+  }
+  if (&coroutines[id] == active) {
+    serial->print("kill: A coroutine cannot kill itself\n");
+    return 1;
+  }
+  release(coroutines[id]);
+  return 0;
+}
+
+#endif
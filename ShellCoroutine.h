@@ -0,0 +1,299 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Commands written as C++20 coroutines, which wait without blocking the
+ * shell and without a task of their own.
+ *
+ *     static ShellTask cmdBlink(int argc, const char *const *argv,
+ *                               Stream *serial) {
+ *       for (int i = 0; i < 10; i++) {
+ *         digitalWrite(LED_BUILTIN, i & 1);
+ *         co_await shellDelay(500);
+ *       }
+ *       co_return 0;
+ *     }
+ *
+ *     constexpr Command commands[] = {
+ *         {"blink", shellCoroutine<cmdBlink>},
+ *         {"kill", cmdKill},
+ *         {"ps", cmdPs},
+ *     };
+ *
+ * A coroutine command runs on the shell's task like any other until it
+ * first waits. The shell then prints its id, goes back to reading
+ * command lines, and resumes it from a service once what it waits for has
+ * happened. Many can be in flight at once, each costing only its coroutine
+ * frame, allocated from the heap, and a slot of `SHELL_COROUTINE_LINE`
+ * bytes holding a copy of its arguments. At most `SHELL_COROUTINE_MAX` run
+ * at a time. `ps` lists them, and `kill` ends one at the point it waits,
+ * running the destructors of its locals. Coroutines belong to the shell
+ * that spawns the first; when it stops, they are all ended.
+ *
+ * A coroutine may `co_await`:
+ *
+ *   - `shellDelay(ms)`, to sleep;
+ *   - `shellRead(stream, timeout)`, for a byte from a stream, or -1 on
+ *     timeout;
+ *   - `shellReceive(queue, &item, timeout)`, for an item from a FreeRTOS
+ *     queue, or false on timeout;
+ *   - `event.wait(timeout)` on a `ShellEvent`, until another task calls
+ *     `event.signal()`, or false on timeout.
+ *
+ * Timeouts are in milliseconds; `SHELL_FOREVER` waits without one. Waits
+ * are checked whenever the shell runs its services: at once for events,
+ * within a tick for delays and timeouts, and within 20 milliseconds for
+ * streams and queues. Reading the shell's own stream competes with the
+ * shell for input; it suits other ports better.
+ *
+ * `shellCoroutineClock` swaps in another clock, such as a simulated one on
+ * the host, to step through delays without waiting for them.
+ *
+ * This needs a compiler with coroutines, such as GCC 10 or later with
+ * `-std=gnu++20`. Elsewhere this file is left out.
+ */
+#ifndef TOYSHELL_COROUTINE_H
+#define TOYSHELL_COROUTINE_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "ToyShell.h"
+
+#if defined(__cpp_impl_coroutine)
+#define SHELL_HAVE_COROUTINES 1
+
+#include <coroutine>
+
+#if defined(ARDUINO_ARCH_ESP32)
+// The ESP32 core puts FreeRTOS headers in a custom location. Make it happy.
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#else
+// Include the usual FreeRTOS central header.
+#include <Arduino_FreeRTOS.h>
+#include <queue.h>
+#endif
+
+#ifndef SHELL_COROUTINE_MAX
+#define SHELL_COROUTINE_MAX 8
+#endif
+#ifndef SHELL_COROUTINE_LINE
+#define SHELL_COROUTINE_LINE 64
+#endif
+#ifndef SHELL_COROUTINE_ARGS
+#define SHELL_COROUTINE_ARGS 8
+#endif
+
+/**
+ * A timeout meaning no timeout.
+ */
+#define SHELL_FOREVER ((unsigned long)-1)
+
+/**
+ * What a coroutine is waiting for. The awaitables below are all made of
+ * one; `check` is called from the shell's task until it returns true or
+ * the timeout passes. A null `check` waits for the timeout alone.
+ */
+struct ShellAwaiter {
+  bool (*check)(ShellAwaiter *self);
+  unsigned long timeout;
+  bool f_done = false; // `check` returned true
+
+  ShellAwaiter(bool (*check)(ShellAwaiter *), unsigned long timeout)
+      : check(check), timeout(timeout) {}
+
+  bool await_ready() {
+    if (check) f_done = check(this);
+    return f_done || timeout == 0;
+  }
+  void await_suspend(std::coroutine_handle<> handle);
+};
+
+/**
+ * The return type of coroutine commands. See `shellCoroutine`.
+ */
+class ShellTask {
+public:
+  struct promise_type {
+    ShellAwaiter *waiting = nullptr;
+    unsigned long deadline = 0;
+    int result = 0;
+
+    ShellTask get_return_object() {
+      return ShellTask(
+          std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    static ShellTask get_return_object_on_allocation_failure() {
+      return ShellTask(nullptr);
+    }
+    static void *operator new(size_t size) noexcept { return malloc(size); }
+    static void operator delete(void *frame) { free(frame); }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    void return_value(int value) { result = value; }
+    void unhandled_exception() { abort(); }
+  };
+  using Handle = std::coroutine_handle<promise_type>;
+
+  explicit ShellTask(Handle handle) : handle(handle) {}
+  ShellTask(ShellTask &&other) : handle(other.handle) {
+    other.handle = nullptr;
+  }
+  ShellTask(ShellTask &other) = delete;
+  ~ShellTask() {
+    if (handle) handle.destroy();
+  }
+
+  /**
+   * Take the coroutine over from this object.
+   */
+  Handle release() {
+    Handle taken = handle;
+    handle = nullptr;
+    return taken;
+  }
+
+private:
+  Handle handle;
+};
+
+typedef ShellTask (*ShellCoroutineEntry)(int argc, const char *const *argv,
+                                         Stream *serial);
+
+/**
+ * Start a coroutine command. Returns what it returned if it finished
+ * without waiting, 0 if it is still running, or 1 if it could not start.
+ */
+int shellSpawn(ShellCoroutineEntry entry, int argc, const char *const *argv,
+               Stream *serial);
+
+/**
+ * The entry point to put in a `Command` for a coroutine command.
+ */
+template <ShellCoroutineEntry entry>
+int shellCoroutine(int argc, const char *const *argv, Stream *serial) {
+  return shellSpawn(entry, argc, argv, serial);
+}
+
+/**
+ * Use `clock` for delays and timeouts rather than `millis`.
+ */
+void shellCoroutineClock(unsigned long (*clock)());
+
+struct ShellDelay : ShellAwaiter {
+  ShellDelay(unsigned long ms) : ShellAwaiter(nullptr, ms) {}
+  void await_resume() {}
+};
+
+/**
+ * Sleep for `ms` milliseconds.
+ */
+inline ShellDelay shellDelay(unsigned long ms) {
+  return ShellDelay(ms);
+}
+
+struct ShellRead : ShellAwaiter {
+  Stream *stream;
+  int c = -1;
+
+  ShellRead(Stream *stream, unsigned long timeout)
+      : ShellAwaiter(ready, timeout), stream(stream) {}
+  static bool ready(ShellAwaiter *self);
+  int await_resume() { return f_done ? c : -1; }
+};
+
+/**
+ * Read a byte from `stream`, waiting up to `timeout` milliseconds for one.
+ * Gives the byte, or -1 on timeout.
+ */
+inline ShellRead shellRead(Stream &stream,
+                           unsigned long timeout = SHELL_FOREVER) {
+  return ShellRead(&stream, timeout);
+}
+
+struct ShellReceive : ShellAwaiter {
+  QueueHandle_t queue;
+  void *item;
+
+  ShellReceive(QueueHandle_t queue, void *item, unsigned long timeout)
+      : ShellAwaiter(ready, timeout), queue(queue), item(item) {}
+  static bool ready(ShellAwaiter *self);
+  bool await_resume() { return f_done; }
+};
+
+/**
+ * Receive an item from `queue` into `item`, waiting up to `timeout`
+ * milliseconds for one. Gives false on timeout.
+ */
+inline ShellReceive shellReceive(QueueHandle_t queue, void *item,
+                                 unsigned long timeout = SHELL_FOREVER) {
+  return ShellReceive(queue, item, timeout);
+}
+
+/**
+ * A flag another task raises to resume a coroutine waiting on it.
+ */
+class ShellEvent {
+private:
+  atomic_bool f_set;
+
+  struct Wait : ShellAwaiter {
+    ShellEvent *event;
+
+    Wait(ShellEvent *event, unsigned long timeout)
+        : ShellAwaiter(ready, timeout), event(event) {}
+    static bool ready(ShellAwaiter *self);
+    bool await_resume() { return f_done; }
+  };
+public:
+  ShellEvent() : f_set(0) {}
+  ShellEvent(ShellEvent &other) = delete;
+
+  /**
+   * Raise the flag, and have the shell look at once. May be called from
+   * any task.
+   */
+  void signal();
+
+  /**
+   * Wait up to `timeout` milliseconds for the flag, and lower it again.
+   * Gives false on timeout. A signal given before waiting is not lost.
+   */
+  Wait wait(unsigned long timeout = SHELL_FOREVER) {
+    return Wait(this, timeout);
+  }
+};
+
+/**
+ * `ps`: list running coroutine commands.
+ */
+int cmdPs(int argc, const char *const *argv, Stream *serial);
+
+/**
+ * `kill id|all`: end running coroutine commands.
+ */
+int cmdKill(int argc, const char *const *argv, Stream *serial);
+
+#endif
+
+#endif
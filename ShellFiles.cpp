@@ -0,0 +1,322 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Commands for looking at files.
+ *
+ * This is the implementation. See `"ShellFiles.h"` for documentation.
+ */
+#include "ShellFiles.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// the rows `hexdump` collects before writing them out
+#define HEXDUMP_ROWS 8
+#define HEXDUMP_ROW 79
+
+static const ShellFs *filesystem;
+
+void shellSetFs(const ShellFs *fs) {
+  filesystem = fs;
+}
+
+static const ShellFs *need(const char *cmd, Stream *serial) {
+  if (!filesystem) serial->printf("%s: No filesystem\n", cmd);
+  return filesystem;
+}
+
+/*
+ * A buffer of `SHELL_FS_BLOCK` bytes, from scratch memory if it has room.
+ * `heap` tells whether it has to be freed.
+ */
+static char *takeBlock(bool *heap) {
+  char *block = (char *)Shell::scratch(SHELL_FS_BLOCK);
+  *heap = !block;
+  if (*heap) block = (char *)malloc(SHELL_FS_BLOCK);
+  return block;
+}
+
+static void printEntry(void *arg, const char *name, size_t size, bool dir) {
+  Stream *serial = (Stream *)arg;
+  if (dir) serial->printf("%10s  %s/\n", "", name);
+  else serial->printf("%10lu  %s\n", (unsigned long)size, name);
+}
+
+int cmdLs(int argc, const char *const *argv, Stream *serial) {
+  if (argc > 2) {
+    serial->print("usage: ls [directory]\n");
+    return 1;
+  }
+  const ShellFs *fs = need("ls", serial);
+  if (!fs) return 1;
+  const char *path = argc > 1 ? argv[1] : "/";
+  if (!fs->list(path, printEntry, serial)) {
+    serial->printf("ls: No such directory: %s\n", path);
+    return 1;
+  }
+  return 0;
+}
+
+int cmdCat(int argc, const char *const *argv, Stream *serial) {
+  bool raw = argc == 3 && !strcmp(argv[1], "-r");
+  if (argc != 2 && !raw) {
+    serial->print("usage: cat [-r] file\n");
+    return 1;
+  }
+  const ShellFs *fs = need("cat", serial);
+  if (!fs) return 1;
+  const char *path = argv[argc - 1];
+  void *file = fs->open(path, false);
+  if (!file) {
+    serial->printf("cat: Cannot open %s\n", path);
+    return 1;
+  }
+  long left = raw ? fs->size(file) : -1;
+  bool heap;
+  char *block = takeBlock(&heap);
+  if (!block || (raw && left < 0)) {
+    fs->close(file);
+    if (heap) free(block);
+    serial->print(block ? "cat: Size unknown\n" : "cat: Out of memory\n");
+    return 1;
+  }
+
+  if (raw) serial->printf("raw %ld\n", left);
+  const char *error = nullptr;
+  char last = '\n';
+  while (!raw || left > 0) {
+    size_t want = SHELL_FS_BLOCK;
+    if (raw && (unsigned long)left < want) want = left;
+    long count = fs->read(file, block, want);
+    if (count < 0) error = "cat: Cannot read %s\n";
+    if (count <= 0) break;
+    serial->write(block, count);
+    last = block[count - 1];
+    if (raw) left -= count;
+    if (Shell::cancelled()) {
+      error = "cat: Stopped\n";
+      break;
+    }
+  }
+  fs->close(file);
+
+  if (raw && left > 0) {
+    // keep the frame whole for whoever is reading it
+    if (!error) error = "cat: %s got shorter\n";
+    memset(block, 0, SHELL_FS_BLOCK);
+    for (; left > 0; left -= SHELL_FS_BLOCK)
+      serial->write(block, left < SHELL_FS_BLOCK ? left : SHELL_FS_BLOCK);
+  } else if (!raw && last != '\n') {
+    serial->print('\n');
+  }
+  if (heap) free(block);
+  if (error) serial->printf(error, path);
+  return error ? 1 : 0;
+}
+
+/*
+ * Format 16 bytes or fewer at `offset` as `hexdump -C` does.
+ */
+static size_t formatRow(char *out, unsigned long offset, const uint8_t *row,
+                        size_t n) {
+  static const char digits[] = "0123456789abcdef";
+  char *p = out;
+  for (int shift = 28; shift >= 0; shift -= 4)
+    *p++ = digits[(offset >> shift) & 15];
+  *p++ = ' ';
+  for (size_t i = 0; i < 16; i++) {
+    if (i % 8 == 0) *p++ = ' ';
+    if (i < n) {
+      *p++ = digits[row[i] >> 4];
+      *p++ = digits[row[i] & 15];
+    } else {
+      *p++ = ' ';
+      *p++ = ' ';
+    }
+    *p++ = ' ';
+  }
+  *p++ = ' ';
+  *p++ = '|';
+  for (size_t i = 0; i < n; i++)
+    *p++ = row[i] >= 0x20 && row[i] < 0x7f ? row[i] : '.';
+  *p++ = '|';
+  *p++ = '\n';
+  return p - out;
+}
+
+int cmdHexdump(int argc, const char *const *argv, Stream *serial) {
+  unsigned long skip = 0;
+  unsigned long limit = (unsigned long)-1;
+  int i = 1;
+  for (; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+    char *end;
+    unsigned long value = strtoul(argv[i + 1], &end, 0);
+    if (*end) break;
+    if (!strcmp(argv[i], "-s")) skip = value;
+    else if (!strcmp(argv[i], "-n")) limit = value;
+    else break;
+  }
+  if (i + 1 != argc) {
+    serial->print("usage: hexdump [-s skip] [-n count] file\n");
+    return 1;
+  }
+  const ShellFs *fs = need("hexdump", serial);
+  if (!fs) return 1;
+  const char *path = argv[i];
+  void *file = fs->open(path, false);
+  if (!file) {
+    serial->printf("hexdump: Cannot open %s\n", path);
+    return 1;
+  }
+  bool heap;
+  uint8_t *block = (uint8_t *)takeBlock(&heap);
+  if (!block) {
+    fs->close(file);
+    serial->print("hexdump: Out of memory\n");
+    return 1;
+  }
+
+  // rows are collected and written several at a time
+  char text[HEXDUMP_ROWS * HEXDUMP_ROW];
+  size_t len = 0;
+  unsigned long offset = 0;
+  const char *error = nullptr;
+  while (limit > 0) {
+    long count = fs->read(file, block, SHELL_FS_BLOCK);
+    if (count < 0) error = "hexdump: Cannot read %s\n";
+    if (count <= 0) break;
+
+    size_t at = 0;
+    if (skip > 0) {
+      at = skip < (unsigned long)count ? skip : count;
+      skip -= at;
+      offset += at;
+    }
+    size_t end = count;
+    if (end - at > limit) end = at + limit;
+    limit -= end - at;
+    while (at < end) {
+      size_t n = end - at < 16 ? end - at : 16;
+      len += formatRow(&text[len], offset, &block[at], n);
+      if (len + HEXDUMP_ROW > sizeof(text)) {
+        serial->write(text, len);
+        len = 0;
+      }
+      at += n;
+      offset += n;
+    }
+    if (Shell::cancelled()) {
+      error = "hexdump: Stopped\n";
+      break;
+    }
+  }
+  fs->close(file);
+  if (heap) free(block);
+
+  serial->write(text, len);
+  serial->printf("%08lx\n", offset);
+  if (error) serial->printf(error, path);
+  return error ? 1 : 0;
+}
+
+int cmdCp(int argc, const char *const *argv, Stream *serial) {
+  if (argc != 3) {
+    serial->print("usage: cp source destination\n");
+    return 1;
+  }
+  const ShellFs *fs = need("cp", serial);
+  if (!fs) return 1;
+  // opening the destination would empty the source
+  const char *source = argv[1], *destination = argv[2];
+  while (*source == '/') source++;
+  while (*destination == '/') destination++;
+  if (!strcmp(source, destination)) {
+    serial->printf("cp: %s and %s are the same file\n", argv[1], argv[2]);
+    return 1;
+  }
+  void *from = fs->open(argv[1], false);
+  if (!from) {
+    serial->printf("cp: Cannot open %s\n", argv[1]);
+    return 1;
+  }
+  void *to = fs->open(argv[2], true);
+  if (!to) {
+    fs->close(from);
+    serial->printf("cp: Cannot create %s\n", argv[2]);
+    return 1;
+  }
+  bool heap;
+  char *block = takeBlock(&heap);
+  const char *error = block ? nullptr : "cp: Out of memory\n";
+  const char *path = argv[1];
+
+  while (!error) {
+    long count = fs->read(from, block, SHELL_FS_BLOCK);
+    if (count < 0) error = "cp: Cannot read %s\n";
+    if (count <= 0) break;
+    if (fs->write(to, block, count) != count) {
+      error = "cp: Cannot write %s\n";
+      path = argv[2];
+    } else if (Shell::cancelled()) {
+      error = "cp: Stopped\n";
+    }
+  }
+  fs->close(from);
+  fs->close(to);
+  if (heap) free(block);
+  if (error) serial->printf(error, path);
+  return error ? 1 : 0;
+}
+
+int cmdRm(int argc, const char *const *argv, Stream *serial) {
+  if (argc < 2) {
+    serial->print("usage: rm file...\n");
+    return 1;
+  }
+  const ShellFs *fs = need("rm", serial);
+  if (!fs) return 1;
+  int result = 0;
+  for (int i = 1; i < argc; i++) {
+    if (!fs->remove(argv[i])) {
+      serial->printf("rm: Cannot remove %s\n", argv[i]);
+      result = 1;
+    }
+  }
+  return result;
+}
+
+int cmdDf(int argc, const char *const *argv, Stream *serial) {
+  const ShellFs *fs = need("df", serial);
+  if (!fs) return 1;
+  uint64_t total, used;
+  if (!fs->usage(&total, &used)) {
+    serial->print("df: Size unknown\n");
+    return 1;
+  }
+  serial->printf("%10s %10s %10s %4s\n", "1K-blocks", "Used", "Available",
+                 "Use%");
+  serial->printf("%10lu %10lu %10lu %3u%%\n", (unsigned long)(total / 1024),
+                 (unsigned long)(used / 1024),
+                 (unsigned long)((total - used) / 1024),
+                 total ? (unsigned)((used * 100 + total - 1) / total) : 0);
+  return 0;
+}
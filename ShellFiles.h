@@ -0,0 +1,197 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Commands for looking at files: `ls`, `cat`, `hexdump`, `cp`, `rm` and
+ * `df`, over whichever filesystem the application hands over.
+ *
+ *     LittleFS.begin();
+ *     shellSetFs(&shellFsOf<LittleFS>);
+ *
+ * Files are read in blocks of `SHELL_FS_BLOCK` bytes, from the start, so
+ * reads line up with the blocks of the filesystem, and each block goes to
+ * the shell's output in one write. The buffer comes from the shell's
+ * scratch memory if it has room, or else from the heap. The default block
+ * fits the default `SHELL_SCRATCH`; raise both together, e.g. to match
+ * 4096-byte flash sectors, or every transfer allocates. `cat -r` frames
+ * the file for programs at the other end: a line `raw SIZE` followed by
+ * exactly SIZE bytes, whatever they are. Long transfers stop early for a
+ * `SHELL_CANCEL` command.
+ */
+#ifndef TOYSHELL_FILES_H
+#define TOYSHELL_FILES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ToyShell.h"
+
+#ifndef SHELL_FS_BLOCK
+#define SHELL_FS_BLOCK 512
+#endif
+
+/**
+ * A filesystem the commands work on. Paths are passed on as typed.
+ */
+struct ShellFs {
+  /**
+   * Open a file for reading, or if `write`, create it or make it empty for
+   * writing. Returns a handle, or `nullptr` on failure.
+   */
+  void *(*open)(const char *path, bool write);
+  /**
+   * Read up to `size` bytes. Returns the number read, 0 at the end of the
+   * file, or -1 on failure.
+   */
+  long (*read)(void *file, void *buffer, size_t size);
+  /**
+   * Write `size` bytes. Returns the number written, or -1 on failure.
+   */
+  long (*write)(void *file, const void *buffer, size_t size);
+  /**
+   * The size of an open file in bytes, or -1 if unknown.
+   */
+  long (*size)(void *file);
+  /**
+   * Close a file opened by `open`.
+   */
+  void (*close)(void *file);
+  /**
+   * Call `each` for every entry of a directory. Returns false if there is
+   * no such directory.
+   */
+  bool (*list)(const char *path,
+               void (*each)(void *arg, const char *name, size_t size,
+                            bool dir),
+               void *arg);
+  /**
+   * Remove a file. Returns false on failure.
+   */
+  bool (*remove)(const char *path);
+  /**
+   * Find the size of the filesystem and how much of it is in use, in
+   * bytes. Returns false if unknown.
+   */
+  bool (*usage)(uint64_t *total, uint64_t *used);
+};
+
+/**
+ * Have the commands work on `fs`, or on nothing if it is `nullptr`.
+ */
+void shellSetFs(const ShellFs *fs);
+
+/**
+ * `ls [directory]`: list the files in a directory, or in `/`.
+ */
+int cmdLs(int argc, const char *const *argv, Stream *serial);
+
+/**
+ * `cat [-r] file`: print a file; with `-r`, framed as `raw SIZE`.
+ */
+int cmdCat(int argc, const char *const *argv, Stream *serial);
+
+/**
+ * `hexdump [-s skip] [-n count] file`: print a file in hexadecimal.
+ */
+int cmdHexdump(int argc, const char *const *argv, Stream *serial);
+
+/**
+ * `cp source destination`: copy a file.
+ */
+int cmdCp(int argc, const char *const *argv, Stream *serial);
+
+/**
+ * `rm file...`: remove files.
+ */
+int cmdRm(int argc, const char *const *argv, Stream *serial);
+
+/**
+ * `df`: print the size of the filesystem and how much of it is in use.
+ */
+int cmdDf(int argc, const char *const *argv, Stream *serial);
+
+#if defined(ARDUINO_ARCH_ESP32)
+#include <FS.h>
+
+/**
+ * The workings of `shellFsOf`.
+ */
+template <auto &filesystem> struct ShellArduinoFs {
+  static void *open(const char *path, bool write) {
+    File *file =
+        new File(filesystem.open(path, write ? FILE_WRITE : FILE_READ));
+    if (!*file || file->isDirectory()) {
+      delete file;
+      return nullptr;
+    }
+    return file;
+  }
+  static long read(void *file, void *buffer, size_t size) {
+    return ((File *)file)->read((uint8_t *)buffer, size);
+  }
+  static long write(void *file, const void *buffer, size_t size) {
+    return ((File *)file)->write((const uint8_t *)buffer, size);
+  }
+  static long size(void *file) {
+    return ((File *)file)->size();
+  }
+  static void close(void *file) {
+    ((File *)file)->close();
+    delete (File *)file;
+  }
+  static bool list(const char *path,
+                   void (*each)(void *arg, const char *name, size_t size,
+                                bool dir),
+                   void *arg) {
+    File dir = filesystem.open(path);
+    if (!dir || !dir.isDirectory()) return false;
+    for (File entry = dir.openNextFile(); entry; entry = dir.openNextFile())
+      each(arg, entry.name(), entry.size(), entry.isDirectory());
+    return true;
+  }
+  static bool remove(const char *path) {
+    return filesystem.remove(path);
+  }
+  static bool usage(uint64_t *total, uint64_t *used) {
+    *total = filesystem.totalBytes();
+    *used = filesystem.usedBytes();
+    return true;
+  }
+};
+
+/**
+ * A `ShellFs` over a filesystem of the ESP32 core, like `LittleFS`,
+ * `SPIFFS`, `FFat` or `SD`. Start the filesystem with `begin` first.
+ */
+template <auto &filesystem>
+constexpr ShellFs shellFsOf = {
+    ShellArduinoFs<filesystem>::open,
+    ShellArduinoFs<filesystem>::read,
+    ShellArduinoFs<filesystem>::write,
+    ShellArduinoFs<filesystem>::size,
+    ShellArduinoFs<filesystem>::close,
+    ShellArduinoFs<filesystem>::list,
+    ShellArduinoFs<filesystem>::remove,
+    ShellArduinoFs<filesystem>::usage,
+};
+#endif
+
+#endif
@@ -0,0 +1,247 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Reaching shells on other boards through this one.
+ *
+ * This is the implementation. See `"ShellGateway.h"` for documentation.
+ */
+#include "ShellGateway.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <Arduino.h>
+
+#define PROMPT "shell> "
+#define PROMPT_LEN (sizeof(PROMPT) - 1)
+#define HASH_BASIS 2166136261u
+
+/*
+ * A line sent to a node. Its echo is recognized by a hash, and the
+ * response goes to `out`.
+ */
+struct Request {
+  Stream *out;
+  uint32_t hash;
+  bool echoed;
+};
+
+/*
+ * What is known about a node: the lines waiting for a response, oldest
+ * first, and the part of a line received so far.
+ */
+struct Node {
+  Request pending[SHELL_GATEWAY_PENDING];
+  uint8_t first;
+  uint8_t count;
+  Stream *last_out;
+  unsigned long heard;
+  size_t len;
+  char line[SHELL_GATEWAY_LINE];
+};
+
+static const GatewayNode *nodes;
+static size_t node_count;
+static Node states[SHELL_GATEWAY_NODES];
+static Shell *owner;
+
+static_assert(SHELL_GATEWAY_LINE > PROMPT_LEN, "SHELL_GATEWAY_LINE too small");
+
+void shellGateway(const GatewayNode *table, size_t count) {
+  nodes = table;
+  node_count = count < SHELL_GATEWAY_NODES ? count : SHELL_GATEWAY_NODES;
+}
+
+static int cmp(const void *k, const void *e) {
+  const char *key = (const char *)k;
+  const GatewayNode *entry = (const GatewayNode *)e;
+  return strcmp(key, entry->name);
+}
+
+/*
+ * Continue an FNV-1a hash over more text.
+ */
+static uint32_t hashText(uint32_t hash, const char *text, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ (uint8_t)text[i]) * 16777619u;
+  }
+  return hash;
+}
+
+/*
+ * The response to the oldest line is complete.
+ */
+static void finish(size_t id) {
+  Node &node = states[id];
+  Request &request = node.pending[node.first];
+  request.out->printf("[%s]\n", nodes[id].name);
+  node.first = (node.first + 1) % SHELL_GATEWAY_PENDING;
+  node.count -= 1;
+}
+
+/*
+ * Deal with a line a node sent: the echo of a line sent to it, or part of
+ * a response to pass on.
+ */
+static void handleLine(size_t id) {
+  Node &node = states[id];
+  size_t len = node.len;
+  node.len = 0;
+  if (len > 0 && node.line[len - 1] == '\r') len -= 1;
+
+  Request *request = node.count ? &node.pending[node.first] : nullptr;
+  if (request && !request->echoed &&
+      hashText(HASH_BASIS, node.line, len) == request->hash) {
+    request->echoed = true;
+    return;
+  }
+
+  // output nobody waits for goes where the last response went
+  Stream *out = request ? request->out : node.last_out;
+  if (out) out->printf("[%s] %.*s\n", nodes[id].name, (int)len, node.line);
+}
+
+static void receive(size_t id) {
+  Node &node = states[id];
+  Stream *stream = nodes[id].stream;
+  int c;
+  while ((c = stream->read()) >= 0) {
+    node.heard = millis();
+    if (c == '\n') {
+      handleLine(id);
+      continue;
+    }
+
+    node.line[node.len++] = c;
+    if (node.len == PROMPT_LEN && !memcmp(node.line, PROMPT, PROMPT_LEN)) {
+      // the node is ready for the next line; whatever it was doing is done
+      node.len = 0;
+      if (node.count && node.pending[node.first].echoed) finish(id);
+    } else if (node.len == sizeof(node.line)) {
+      handleLine(id);
+    }
+  }
+
+  if (node.count && millis() - node.heard >= SHELL_GATEWAY_TIMEOUT) {
+    Stream *out = node.pending[node.first].out;
+    out->printf("[%s] gateway: No response\n", nodes[id].name);
+    finish(id);
+    node.heard = millis();
+  }
+}
+
+static void poll(Shell &, void *) {
+  for (size_t id = 0; id < node_count; id++) {
+    if (states[id].count || nodes[id].stream->available() > 0) receive(id);
+  }
+}
+
+/*
+ * The shell polling the nodes stops: forget the lines waiting for it, and
+ * where it wanted output, so the next shell to route a line starts afresh.
+ */
+static void stop(Shell &, void *) {
+  for (size_t id = 0; id < node_count; id++) {
+    Node &node = states[id];
+    node.first = 0;
+    node.count = 0;
+    node.last_out = nullptr;
+  }
+  owner = nullptr;
+}
+
+static int list(Stream *serial) {
+  for (size_t id = 0; id < node_count; id++) {
+    serial->printf("%s: %u waiting\n", nodes[id].name,
+                   (unsigned)states[id].count);
+  }
+  return 0;
+}
+
+int cmdRoute(int argc, const char *const *argv, Stream *serial) {
+  const char *name = argv[0] + 1;
+  if (*name == '\0') {
+    if (argc == 1) return list(serial);
+    serial->print("usage: @name command...\n");
+    return 1;
+  }
+
+  const GatewayNode *entry = (const GatewayNode *)bsearch(
+      name, nodes, node_count, sizeof(GatewayNode), cmp);
+  if (!entry) {
+    serial->printf("@: No such node: %s\n", name);
+    return 1;
+  }
+  if (argc < 2) {
+    serial->printf("usage: @%s command...\n", name);
+    return 1;
+  }
+
+  Shell *shell = Shell::current();
+  if (!shell) {
+    serial->print("@: Not running in a shell\n");
+    return 1;
+  }
+  if (owner && owner != shell) {
+    serial->print("@: Nodes belong to another shell\n");
+    return 1;
+  }
+  if (!owner) {
+    if (!shell->addService(poll, nullptr, stop)) {
+      serial->print("@: Too many shell services\n");
+      return 1;
+    }
+    owner = shell;
+  }
+
+  size_t id = entry - nodes;
+  Node &node = states[id];
+  if (node.count == SHELL_GATEWAY_PENDING) {
+    serial->printf("@: %s has %d lines waiting already\n", name,
+                   SHELL_GATEWAY_PENDING);
+    return 1;
+  }
+
+  // send the line on, hashing it as the node will echo it
+  Stream *stream = entry->stream;
+  uint32_t hash = HASH_BASIS;
+  for (int i = 1; i < argc; i++) {
+    size_t len = strlen(argv[i]);
+    if (i > 1) {
+      stream->write(' ');
+      hash = hashText(hash, " ", 1);
+    }
+    stream->write((const uint8_t *)argv[i], len);
+    hash = hashText(hash, argv[i], len);
+  }
+  stream->write('\n');
+
+  Request &request =
+      node.pending[(node.first + node.count) % SHELL_GATEWAY_PENDING];
+  request.out = serial;
+  request.hash = hash;
+  request.echoed = false;
+  node.count += 1;
+  node.last_out = serial;
+  node.heard = millis();
+  return 0;
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Reaching shells on other boards through this one.
+ *
+ * Boards further down a chain hang off spare serial ports of this one, each
+ * running a shell of its own. List them in a table and hand it to
+ * `shellGateway`, and add the command `@` to the command table:
+ *
+ *     constexpr GatewayNode nodes[] = {
+ *       {"b1", &Serial1},
+ *       {"b2", &Serial2},
+ *     };
+ *     static_assert(shellSorted(nodes), "nodes must be sorted");
+ *
+ *     constexpr Command commands[] = {
+ *       {"@", cmdRoute},
+ *       ...
+ *     };
+ *
+ * A line starting with `@name` is then sent on to that node, and what the
+ * node prints in response comes back a line at a time, tagged with the
+ * name:
+ *
+ *     shell> @b1 get gain
+ *     shell> [b1] 3
+ *     [b1]
+ *
+ * A tag on its own marks the end of a response. Sending a line does not
+ * wait for the response, so lines can go out to several nodes at once,
+ * and up to `SHELL_GATEWAY_PENDING` lines to each; responses come back as
+ * they arrive, between commands. Nodes may be gateways themselves:
+ * `@b1 @c1 get gain` reaches `c1` behind `b1`. `@` alone lists the nodes.
+ *
+ * The end of a response is recognized by the prompt of the shell on the
+ * node. A node that sends nothing for `SHELL_GATEWAY_TIMEOUT` milliseconds
+ * while a line is outstanding is given up on.
+ *
+ * The nodes belong to the shell that routes the first line. When that
+ * shell stops, the responses still owed to it are dropped and the next
+ * shell to route a line takes the nodes over.
+ */
+#ifndef TOYSHELL_GATEWAY_H
+#define TOYSHELL_GATEWAY_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "ToyShell.h"
+
+#ifndef SHELL_GATEWAY_NODES
+#define SHELL_GATEWAY_NODES 8
+#endif
+#ifndef SHELL_GATEWAY_PENDING
+#define SHELL_GATEWAY_PENDING 4
+#endif
+#ifndef SHELL_GATEWAY_LINE
+#define SHELL_GATEWAY_LINE 128
+#endif
+#ifndef SHELL_GATEWAY_TIMEOUT
+#define SHELL_GATEWAY_TIMEOUT 5000
+#endif
+
+/**
+ * A board reached through this one.
+ */
+struct GatewayNode {
+  /**
+   * The name used after `@`.
+   */
+  const char *name;
+  /**
+   * The port the node's shell listens on.
+   */
+  Stream *stream;
+};
+
+/**
+ * Make a table of nodes available to `@`. The table must be sorted by name
+ * in dictionary order. Call it before the first line is routed.
+ */
+void shellGateway(const GatewayNode *nodes, size_t count);
+
+/**
+ * `@name command...`: send a command line to a node. `@` alone lists the
+ * nodes, with the number of lines waiting for a response from each. List
+ * it under the name `@`; the shell hands it every line whose first word
+ * starts with `@`.
+ */
+int cmdRoute(int argc, const char *const *argv, Stream *serial);
+
+#endif
@@ -0,0 +1,279 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Finding out which commands use the heap, and which leak.
+ *
+ * This is the implementation. See `"ShellHeap.h"` for documentation.
+ */
+#include "ShellHeap.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <Arduino.h>
+
+#if defined(ARDUINO_ARCH_ESP32)
+// The ESP32 core puts FreeRTOS headers in a custom location. Make it happy.
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#else
+// Include the usual FreeRTOS central header.
+#include <Arduino_FreeRTOS.h>
+#endif
+
+#if SHELL_HEAP_STATS
+/*
+ * What the command a shell is running has allocated so far. Only the
+ * shell's tasks touch it.
+ */
+struct HeapRun {
+  Shell *shell; // claimed for good by the first run of a shell
+  atomic_bool f_active;
+  const Command *cmd;
+  uint32_t allocs;
+  size_t bytes;
+  size_t outstanding;
+  size_t peak;
+  bool f_lost; // some blocks were not followed
+  struct {
+    void *ptr;
+    size_t size;
+  } blocks[SHELL_HEAP_BLOCKS];
+};
+
+/*
+ * Totals for a command.
+ */
+struct HeapStats {
+  const Command *cmd;
+  uint32_t runs;
+  uint32_t allocs;
+  size_t bytes;
+  size_t peak;
+  size_t leaked;
+  bool f_lost;
+};
+
+static HeapRun runs[SHELL_INSTANCE_MAX];
+static atomic_uint active; // runs being counted, so others pass quickly
+static HeapStats stats[SHELL_HEAP_COMMANDS];
+static atomic_flag stats_lock = ATOMIC_FLAG_INIT;
+
+static void lock() {
+  while (atomic_flag_test_and_set(&stats_lock))
+    taskYIELD();
+}
+
+static void unlock() {
+  atomic_flag_clear(&stats_lock);
+}
+
+/*
+ * Find the run of the shell whose task is calling, claiming a slot for it
+ * if `claim` is set.
+ */
+static HeapRun *find(bool claim) {
+  Shell *shell = Shell::current();
+  if (!shell) return nullptr;
+  for (HeapRun &run : runs) {
+    Shell *owner = __atomic_load_n(&run.shell, __ATOMIC_ACQUIRE);
+    if (owner == shell) return &run;
+    if (!owner && claim &&
+        __atomic_compare_exchange_n(&run.shell, &owner, shell, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      return &run;
+    }
+  }
+  return nullptr;
+}
+
+static HeapRun *running() {
+  if (atomic_load_explicit(&active, memory_order_relaxed) == 0) return nullptr;
+  HeapRun *run = find(false);
+  return run && atomic_load(&run->f_active) ? run : nullptr;
+}
+
+bool shellHeapBegin(const Command *cmd) {
+  HeapRun *run = find(true);
+  if (!run || atomic_load(&run->f_active)) return false;
+  run->cmd = cmd;
+  run->allocs = 0;
+  run->bytes = 0;
+  run->outstanding = 0;
+  run->peak = 0;
+  run->f_lost = false;
+  memset(run->blocks, 0, sizeof(run->blocks));
+  atomic_store(&run->f_active, 1);
+  atomic_fetch_add(&active, 1);
+  return true;
+}
+
+void shellHeapEnd() {
+  HeapRun *run = running();
+  if (!run) return;
+  atomic_store(&run->f_active, 0);
+  atomic_fetch_sub(&active, 1);
+
+  lock();
+  HeapStats *row = nullptr;
+  for (HeapStats &slot : stats) {
+    if (slot.cmd == run->cmd) {
+      row = &slot;
+      break;
+    }
+    if (!slot.cmd && !row) row = &slot;
+  }
+  if (row) {
+    row->cmd = run->cmd;
+    row->runs += 1;
+    row->allocs += run->allocs;
+    row->bytes += run->bytes;
+    row->leaked += run->outstanding;
+    if (run->peak > row->peak) row->peak = run->peak;
+    if (run->f_lost) row->f_lost = true;
+  }
+  unlock();
+}
+
+void shellHeapTraceAlloc(void *ptr, size_t size) {
+  if (!ptr) return;
+  HeapRun *run = running();
+  if (!run) return;
+  run->allocs += 1;
+  run->bytes += size;
+  for (auto &block : run->blocks) {
+    if (block.ptr) continue;
+    block.ptr = ptr;
+    block.size = size;
+    run->outstanding += size;
+    if (run->outstanding > run->peak) run->peak = run->outstanding;
+    return;
+  }
+  run->f_lost = true;
+}
+
+void shellHeapTraceFree(void *ptr) {
+  if (!ptr) return;
+  HeapRun *run = running();
+  if (!run) return;
+  for (auto &block : run->blocks) {
+    if (block.ptr != ptr) continue;
+    block.ptr = nullptr;
+    run->outstanding -= block.size;
+    return;
+  }
+}
+
+int cmdHeap(int argc, const char *const *argv, Stream *serial) {
+  if (argc > 2 || (argc == 2 && strcmp(argv[1], "reset") != 0)) {
+    serial->print("usage: heap [reset]\n");
+    return 1;
+  }
+  if (argc == 2) {
+    lock();
+    memset(stats, 0, sizeof(stats));
+    unlock();
+    return 0;
+  }
+
+  // printing may allocate; do it from a copy
+  HeapStats copy[SHELL_HEAP_COMMANDS];
+  lock();
+  memcpy(copy, stats, sizeof(stats));
+  unlock();
+
+  serial->printf("%-12s %5s %7s %9s %9s %9s\n", "command", "runs", "allocs",
+                 "bytes", "peak", "leaked");
+  for (const HeapStats &row : copy) {
+    if (!row.cmd) continue;
+    serial->printf("%-12s %5lu %7lu %9lu %9lu %9lu%s\n", row.cmd->name,
+                   (unsigned long)row.runs, (unsigned long)row.allocs,
+                   (unsigned long)row.bytes, (unsigned long)row.peak,
+                   (unsigned long)row.leaked, row.f_lost ? "+" : "");
+  }
+  return 0;
+}
+#else
+bool shellHeapBegin(const Command *cmd) {
+  return false;
+}
+
+void shellHeapEnd() {}
+
+void shellHeapTraceAlloc(void *ptr, size_t size) {}
+
+void shellHeapTraceFree(void *ptr) {}
+
+int cmdHeap(int argc, const char *const *argv, Stream *serial) {
+  serial->print("heap: Built without SHELL_HEAP_STATS\n");
+  return 1;
+}
+#endif
+
+#if SHELL_HEAP_STATS && defined(ARDUINO_ARCH_ESP32) && \
+    defined(CONFIG_HEAP_USE_HOOKS)
+extern "C" void esp_heap_trace_alloc_hook(void *ptr, size_t size,
+                                          uint32_t caps) {
+  shellHeapTraceAlloc(ptr, size);
+}
+
+extern "C" void esp_heap_trace_free_hook(void *ptr) {
+  shellHeapTraceFree(ptr);
+}
+#endif
+
+#if SHELL_HEAP_WRAP
+extern "C" {
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+void *__wrap_malloc(size_t size) {
+  void *ptr = __real_malloc(size);
+  shellHeapTraceAlloc(ptr, size);
+  return ptr;
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+  void *ptr = __real_calloc(count, size);
+  shellHeapTraceAlloc(ptr, count * size);
+  return ptr;
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+  void *moved = __real_realloc(ptr, size);
+  // on failure the old block stays
+  if (moved || size == 0) {
+    shellHeapTraceFree(ptr);
+    shellHeapTraceAlloc(moved, size);
+  }
+  return moved;
+}
+
+void __wrap_free(void *ptr) {
+  shellHeapTraceFree(ptr);
+  __real_free(ptr);
+}
+}
+#endif
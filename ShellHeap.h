@@ -0,0 +1,100 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Finding out which commands use the heap, and which leak.
+ *
+ * With `SHELL_HEAP_STATS` set to 1, the shell notes every allocation and
+ * free made while a command runs, on the shell's task or a stack borrowed
+ * for it, and keeps totals per command:
+ *
+ *     shell> heap
+ *     command       runs  allocs     bytes      peak    leaked
+ *     sieve            4       0         0         0         0
+ *     report           2      40      5120       768       256
+ *
+ * `bytes` adds up every allocation, `peak` is the most a single run had
+ * outstanding at once, and `leaked` adds up what runs had not freed when
+ * they returned. Commands run by another through `Shell::execute` count
+ * towards the outer one. Up to `SHELL_HEAP_BLOCKS` blocks are followed per
+ * run; a run allocating more without freeing gets a `+` after its leak, as
+ * blocks beyond that are not counted as outstanding. Memory left for other
+ * tasks to free counts as leaked too: that of tasks the command started,
+ * or, on first use, of the pool lending `SHELL_LARGE_STACK` commands their
+ * stack. Allocations by `parallel` lines are not counted, as they run
+ * away from the shell.
+ *
+ * The shell learns of allocations from a hook:
+ *
+ * - On ESP32s built with `CONFIG_HEAP_USE_HOOKS`, the ESP-IDF heap hooks
+ *   are taken over by this file.
+ * - FreeRTOS heaps can report through the trace macros, in
+ *   `FreeRTOSConfig.h`:
+ *
+ *       #define traceMALLOC(p, size) shellHeapTraceAlloc(p, size)
+ *       #define traceFREE(p, size) shellHeapTraceFree(p)
+ *
+ * - With `SHELL_HEAP_WRAP` set to 1, this file wraps the C library's
+ *   `malloc`, `calloc`, `realloc` and `free`; link with
+ *   `-Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,--wrap=free`. The
+ *   Linux runtime does so when built with `make HEAP_STATS=1`.
+ *
+ * Noting allocations slows every one of them down a little, on all tasks,
+ * so this is off by default.
+ */
+#ifndef TOYSHELL_HEAP_H
+#define TOYSHELL_HEAP_H
+
+#include <stddef.h>
+
+#include "ToyShell.h"
+
+#ifndef SHELL_HEAP_COMMANDS
+#define SHELL_HEAP_COMMANDS 16
+#endif
+#ifndef SHELL_HEAP_BLOCKS
+#define SHELL_HEAP_BLOCKS 32
+#endif
+#ifndef SHELL_HEAP_WRAP
+#define SHELL_HEAP_WRAP 0
+#endif
+
+/**
+ * Start and stop counting for a command run by the calling shell. Called by
+ * the shell. DO NOT CALL THESE FUNCTIONS YOURSELF. `shellHeapBegin` returns
+ * false, and nothing is counted, if the shell is counting already.
+ */
+bool shellHeapBegin(const Command *cmd);
+void shellHeapEnd();
+
+/**
+ * Hooks for allocators to report to. They may be called from any task, and
+ * do not allocate themselves.
+ */
+extern "C" void shellHeapTraceAlloc(void *ptr, size_t size);
+extern "C" void shellHeapTraceFree(void *ptr);
+
+/**
+ * `heap [reset]`: print the totals per command, or clear them.
+ */
+int cmdHeap(int argc, const char *const *argv, Stream *serial);
+
+#endif
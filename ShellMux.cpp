@@ -0,0 +1,402 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Several logical channels over one serial port.
+ *
+ * This is the implementation. See `"ShellMux.h"` for documentation.
+ */
+#include "ShellMux.h"
+
+#include <string.h>
+
+#include <Arduino.h>
+
+#if defined(ARDUINO_ARCH_ESP32)
+// The ESP32 core puts FreeRTOS headers in a custom location. Make it happy.
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#else
+// Include the usual FreeRTOS central header.
+#include <Arduino_FreeRTOS.h>
+#endif
+
+static_assert((SHELL_MUX_BUFFER & (SHELL_MUX_BUFFER - 1)) == 0,
+              "SHELL_MUX_BUFFER must be a power of two");
+static_assert(SHELL_MUX_BUFFER <= 16384, "SHELL_MUX_BUFFER is too large");
+static_assert(SHELL_MUX_CHANNELS <= 16, "SHELL_MUX_CHANNELS is too large");
+static_assert(SHELL_MUX_PAYLOAD <= 253, "SHELL_MUX_PAYLOAD is too large");
+
+#define FRAME_DATA 0
+#define FRAME_CREDIT 1
+#define FRAME_HELLO 2
+
+#define REFRESH_MS 500
+#define PROBE_MS 20
+
+enum {
+  WAIT_SYNC,
+  WAIT_SYNC2,
+  WAIT_KIND,
+  WAIT_LEN,
+  WAIT_PAYLOAD,
+  WAIT_CRC,
+};
+
+static uint8_t crc8(uint8_t crc, const uint8_t *data, size_t len) {
+  while (len--) {
+    crc ^= *data++;
+    for (int i = 0; i < 8; i++) {
+      crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+    }
+  }
+  return crc;
+}
+
+size_t MuxChannel::write(uint8_t c) {
+  return write(&c, 1);
+}
+
+size_t MuxChannel::write(const uint8_t *buffer, size_t size) {
+  unsigned long start = millis();
+  size_t done = 0;
+  while (done < size) {
+    unsigned head = atomic_load_explicit(&tx_head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&tx_tail, memory_order_acquire);
+    size_t room = SHELL_MUX_BUFFER - (head - tail);
+    if (room == 0) {
+      if (!mux || !mux->f_running || millis() - start >= SHELL_MUX_WRITE_WAIT)
+        break;
+      mux->kick();
+      vTaskDelay(1);
+      continue;
+    }
+
+    size_t count = size - done;
+    if (count > room) count = room;
+    for (size_t i = 0; i < count; i++) {
+      tx[(head + i) % SHELL_MUX_BUFFER] = buffer[done + i];
+    }
+    atomic_store_explicit(&tx_head, head + count, memory_order_release);
+    done += count;
+
+    // small writes go out at the next tick, together
+    if (mux && head + count - tail >= SHELL_MUX_BUFFER / 2) mux->kick();
+  }
+  return done;
+}
+
+int MuxChannel::availableForWrite() {
+  unsigned head = atomic_load_explicit(&tx_head, memory_order_relaxed);
+  unsigned tail = atomic_load_explicit(&tx_tail, memory_order_acquire);
+  return SHELL_MUX_BUFFER - (head - tail);
+}
+
+void MuxChannel::flush() {
+  if (!mux) return;
+  mux->kick();
+  unsigned long start = millis();
+  while (mux->f_running && millis() - start < SHELL_MUX_WRITE_WAIT &&
+         atomic_load(&tx_tail) != atomic_load(&tx_head))
+    vTaskDelay(1);
+}
+
+int MuxChannel::available() {
+  unsigned head = atomic_load_explicit(&rx_head, memory_order_acquire);
+  unsigned tail = atomic_load_explicit(&rx_tail, memory_order_relaxed);
+  return head - tail;
+}
+
+int MuxChannel::read() {
+  unsigned head = atomic_load_explicit(&rx_head, memory_order_acquire);
+  unsigned tail = atomic_load_explicit(&rx_tail, memory_order_relaxed);
+  if (head == tail) return -1;
+  uint8_t c = rx[tail % SHELL_MUX_BUFFER];
+  atomic_store_explicit(&rx_tail, tail + 1, memory_order_release);
+  return c;
+}
+
+int MuxChannel::peek() {
+  unsigned head = atomic_load_explicit(&rx_head, memory_order_acquire);
+  unsigned tail = atomic_load_explicit(&rx_tail, memory_order_relaxed);
+  if (head == tail) return -1;
+  return rx[tail % SHELL_MUX_BUFFER];
+}
+
+size_t MuxChannel::readBytes(char *buffer, size_t length) {
+  unsigned long start = millis();
+  size_t count = 0;
+  while (count < length) {
+    int c = read();
+    if (c >= 0) {
+      buffer[count++] = c;
+    } else if (millis() - start < _timeout) {
+      vTaskDelay(1);
+    } else {
+      break;
+    }
+  }
+  return count;
+}
+
+bool ShellMux::begin(Stream &stream, unsigned priority, int core) {
+  if (f_running) return false;
+
+  this->stream = &stream;
+  for (MuxChannel &channel : channels) {
+    channel.mux = this;
+    channel.rx_offset = channel.rx_granted = 0;
+    channel.tx_offset = channel.tx_limit = 0;
+  }
+  state = WAIT_SYNC;
+  f_greeted = false;
+  atomic_store(&f_end, 0);
+  atomic_store(&f_running, 1);
+  if (!shellCreateTask(ShellMux::start, "shell-mux", SHELL_MUX_STACK, this,
+                       priority, &task, core)) {
+    task = nullptr;
+    atomic_store(&f_running, 0);
+    return false;
+  }
+  return true;
+}
+
+void ShellMux::end() {
+  atomic_store(&f_end, 1);
+  while (f_running != 0)
+    vTaskDelay(1);
+  task = nullptr;
+}
+
+/*
+ * Have the mux task send what the channels have without waiting for the
+ * next tick.
+ */
+void ShellMux::kick() {
+  if (task) xTaskNotifyGive((TaskHandle_t)task);
+}
+
+void ShellMux::sendFrame(uint8_t kind, const uint8_t *head, size_t head_len,
+                         const uint8_t *data, size_t data_len) {
+  uint8_t frame[5 + 2 + SHELL_MUX_PAYLOAD];
+  size_t len = head_len + data_len;
+  frame[0] = 0xa5;
+  frame[1] = 0x5a;
+  frame[2] = kind;
+  frame[3] = len;
+  if (head_len) memcpy(&frame[4], head, head_len);
+  if (data_len) memcpy(&frame[4 + head_len], data, data_len);
+  frame[4 + len] = crc8(0, &frame[2], len + 2);
+  stream->write(frame, len + 5);
+}
+
+/*
+ * Tell the other end how far it may send on a channel: as far as there is
+ * room in the receive buffer. Unless `always`, only when enough has been
+ * read to be worth a frame.
+ */
+void ShellMux::grant(MuxChannel &channel, bool always) {
+  unsigned head = atomic_load_explicit(&channel.rx_head, memory_order_relaxed);
+  unsigned tail = atomic_load_explicit(&channel.rx_tail, memory_order_acquire);
+  uint16_t limit = channel.rx_offset + (SHELL_MUX_BUFFER - (head - tail));
+  if (!always && (uint16_t)(limit - channel.rx_granted) < SHELL_MUX_BUFFER / 4)
+    return;
+
+  channel.rx_granted = limit;
+  uint8_t kind = FRAME_CREDIT << 4 | (uint8_t)(&channel - channels);
+  uint8_t offset[2] = {(uint8_t)limit, (uint8_t)(limit >> 8)};
+  sendFrame(kind, offset, 2, nullptr, 0);
+}
+
+/*
+ * Ask for credit on a channel with data waiting, in case the last grant
+ * got lost, by sending its current offset and no data.
+ */
+void ShellMux::probe(MuxChannel &channel) {
+  unsigned long now = millis();
+  if (now - channel.tx_probed < PROBE_MS) return;
+  channel.tx_probed = now;
+
+  uint8_t kind = FRAME_DATA << 4 | (uint8_t)(&channel - channels);
+  uint8_t offset[2] = {(uint8_t)channel.tx_offset,
+                       (uint8_t)(channel.tx_offset >> 8)};
+  sendFrame(kind, offset, 2, nullptr, 0);
+}
+
+/*
+ * Send one frame from the most urgent channel with data and credit.
+ * Returns false if there was none.
+ */
+bool ShellMux::sendData() {
+  MuxChannel *best = nullptr;
+  size_t best_count = 0;
+  for (size_t i = 0; i < SHELL_MUX_CHANNELS; i++) {
+    MuxChannel &channel = channels[(turn + i) % SHELL_MUX_CHANNELS];
+    unsigned head = atomic_load_explicit(&channel.tx_head, memory_order_acquire);
+    unsigned tail = atomic_load_explicit(&channel.tx_tail, memory_order_relaxed);
+    int16_t credit = (int16_t)(channel.tx_limit - channel.tx_offset);
+    size_t count = head - tail;
+    if (count == 0) continue;
+    if (credit <= 0) {
+      probe(channel);
+      continue;
+    }
+    if (count > (size_t)credit) count = credit;
+    if (count > SHELL_MUX_PAYLOAD) count = SHELL_MUX_PAYLOAD;
+
+    if (!best || channel.priority > best->priority) {
+      best = &channel;
+      best_count = count;
+    }
+  }
+  if (!best) return false;
+
+  uint8_t data[SHELL_MUX_PAYLOAD];
+  unsigned tail = atomic_load_explicit(&best->tx_tail, memory_order_relaxed);
+  for (size_t i = 0; i < best_count; i++) {
+    data[i] = best->tx[(tail + i) % SHELL_MUX_BUFFER];
+  }
+  uint8_t id = best - channels;
+  uint8_t offset[2] = {(uint8_t)best->tx_offset, (uint8_t)(best->tx_offset >> 8)};
+  sendFrame(FRAME_DATA << 4 | id, offset, 2, data, best_count);
+
+  best->tx_offset += best_count;
+  atomic_store_explicit(&best->tx_tail, tail + best_count, memory_order_release);
+  turn = id + 1;
+  return true;
+}
+
+/*
+ * Act on a frame that arrived intact.
+ */
+void ShellMux::accept() {
+  uint8_t type = kind >> 4;
+  uint8_t id = kind & 0x0f;
+  f_greeted = true;
+
+  if (type == FRAME_HELLO) {
+    for (MuxChannel &channel : channels) {
+      channel.rx_offset = 0;
+      channel.tx_offset = channel.tx_limit = 0;
+    }
+    f_regrant = true;
+    return;
+  }
+  if (id >= SHELL_MUX_CHANNELS || len < 2) return;
+
+  MuxChannel &channel = channels[id];
+  uint16_t offset = payload[0] | payload[1] << 8;
+  if (type == FRAME_CREDIT) {
+    if ((int16_t)(offset - channel.tx_limit) > 0) channel.tx_limit = offset;
+  } else if (type == FRAME_DATA) {
+    // a frame from before is dropped; one from after a lost frame skips
+    // the gap
+    if ((int16_t)(offset - channel.rx_offset) < 0) return;
+    channel.rx_offset = offset;
+
+    size_t count = len - 2;
+    if (count == 0) channel.f_probed = true;
+    unsigned head = atomic_load_explicit(&channel.rx_head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&channel.rx_tail, memory_order_acquire);
+    size_t room = SHELL_MUX_BUFFER - (head - tail);
+    // the other end overran its credit if there is no room; drop the rest
+    size_t kept = count < room ? count : room;
+    for (size_t i = 0; i < kept; i++) {
+      channel.rx[(head + i) % SHELL_MUX_BUFFER] = payload[2 + i];
+    }
+    atomic_store_explicit(&channel.rx_head, head + kept, memory_order_release);
+    channel.rx_offset += count;
+  }
+}
+
+void ShellMux::parse(uint8_t c) {
+  switch (state) {
+  case WAIT_SYNC:
+    if (c == 0xa5) state = WAIT_SYNC2;
+    break;
+  case WAIT_SYNC2:
+    if (c == 0x5a) state = WAIT_KIND;
+    else if (c != 0xa5) state = WAIT_SYNC;
+    break;
+  case WAIT_KIND:
+    kind = c;
+    state = WAIT_LEN;
+    break;
+  case WAIT_LEN:
+    len = c;
+    got = 0;
+    if (len > sizeof(payload)) state = WAIT_SYNC;
+    else state = len ? WAIT_PAYLOAD : WAIT_CRC;
+    break;
+  case WAIT_PAYLOAD:
+    payload[got++] = c;
+    if (got == len) state = WAIT_CRC;
+    break;
+  case WAIT_CRC: {
+    state = WAIT_SYNC;
+    uint8_t header[2] = {kind, len};
+    if (crc8(crc8(0, header, 2), payload, len) == c) accept();
+    break;
+  }
+  }
+}
+
+void ShellMux::main() {
+  uint8_t buffer[64];
+  unsigned long refreshed = millis() - REFRESH_MS;
+
+  while (f_end == 0) {
+    bool busy = false;
+
+    int ready = stream->available();
+    if (ready > 0) {
+      size_t count = (size_t)ready < sizeof(buffer) ? ready : sizeof(buffer);
+      count = stream->readBytes(buffer, count);
+      for (size_t i = 0; i < count; i++) parse(buffer[i]);
+      busy = true;
+    }
+
+    bool refresh = f_regrant || millis() - refreshed >= REFRESH_MS;
+    if (refresh) {
+      // greet the other end until it answers, in case it missed it
+      if (!f_greeted && !f_regrant) {
+        sendFrame(FRAME_HELLO << 4, nullptr, 0, nullptr, 0);
+      }
+      refreshed = millis();
+      f_regrant = false;
+    }
+    for (MuxChannel &channel : channels) {
+      grant(channel, refresh || channel.f_probed);
+      channel.f_probed = false;
+    }
+
+    if (sendData()) busy = true;
+    if (!busy) ulTaskNotifyTake(pdTRUE, 1);
+  }
+
+  atomic_store(&f_running, 0);
+  vTaskDelete(NULL);
+}
+
+void ShellMux::start(void *parameters) {
+  ShellMux *mux = (ShellMux *)parameters;
+  mux->main();
+}
@@ -0,0 +1,218 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Several logical channels over one serial port.
+ *
+ * A `ShellMux` splits a port into up to `SHELL_MUX_CHANNELS` channels, each
+ * a `Stream` of its own, so the shell, logs and sampled data can share a
+ * single UART without garbling each other:
+ *
+ *     static ShellMux mux;
+ *
+ *     void setup() {
+ *       Serial.begin(921600);
+ *       mux.setPriority(0, 2); // interactive
+ *       mux.setPriority(1, 1); // logs
+ *       mux.begin(Serial);
+ *       shell.begin(mux.channel(0));
+ *     }
+ *
+ *     void logTask(void *) { ... mux.channel(1).printf(...); ... }
+ *     void sampleTask(void *) { ... mux.channel(2).write(frame, size); ... }
+ *
+ * The other end must speak the same protocol; `extras/linux` has a
+ * `shellmux` program that does so from a workstation, putting channel 0 on
+ * the terminal and the others in files.
+ *
+ * On the wire, everything goes in frames of:
+ *
+ *   - the bytes 0xa5 0x5a;
+ *   - a kind byte: the type in the upper four bits, the channel in the lower
+ *     four;
+ *   - the length of the payload, one byte;
+ *   - the payload;
+ *   - a CRC-8 (polynomial 0x07) over the kind, length and payload.
+ *
+ * The types are:
+ *
+ *   - 0, data: a 16-bit little-endian offset into the channel's stream,
+ *     then at most `SHELL_MUX_PAYLOAD` bytes of it. A receiver that finds
+ *     the offset ahead of what it expected has lost a frame, and carries on.
+ *     A sender out of credit sends a frame with no data every now and then,
+ *     to have the credit granted again in case it got lost.
+ *   - 1, credit: a 16-bit little-endian offset up to which the sender may
+ *     send on the channel. Each end grants as much as it has room for, and
+ *     grants more as the data is read, so a channel nobody reads stalls on
+ *     its own instead of flooding the others. Credit is granted again every
+ *     half second, in case a frame got lost.
+ *   - 2, hello: the sender has just started. Both ends start counting
+ *     offsets from 0 again.
+ *
+ * Frames are short, and the mux task sends whichever waiting channel has
+ * the highest priority first, taking turns between channels of the same
+ * priority. A keystroke echoed by the shell thus waits for at most one
+ * frame of bulk data, however much is queued.
+ *
+ * Every channel has buffers of `SHELL_MUX_BUFFER` bytes each way. Each
+ * channel should have a single reader and a single writer task at a time.
+ * Writes wait up to `SHELL_MUX_WRITE_WAIT` milliseconds for room, then drop
+ * what does not fit.
+ */
+#ifndef TOYSHELL_MUX_H
+#define TOYSHELL_MUX_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <Stream.h>
+
+#include "ToyShell.h"
+
+#ifndef SHELL_MUX_CHANNELS
+#define SHELL_MUX_CHANNELS 4
+#endif
+#ifndef SHELL_MUX_BUFFER
+#define SHELL_MUX_BUFFER 256
+#endif
+#ifndef SHELL_MUX_PAYLOAD
+#define SHELL_MUX_PAYLOAD 64
+#endif
+#ifndef SHELL_MUX_WRITE_WAIT
+#define SHELL_MUX_WRITE_WAIT 100
+#endif
+#ifndef SHELL_MUX_STACK
+#define SHELL_MUX_STACK 2048
+#endif
+
+class ShellMux;
+
+/**
+ * One channel of a `ShellMux`.
+ */
+class MuxChannel : public Stream {
+private:
+  ShellMux *mux = nullptr;
+  uint8_t priority = 0;
+
+  uint8_t rx[SHELL_MUX_BUFFER];
+  atomic_uint rx_head; // advanced by the mux task
+  atomic_uint rx_tail; // advanced by the reader
+  uint8_t tx[SHELL_MUX_BUFFER];
+  atomic_uint tx_head; // advanced by the writer
+  atomic_uint tx_tail; // advanced by the mux task
+
+  // stream offsets and credit, kept by the mux task
+  uint16_t rx_offset = 0;
+  uint16_t rx_granted = 0;
+  uint16_t tx_offset = 0;
+  uint16_t tx_limit = 0;
+  unsigned long tx_probed = 0;
+  bool f_probed = false;
+
+  friend class ShellMux;
+public:
+  MuxChannel() : rx_head(0), rx_tail(0), tx_head(0), tx_tail(0) {}
+  MuxChannel(MuxChannel &other) = delete;
+
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t *buffer, size_t size) override;
+  int availableForWrite() override;
+  void flush() override;
+  int available() override;
+  int read() override;
+  int peek() override;
+
+  // waits without spinning, as the shell may wait on a channel
+  size_t readBytes(char *buffer, size_t length);
+  using Stream::readBytes;
+};
+
+/**
+ * A serial port split into channels. See the top of this file.
+ */
+class ShellMux {
+private:
+  Stream *stream = nullptr;
+  MuxChannel channels[SHELL_MUX_CHANNELS];
+  void *task = nullptr;
+  atomic_bool f_end;
+  atomic_bool f_running;
+  uint8_t turn = 0;
+  bool f_greeted = false; // heard from the other end
+  bool f_regrant = false;
+
+  // the frame coming in
+  uint8_t state = 0;
+  uint8_t kind = 0;
+  uint8_t len = 0;
+  uint8_t got = 0;
+  uint8_t payload[SHELL_MUX_PAYLOAD + 2];
+
+  void main();
+  void parse(uint8_t c);
+  void accept();
+  void sendFrame(uint8_t kind, const uint8_t *head, size_t head_len,
+                 const uint8_t *data, size_t data_len);
+  void grant(MuxChannel &channel, bool always);
+  void probe(MuxChannel &channel);
+  bool sendData();
+  void kick();
+  static void start(void *);
+  friend class MuxChannel;
+public:
+  ShellMux() : f_end(0), f_running(0) {}
+  ShellMux(ShellMux &other) = delete;
+
+  /**
+   * Stop the mux task.
+   */
+  ~ShellMux() { end(); }
+
+  /**
+   * Start multiplexing on `stream`, with a task of the priority given
+   * moving data between it and the channels, pinned to `core` on
+   * dual-core ESP32s. Does nothing if already started.
+   */
+  bool begin(Stream &stream, unsigned priority = 2,
+             int core = SHELL_ANY_CORE);
+
+  /**
+   * Stop the mux task. Data not sent yet stays in the channels.
+   */
+  void end();
+
+  /**
+   * Get a channel, numbered from 0.
+   */
+  MuxChannel &channel(uint8_t id) { return channels[id]; }
+
+  /**
+   * Have frames of one channel go out before those of channels with a
+   * lower priority. All channels start out with priority 0.
+   */
+  void setPriority(uint8_t id, uint8_t priority) {
+    channels[id].priority = priority;
+  }
+};
+
+#endif
@@ -0,0 +1,178 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Running several command lines at once.
+ *
+ * This is the implementation. See `"ShellParallel.h"` for documentation.
+ */
+#include "ShellParallel.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(ARDUINO_ARCH_ESP32)
+// The ESP32 core puts FreeRTOS headers in a custom location. Make it happy.
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#define CORES portNUM_PROCESSORS
+#else
+// Include the usual FreeRTOS central header.
+#include <Arduino_FreeRTOS.h>
+#define CORES 1
+#endif
+
+/*
+ * The output of one line, kept until every line is done.
+ */
+class Capture : public Stream {
+public:
+  char *buffer = nullptr;
+  size_t len = 0;
+  bool f_cut = false;
+
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t *data, size_t size) override {
+    size_t room = SHELL_PARALLEL_OUTPUT - len;
+    if (size > room) {
+      f_cut = true;
+      size = room;
+    }
+    memcpy(&buffer[len], data, size);
+    len += size;
+    return size;
+  }
+  int availableForWrite() override { return SHELL_PARALLEL_OUTPUT - len; }
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+};
+
+struct Worker {
+  const Command *cmd;
+  int argc;
+  const char *const *argv;
+  int result;
+  Capture out;
+  atomic_uint *remaining;
+  TaskHandle_t waiter;
+};
+
+static void work(Worker &worker) {
+  if (worker.cmd) {
+    worker.result = worker.cmd->entry(worker.argc, worker.argv, &worker.out);
+  } else {
+    worker.out.printf("shell: No such command: %s\n", worker.argv[0]);
+    worker.result = -1;
+  }
+}
+
+static void workerMain(void *parameters) {
+  Worker &worker = *(Worker *)parameters;
+  work(worker);
+  TaskHandle_t waiter = worker.waiter;
+  // `worker` belongs to the waiting task and may be gone after this
+  atomic_fetch_sub(worker.remaining, 1);
+  xTaskNotifyGive(waiter);
+  vTaskDelete(NULL);
+}
+
+int cmdParallel(int argc, const char *const *argv, Stream *serial) {
+  Shell *shell = Shell::current();
+  if (!shell) {
+    serial->print("parallel: Not running in a shell\n");
+    return 1;
+  }
+
+  // cut the arguments into lines at each `;`
+  Worker workers[SHELL_PARALLEL_MAX];
+  int count = 0;
+  int start = 1;
+  for (int i = 1; i <= argc; i++) {
+    if (i < argc && strcmp(argv[i], ";")) continue;
+    if (i > start) {
+      if (count == SHELL_PARALLEL_MAX) {
+        serial->printf("parallel: At most %d lines\n", SHELL_PARALLEL_MAX);
+        return 1;
+      }
+      Worker &worker = workers[count++];
+      worker.cmd = shell->find(argv[start]);
+      // the workers' stacks are sized for ordinary commands
+      if (worker.cmd && (worker.cmd->flags & SHELL_LARGE_STACK)) {
+        serial->printf("parallel: %s needs a large stack\n", argv[start]);
+        return 1;
+      }
+      worker.argc = i - start;
+      worker.argv = &argv[start];
+      worker.result = 0;
+    }
+    start = i + 1;
+  }
+  if (count == 0) {
+    serial->print("usage: parallel line [; line]...\n");
+    return 1;
+  }
+
+  size_t size = (size_t)count * SHELL_PARALLEL_OUTPUT;
+  char *buffers = (char *)Shell::scratch(size);
+  bool heap = !buffers;
+  if (heap) buffers = (char *)malloc(size);
+  if (!buffers) {
+    serial->print("parallel: Out of memory\n");
+    return 1;
+  }
+
+  atomic_uint remaining;
+  atomic_init(&remaining, 0);
+  TaskHandle_t self = xTaskGetCurrentTaskHandle();
+  unsigned priority = uxTaskPriorityGet(NULL);
+  bool started[SHELL_PARALLEL_MAX];
+  for (int i = 0; i < count; i++) {
+    Worker &worker = workers[i];
+    worker.out.buffer = &buffers[i * SHELL_PARALLEL_OUTPUT];
+    worker.remaining = &remaining;
+    worker.waiter = self;
+    atomic_fetch_add(&remaining, 1);
+    started[i] = shellCreateTask(workerMain, "shell-par", SHELL_PARALLEL_STACK,
+                                 &worker, priority, nullptr,
+                                 CORES > 1 ? i % CORES : SHELL_ANY_CORE);
+    if (!started[i]) atomic_fetch_sub(&remaining, 1);
+  }
+  for (int i = 0; i < count; i++) {
+    if (!started[i]) work(workers[i]);
+  }
+  // other tasks may notify the shell too; the count is what matters
+  while (atomic_load(&remaining) > 0)
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(20));
+
+  int result = 0;
+  for (int i = 0; i < count; i++) {
+    const Worker &worker = workers[i];
+    serial->write(worker.out.buffer, worker.out.len);
+    if (worker.out.f_cut) {
+      serial->printf("parallel: Output of line %d cut short\n", i + 1);
+    }
+    if (result == 0) result = worker.result;
+  }
+  if (heap) free(buffers);
+  return result;
+}
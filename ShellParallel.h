@@ -0,0 +1,65 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Running several command lines at once.
+ *
+ *     parallel selftest adc ; selftest flash ; selftest radio
+ *
+ * Lines are separated by a lone `;`, as the shell has no quoting. Each line
+ * runs on a task of its own, at the shell's priority; on dual-core ESP32s
+ * the tasks take turns between the cores, so independent self-tests finish
+ * in about half the time. Once every line has finished, their outputs are
+ * printed one after another, in the order the lines were given, so they
+ * never interleave. Up to `SHELL_PARALLEL_OUTPUT` bytes are kept per line,
+ * in the shell's scratch memory if it has room, or else on the heap.
+ * `parallel` returns the status of the first line that failed, or 0.
+ *
+ * The commands must be safe to run at the same time as each other. They
+ * run away from the shell's task: `Shell::current` and `Shell::scratch`
+ * give `nullptr` there, so commands that schedule or subscribe do not work
+ * in parallel, and their stream has no input. Commands flagged
+ * `SHELL_LARGE_STACK` are refused, as the tasks only have
+ * `SHELL_PARALLEL_STACK` bytes of stack. A line that cannot get a task runs
+ * on the shell's task after the others have started.
+ */
+#ifndef TOYSHELL_PARALLEL_H
+#define TOYSHELL_PARALLEL_H
+
+#include "ToyShell.h"
+
+#ifndef SHELL_PARALLEL_MAX
+#define SHELL_PARALLEL_MAX 4
+#endif
+#ifndef SHELL_PARALLEL_OUTPUT
+#define SHELL_PARALLEL_OUTPUT 512
+#endif
+#ifndef SHELL_PARALLEL_STACK
+#define SHELL_PARALLEL_STACK 4096
+#endif
+
+/**
+ * `parallel line [; line]...`: run command lines at once, and print their
+ * outputs in order.
+ */
+int cmdParallel(int argc, const char *const *argv, Stream *serial);
+
+#endif
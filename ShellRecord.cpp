@@ -0,0 +1,132 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Recording what comes in on a shell's port, timing included.
+ *
+ * This is the implementation. See `"ShellRecord.h"` for documentation.
+ */
+#include "ShellRecord.h"
+
+#include <string.h>
+
+#include <Arduino.h>
+
+static size_t putVarint(uint8_t *out, unsigned long value) {
+  size_t len = 0;
+  while (value >= 0x80) {
+    out[len++] = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  out[len++] = (uint8_t)value;
+  return len;
+}
+
+void RecordStream::begin() {
+  sink->write((const uint8_t *)"TSR1", 4);
+  chunk_len = 0;
+  last = micros();
+  f_recording = true;
+}
+
+void RecordStream::end() {
+  if (!f_recording) return;
+  emit();
+  sink->flush();
+  f_recording = false;
+}
+
+/*
+ * Write out the chunk being collected.
+ */
+void RecordStream::emit() {
+  if (chunk_len == 0) return;
+
+  uint8_t header[2 * 5];
+  size_t len = putVarint(header, chunk_at - last);
+  len += putVarint(&header[len], chunk_len);
+  sink->write(header, len);
+  sink->write(chunk, chunk_len);
+
+  last = chunk_at;
+  chunk_len = 0;
+}
+
+void RecordStream::note(const uint8_t *data, size_t len) {
+  if (!f_recording || len == 0) return;
+
+  unsigned long now = micros();
+  if (chunk_len > 0 && now - chunk_at >= SHELL_RECORD_MERGE) emit();
+  if (chunk_len == 0) chunk_at = now;
+
+  while (len > 0) {
+    size_t count = SHELL_RECORD_CHUNK - chunk_len;
+    if (count > len) count = len;
+    memcpy(&chunk[chunk_len], data, count);
+    chunk_len += count;
+    data += count;
+    len -= count;
+    if (chunk_len == SHELL_RECORD_CHUNK) {
+      emit();
+      chunk_at = now;
+    }
+  }
+}
+
+size_t RecordStream::write(uint8_t c) {
+  return port->write(c);
+}
+
+size_t RecordStream::write(const uint8_t *buffer, size_t size) {
+  return port->write(buffer, size);
+}
+
+int RecordStream::availableForWrite() {
+  return port->availableForWrite();
+}
+
+void RecordStream::flush() {
+  port->flush();
+}
+
+int RecordStream::available() {
+  return port->available();
+}
+
+int RecordStream::read() {
+  int c = port->read();
+  if (c >= 0) {
+    uint8_t byte = c;
+    note(&byte, 1);
+  }
+  return c;
+}
+
+int RecordStream::peek() {
+  return port->peek();
+}
+
+size_t RecordStream::readBytes(char *buffer, size_t length) {
+  port->setTimeout(_timeout);
+  size_t count = port->readBytes(buffer, length);
+  note((const uint8_t *)buffer, count);
+  return count;
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Recording what comes in on a shell's port, timing included.
+ *
+ * A `RecordStream` sits between the shell and its port and copies every
+ * byte read, along with when it was read, to a sink such as a file or a
+ * spare channel:
+ *
+ *     static File capture;
+ *     static RecordStream recorder(Serial, capture);
+ *
+ *     void setup() {
+ *       capture = LittleFS.open("/session.tsr", "w");
+ *       recorder.begin();
+ *       shell.begin(recorder);
+ *     }
+ *
+ * The Linux runtime replays such a recording into a sketch with
+ * `--replay`, at the original pace or faster, and reports how long each
+ * command line took; see `extras/linux/ReplayStream.h`.
+ *
+ * A recording starts with the four bytes `TSR1`, followed by chunks of:
+ *
+ *   - the time since the previous chunk (or since `begin`), in
+ *     microseconds;
+ *   - the number of bytes in the chunk;
+ *   - the bytes.
+ *
+ * Both numbers are unsigned LEB128: seven bits per byte, least significant
+ * first, with the top bit set on all but the last byte. Bytes read within
+ * `SHELL_RECORD_MERGE` microseconds of the first byte of a chunk join that
+ * chunk, so a paste costs a few bytes of overhead rather than a few per
+ * byte.
+ */
+#ifndef TOYSHELL_RECORD_H
+#define TOYSHELL_RECORD_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <Stream.h>
+
+#ifndef SHELL_RECORD_CHUNK
+#define SHELL_RECORD_CHUNK 64
+#endif
+#ifndef SHELL_RECORD_MERGE
+#define SHELL_RECORD_MERGE 1000
+#endif
+
+/**
+ * A stream passing everything through to another, and recording what is
+ * read from it.
+ */
+class RecordStream : public Stream {
+private:
+  Stream *port;
+  Print *sink;
+  bool f_recording = false;
+  unsigned long last = 0;
+  unsigned long chunk_at = 0;
+  size_t chunk_len = 0;
+  uint8_t chunk[SHELL_RECORD_CHUNK];
+
+  void note(const uint8_t *data, size_t len);
+  void emit();
+public:
+  /**
+   * Record what is read from `port` into `sink`.
+   */
+  RecordStream(Stream &port, Print &sink) : port(&port), sink(&sink) {}
+  RecordStream(RecordStream &other) = delete;
+
+  /**
+   * Start a recording. Until then, bytes pass through unrecorded.
+   */
+  void begin();
+
+  /**
+   * Write out what is still held back, and stop recording.
+   */
+  void end();
+
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t *buffer, size_t size) override;
+  int availableForWrite() override;
+  void flush() override;
+  int available() override;
+  int read() override;
+  int peek() override;
+
+  // passes the wait on to the port
+  size_t readBytes(char *buffer, size_t length);
+  using Stream::readBytes;
+};
+
+#endif
@@ -0,0 +1,373 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Commands run later or periodically.
+ *
+ * This is the implementation. See `"ShellScheduler.h"` for documentation.
+ */
+#include "ShellScheduler.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(ARDUINO_ARCH_ESP32)
+// The ESP32 core puts FreeRTOS headers in a custom location. Make it happy.
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#else
+// Include the usual FreeRTOS central header.
+#include <Arduino_FreeRTOS.h>
+#endif
+
+/*
+ * The wheel has three levels. Level 0 has a slot for each of the next 256
+ * ticks; a slot of level 1 covers 256 ticks, and a slot of level 2 covers
+ * 64 slots of level 1. When level 0 wraps around, the next slot of level 1
+ * is emptied into level 0, and so on, so every job is only moved a couple
+ * of times before it expires.
+ */
+#define L0_BITS 8
+#define LN_BITS 6
+#define L0_SIZE (1 << L0_BITS)
+#define LN_SIZE (1 << LN_BITS)
+#define L1_SPAN ((uint32_t)1 << (L0_BITS + LN_BITS))
+#define L2_SPAN ((uint32_t)1 << (L0_BITS + 2 * LN_BITS))
+#define SLOTS (L0_SIZE + 2 * LN_SIZE)
+
+#define NONE 0xffff
+
+// keeps expiry times within the signed distance the wheel compares
+#define TIME_MAX ((uint32_t)INT32_MAX)
+
+static_assert(SHELL_JOB_MAX < NONE, "too many jobs");
+
+struct Job {
+  uint16_t next;
+  uint16_t prev;
+  uint16_t slot;
+  uint32_t expires;
+  uint32_t period;
+  char line[SHELL_JOB_LINE];
+};
+
+static Job jobs[SHELL_JOB_MAX];
+static uint16_t heads[SLOTS];
+static uint16_t free_list;
+static uint32_t now;
+static Shell *owner;
+static TickType_t seen;  // the RTOS tick count last looked at
+static uint64_t elapsed; // RTOS ticks since boot, not wrapping like it
+
+static uint32_t currentTick() {
+  // the RTOS count wraps after 2^32 ticks, so follow it by differences
+  TickType_t count = xTaskGetTickCount();
+  elapsed += (TickType_t)(count - seen);
+  seen = count;
+  // go through milliseconds; an RTOS tick may be longer than a wheel tick
+  uint64_t ms = elapsed * 1000 / configTICK_RATE_HZ;
+  return (uint32_t)(ms / SHELL_SCHED_TICK);
+}
+
+static void link(uint16_t id, uint16_t slot) {
+  Job &job = jobs[id];
+  job.slot = slot;
+  job.prev = NONE;
+  job.next = heads[slot];
+  if (job.next != NONE) jobs[job.next].prev = id;
+  heads[slot] = id;
+}
+
+static void unlink(uint16_t id) {
+  Job &job = jobs[id];
+  if (job.prev != NONE) {
+    jobs[job.prev].next = job.next;
+  } else {
+    heads[job.slot] = job.next;
+  }
+  if (job.next != NONE) jobs[job.next].prev = job.prev;
+  job.slot = NONE;
+}
+
+/*
+ * Put a job in the slot matching its expiry. Jobs due before `soonest`,
+ * the first tick still to be processed, go in its slot.
+ */
+static void insert(uint16_t id, uint32_t soonest) {
+  uint32_t expires = jobs[id].expires;
+  if ((int32_t)(expires - soonest) < 0) expires = soonest;
+  int32_t delta = (int32_t)(expires - now);
+
+  if (delta < L0_SIZE) {
+    link(id, expires & (L0_SIZE - 1));
+  } else if ((uint32_t)delta < L1_SPAN) {
+    link(id, L0_SIZE + ((expires >> L0_BITS) & (LN_SIZE - 1)));
+  } else {
+    // too far out; park it in the last slot of the level and look again
+    // when it cascades
+    if ((uint32_t)delta >= L2_SPAN) expires = now + L2_SPAN - 1;
+    link(id, L0_SIZE + LN_SIZE +
+                 ((expires >> (L0_BITS + LN_BITS)) & (LN_SIZE - 1)));
+  }
+}
+
+/*
+ * Move the jobs of a slot of a higher level down, as the tick `now` is
+ * about to be processed.
+ */
+static void cascade(uint16_t slot) {
+  while (heads[slot] != NONE) {
+    uint16_t id = heads[slot];
+    unlink(id);
+    insert(id, now);
+  }
+}
+
+static void release(uint16_t id) {
+  if (jobs[id].slot != NONE) unlink(id);
+  jobs[id].line[0] = '\0';
+  jobs[id].next = free_list;
+  free_list = id;
+}
+
+/*
+ * Process every tick up to the present.
+ */
+static void run(Shell &shell, void *) {
+  uint32_t target = currentTick();
+  while ((int32_t)(target - now) > 0) {
+    now += 1;
+
+    uint32_t index = now & (L0_SIZE - 1);
+    if (index == 0) {
+      uint32_t i1 = (now >> L0_BITS) & (LN_SIZE - 1);
+      cascade(L0_SIZE + i1);
+      if (i1 == 0) {
+        cascade(L0_SIZE + LN_SIZE +
+                ((now >> (L0_BITS + LN_BITS)) & (LN_SIZE - 1)));
+      }
+    }
+
+    // take jobs off one at a time, so commands may schedule or cancel
+    // jobs freely
+    while (heads[index] != NONE) {
+      uint16_t id = heads[index];
+      Job &job = jobs[id];
+      unlink(id);
+      if ((int32_t)(job.expires - now) > 0) {
+        insert(id, now + 1);
+        continue;
+      }
+
+      char line[SHELL_JOB_LINE];
+      memcpy(line, job.line, sizeof(line));
+      if (job.period) {
+        job.expires += job.period;
+        // skip runs missed while the shell was busy, which catching up
+        // tick by tick would otherwise make up for all at once
+        if ((int32_t)(job.expires - target) <= 0)
+          job.expires = target + job.period;
+        insert(id, now + 1);
+      } else {
+        release(id);
+      }
+      shell.execute(line);
+    }
+  }
+}
+
+/*
+ * The shell running the jobs is stopping: drop them all, so the next shell
+ * to schedule any starts afresh.
+ */
+static void stop(Shell &, void *) {
+  owner = nullptr;
+}
+
+/*
+ * Parse a duration like `500ms` or `2h` into milliseconds, up to
+ * `TIME_MAX`.
+ */
+static bool parseTime(const char *text, uint32_t *ms) {
+  char *unit;
+  if (*text == '-') return false;
+  unsigned long value = strtoul(text, &unit, 0);
+  if (unit == text) return false;
+
+  uint32_t scale;
+  if (*unit == '\0' || !strcmp(unit, "ms")) {
+    scale = 1;
+  } else if (!strcmp(unit, "s")) {
+    scale = 1000;
+  } else if (!strcmp(unit, "m")) {
+    scale = 60000;
+  } else if (!strcmp(unit, "h")) {
+    scale = 3600000;
+  } else {
+    return false;
+  }
+  if (value > TIME_MAX / scale) return false;
+  *ms = value * scale;
+  return true;
+}
+
+/*
+ * Common part of `every`, `after` and `at`.
+ */
+static int schedule(int argc, const char *const *argv, Stream *serial,
+                    bool periodic, bool absolute) {
+  if (argc < 3) {
+    serial->printf("usage: %s time command...\n", argv[0]);
+    return 1;
+  }
+
+  Shell *shell = Shell::current();
+  if (!shell) {
+    serial->printf("%s: Not running in a shell\n", argv[0]);
+    return 1;
+  }
+  if (owner && owner != shell) {
+    serial->printf("%s: Jobs belong to another shell\n", argv[0]);
+    return 1;
+  }
+
+  uint32_t ms;
+  if (!parseTime(argv[1], &ms)) {
+    serial->printf("%s: Bad time: %s (at most %lums, or %luh)\n", argv[0],
+                   argv[1], (unsigned long)TIME_MAX,
+                   (unsigned long)(TIME_MAX / 3600000));
+    return 1;
+  }
+  uint32_t ticks = (ms + SHELL_SCHED_TICK - 1) / SHELL_SCHED_TICK;
+  if (periodic && ticks == 0) ticks = 1;
+
+  if (!owner) {
+    // first use: set up the wheel
+    for (uint16_t &head : heads) head = NONE;
+    for (uint16_t i = 0; i < SHELL_JOB_MAX; i++) {
+      jobs[i].slot = NONE;
+      jobs[i].next = i + 1 < SHELL_JOB_MAX ? i + 1 : NONE;
+    }
+    free_list = 0;
+    seen = xTaskGetTickCount();
+    elapsed = seen;
+    now = currentTick();
+    if (!shell->addService(run, nullptr, stop)) {
+      serial->printf("%s: Too many shell services\n", argv[0]);
+      return 1;
+    }
+    owner = shell;
+  }
+
+  if (free_list == NONE) {
+    serial->printf("%s: At most %d jobs can be scheduled\n",
+                   argv[0], SHELL_JOB_MAX);
+    return 1;
+  }
+  uint16_t id = free_list;
+  Job &job = jobs[id];
+
+  // join the command line back together
+  size_t len = 0;
+  for (int i = 2; i < argc; i++) {
+    size_t n = strlen(argv[i]);
+    if (len + n + 1 > sizeof(job.line)) {
+      serial->printf("%s: Command line too long\n", argv[0]);
+      return 1;
+    }
+    if (i > 2) job.line[len++] = ' ';
+    memcpy(&job.line[len], argv[i], n);
+    len += n;
+  }
+  job.line[len] = '\0';
+
+  free_list = job.next;
+  job.period = periodic ? ticks : 0;
+  if (absolute) {
+    job.expires = ms / SHELL_SCHED_TICK;
+  } else {
+    // from the present, which the wheel may not have caught up with yet
+    job.expires = currentTick() + ticks;
+  }
+  // the tick `now` has been processed already
+  insert(id, now + 1);
+  serial->printf("[%u]\n", (unsigned)id);
+  return 0;
+}
+
+int cmdEvery(int argc, const char *const *argv, Stream *serial) {
+  return schedule(argc, argv, serial, true, false);
+}
+
+int cmdAfter(int argc, const char *const *argv, Stream *serial) {
+  return schedule(argc, argv, serial, false, false);
+}
+
+int cmdAt(int argc, const char *const *argv, Stream *serial) {
+  return schedule(argc, argv, serial, false, true);
+}
+
+int cmdJobs(int, const char *const *, Stream *serial) {
+  if (!owner) return 0;
+  for (uint16_t i = 0; i < SHELL_JOB_MAX; i++) {
+    const Job &job = jobs[i];
+    if (job.slot == NONE) continue;
+
+    int32_t due = (int32_t)(job.expires - now);
+    if (due < 0) due = 0;
+    serial->printf("[%u] in %lums", (unsigned)i,
+                   (unsigned long)due * SHELL_SCHED_TICK);
+    if (job.period) {
+      serial->printf(", every %lums",
+                     (unsigned long)job.period * SHELL_SCHED_TICK);
+    }
+    serial->printf(": %s\n", job.line);
+  }
+  return 0;
+}
+
+int cmdCancel(int argc, const char *const *argv, Stream *serial) {
+  if (argc != 2) {
+    serial->print("usage: cancel id|all\n");
+    return 1;
+  }
+  if (!owner) {
+    serial->print("cancel: Nothing scheduled\n");
+    return 1;
+  }
+
+  if (!strcmp(argv[1], "all")) {
+    for (uint16_t i = 0; i < SHELL_JOB_MAX; i++) {
+      if (jobs[i].slot != NONE) release(i);
+    }
+    return 0;
+  }
+
+  char *end;
+  unsigned long id = strtoul(argv[1], &end, 0);
+  if (*end != '\0' || id >= SHELL_JOB_MAX || jobs[id].slot == NONE) {
+    serial->printf("cancel: No such job: %s\n", argv[1]);
+    return 1;
+  }
+  release(id);
+  return 0;
+}
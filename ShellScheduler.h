@@ -0,0 +1,84 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Commands run later or periodically.
+ *
+ *     every 1s get temp
+ *     after 500ms reset
+ *     at 2h dump log
+ *
+ * `every` repeats a command line at a fixed interval, `after` runs it once
+ * after a delay, and `at` runs it once when the uptime reaches a point, or
+ * at once if it is past.
+ * Times are numbers of milliseconds, or take one of the suffixes `ms`, `s`,
+ * `m` or `h`, up to about 24 days. `jobs` lists what is scheduled, and
+ * `cancel` removes it.
+ *
+ * Jobs run on the shell task through the usual command table, between
+ * commands typed in, so a long-running command delays them. Scheduling and
+ * expiring a job take constant time, regardless of how many are pending:
+ * jobs are kept in a hierarchical timer wheel whose resolution is
+ * `SHELL_SCHED_TICK` milliseconds, drawing from a fixed pool of
+ * `SHELL_JOB_MAX` entries.
+ */
+#ifndef TOYSHELL_SCHEDULER_H
+#define TOYSHELL_SCHEDULER_H
+
+#include "ToyShell.h"
+
+#ifndef SHELL_JOB_MAX
+#define SHELL_JOB_MAX 32
+#endif
+#ifndef SHELL_JOB_LINE
+#define SHELL_JOB_LINE 64
+#endif
+#ifndef SHELL_SCHED_TICK
+#define SHELL_SCHED_TICK 10
+#endif
+
+/**
+ * `every interval command...`: run a command line periodically.
+ */
+int cmdEvery(int argc, const char *const *argv, Stream *serial);
+
+/**
+ * `after delay command...`: run a command line once, after a delay.
+ */
+int cmdAfter(int argc, const char *const *argv, Stream *serial);
+
+/**
+ * `at uptime command...`: run a command line once, when the system has
+ * been up for the time given.
+ */
+int cmdAt(int argc, const char *const *argv, Stream *serial);
+
+/**
+ * `jobs`: list scheduled command lines.
+ */
+int cmdJobs(int argc, const char *const *argv, Stream *serial);
+
+/**
+ * `cancel id|all`: remove scheduled command lines.
+ */
+int cmdCancel(int argc, const char *const *argv, Stream *serial);
+
+#endif
@@ -0,0 +1,177 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Text screens redrawn by difference, for dashboards.
+ *
+ * This is the implementation. See `"ShellScreen.h"` for documentation.
+ */
+#include "ShellScreen.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+// changed cells closer than this are reached by resending the ones between
+#define SKIP_MAX 4
+
+#define CELL(attr, c) ((uint16_t)((attr) << 8 | (uint8_t)(c)))
+#define CELL_ATTR(cell) ((uint8_t)((cell) >> 8))
+#define CELL_CHAR(cell) ((char)((cell) & 0xff))
+
+/*
+ * Collects output into a small buffer, so a frame goes out in a few writes.
+ */
+struct Output {
+  Stream *out;
+  size_t count = 0;
+  size_t total = 0;
+  char buffer[64];
+
+  Output(Stream *out) : out(out) {}
+
+  void flush() {
+    out->write((const uint8_t *)buffer, count);
+    total += count;
+    count = 0;
+  }
+
+  void put(char c) {
+    if (count == sizeof(buffer)) flush();
+    buffer[count++] = c;
+  }
+
+  void put(const char *s) {
+    while (*s) put(*s++);
+  }
+
+  void number(unsigned n) {
+    char digits[4];
+    snprintf(digits, sizeof(digits), "%u", n);
+    put(digits);
+  }
+};
+
+/*
+ * Select graphic rendition: switch the terminal over to `attr`.
+ */
+static void sgr(Output &o, uint8_t attr) {
+  o.put("\x1b[0");
+  if (attr & SCREEN_BOLD) o.put(";1");
+  if (attr & SCREEN_UNDERLINE) o.put(";4");
+  if (attr & SCREEN_REVERSE) o.put(";7");
+  if (attr & 0x08) {
+    o.put(";3");
+    o.put('0' + (attr & 0x07));
+  }
+  o.put('m');
+}
+
+Screen::Screen(uint16_t *cells, uint16_t *shadow, uint8_t width,
+               uint8_t height, uint8_t top, uint8_t left)
+    : cells(cells), shadow(shadow), width(width), height(height), top(top),
+      left(left) {
+  clear();
+}
+
+void Screen::clear() {
+  for (size_t i = 0; i < (size_t)width * height; i++) cells[i] = CELL(0, ' ');
+}
+
+int Screen::print(int col, int row, const char *text) {
+  if (row < 0 || row >= height) return col;
+
+  uint16_t *line = &cells[row * width];
+  for (; *text && col < width; text++, col++) {
+    char c = *text;
+    if ((unsigned char)c < ' ' || c == 0x7f) c = ' ';
+    if (col >= 0) line[col] = CELL(attr, c);
+  }
+  return col;
+}
+
+int Screen::printf(int col, int row, const char *format, ...) {
+  char text[256];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(text, sizeof(text), format, args);
+  va_end(args);
+  return print(col, row, text);
+}
+
+size_t Screen::draw(Stream *out) {
+  Output o(out);
+  uint8_t current = 0;  // the terminal's attributes, reset after every frame
+  int at_row = -1;      // where the cursor is, if known
+  int at_col = -1;
+
+  for (int row = 0; row < height; row++) {
+    uint16_t *line = &cells[row * width];
+    uint16_t *seen = &shadow[row * width];
+
+    for (int col = 0; col < width; col++) {
+      if (!f_full && line[col] == seen[col]) continue;
+
+      // get the cursor here
+      int gap = col - at_col;
+      bool resend = at_row == row && at_col >= 0 && gap <= SKIP_MAX;
+      for (int i = at_col; resend && i < col; i++) {
+        resend = CELL_ATTR(line[i]) == current;
+      }
+      if (at_row == row && gap == 0) {
+        // already there
+      } else if (resend) {
+        for (int i = at_col; i < col; i++) o.put(CELL_CHAR(line[i]));
+      } else if (at_row == row && at_col >= 0) {
+        o.put("\x1b[");
+        o.number(gap);
+        o.put('C');
+      } else {
+        o.put("\x1b[");
+        o.number(top + row);
+        o.put(';');
+        o.number(left + col);
+        o.put('H');
+      }
+
+      if (CELL_ATTR(line[col]) != current) {
+        current = CELL_ATTR(line[col]);
+        sgr(o, current);
+      }
+      o.put(CELL_CHAR(line[col]));
+      seen[col] = line[col];
+
+      // the cursor may or may not wrap after the last column of the
+      // terminal; do not rely on it
+      at_row = row;
+      at_col = col + 1 < width ? col + 1 : -1;
+    }
+  }
+
+  if (current != 0) o.put("\x1b[0m");
+  o.flush();
+  f_full = false;
+  return o.total;
+}
+
+void Screen::leave(Stream *out) {
+  out->printf("\x1b[%u;1H\n", top + height - 1);
+}
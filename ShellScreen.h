@@ -0,0 +1,173 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Text screens redrawn by difference, for dashboards.
+ *
+ * Reprinting a whole dashboard on every refresh keeps the UART busy with
+ * text that has not changed. A `Screen` instead holds the contents of a
+ * fixed-size region of the terminal along with a shadow copy of what was
+ * last sent. Commands write into it freely; `draw` then sends only cursor
+ * moves and the characters that differ, so the cost of a frame depends on
+ * what changed rather than on the size of the region:
+ *
+ *     static ScreenBuffer<40, 3> dash(1, 1);
+ *
+ *     int cmdTop(int argc, const char *const *argv, Stream *serial) {
+ *       serial->print("\x1b[2J");
+ *       dash.invalidate();
+ *       while (serial->available() <= 0) {
+ *         dash.printf(0, 0, "uptime %10lu ms", millis());
+ *         dash.setAttr(gain > 5 ? screenColor(SCREEN_RED) : 0);
+ *         dash.printf(0, 1, "gain   %10d", gain);
+ *         dash.setAttr(0);
+ *         dash.draw(serial);
+ *         vTaskDelay(pdMS_TO_TICKS(100));
+ *       }
+ *       serial->read();
+ *       dash.leave(serial);
+ *       return 0;
+ *     }
+ *
+ * The terminal must understand ANSI (VT100) escape sequences. Text is
+ * expected to be ASCII; other bytes would throw off the column count.
+ */
+#ifndef TOYSHELL_SCREEN_H
+#define TOYSHELL_SCREEN_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "ToyShell.h"
+
+/**
+ * Colors for `screenColor`.
+ */
+enum ScreenColor : uint8_t {
+  SCREEN_BLACK,
+  SCREEN_RED,
+  SCREEN_GREEN,
+  SCREEN_YELLOW,
+  SCREEN_BLUE,
+  SCREEN_MAGENTA,
+  SCREEN_CYAN,
+  SCREEN_WHITE,
+};
+
+/**
+ * Attributes for `Screen::setAttr`. They may be combined with each other
+ * and with a color.
+ */
+enum : uint8_t {
+  SCREEN_BOLD = 0x10,
+  SCREEN_UNDERLINE = 0x20,
+  SCREEN_REVERSE = 0x40,
+};
+
+/**
+ * The attribute selecting a foreground color.
+ */
+constexpr uint8_t screenColor(ScreenColor color) {
+  return 0x08 | color;
+}
+
+/**
+ * A region of the terminal redrawn by difference. Declare a
+ * `ScreenBuffer` to get one.
+ */
+class Screen {
+private:
+  uint16_t *cells;
+  uint16_t *shadow;
+  uint8_t width;
+  uint8_t height;
+  uint8_t top;
+  uint8_t left;
+  uint8_t attr = 0;
+  bool f_full = true;
+
+protected:
+  Screen(uint16_t *cells, uint16_t *shadow, uint8_t width, uint8_t height,
+         uint8_t top, uint8_t left);
+
+public:
+  Screen(Screen &other) = delete;
+
+  /**
+   * Fill the region with blanks.
+   */
+  void clear();
+
+  /**
+   * Set the attributes of text written from now on, such as
+   * `SCREEN_BOLD | screenColor(SCREEN_RED)`. 0 is the terminal's default.
+   */
+  void setAttr(uint8_t attr) { this->attr = attr; }
+
+  /**
+   * Write text starting at column `col` of row `row`, both counted from 0.
+   * Text past the end of the row is cut off. Returns the column after the
+   * text.
+   */
+  int print(int col, int row, const char *text);
+
+  /**
+   * Like `print`, but formatted like `printf`.
+   */
+  int printf(int col, int row, const char *format, ...)
+      __attribute__((format(printf, 4, 5)));
+
+  /**
+   * Send what changed since the last `draw` to `out`. Returns the number of
+   * bytes sent.
+   */
+  size_t draw(Stream *out);
+
+  /**
+   * Forget what is on the terminal, so the next `draw` sends the whole
+   * region. Call this after clearing the terminal or printing over it.
+   */
+  void invalidate() { f_full = true; }
+
+  /**
+   * Move the cursor to the line below the region, e.g. before returning to
+   * the prompt.
+   */
+  void leave(Stream *out);
+};
+
+/**
+ * A `Screen` of `W` columns and `H` rows, with its top left corner at
+ * terminal row `top` and column `left` (counted from 1, as the terminal
+ * does).
+ */
+template <uint8_t W, uint8_t H>
+class ScreenBuffer : public Screen {
+private:
+  uint16_t cells[W * H];
+  uint16_t shadow[W * H];
+
+public:
+  ScreenBuffer(uint8_t top = 1, uint8_t left = 1)
+      : Screen(cells, shadow, W, H, top, left) {}
+};
+
+#endif
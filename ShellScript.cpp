@@ -0,0 +1,727 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Small scripts running on the device.
+ *
+ * This is the implementation. See `"ShellScript.h"` for documentation.
+ */
+#include "ShellScript.h"
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(ARDUINO_ARCH_ESP32)
+// The ESP32 core puts FreeRTOS headers in a custom location. Make it happy.
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#else
+// Include the usual FreeRTOS central header.
+#include <Arduino_FreeRTOS.h>
+#endif
+
+#include "ShellVars.h"
+
+#define SCRIPT_LINE 256
+#define SCRIPT_NAME_MAX 16
+#define CTRL_C 0x03
+
+// Room a value takes in a command line, as in "-2147483648".
+#define VALUE_MAX 11
+// Backward jumps between looks at the clock, and how long a loop may keep
+// the task from yielding to lower priorities, such as the idle task.
+#define YIELD_JUMPS 256
+#define YIELD_MS 100
+
+/*
+ * The instruction set. Operands follow the opcode in little-endian order;
+ * jump targets are absolute addresses.
+ */
+enum Op : uint8_t {
+  OP_HALT,
+  OP_PUSH8,   // int8 value
+  OP_PUSH32,  // int32 value
+  OP_LOAD,    // uint8 register
+  OP_STORE,   // uint8 register
+  OP_LOADVAR, // uint8 index into `vars`
+  OP_OR,
+  OP_AND,
+  OP_BITOR,
+  OP_XOR,
+  OP_BITAND,
+  OP_EQ,
+  OP_NE,
+  OP_LT,
+  OP_LE,
+  OP_GT,
+  OP_GE,
+  OP_SHL,
+  OP_SHR,
+  OP_ADD,
+  OP_SUB,
+  OP_MUL,
+  OP_DIV,
+  OP_MOD,
+  OP_NEG,
+  OP_NOT,
+  OP_JMP,  // uint16 target
+  OP_JZ,   // uint16 target
+  OP_CALL, // uint16 offset into `strings`, uint8 number of values
+};
+
+/*
+ * Binary operators, two-character ones first so they win over their
+ * prefixes.
+ */
+static const struct {
+  char text[3];
+  uint8_t precedence;
+  Op op;
+} binary_ops[] = {
+    {"||", 1, OP_OR},   {"&&", 2, OP_AND},  {"==", 6, OP_EQ},
+    {"!=", 6, OP_NE},   {"<=", 7, OP_LE},   {">=", 7, OP_GE},
+    {"<<", 8, OP_SHL},  {">>", 8, OP_SHR},  {"|", 3, OP_BITOR},
+    {"^", 4, OP_XOR},   {"&", 5, OP_BITAND}, {"<", 7, OP_LT},
+    {">", 7, OP_GT},    {"+", 9, OP_ADD},   {"-", 9, OP_SUB},
+    {"*", 10, OP_MUL},  {"/", 10, OP_DIV},  {"%", 10, OP_MOD},
+};
+
+// Markers for values in command lines.
+#define SUBST_DEC '\x01'
+#define SUBST_HEX '\x02'
+
+enum BlockKind : uint8_t { BLOCK_IF, BLOCK_ELSE, BLOCK_WHILE, BLOCK_FOR };
+
+/*
+ * A compiled script, and the state of the compiler while building it.
+ * Only one script exists at a time.
+ */
+static struct {
+  uint8_t code[SHELL_SCRIPT_CODE];
+  size_t code_len;
+  char strings[SHELL_SCRIPT_STRINGS];
+  size_t strings_len;
+  const Variable *vars[SHELL_SCRIPT_REGS];
+  size_t var_count;
+  char names[SHELL_SCRIPT_REGS][SCRIPT_NAME_MAX];
+  size_t reg_count;
+
+  struct {
+    BlockKind kind;
+    uint8_t reg;
+    uint16_t start;
+    uint16_t patch;
+  } blocks[SHELL_SCRIPT_DEPTH];
+  size_t depth;
+  size_t stack;
+
+  const char *error;
+  const char *source;
+} prog;
+
+static atomic_bool busy;
+
+static const Script *scripts;
+static size_t script_count;
+
+void shellScripts(const Script *table, size_t count) {
+  scripts = table;
+  script_count = count;
+}
+
+/* compiler */
+
+static bool fail(const char *message) {
+  if (!prog.error) prog.error = message;
+  return false;
+}
+
+static bool emit(uint8_t byte) {
+  if (prog.code_len >= SHELL_SCRIPT_CODE) return fail("script too long");
+  prog.code[prog.code_len++] = byte;
+  return true;
+}
+
+static bool emit16(uint16_t v) {
+  return emit(v & 0xff) && emit(v >> 8);
+}
+
+static void patch16(size_t at, uint16_t v) {
+  prog.code[at] = v & 0xff;
+  prog.code[at + 1] = v >> 8;
+}
+
+/*
+ * Track how deep the value stack gets, so the machine needs no checks.
+ */
+static bool push() {
+  if (++prog.stack > SHELL_SCRIPT_STACK) return fail("expression too deep");
+  return true;
+}
+
+static void skip(const char *&p) {
+  while (*p == ' ' || *p == '\t') p++;
+}
+
+static bool identifier(const char *&p, char *name) {
+  size_t len = 0;
+  if (!isalpha((unsigned char)*p) && *p != '_') return false;
+  while (isalnum((unsigned char)*p) || *p == '_') {
+    if (len + 1 >= SCRIPT_NAME_MAX) return fail("name too long");
+    name[len++] = *p++;
+  }
+  name[len] = '\0';
+  return true;
+}
+
+static int findRegister(const char *name, bool create) {
+  for (size_t i = 0; i < prog.reg_count; i++) {
+    if (!strcmp(prog.names[i], name)) return i;
+  }
+  if (!create) return -1;
+  if (prog.reg_count >= SHELL_SCRIPT_REGS) {
+    fail("too many variables");
+    return -1;
+  }
+  strcpy(prog.names[prog.reg_count], name);
+  return prog.reg_count++;
+}
+
+static bool constant(int32_t v) {
+  if (!push()) return false;
+  if (v >= INT8_MIN && v <= INT8_MAX) {
+    return emit(OP_PUSH8) && emit((uint8_t)v);
+  }
+  return emit(OP_PUSH32) && emit16(v & 0xffff) && emit16((uint32_t)v >> 16);
+}
+
+static bool load(const char *name) {
+  int reg = findRegister(name, false);
+  if (reg >= 0) return push() && emit(OP_LOAD) && emit(reg);
+
+  const Variable *var = shellFindVariable(name);
+  if (!var) return fail("unknown variable");
+  size_t i;
+  for (i = 0; i < prog.var_count && prog.vars[i] != var; i++) {}
+  if (i == prog.var_count) {
+    if (prog.var_count >= SHELL_SCRIPT_REGS) return fail("too many variables");
+    prog.vars[prog.var_count++] = var;
+  }
+  return push() && emit(OP_LOADVAR) && emit(i);
+}
+
+static bool expression(const char *&p, int precedence = 1);
+
+static bool primary(const char *&p) {
+  char name[SCRIPT_NAME_MAX];
+  skip(p);
+
+  if (*p == '(') {
+    p++;
+    if (!expression(p)) return false;
+    skip(p);
+    if (*p != ')') return fail("missing )");
+    p++;
+    return true;
+  }
+  if (*p == '-' || *p == '!') {
+    Op op = *p++ == '-' ? OP_NEG : OP_NOT;
+    return primary(p) && emit(op);
+  }
+  if (isdigit((unsigned char)*p)) {
+    char *end;
+    int32_t v = (int32_t)strtoul(p, &end, 0);
+    p = end;
+    return constant(v);
+  }
+  if (identifier(p, name)) return load(name);
+  return fail("expected a value");
+}
+
+/*
+ * Compile an expression by precedence climbing.
+ */
+static bool expression(const char *&p, int precedence) {
+  if (!primary(p)) return false;
+  for (;;) {
+    skip(p);
+    size_t i;
+    for (i = 0; i < sizeof(binary_ops) / sizeof(*binary_ops); i++) {
+      size_t len = strlen(binary_ops[i].text);
+      if (!strncmp(p, binary_ops[i].text, len)) break;
+    }
+    if (i == sizeof(binary_ops) / sizeof(*binary_ops) ||
+        binary_ops[i].precedence < precedence) {
+      return true;
+    }
+
+    p += strlen(binary_ops[i].text);
+    if (!expression(p, binary_ops[i].precedence + 1)) return false;
+    if (!emit(binary_ops[i].op)) return false;
+    prog.stack -= 1;
+  }
+}
+
+/*
+ * Compile an expression making up the rest of a line.
+ */
+static bool wholeExpression(const char *p) {
+  if (!expression(p)) return false;
+  skip(p);
+  if (*p != '\0') return fail("junk after expression");
+  return true;
+}
+
+static bool assign(const char *name, const char *p) {
+  int reg = findRegister(name, true);
+  if (reg < 0) return false;
+  if (!wholeExpression(p)) return false;
+  prog.stack -= 1;
+  return emit(OP_STORE) && emit(reg);
+}
+
+static bool openBlock(BlockKind kind, uint16_t start, uint8_t reg = 0) {
+  if (prog.depth >= SHELL_SCRIPT_DEPTH) return fail("nested too deeply");
+  prog.stack -= 1; // the condition
+  if (!emit(OP_JZ)) return false;
+  prog.blocks[prog.depth].kind = kind;
+  prog.blocks[prog.depth].reg = reg;
+  prog.blocks[prog.depth].start = start;
+  prog.blocks[prog.depth].patch = prog.code_len;
+  prog.depth += 1;
+  return emit16(0);
+}
+
+static bool forLoop(const char *p) {
+  char name[SCRIPT_NAME_MAX];
+  skip(p);
+  if (!identifier(p, name)) return fail("expected a variable");
+  skip(p);
+  if (strncmp(p, "in", 2) != 0) return fail("expected in");
+  p += 2;
+
+  int reg = findRegister(name, true);
+  if (reg < 0) return false;
+  if (!expression(p)) return false;
+  prog.stack -= 1;
+  if (!emit(OP_STORE) || !emit(reg)) return false;
+
+  skip(p);
+  if (strncmp(p, "..", 2) != 0) return fail("expected ..");
+  p += 2;
+
+  // the last value lives in a register without a name
+  if (prog.reg_count >= SHELL_SCRIPT_REGS) return fail("too many variables");
+  int limit = prog.reg_count++;
+  prog.names[limit][0] = '\0';
+  if (!wholeExpression(p)) return false;
+  prog.stack -= 1;
+  if (!emit(OP_STORE) || !emit(limit)) return false;
+
+  uint16_t start = prog.code_len;
+  if (!push() || !emit(OP_LOAD) || !emit(reg) || !push() || !emit(OP_LOAD) ||
+      !emit(limit) || !emit(OP_LE)) {
+    return false;
+  }
+  prog.stack -= 1;
+  return openBlock(BLOCK_FOR, start, reg);
+}
+
+static bool endBlock() {
+  if (prog.depth == 0) return fail("end without block");
+  auto &block = prog.blocks[--prog.depth];
+
+  switch (block.kind) {
+  case BLOCK_FOR:
+    if (!emit(OP_LOAD) || !emit(block.reg) || !emit(OP_PUSH8) || !emit(1) ||
+        !emit(OP_ADD) || !emit(OP_STORE) || !emit(block.reg)) {
+      return false;
+    }
+    // fall through
+  case BLOCK_WHILE:
+    if (!emit(OP_JMP) || !emit16(block.start)) return false;
+    break;
+  default:
+    break;
+  }
+  patch16(block.patch, prog.code_len);
+  return true;
+}
+
+static bool elseBlock() {
+  if (prog.depth == 0 || prog.blocks[prog.depth - 1].kind != BLOCK_IF) {
+    return fail("else without if");
+  }
+  auto &block = prog.blocks[prog.depth - 1];
+  if (!emit(OP_JMP)) return false;
+  size_t jump = prog.code_len;
+  if (!emit16(0)) return false;
+  patch16(block.patch, prog.code_len);
+  block.kind = BLOCK_ELSE;
+  block.patch = jump;
+  return true;
+}
+
+/*
+ * Compile a command line, turning substitutions into code that pushes
+ * their values and markers in the stored text.
+ */
+static bool commandLine(const char *p) {
+  size_t start = prog.strings_len;
+  uint8_t values = 0;
+  size_t longest = 0; // with every value at its widest
+
+  while (*p) {
+    char c = *p++;
+    if (c == '$' && *p == '$') {
+      p++;
+    } else if (c == '$') {
+      c = SUBST_DEC;
+      if (*p == 'x' && p[1] == '(') {
+        c = SUBST_HEX;
+        p++;
+      }
+      if (*p == '(') {
+        p++;
+        if (!expression(p)) return false;
+        skip(p);
+        if (*p != ')') return fail("missing )");
+        p++;
+      } else {
+        char name[SCRIPT_NAME_MAX];
+        if (!identifier(p, name)) return fail("expected a variable after $");
+        if (!load(name)) return false;
+      }
+      values += 1;
+      longest += VALUE_MAX - 1;
+    }
+
+    if (++longest >= SCRIPT_LINE) return fail("command line too long");
+
+    if (prog.strings_len + 1 >= SHELL_SCRIPT_STRINGS) {
+      return fail("too many command lines");
+    }
+    prog.strings[prog.strings_len++] = c;
+  }
+  prog.strings[prog.strings_len++] = '\0';
+
+  prog.stack -= values;
+  return emit(OP_CALL) && emit16(start) && emit(values);
+}
+
+static bool compileLine(const char *p) {
+  char word[SCRIPT_NAME_MAX];
+  skip(p);
+  if (*p == '\0' || *p == '#') return true;
+
+  const char *rest = p;
+  if (identifier(rest, word)) {
+    const char *after = rest;
+    skip(after);
+    if (!strcmp(word, "let")) {
+      skip(rest);
+      if (!identifier(rest, word)) return fail("expected a variable");
+      skip(rest);
+      if (*rest != '=') return fail("expected =");
+      return assign(word, rest + 1);
+    }
+    if (!strcmp(word, "if")) {
+      return wholeExpression(rest) && openBlock(BLOCK_IF, 0);
+    }
+    if (!strcmp(word, "while")) {
+      uint16_t start = prog.code_len;
+      return wholeExpression(rest) && openBlock(BLOCK_WHILE, start);
+    }
+    if (!strcmp(word, "for")) return forLoop(rest);
+    if (!strcmp(word, "else") && *after == '\0') return elseBlock();
+    if (!strcmp(word, "end") && *after == '\0') return endBlock();
+    if (after[0] == '=' && after[1] != '=') return assign(word, after + 1);
+  }
+  prog.error = nullptr;
+  return commandLine(p);
+}
+
+static void reset() {
+  prog.code_len = 0;
+  prog.strings_len = 0;
+  prog.var_count = 0;
+  prog.depth = 0;
+  prog.stack = 0;
+  prog.error = nullptr;
+  prog.source = nullptr;
+  strcpy(prog.names[0], "status");
+  prog.reg_count = 1;
+}
+
+static bool finish() {
+  if (prog.depth) return fail("missing end");
+  return emit(OP_HALT);
+}
+
+/* machine */
+
+static int32_t fetch16(size_t &pc) {
+  uint16_t v = prog.code[pc] | (prog.code[pc + 1] << 8);
+  pc += 2;
+  return v;
+}
+
+static int run(Shell *shell, Stream *serial) {
+  static char line[SCRIPT_LINE];
+  int32_t regs[SHELL_SCRIPT_REGS] = {};
+  int32_t stack[SHELL_SCRIPT_STACK];
+  int32_t *sp = stack;
+  size_t pc = 0;
+  unsigned jumps = 0;
+  TickType_t yielded = xTaskGetTickCount();
+
+  for (;;) {
+    Op op = (Op)prog.code[pc++];
+    int32_t a = 0, b = 0;
+
+    // binary operators take their operands off the stack
+    if (op >= OP_OR && op <= OP_MOD) {
+      b = *--sp;
+      a = *--sp;
+    }
+
+    switch (op) {
+    case OP_HALT:
+      return 0;
+    case OP_PUSH8:
+      *sp++ = (int8_t)prog.code[pc++];
+      break;
+    case OP_PUSH32:
+      a = fetch16(pc);
+      *sp++ = (int32_t)((uint32_t)a | ((uint32_t)fetch16(pc) << 16));
+      break;
+    case OP_LOAD:
+      *sp++ = regs[prog.code[pc++]];
+      break;
+    case OP_STORE:
+      regs[prog.code[pc++]] = *--sp;
+      break;
+    case OP_LOADVAR:
+      *sp++ = (int32_t)shellVariableValue(prog.vars[prog.code[pc++]], 0);
+      break;
+    case OP_OR: *sp++ = a || b; break;
+    case OP_AND: *sp++ = a && b; break;
+    case OP_BITOR: *sp++ = a | b; break;
+    case OP_XOR: *sp++ = a ^ b; break;
+    case OP_BITAND: *sp++ = a & b; break;
+    case OP_EQ: *sp++ = a == b; break;
+    case OP_NE: *sp++ = a != b; break;
+    case OP_LT: *sp++ = a < b; break;
+    case OP_LE: *sp++ = a <= b; break;
+    case OP_GT: *sp++ = a > b; break;
+    case OP_GE: *sp++ = a >= b; break;
+    case OP_SHL: *sp++ = (uint32_t)a << (b & 31); break;
+    case OP_SHR: *sp++ = (uint32_t)a >> (b & 31); break;
+    case OP_ADD: *sp++ = (uint32_t)a + (uint32_t)b; break;
+    case OP_SUB: *sp++ = (uint32_t)a - (uint32_t)b; break;
+    case OP_MUL: *sp++ = (uint32_t)a * (uint32_t)b; break;
+    case OP_DIV:
+    case OP_MOD:
+      if (b == 0 || (a == INT32_MIN && b == -1)) {
+        serial->print("script: Division by zero\n");
+        return 1;
+      }
+      *sp++ = op == OP_DIV ? a / b : a % b;
+      break;
+    case OP_NEG:
+      sp[-1] = -(uint32_t)sp[-1];
+      break;
+    case OP_NOT:
+      sp[-1] = !sp[-1];
+      break;
+    case OP_JMP:
+      a = fetch16(pc);
+      // a backward jump closes a loop; let the user break out of it,
+      // leaving lines typed ahead for the commands after the script
+      if ((size_t)a < pc) {
+        bool key = serial->peek() == CTRL_C;
+        if (key || Shell::cancelled()) {
+          if (key) serial->read();
+          serial->print("script: Interrupted\n");
+          return 1;
+        }
+        // a loop without commands would otherwise starve the idle task,
+        // and trip its watchdog
+        if (++jumps % YIELD_JUMPS == 0 &&
+            xTaskGetTickCount() - yielded >= pdMS_TO_TICKS(YIELD_MS)) {
+          vTaskDelay(1);
+          yielded = xTaskGetTickCount();
+        }
+      }
+      pc = a;
+      break;
+    case OP_JZ:
+      a = fetch16(pc);
+      if (*--sp == 0) pc = a;
+      break;
+    case OP_CALL: {
+      const char *text = &prog.strings[fetch16(pc)];
+      uint8_t n = prog.code[pc++];
+      sp -= n;
+
+      // build the command line, filling in values in order; the compiler
+      // made sure it fits
+      size_t len = 0;
+      const int32_t *value = sp;
+      for (; *text; text++) {
+        if (*text == SUBST_DEC) {
+          len += snprintf(&line[len], VALUE_MAX + 1, "%ld", (long)*value++);
+        } else if (*text == SUBST_HEX) {
+          len += snprintf(&line[len], VALUE_MAX + 1, "0x%lx",
+                          (unsigned long)(uint32_t)*value++);
+        } else {
+          line[len++] = *text;
+        }
+      }
+      line[len] = '\0';
+      regs[0] = shell->execute(line);
+      break;
+    }
+    }
+  }
+}
+
+/*
+ * Check that we may use the compiler, and which shell to run commands on.
+ */
+static Shell *acquire(Stream *serial) {
+  Shell *shell = Shell::current();
+  if (!shell) {
+    serial->print("script: Not running in a shell\n");
+    return nullptr;
+  }
+  bool expected = false;
+  if (!atomic_compare_exchange_strong(&busy, &expected, true)) {
+    serial->print("script: Another script is running\n");
+    return nullptr;
+  }
+  return shell;
+}
+
+int cmdScript(int, const char *const *, Stream *serial) {
+  Shell *shell = acquire(serial);
+  if (!shell) return 1;
+
+  // one more than a line may hold, to tell lines cut short
+  char text[SCRIPT_LINE + 1];
+  unsigned lineno = 0;
+  unsigned error_line = 0;
+  reset();
+
+  // keep reading up to the end even after an error, so the rest of the
+  // script is not taken for commands
+  for (;;) {
+    int len = shell->readLine(text, sizeof(text));
+    if (len < 0) break;
+    lineno += 1;
+    if (!strcmp(text, ".")) break;
+    serial->printf("%s\n", text);
+    if (error_line) continue;
+    if (len >= SCRIPT_LINE) {
+      fail("line too long");
+      error_line = lineno;
+    } else if (!compileLine(text)) {
+      error_line = lineno;
+    }
+  }
+  if (!error_line && !finish()) error_line = lineno;
+
+  int ret = 1;
+  if (error_line) {
+    serial->printf("script: Line %u: %s\n", error_line, prog.error);
+    reset();
+  } else {
+    ret = run(shell, serial);
+  }
+  atomic_store(&busy, 0);
+  return ret;
+}
+
+static int cmp(const void *k, const void *e) {
+  const char *key = (const char *)k;
+  const Script *entry = (const Script *)e;
+  return strcmp(key, entry->name);
+}
+
+int cmdRun(int argc, const char *const *argv, Stream *serial) {
+  if (argc < 2) {
+    for (size_t i = 0; i < script_count; i++) {
+      serial->printf("%s\n", scripts[i].name);
+    }
+    return 0;
+  }
+
+  const Script *script = nullptr;
+  if (scripts) {
+    script = (const Script *)bsearch(
+        argv[1], scripts, script_count, sizeof(Script), cmp);
+  }
+  if (!script) {
+    serial->printf("run: No such script: %s\n", argv[1]);
+    return 1;
+  }
+
+  Shell *shell = acquire(serial);
+  if (!shell) return 1;
+
+  // the last script run stays compiled
+  if (prog.source != script->source) {
+    reset();
+    const char *p = script->source;
+    unsigned lineno = 0;
+    bool ok = true;
+    while (ok && *p) {
+      char text[SCRIPT_LINE];
+      size_t len = strcspn(p, "\n");
+      lineno += 1;
+      if (len >= sizeof(text)) {
+        ok = fail("line too long");
+        break;
+      }
+      memcpy(text, p, len);
+      text[len] = '\0';
+      p += len + (p[len] == '\n');
+      ok = compileLine(text);
+    }
+    if (ok) ok = finish();
+
+    if (!ok) {
+      serial->printf("run: %s: Line %u: %s\n", script->name, lineno,
+                     prog.error);
+      reset();
+      atomic_store(&busy, 0);
+      return 1;
+    }
+    prog.source = script->source;
+  }
+
+  int ret = run(shell, serial);
+  atomic_store(&busy, 0);
+  return ret;
+}
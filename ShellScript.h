@@ -0,0 +1,113 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Small scripts running on the device.
+ *
+ * A script is a sequence of lines, each either a statement or a command
+ * line run through the shell:
+ *
+ *     let base = 0x40000000
+ *     for i in 0..255
+ *       reg read $x(base + i * 4)
+ *     end
+ *
+ * The statements are:
+ *
+ *   - `let name = expression`, or just `name = expression`: assign a script
+ *     variable. Variables hold 32-bit integers and start out as 0.
+ *   - `if expression` ... [`else` ...] `end`
+ *   - `while expression` ... `end`
+ *   - `for name in first..last` ... `end`: count from `first` to `last`,
+ *     both included.
+ *   - `#` starts a comment.
+ *
+ * Any other line is a command line. In it, `$name` and `$(expression)` are
+ * replaced by the value in decimal, and `$x(expression)` by the value in
+ * hexadecimal. The value the last command returned is available as the
+ * variable `status`. A line may be up to 255 characters long, and so may a
+ * command line with its values filled in, each counted at its widest.
+ *
+ * Expressions are made of integers, script variables, variables registered
+ * with `shellVariables` (read-only), parentheses and the C operators
+ * `|| && | ^ & == != < <= > >= << >> + - * / % ! -`, with their usual
+ * precedence.
+ *
+ * A script is compiled to bytecode once, then run by a small stack machine
+ * on the shell task, so loops run at full speed without the host, giving
+ * up a tick every 100 milliseconds for the tasks below it. Ctrl-C, or a
+ * `SHELL_CANCEL` command, stops a running script; other input waits for
+ * the commands after it.
+ */
+#ifndef TOYSHELL_SCRIPT_H
+#define TOYSHELL_SCRIPT_H
+
+#include "ToyShell.h"
+
+#ifndef SHELL_SCRIPT_CODE
+#define SHELL_SCRIPT_CODE 1024
+#endif
+#ifndef SHELL_SCRIPT_STRINGS
+#define SHELL_SCRIPT_STRINGS 1024
+#endif
+#ifndef SHELL_SCRIPT_REGS
+#define SHELL_SCRIPT_REGS 16
+#endif
+#ifndef SHELL_SCRIPT_STACK
+#define SHELL_SCRIPT_STACK 16
+#endif
+#ifndef SHELL_SCRIPT_DEPTH
+#define SHELL_SCRIPT_DEPTH 8
+#endif
+
+/**
+ * A script stored with the firmware, e.g. in flash.
+ */
+struct Script {
+  /**
+   * The name of the script, given to `run`.
+   */
+  const char *name;
+  /**
+   * The text of the script, lines separated by newlines.
+   */
+  const char *source;
+};
+
+/**
+ * Make a table of scripts available to `run`. The table must be sorted by
+ * name in dictionary order.
+ */
+void shellScripts(const Script *scripts, size_t count);
+
+/**
+ * `script`: read a script from the terminal, up to a line containing only
+ * `.`, then run it.
+ */
+int cmdScript(int argc, const char *const *argv, Stream *serial);
+
+/**
+ * `run name`: run a script registered with `shellScripts`. Without
+ * arguments, list the scripts available.
+ */
+int cmdRun(int argc, const char *const *argv, Stream *serial);
+
+#endif
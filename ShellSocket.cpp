@@ -0,0 +1,376 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * The shell over TCP.
+ *
+ * This is the implementation. See `"ShellSocket.h"` for documentation.
+ */
+#include "ShellSocket.h"
+
+#if SHELL_HAVE_SOCKETS
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <Arduino.h>
+
+#if defined(ARDUINO_ARCH_ESP32)
+// The ESP32 core puts FreeRTOS headers in a custom location. Make it happy.
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <lwip/sockets.h>
+#else
+// Include the usual FreeRTOS central header.
+#include <Arduino_FreeRTOS.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+static_assert(SHELL_SOCKET_CLIENTS < 32, "SHELL_SOCKET_CLIENTS is too large");
+
+#define READY_LISTEN (1u << 31)
+
+void SocketStream::attach(int fd) {
+  stop();
+  sock = fd;
+  f_eof = false;
+  f_broken = false;
+  in_head = in_tail = 0;
+  out_len = 0;
+  if (fd < 0) return;
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+  // output is buffered here already; waiting for more only adds latency
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+void SocketStream::stop() {
+  if (sock < 0) return;
+  flush();
+  ::close(sock);
+  sock = -1;
+}
+
+/*
+ * Send all of `buffer`, waiting for the other end to make room if needed.
+ * Gives up on the connection if it takes no data for `SHELL_SOCKET_TIMEOUT`
+ * milliseconds.
+ */
+bool SocketStream::transmit(const uint8_t *buffer, size_t size) {
+  while (size > 0 && !f_broken) {
+    ssize_t count = ::send(sock, buffer, size, MSG_NOSIGNAL);
+    if (count > 0) {
+      buffer += count;
+      size -= count;
+      continue;
+    }
+    if (count < 0 && errno == EINTR) continue;
+    if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      fd_set fds;
+      FD_ZERO(&fds);
+      FD_SET(sock, &fds);
+      timeval timeout = {SHELL_SOCKET_TIMEOUT / 1000,
+                         SHELL_SOCKET_TIMEOUT % 1000 * 1000};
+      if (select(sock + 1, nullptr, &fds, nullptr, &timeout) > 0) continue;
+    }
+    f_broken = true;
+  }
+  return !f_broken;
+}
+
+size_t SocketStream::receive() {
+  if (sock < 0 || f_eof || f_broken) return 0;
+
+  if (!f_pinned && in_tail > 0) {
+    memmove(in, &in[in_tail], in_head - in_tail);
+    in_head -= in_tail;
+    in_tail = 0;
+  }
+  size_t room = SHELL_SOCKET_LINE - in_head;
+  if (room == 0) return 0;
+
+  ssize_t count = ::recv(sock, &in[in_head], room, 0);
+  if (count > 0) {
+    in_head += count;
+    return count;
+  }
+  if (count == 0) {
+    f_eof = true;
+  } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+    f_broken = true;
+  }
+  return 0;
+}
+
+size_t SocketStream::write(uint8_t c) {
+  if (sock < 0 || f_broken) return 0;
+  if (out_len == SHELL_SOCKET_OUTPUT) flush();
+  out[out_len++] = c;
+  return 1;
+}
+
+size_t SocketStream::write(const uint8_t *buffer, size_t size) {
+  if (sock < 0 || f_broken) return 0;
+  if (size > SHELL_SOCKET_OUTPUT - out_len) {
+    flush();
+    // too large to be worth copying
+    if (size >= SHELL_SOCKET_OUTPUT) return transmit(buffer, size) ? size : 0;
+  }
+  memcpy(&out[out_len], buffer, size);
+  out_len += size;
+  return size;
+}
+
+int SocketStream::availableForWrite() {
+  return SHELL_SOCKET_OUTPUT - out_len;
+}
+
+void SocketStream::flush() {
+  if (out_len == 0 || sock < 0) return;
+  transmit(out, out_len);
+  out_len = 0;
+}
+
+int SocketStream::available() {
+  // whoever asks is likely waiting for an answer to what was sent
+  flush();
+  receive();
+  return in_head - in_tail;
+}
+
+int SocketStream::read() {
+  if (in_tail == in_head) receive();
+  if (in_tail == in_head) return -1;
+  return (unsigned char)in[in_tail++];
+}
+
+int SocketStream::peek() {
+  if (in_tail == in_head) receive();
+  if (in_tail == in_head) return -1;
+  return (unsigned char)in[in_tail];
+}
+
+bool ShellListener::begin(Shell &shell, uint16_t port) {
+  if (listen_fd >= 0) return false;
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) return false;
+  if (fd >= FD_SETSIZE) {
+    ::close(fd);
+    return false;
+  }
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  socklen_t len = sizeof(addr);
+  if (bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(fd, SHELL_SOCKET_CLIENTS) < 0 ||
+      getsockname(fd, (sockaddr *)&addr, &len) < 0) {
+    ::close(fd);
+    return false;
+  }
+  // a client may give up between `select` and `accept`
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+  this->shell = &shell;
+  listen_fd = fd;
+  bound_port = ntohs(addr.sin_port);
+  ready = 0;
+  atomic_store(&f_ready, 0);
+  atomic_store(&f_stop, 0);
+  atomic_store(&f_watching, 1);
+  if (!shell.addService(ShellListener::poll, this)) {
+    atomic_store(&f_watching, 0);
+    end();
+    return false;
+  }
+  if (!shellCreateTask(ShellListener::startWatch, "shell-net",
+                       SHELL_WATCHER_STACK, this, 1, &watcher,
+                       shell.getCore())) {
+    atomic_store(&f_watching, 0);
+    end();
+    return false;
+  }
+  return true;
+}
+
+void ShellListener::end() {
+  if (listen_fd < 0) return;
+
+  shell->removeService(ShellListener::poll, this);
+  atomic_store(&f_stop, 1);
+  if (watcher) xTaskNotifyGive((TaskHandle_t)watcher);
+  while (f_watching != 0)
+    vTaskDelay(1);
+  watcher = nullptr;
+
+  for (SocketStream &client : clients) client.stop();
+  ::close(listen_fd);
+  listen_fd = -1;
+  bound_port = 0;
+}
+
+size_t ShellListener::clientCount() const {
+  size_t count = 0;
+  for (const SocketStream &client : clients) {
+    if (client.fd() >= 0) count += 1;
+  }
+  return count;
+}
+
+void ShellListener::admit() {
+  int fd = ::accept(listen_fd, nullptr, nullptr);
+  if (fd < 0) return;
+
+  // the watcher could not `select` on it
+  if (fd >= FD_SETSIZE) {
+    static const char busy[] = "shell: Too many open files\n";
+    ::send(fd, busy, sizeof(busy) - 1, MSG_NOSIGNAL);
+    ::close(fd);
+    return;
+  }
+
+  for (SocketStream &client : clients) {
+    if (client.fd() < 0) {
+      client.attach(fd);
+      client.print("shell> ");
+      client.flush();
+      return;
+    }
+  }
+
+  static const char full[] = "shell: Too many connections\n";
+  ::send(fd, full, sizeof(full) - 1, MSG_NOSIGNAL);
+  ::close(fd);
+}
+
+/*
+ * Run every complete line a client has sent.
+ */
+void ShellListener::serve(SocketStream &client) {
+  client.receive();
+
+  for (;;) {
+    char *line = &client.in[client.in_tail];
+    char *end = (char *)memchr(line, '\n', client.in_head - client.in_tail);
+    if (!end) break;
+
+    *end = '\0';
+    if (end > line && end[-1] == '\r') end[-1] = '\0';
+    client.in_tail = end + 1 - client.in;
+
+    // the command may read input after its line, but must not move it
+    client.f_pinned = true;
+    shell->execute(line, &client);
+    client.f_pinned = false;
+    if (listen_fd < 0) return; // the command stopped the listener
+
+    client.print("shell> ");
+  }
+
+  if (client.in_tail == 0 && client.in_head == SHELL_SOCKET_LINE) {
+    client.print("\nshell: Command line too long; discarding\nshell> ");
+    client.in_head = 0;
+  }
+
+  client.flush();
+  if (!client.connected()) client.stop();
+}
+
+/*
+ * Serve the clients the watcher found ready, then hand the sockets back.
+ */
+void ShellListener::service() {
+  if (!atomic_load_explicit(&f_ready, memory_order_acquire)) return;
+
+  for (size_t i = 0; i < SHELL_SOCKET_CLIENTS; i++) {
+    if (!(ready & (1u << i))) continue;
+    serve(clients[i]);
+    if (listen_fd < 0) return;
+  }
+  if (ready & READY_LISTEN) admit();
+
+  atomic_store_explicit(&f_ready, 0, memory_order_release);
+  xTaskNotifyGive((TaskHandle_t)watcher);
+}
+
+void ShellListener::poll(Shell &, void *arg) {
+  ShellListener *listener = (ShellListener *)arg;
+  listener->service();
+}
+
+/*
+ * Wait for any socket to become readable, and have the shell serve it.
+ * The timeout only bounds how long `end` waits for this task to notice.
+ */
+void ShellListener::watch() {
+  while (f_stop == 0) {
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(listen_fd, &fds);
+    int max = listen_fd;
+    for (SocketStream &client : clients) {
+      int fd = client.fd();
+      if (fd < 0) continue;
+      FD_SET(fd, &fds);
+      if (fd > max) max = fd;
+    }
+
+    timeval timeout = {0, 100000};
+    if (select(max + 1, &fds, nullptr, nullptr, &timeout) <= 0) continue;
+
+    ready = FD_ISSET(listen_fd, &fds) ? READY_LISTEN : 0;
+    for (size_t i = 0; i < SHELL_SOCKET_CLIENTS; i++) {
+      int fd = clients[i].fd();
+      if (fd >= 0 && FD_ISSET(fd, &fds)) ready |= 1u << i;
+    }
+
+    atomic_store_explicit(&f_ready, 1, memory_order_release);
+    shell->wake();
+    while (atomic_load_explicit(&f_ready, memory_order_acquire) && f_stop == 0)
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+  }
+
+  atomic_store(&f_watching, 0);
+  vTaskDelete(NULL);
+}
+
+void ShellListener::startWatch(void *parameters) {
+  ShellListener *listener = (ShellListener *)parameters;
+  listener->watch();
+}
+
+#endif
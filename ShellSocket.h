@@ -0,0 +1,223 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * The shell over TCP.
+ *
+ * A `ShellListener` accepts connections on a port and runs the command
+ * lines that arrive on them, alongside the shell's own port:
+ *
+ *     static Shell shell(commands);
+ *     static ShellListener telnet;
+ *
+ *     void setup() {
+ *       WiFi.begin(ssid, password);
+ *       // ...
+ *       shell.begin();
+ *       telnet.begin(shell, 23);
+ *     }
+ *
+ * Up to `SHELL_SOCKET_CLIENTS` clients may be connected at once. They are
+ * served by the shell's task, one line at a time, through the same command
+ * table; no task is created per connection. A single watcher task waits on
+ * all sockets at once with `select` and wakes the shell when any of them
+ * has something to read. Commands get a `SocketStream` on the client that
+ * sent the line, and their output goes back to that client only. Lines are
+ * not echoed, as terminal programs echo them locally.
+ *
+ * Sockets are the BSD sockets of lwIP on ESP32, or of the host when built
+ * for simulation on Linux or macOS. Elsewhere this file is left out.
+ */
+#ifndef TOYSHELL_SOCKET_H
+#define TOYSHELL_SOCKET_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "ToyShell.h"
+
+#if defined(ARDUINO_ARCH_ESP32) || defined(__linux__) || defined(__APPLE__)
+#define SHELL_HAVE_SOCKETS 1
+#else
+#define SHELL_HAVE_SOCKETS 0
+#endif
+
+#if SHELL_HAVE_SOCKETS
+
+#ifndef SHELL_SOCKET_CLIENTS
+#define SHELL_SOCKET_CLIENTS 4
+#endif
+
+/*
+ * Every client has an input buffer of `SHELL_SOCKET_LINE` bytes, which
+ * limits the length of a command line, and an output buffer of
+ * `SHELL_SOCKET_OUTPUT` bytes. Output is sent when the buffer fills up, when
+ * a command returns, and when a command checks for input.
+ */
+#ifndef SHELL_SOCKET_LINE
+#define SHELL_SOCKET_LINE 256
+#endif
+#ifndef SHELL_SOCKET_OUTPUT
+#define SHELL_SOCKET_OUTPUT 512
+#endif
+
+/*
+ * How long to wait, in milliseconds, for a client to take output before
+ * giving up on it.
+ */
+#ifndef SHELL_SOCKET_TIMEOUT
+#define SHELL_SOCKET_TIMEOUT 1000
+#endif
+
+#ifndef SHELL_WATCHER_STACK
+#define SHELL_WATCHER_STACK 2048
+#endif
+
+/**
+ * A `Stream` on a connected socket. The socket is switched to non-blocking
+ * mode: reads return what has arrived and never wait, and writes are
+ * buffered. It may also be handed to `Shell::begin` on its own.
+ */
+class SocketStream : public Stream {
+private:
+  int sock = -1;
+  bool f_eof = false;
+  bool f_broken = false;
+  bool f_pinned = false; // a command line lies in `in`; do not move it
+  size_t in_head = 0;
+  size_t in_tail = 0;
+  size_t out_len = 0;
+  char in[SHELL_SOCKET_LINE];
+  uint8_t out[SHELL_SOCKET_OUTPUT];
+
+  bool transmit(const uint8_t *buffer, size_t size);
+  friend class ShellListener;
+public:
+  SocketStream() {}
+  explicit SocketStream(int fd) { attach(fd); }
+  SocketStream(SocketStream &other) = delete;
+
+  /**
+   * Close the socket.
+   */
+  ~SocketStream() { stop(); }
+
+  /**
+   * Take over a connected socket, closing the one held before.
+   */
+  void attach(int fd);
+
+  /**
+   * Send what is buffered and close the socket.
+   */
+  void stop();
+
+  /**
+   * Whether the socket is open and has neither been closed by the other
+   * end nor failed.
+   */
+  bool connected() const { return sock >= 0 && !f_eof && !f_broken; }
+
+  /**
+   * The socket, or -1 if there is none.
+   */
+  int fd() const { return sock; }
+
+  /**
+   * Move what the socket has received into the input buffer, without
+   * waiting. Returns the number of bytes moved.
+   */
+  size_t receive();
+
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t *buffer, size_t size) override;
+  int availableForWrite() override;
+  void flush() override;
+  int available() override;
+  int read() override;
+  int peek() override;
+};
+
+/**
+ * Serves a shell to TCP clients. See the top of this file.
+ */
+class ShellListener {
+private:
+  Shell *shell = nullptr;
+  int listen_fd = -1;
+  uint16_t bound_port = 0;
+  SocketStream clients[SHELL_SOCKET_CLIENTS];
+
+  // the watcher owns the sockets while `f_ready` is clear, the shell while
+  // it is set; `ready` has a bit for every client with input, and the top
+  // bit for a connection waiting to be accepted
+  void *watcher = nullptr;
+  atomic_bool f_ready;
+  atomic_bool f_stop;
+  atomic_bool f_watching;
+  uint32_t ready = 0;
+
+  void admit();
+  void serve(SocketStream &client);
+  void service();
+  void watch();
+  static void poll(Shell &shell, void *arg);
+  static void startWatch(void *);
+public:
+  ShellListener() : f_ready(0), f_stop(0), f_watching(0) {}
+  ShellListener(ShellListener &other) = delete;
+
+  /**
+   * Stop listening and disconnect all clients.
+   */
+  ~ShellListener() { end(); }
+
+  /**
+   * Listen on a TCP port on all interfaces and serve `shell` to whoever
+   * connects. Port 0 picks a free port; see `port`. The shell should be
+   * started already, and have `SHELL_READ_AHEAD` on: otherwise its task
+   * only notices clients every 20 milliseconds. Returns false if the port
+   * cannot be opened, or if there is no room for another service. The
+   * watcher task runs on the shell's core; see `Shell::setCore`.
+   */
+  bool begin(Shell &shell, uint16_t port);
+
+  /**
+   * Disconnect all clients and stop listening. Call this from the shell's
+   * own task, or while the shell is stopped.
+   */
+  void end();
+
+  /**
+   * The port listened on, or 0 if not listening.
+   */
+  uint16_t port() const { return bound_port; }
+
+  /**
+   * The number of clients connected.
+   */
+  size_t clientCount() const;
+};
+
+#endif
+
+#endif
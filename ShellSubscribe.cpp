@@ -0,0 +1,229 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Binary sample streams of shell variables.
+ *
+ * This is the implementation. See `"ShellSubscribe.h"` for documentation.
+ */
+#include "ShellSubscribe.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <Arduino.h>
+
+#if defined(ARDUINO_ARCH_ESP32)
+// The ESP32 core puts FreeRTOS headers in a custom location. Make it happy.
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/timers.h>
+#else
+// Include the usual FreeRTOS central header.
+#include <Arduino_FreeRTOS.h>
+#include <timers.h>
+#endif
+
+#define FRAME_HEADER 9
+
+/*
+ * State of the running subscription. There is at most one at a time; the
+ * timer callback fills frames at `head`, the shell task sends them from
+ * `tail`.
+ */
+static struct {
+  const Variable *vars[SHELL_ARG_MAX];
+  size_t var_count;
+  size_t frame_size;
+  size_t slots;
+  uint8_t seq;
+  atomic_uint head;
+  atomic_uint tail;
+  atomic_bool stopped;
+  TaskHandle_t reader;
+  uint8_t buffer[SHELL_SUBSCRIBE_BUFFER];
+} sub;
+
+static atomic_bool busy;
+
+static uint8_t crc8(const uint8_t *data, size_t len) {
+  uint8_t crc = 0;
+  while (len--) {
+    crc ^= *data++;
+    for (int i = 0; i < 8; i++) {
+      crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+    }
+  }
+  return crc;
+}
+
+static void sample(TimerHandle_t) {
+  unsigned head = atomic_load_explicit(&sub.head, memory_order_relaxed);
+  unsigned tail = atomic_load_explicit(&sub.tail, memory_order_acquire);
+  uint8_t seq = sub.seq++;
+  if (head - tail >= sub.slots) return; // full; the gap in seq tells
+
+  uint8_t *frame = &sub.buffer[(head % sub.slots) * sub.frame_size];
+  size_t payload = sub.frame_size - FRAME_HEADER - 1;
+  uint32_t now = micros();
+  frame[0] = 0xa5;
+  frame[1] = 0x5a;
+  frame[2] = payload & 0xff;
+  frame[3] = payload >> 8;
+  frame[4] = seq;
+  frame[5] = now & 0xff;
+  frame[6] = (now >> 8) & 0xff;
+  frame[7] = (now >> 16) & 0xff;
+  frame[8] = now >> 24;
+
+  uint8_t *p = &frame[FRAME_HEADER];
+  for (size_t i = 0; i < sub.var_count; i++) {
+    const Variable *var = sub.vars[i];
+    for (size_t j = 0; j < var->count; j++) {
+      shellLoadVariable(var, j, p);
+      p += var->size;
+    }
+  }
+  *p = crc8(&frame[2], p - &frame[2]);
+
+  atomic_store_explicit(&sub.head, head + 1, memory_order_release);
+  xTaskNotifyGive(sub.reader);
+}
+
+// Runs on the timer task after the sampling timer is gone for good.
+static void stopped(void *, uint32_t) {
+  atomic_store(&sub.stopped, 1);
+  xTaskNotifyGive(sub.reader);
+}
+
+static char typeCode(const Variable *var) {
+  switch (var->type) {
+  case VAR_BOOL: return 'b';
+  case VAR_INT: return 'i';
+  case VAR_UINT: return 'u';
+  case VAR_FLOAT: return 'f';
+  case VAR_ENUM: return 'e';
+  }
+  return '?';
+}
+
+/*
+ * Send every complete frame, in as few writes as the ring allows.
+ */
+static void drain(Stream *serial) {
+  unsigned tail = atomic_load_explicit(&sub.tail, memory_order_relaxed);
+  unsigned head = atomic_load_explicit(&sub.head, memory_order_acquire);
+  while (tail != head) {
+    size_t first = tail % sub.slots;
+    size_t n = head - tail;
+    if (first + n > sub.slots) n = sub.slots - first;
+
+    serial->write(&sub.buffer[first * sub.frame_size], n * sub.frame_size);
+    tail += n;
+    atomic_store_explicit(&sub.tail, tail, memory_order_release);
+  }
+}
+
+int cmdSubscribe(int argc, const char *const *argv, Stream *serial) {
+  if (argc < 3) {
+    serial->print("usage: subscribe hz name...\n");
+    return 1;
+  }
+
+  unsigned long hz = strtoul(argv[1], nullptr, 0);
+  if (hz == 0 || hz > configTICK_RATE_HZ) {
+    serial->printf("subscribe: Rate must be between 1 and %u Hz\n",
+                   (unsigned)configTICK_RATE_HZ);
+    return 1;
+  }
+
+  bool expected = false;
+  if (!atomic_compare_exchange_strong(&busy, &expected, true)) {
+    serial->print("subscribe: Another subscription is running\n");
+    return 1;
+  }
+
+  sub.var_count = 0;
+  sub.frame_size = FRAME_HEADER + 1;
+  for (int i = 2; i < argc; i++) {
+    const Variable *var = shellFindVariable(argv[i]);
+    if (!var) {
+      serial->printf("subscribe: No such variable: %s\n", argv[i]);
+      atomic_store(&busy, 0);
+      return 1;
+    }
+    sub.vars[sub.var_count++] = var;
+    sub.frame_size += var->size * var->count;
+  }
+  if (sub.frame_size > SHELL_SUBSCRIBE_BUFFER / 2) {
+    serial->print("subscribe: Frame too large\n");
+    atomic_store(&busy, 0);
+    return 1;
+  }
+
+  sub.slots = SHELL_SUBSCRIBE_BUFFER / sub.frame_size;
+  sub.seq = 0;
+  atomic_store(&sub.head, 0);
+  atomic_store(&sub.tail, 0);
+  atomic_store(&sub.stopped, 0);
+  sub.reader = xTaskGetCurrentTaskHandle();
+
+  // samples are a whole number of ticks apart, so tell the rate that gives
+  TickType_t period = configTICK_RATE_HZ / hz;
+  double rate = (double)configTICK_RATE_HZ / period;
+
+  // describe the layout for the host
+  serial->printf("subscribe: %g Hz; frame a5 5a len:u16 seq:u8 us:u32", rate);
+  for (size_t i = 0; i < sub.var_count; i++) {
+    const Variable *var = sub.vars[i];
+    serial->printf(" %s:%c%u", var->name, typeCode(var),
+                   (unsigned)(var->size * 8));
+    if (var->count > 1) serial->printf("[%u]", (unsigned)var->count);
+  }
+  serial->print(" crc8\n");
+
+  TimerHandle_t timer =
+      xTimerCreate("subscribe", period, pdTRUE, nullptr, sample);
+  if (!timer || xTimerStart(timer, portMAX_DELAY) != pdPASS) {
+    serial->print("subscribe: Cannot start timer\n");
+    if (timer) xTimerDelete(timer, portMAX_DELAY);
+    atomic_store(&busy, 0);
+    return 1;
+  }
+
+  while (serial->available() <= 0 && !Shell::cancelled()) {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(20));
+    drain(serial);
+  }
+  serial->read();
+
+  // the timer task runs commands in order, so once `stopped` has run no
+  // sample can be in progress
+  xTimerDelete(timer, portMAX_DELAY);
+  xTimerPendFunctionCall(stopped, nullptr, 0, portMAX_DELAY);
+  while (!atomic_load(&sub.stopped))
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+  drain(serial);
+
+  serial->print("\nsubscribe: Stopped\n");
+  atomic_store(&busy, 0);
+  return 0;
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Binary sample streams of shell variables.
+ *
+ * `subscribe` samples a set of variables and probes (see `"ShellVars.h"`)
+ * on a FreeRTOS timer and streams them out as binary frames until a key is
+ * pressed, so a host charting values needs no round trip per sample.
+ *
+ * Before the first frame, a single text line describes the layout:
+ *
+ *     subscribe: 100 Hz; frame a5 5a len:u16 seq:u8 us:u32 gain:i32 ... crc8
+ *
+ * Every frame then consists of:
+ *
+ *   - the bytes 0xa5 0x5a;
+ *   - the length of the payload, a little-endian 16-bit integer;
+ *   - a sequence number, incremented for every sample taken, so dropped
+ *     frames show up as gaps;
+ *   - the time of sampling in microseconds, a little-endian 32-bit integer;
+ *   - the payload: every element of every variable in the order given,
+ *     in native (little-endian) representation;
+ *   - a CRC-8 (polynomial 0x07) over everything after the sync bytes.
+ */
+#ifndef TOYSHELL_SUBSCRIBE_H
+#define TOYSHELL_SUBSCRIBE_H
+
+#include "ShellVars.h"
+
+/**
+ * The size of the buffer holding frames waiting to be sent. Samples taken
+ * while the buffer is full are dropped.
+ */
+#ifndef SHELL_SUBSCRIBE_BUFFER
+#define SHELL_SUBSCRIBE_BUFFER 1024
+#endif
+
+/**
+ * `subscribe hz name...`: stream samples of the named variables at `hz`
+ * samples per second, until a key is pressed. The rate is limited by the
+ * FreeRTOS tick rate, and samples are a whole number of ticks apart; the
+ * line describing the layout gives the rate this comes to, e.g. 333.333 Hz
+ * for 300 at 1000 ticks per second.
+ */
+int cmdSubscribe(int argc, const char *const *argv, Stream *serial);
+
+#endif
@@ -0,0 +1,325 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Commands run when a condition on a shell variable becomes true.
+ *
+ * This is the implementation. See `"ShellTriggers.h"` for documentation.
+ */
+#include "ShellTriggers.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(ARDUINO_ARCH_ESP32)
+// The ESP32 core puts FreeRTOS headers in a custom location. Make it happy.
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#else
+// Include the usual FreeRTOS central header.
+#include <Arduino_FreeRTOS.h>
+#endif
+
+enum {
+  OP_TRUE,
+  OP_GT,
+  OP_GE,
+  OP_LT,
+  OP_LE,
+  OP_EQ,
+  OP_NE,
+  OP_CHANGED,
+  OP_INCREASED,
+  OP_DECREASED,
+};
+
+static const char *const op_names[] = {
+    "", ">", ">=", "<", "<=", "==", "!=", "~", "+", "-",
+};
+
+/*
+ * A compiled condition and the command line bound to it. A slot is free
+ * when `shell` is null.
+ */
+struct Trigger {
+  Shell *shell;
+  const Variable *var;
+  uint16_t index;
+  uint8_t op;
+  bool state;
+  double operand;
+  double last;
+  char line[SHELL_TRIGGER_LINE];
+};
+
+/*
+ * When a shell last checked its conditions, and whether it was asked to
+ * check again since. Handed to `check` as its argument; a slot is free
+ * when `shell` is null.
+ */
+struct Checker {
+  Shell *shell;
+  TickType_t last_check;
+  atomic_bool notified;
+};
+
+static Trigger triggers[SHELL_TRIGGER_MAX];
+static Checker checkers[SHELL_INSTANCE_MAX];
+
+void shellNotify() {
+  for (Checker &checker : checkers) atomic_store(&checker.notified, 1);
+}
+
+/*
+ * Find the checker of `shell`, claiming one if it has none yet.
+ */
+static Checker *checkerOf(Shell *shell) {
+  for (Checker &checker : checkers) {
+    Shell *owner = __atomic_load_n(&checker.shell, __ATOMIC_ACQUIRE);
+    if (owner == shell) return &checker;
+    if (!owner && __atomic_compare_exchange_n(&checker.shell, &owner, shell,
+                                              false, __ATOMIC_ACQ_REL,
+                                              __ATOMIC_ACQUIRE)) {
+      return &checker;
+    }
+  }
+  return nullptr;
+}
+
+/*
+ * Evaluate a condition against the current value of its variable. For
+ * comparisons this is the truth of the comparison; for changes, whether
+ * the value moved in the right direction since the last evaluation.
+ */
+static bool evaluate(Trigger *t) {
+  double v = shellVariableValue(t->var, t->index);
+  double last = t->last;
+  t->last = v;
+
+  switch (t->op) {
+  case OP_TRUE: return v != 0;
+  case OP_GT: return v > t->operand;
+  case OP_GE: return v >= t->operand;
+  case OP_LT: return v < t->operand;
+  case OP_LE: return v <= t->operand;
+  case OP_EQ: return v == t->operand;
+  case OP_NE: return v != t->operand;
+  case OP_CHANGED: return v != last;
+  case OP_INCREASED: return v > last;
+  case OP_DECREASED: return v < last;
+  }
+  return false;
+}
+
+static void check(Shell &shell, void *arg) {
+  Checker *checker = (Checker *)arg;
+  TickType_t now = xTaskGetTickCount();
+  if (!atomic_exchange(&checker->notified, 0) &&
+      now - checker->last_check < pdMS_TO_TICKS(SHELL_TRIGGER_PERIOD)) {
+    return;
+  }
+  checker->last_check = now;
+
+  for (Trigger &t : triggers) {
+    if (t.shell != &shell) continue;
+
+    bool state = evaluate(&t);
+    bool edge = state && (t.op >= OP_CHANGED || !t.state);
+    t.state = state;
+    if (edge) {
+      char line[SHELL_TRIGGER_LINE];
+      memcpy(line, t.line, sizeof(line));
+      shell.execute(line);
+    }
+  }
+}
+
+/*
+ * The shell is stopping: drop its conditions and give up its checker.
+ */
+static void release(Shell &shell, void *arg) {
+  Checker *checker = (Checker *)arg;
+  for (Trigger &t : triggers) {
+    if (t.shell == &shell) t.shell = nullptr;
+  }
+  __atomic_store_n(&checker->shell, nullptr, __ATOMIC_RELEASE);
+}
+
+/*
+ * Parse a condition like `temps[2]>=30` into a trigger. Returns false and
+ * complains on `serial` if it makes no sense.
+ */
+static bool compile(Trigger *t, const char *text, Stream *serial) {
+  char name[SHELL_TRIGGER_LINE];
+  size_t len = strcspn(text, "[<>=!~+-");
+  if (len == 0 || len >= sizeof(name)) {
+    serial->printf("on: Bad condition: %s\n", text);
+    return false;
+  }
+  memcpy(name, text, len);
+  name[len] = '\0';
+
+  t->var = shellFindVariable(name);
+  if (!t->var) {
+    serial->printf("on: No such variable: %s\n", name);
+    return false;
+  }
+
+  const char *p = text + len;
+  char *end;
+  t->index = 0;
+  if (*p == '[') {
+    unsigned long index = strtoul(p + 1, &end, 0);
+    if (*end != ']' || index >= t->var->count) {
+      serial->printf("on: Bad index: %s\n", text);
+      return false;
+    }
+    t->index = index;
+    p = end + 1;
+  }
+
+  // longest operators first, so `>=` is not taken for `>`
+  t->op = OP_TRUE;
+  if (*p != '\0') {
+    size_t n = 0;
+    for (uint8_t op = OP_GT; op <= OP_DECREASED; op++) {
+      size_t l = strlen(op_names[op]);
+      if (l > n && !strncmp(p, op_names[op], l)) {
+        t->op = op;
+        n = l;
+      }
+    }
+    if (n == 0) {
+      serial->printf("on: Bad condition: %s\n", text);
+      return false;
+    }
+    p += n;
+  }
+
+  t->operand = 0;
+  if (t->op >= OP_GT && t->op <= OP_NE) {
+    t->operand = strtod(p, &end);
+    if (end == p || *end != '\0') {
+      serial->printf("on: Bad number: %s\n", p);
+      return false;
+    }
+  } else if (*p != '\0') {
+    serial->printf("on: Bad condition: %s\n", text);
+    return false;
+  }
+
+  // prime the state so only later edges fire
+  t->last = shellVariableValue(t->var, t->index);
+  t->state = evaluate(t);
+  return true;
+}
+
+static void list(Stream *serial) {
+  for (size_t i = 0; i < SHELL_TRIGGER_MAX; i++) {
+    const Trigger &t = triggers[i];
+    if (!t.shell) continue;
+
+    serial->printf("%u: %s", (unsigned)i, t.var->name);
+    if (t.var->count > 1) serial->printf("[%u]", (unsigned)t.index);
+    serial->print(op_names[t.op]);
+    if (t.op >= OP_GT && t.op <= OP_NE) serial->printf("%g", t.operand);
+    serial->printf(" %s\n", t.line);
+  }
+}
+
+int cmdOn(int argc, const char *const *argv, Stream *serial) {
+  if (argc == 1) {
+    list(serial);
+    return 0;
+  }
+  if (argc < 3) {
+    serial->print("usage: on condition command...\n");
+    return 1;
+  }
+
+  Shell *shell = Shell::current();
+  if (!shell) {
+    serial->print("on: Not running in a shell\n");
+    return 1;
+  }
+
+  Trigger *t = nullptr;
+  for (Trigger &slot : triggers) {
+    if (!slot.shell) {
+      t = &slot;
+      break;
+    }
+  }
+  if (!t) {
+    serial->printf("on: At most %d conditions can be bound\n",
+                   SHELL_TRIGGER_MAX);
+    return 1;
+  }
+
+  // join the command line back together
+  size_t len = 0;
+  for (int i = 2; i < argc; i++) {
+    size_t n = strlen(argv[i]);
+    if (len + n + 1 > sizeof(t->line)) {
+      serial->print("on: Command line too long\n");
+      return 1;
+    }
+    if (i > 2) t->line[len++] = ' ';
+    memcpy(&t->line[len], argv[i], n);
+    len += n;
+  }
+  t->line[len] = '\0';
+
+  if (!compile(t, argv[1], serial)) return 1;
+  Checker *checker = checkerOf(shell);
+  if (!checker || !shell->addService(check, checker, release)) {
+    serial->print("on: Too many shell services\n");
+    return 1;
+  }
+  t->shell = shell;
+  return 0;
+}
+
+int cmdOff(int argc, const char *const *argv, Stream *serial) {
+  if (argc != 2) {
+    serial->print("usage: off id|all\n");
+    return 1;
+  }
+
+  Shell *shell = Shell::current();
+  if (!strcmp(argv[1], "all")) {
+    for (Trigger &t : triggers) {
+      if (t.shell == shell) t.shell = nullptr;
+    }
+    return 0;
+  }
+
+  char *end;
+  unsigned long id = strtoul(argv[1], &end, 0);
+  // another shell's conditions are not for this one to remove
+  if (*end != '\0' || id >= SHELL_TRIGGER_MAX || !shell ||
+      triggers[id].shell != shell) {
+    serial->printf("off: No such condition: %s\n", argv[1]);
+    return 1;
+  }
+  triggers[id].shell = nullptr;
+  return 0;
+}
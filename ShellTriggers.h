@@ -0,0 +1,80 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Commands run when a condition on a shell variable becomes true.
+ *
+ *     on temp>30 fan on
+ *     on errors+ dump errors
+ *
+ * binds a command line to a condition on a variable registered with
+ * `shellVariables`. The shell checks the conditions between commands, and
+ * runs the command line whenever its condition changes from false to true;
+ * a condition that is already true when bound fires only after becoming
+ * false again. Conditions take these forms, where `name` may also be an
+ * array element like `temps[2]`:
+ *
+ *   - `name>value`, `name>=value`, `name<value`, `name<=value`,
+ *     `name==value`, `name!=value`: comparisons with a number;
+ *   - `name`: the value is not zero;
+ *   - `name~`, `name+`, `name-`: the value changed, increased or
+ *     decreased since the last check.
+ *
+ * Conditions are checked every `SHELL_TRIGGER_PERIOD` milliseconds, and
+ * as soon as possible after `shellNotify` is called.
+ *
+ * Conditions belong to the shell that bound them, whose commands they run:
+ * `off` only removes that shell's own, and they are dropped when it stops.
+ */
+#ifndef TOYSHELL_TRIGGERS_H
+#define TOYSHELL_TRIGGERS_H
+
+#include "ShellVars.h"
+
+#ifndef SHELL_TRIGGER_MAX
+#define SHELL_TRIGGER_MAX 8
+#endif
+#ifndef SHELL_TRIGGER_LINE
+#define SHELL_TRIGGER_LINE 64
+#endif
+#ifndef SHELL_TRIGGER_PERIOD
+#define SHELL_TRIGGER_PERIOD 100
+#endif
+
+/**
+ * Ask for conditions to be checked without waiting for the next period,
+ * e.g. right after updating a variable a condition depends on. Safe to
+ * call from any task.
+ */
+void shellNotify();
+
+/**
+ * `on [condition command...]`: run a command line whenever a condition
+ * becomes true. Without arguments, list the conditions bound.
+ */
+int cmdOn(int argc, const char *const *argv, Stream *serial);
+
+/**
+ * `off id|all`: remove a condition bound by `on`.
+ */
+int cmdOff(int argc, const char *const *argv, Stream *serial);
+
+#endif
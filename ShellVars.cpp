@@ -0,0 +1,426 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Named variables exposed to the shell.
+ *
+ * This is the implementation. See `"ShellVars.h"` for documentation.
+ */
+#include "ShellVars.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#if defined(ARDUINO_ARCH_ESP32)
+// The ESP32 core puts FreeRTOS headers in a custom location. Make it happy.
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#else
+// Include the usual FreeRTOS central header.
+#include <Arduino_FreeRTOS.h>
+#endif
+
+static const Variable *variables;
+static size_t var_count;
+
+void shellVariables(const Variable *vars, size_t count) {
+  variables = vars;
+  var_count = count;
+}
+
+static int cmp(const void *k, const void *e) {
+  const char *key = (const char *)k;
+  const Variable *entry = (const Variable *)e;
+  return strcmp(key, entry->name);
+}
+
+const Variable *shellFindVariable(const char *name) {
+  if (!variables) return nullptr;
+  return (const Variable *)bsearch(
+      name, variables, var_count, sizeof(Variable), cmp);
+}
+
+/*
+ * Element access. Anything no wider than a pointer is moved with a single
+ * atomic load or store, so a reader never sees half of an update.
+ */
+static void loadElement(const uint8_t *src, void *out, size_t size) {
+  switch (size) {
+  case 1:
+    *(uint8_t *)out = __atomic_load_n(src, __ATOMIC_RELAXED);
+    break;
+  case 2: {
+    uint16_t v = __atomic_load_n((const uint16_t *)src, __ATOMIC_RELAXED);
+    memcpy(out, &v, sizeof(v));
+    break;
+  }
+  case 4: {
+    uint32_t v = __atomic_load_n((const uint32_t *)src, __ATOMIC_RELAXED);
+    memcpy(out, &v, sizeof(v));
+    break;
+  }
+#if UINTPTR_MAX > UINT32_MAX
+  case 8: {
+    uint64_t v = __atomic_load_n((const uint64_t *)src, __ATOMIC_RELAXED);
+    memcpy(out, &v, sizeof(v));
+    break;
+  }
+#endif
+  default:
+    memcpy(out, src, size);
+  }
+}
+
+static void storeElement(uint8_t *dst, const void *in, size_t size) {
+  switch (size) {
+  case 1:
+    __atomic_store_n(dst, *(const uint8_t *)in, __ATOMIC_RELAXED);
+    break;
+  case 2: {
+    uint16_t v;
+    memcpy(&v, in, sizeof(v));
+    __atomic_store_n((uint16_t *)dst, v, __ATOMIC_RELAXED);
+    break;
+  }
+  case 4: {
+    uint32_t v;
+    memcpy(&v, in, sizeof(v));
+    __atomic_store_n((uint32_t *)dst, v, __ATOMIC_RELAXED);
+    break;
+  }
+#if UINTPTR_MAX > UINT32_MAX
+  case 8: {
+    uint64_t v;
+    memcpy(&v, in, sizeof(v));
+    __atomic_store_n((uint64_t *)dst, v, __ATOMIC_RELAXED);
+    break;
+  }
+#endif
+  default:
+    memcpy(dst, in, size);
+  }
+}
+
+void shellLoadVariable(const Variable *var, size_t index, void *out) {
+  if (var->probe) {
+    float v = var->probe();
+    memcpy(out, &v, sizeof(v));
+    return;
+  }
+
+  const uint8_t *src = (const uint8_t *)var->ptr + index * var->size;
+  if (!var->seq) {
+    loadElement(src, out, var->size);
+    return;
+  }
+
+  // retry until no writer interfered with the copy
+  unsigned before, after;
+  do {
+    while ((before = atomic_load_explicit(var->seq, memory_order_acquire)) & 1)
+      taskYIELD();
+    memcpy(out, src, var->size);
+    atomic_thread_fence(memory_order_acquire);
+    after = atomic_load_explicit(var->seq, memory_order_relaxed);
+  } while (before != after);
+}
+
+/*
+ * Conversions between the raw bytes of an element and wide C types.
+ */
+static int64_t toInt(const void *p, size_t size) {
+  switch (size) {
+  case 1: return *(const int8_t *)p;
+  case 2: return *(const int16_t *)p;
+  case 4: return *(const int32_t *)p;
+  default: return *(const int64_t *)p;
+  }
+}
+
+static uint64_t toUint(const void *p, size_t size) {
+  switch (size) {
+  case 1: return *(const uint8_t *)p;
+  case 2: return *(const uint16_t *)p;
+  case 4: return *(const uint32_t *)p;
+  default: return *(const uint64_t *)p;
+  }
+}
+
+static double toFloat(const void *p, size_t size) {
+  return size == sizeof(float) ? *(const float *)p : *(const double *)p;
+}
+
+double shellVariableValue(const Variable *var, size_t index) {
+  uint64_t raw[1];
+  shellLoadVariable(var, index, raw);
+
+  switch (var->type) {
+  case VAR_BOOL: return toUint(raw, var->size) != 0;
+  case VAR_INT:
+  case VAR_ENUM: return (double)toInt(raw, var->size);
+  case VAR_UINT: return (double)toUint(raw, var->size);
+  case VAR_FLOAT: return toFloat(raw, var->size);
+  }
+  return 0;
+}
+
+void shellPrintVariable(Stream *serial, const Variable *var, size_t index) {
+  uint64_t raw[1];
+  shellLoadVariable(var, index, raw);
+
+  switch (var->type) {
+  case VAR_BOOL:
+    serial->print(toUint(raw, var->size) ? "true" : "false");
+    break;
+  case VAR_INT:
+    serial->printf("%lld", (long long)toInt(raw, var->size));
+    break;
+  case VAR_UINT:
+    serial->printf("%llu", (unsigned long long)toUint(raw, var->size));
+    break;
+  case VAR_FLOAT:
+    serial->printf("%g", toFloat(raw, var->size));
+    break;
+  case VAR_ENUM: {
+    int64_t v = toInt(raw, var->size);
+    if (var->labels && v >= 0 && v <= (int64_t)var->max) {
+      serial->print(var->labels[v]);
+    } else {
+      serial->printf("%lld", (long long)v);
+    }
+    break;
+  }
+  }
+}
+
+/*
+ * Check a number against the range of a variable, complaining on `serial`
+ * if it does not fit.
+ */
+static bool inRange(
+    const Variable *var, const char *text, double value, Stream *serial) {
+  if (var->min < var->max && (value < var->min || value > var->max)) {
+    serial->printf("set: %s is out of range [%g, %g]\n",
+                   text, var->min, var->max);
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Parse `text` into the raw representation of an element of `var`.
+ * Returns false and complains on `serial` if the text is not acceptable.
+ */
+static bool parseValue(
+    const Variable *var, const char *text, void *out, Stream *serial) {
+  char *end = nullptr;
+  unsigned bits = var->size * 8;
+
+  switch (var->type) {
+  case VAR_BOOL:
+    if (!strcasecmp(text, "true") || !strcasecmp(text, "on") ||
+        !strcmp(text, "1")) {
+      *(bool *)out = true;
+      return true;
+    }
+    if (!strcasecmp(text, "false") || !strcasecmp(text, "off") ||
+        !strcmp(text, "0")) {
+      *(bool *)out = false;
+      return true;
+    }
+    serial->printf("set: Not a boolean: %s\n", text);
+    return false;
+  case VAR_ENUM:
+  case VAR_INT: {
+    long long v = 0;
+    bool found = false;
+    if (var->type == VAR_ENUM && var->labels) {
+      for (long long i = 0; i <= (long long)var->max; i++) {
+        if (!strcmp(text, var->labels[i])) {
+          v = i;
+          found = true;
+          break;
+        }
+      }
+    }
+    errno = 0;
+    if (!found) {
+      v = strtoll(text, &end, 0);
+      if (*end != '\0' || end == text) {
+        serial->printf("set: Not an integer: %s\n", text);
+        return false;
+      }
+    }
+    // strtoll saturates rather than fail on what does not fit in 64 bits
+    if (errno == ERANGE ||
+        (bits < 64 && (v < -(1LL << (bits - 1)) || v >= (1LL << (bits - 1))))) {
+      serial->printf("set: %s does not fit in %u bits\n", text, bits);
+      return false;
+    }
+    if (!inRange(var, text, (double)v, serial)) return false;
+    memcpy(out, &v, var->size); // little endian: low bytes come first
+    return true;
+  }
+  case VAR_UINT: {
+    errno = 0;
+    unsigned long long v = strtoull(text, &end, 0);
+    if (*end != '\0' || end == text || *text == '-') {
+      serial->printf("set: Not an unsigned integer: %s\n", text);
+      return false;
+    }
+    if (errno == ERANGE || (bits < 64 && v >= (1ULL << bits))) {
+      serial->printf("set: %s does not fit in %u bits\n", text, bits);
+      return false;
+    }
+    if (!inRange(var, text, (double)v, serial)) return false;
+    memcpy(out, &v, var->size);
+    return true;
+  }
+  case VAR_FLOAT: {
+    double v = strtod(text, &end);
+    if (*end != '\0' || end == text) {
+      serial->printf("set: Not a number: %s\n", text);
+      return false;
+    }
+    if (!inRange(var, text, v, serial)) return false;
+    if (var->size == sizeof(float)) {
+      *(float *)out = (float)v;
+    } else {
+      *(double *)out = v;
+    }
+    return true;
+  }
+  }
+  return false;
+}
+
+static void printLine(Stream *serial, const Variable *var) {
+  for (size_t i = 0; i < var->count; i++) {
+    if (i) serial->print(' ');
+    shellPrintVariable(serial, var, i);
+  }
+  serial->print('\n');
+}
+
+int cmdGet(int argc, const char *const *argv, Stream *serial) {
+  if (argc < 2) {
+    for (size_t i = 0; i < var_count; i++) {
+      serial->printf("%s = ", variables[i].name);
+      printLine(serial, &variables[i]);
+    }
+    return 0;
+  }
+
+  int ret = 0;
+  for (int i = 1; i < argc; i++) {
+    const Variable *var = shellFindVariable(argv[i]);
+    if (!var) {
+      serial->printf("get: No such variable: %s\n", argv[i]);
+      ret = 1;
+      continue;
+    }
+    if (argc > 2) serial->printf("%s = ", var->name);
+    printLine(serial, var);
+  }
+  return ret;
+}
+
+int cmdSet(int argc, const char *const *argv, Stream *serial) {
+  if (argc < 3) {
+    serial->print("usage: set name value...\n");
+    return 1;
+  }
+
+  const Variable *var = shellFindVariable(argv[1]);
+  if (!var) {
+    serial->printf("set: No such variable: %s\n", argv[1]);
+    return 1;
+  }
+  if (var->probe) {
+    serial->printf("set: %s is read-only\n", var->name);
+    return 1;
+  }
+  size_t n = argc - 2;
+  if (n > var->count) {
+    serial->printf("set: %s holds only %u value(s)\n",
+                   var->name, (unsigned)var->count);
+    return 1;
+  }
+
+  // validate everything before touching the variable
+  uint64_t values[SHELL_ARG_MAX];
+  for (size_t i = 0; i < n; i++) {
+    values[i] = 0;
+    if (!parseValue(var, argv[i + 2], &values[i], serial)) return 1;
+  }
+
+  if (var->seq) shellSeqWriteBegin(var->seq);
+  for (size_t i = 0; i < n; i++) {
+    storeElement(
+        (uint8_t *)var->ptr + i * var->size, &values[i], var->size);
+  }
+  if (var->seq) shellSeqWriteEnd(var->seq);
+  return 0;
+}
+
+int cmdWatch(int argc, const char *const *argv, Stream *serial) {
+  if (argc < 2) {
+    serial->print("usage: watch name [ms]\n");
+    return 1;
+  }
+
+  const Variable *var = shellFindVariable(argv[1]);
+  if (!var) {
+    serial->printf("watch: No such variable: %s\n", argv[1]);
+    return 1;
+  }
+  unsigned long ms = argc > 2 ? strtoul(argv[2], nullptr, 0) : 100;
+  if (ms == 0) ms = 1;
+
+  // changes are detected by an FNV-1a hash, so arrays of any size can be
+  // watched without a copy
+  uint32_t last = 0;
+  bool first = true;
+  while (serial->available() <= 0 && !Shell::cancelled()) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < var->count; i++) {
+      uint64_t raw = 0;
+      shellLoadVariable(var, i, &raw);
+      const uint8_t *bytes = (const uint8_t *)&raw;
+      for (size_t j = 0; j < var->size; j++) {
+        hash = (hash ^ bytes[j]) * 16777619u;
+      }
+    }
+
+    if (first || hash != last) {
+      printLine(serial, var);
+      last = hash;
+      first = false;
+    }
+    vTaskDelay(pdMS_TO_TICKS(ms));
+  }
+
+  // swallow the key that stopped us
+  serial->read();
+  return 0;
+}
@@ -0,0 +1,235 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Named variables exposed to the shell.
+ *
+ * Instead of writing a command for every global variable worth poking at,
+ * list the variables in a table and hand it to `shellVariables`. The
+ * built-in commands `get`, `set` and `watch` then read and write them by
+ * name:
+ *
+ *     constexpr Variable variables[] = {
+ *       shellVar("gain", &gain, 0.0, 10.0),
+ *       shellVar("led", &ledOn),
+ *       shellVar("thresholds", &thresholds),
+ *       shellProbe("vbat", readBattery),
+ *     };
+ *     static_assert(shellSorted(variables), "variables must be sorted");
+ *
+ *     constexpr Command commands[] = {
+ *       {"get", cmdGet},
+ *       {"set", cmdSet},
+ *       {"watch", cmdWatch},
+ *     };
+ *
+ * Like commands, the table must be sorted by name in dictionary order.
+ */
+#ifndef TOYSHELL_VARS_H
+#define TOYSHELL_VARS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <type_traits>
+
+#include "ToyShell.h"
+
+/**
+ * The kinds of values a `Variable` may hold.
+ */
+enum VariableType : uint8_t {
+  VAR_BOOL,
+  VAR_INT,
+  VAR_UINT,
+  VAR_FLOAT,
+  VAR_ENUM,
+};
+
+/**
+ * A C++ variable exposed to the shell. Use `shellVar`, `shellEnum` or
+ * `shellProbe` to fill one in; the fields are not meant to be set by hand.
+ */
+struct Variable {
+  /**
+   * The name of the variable. The same advice as for `Command::name`
+   * applies.
+   */
+  const char *name;
+  /**
+   * The address of the variable, or of the first element of an array.
+   */
+  void *ptr;
+  /**
+   * The kind of value stored.
+   */
+  VariableType type;
+  /**
+   * The size of a single element in bytes.
+   */
+  uint8_t size;
+  /**
+   * The number of elements; 1 for anything that is not an array.
+   */
+  uint16_t count;
+  /**
+   * The accepted range of values, inclusive. No range checking is done if
+   * `min` is not less than `max`.
+   */
+  double min;
+  double max;
+  /**
+   * Names of the values of an enumeration, indexed by value.
+   */
+  const char *const *labels;
+  /**
+   * An optional sequence counter guarding values wider than a machine
+   * word. Values a single load or store can cover are always accessed
+   * atomically; wider ones are only consistent if every writer brackets
+   * its update with `shellSeqWriteBegin` and `shellSeqWriteEnd`.
+   */
+  atomic_uint *seq;
+  /**
+   * For probes, the function computing the value. Probes are read-only.
+   */
+  float (*probe)();
+};
+
+namespace toyshell {
+template <typename T>
+constexpr VariableType variableType() {
+  return std::is_same<T, bool>::value         ? VAR_BOOL
+         : std::is_enum<T>::value             ? VAR_ENUM
+         : std::is_floating_point<T>::value   ? VAR_FLOAT
+         : std::is_signed<T>::value           ? VAR_INT
+                                              : VAR_UINT;
+}
+} // namespace toyshell
+
+/**
+ * Describe a scalar variable. `min` and `max` restrict what `set` accepts;
+ * leave them out to accept any value the type can hold.
+ */
+template <typename T>
+constexpr Variable shellVar(const char *name, T *ptr, double min = 0,
+                            double max = 0, atomic_uint *seq = nullptr) {
+  static_assert(std::is_arithmetic<T>::value, "unsupported variable type");
+  return Variable{name, ptr, toyshell::variableType<T>(), sizeof(T), 1,
+                  min, max, nullptr, seq, nullptr};
+}
+
+/**
+ * Describe a fixed-size array. Every element is subject to the same range.
+ */
+template <typename T, size_t N>
+constexpr Variable shellVar(const char *name, T (*ptr)[N], double min = 0,
+                            double max = 0, atomic_uint *seq = nullptr) {
+  static_assert(std::is_arithmetic<T>::value, "unsupported variable type");
+  static_assert(N <= UINT16_MAX, "array too large");
+  return Variable{name, *ptr, toyshell::variableType<T>(), sizeof(T), N,
+                  min, max, nullptr, seq, nullptr};
+}
+
+/**
+ * Describe an enumeration whose values run from 0 to `N - 1`, named by
+ * `labels`. `get` prints the name of the value, and `set` accepts either
+ * a name or a number.
+ */
+template <typename T, size_t N>
+constexpr Variable shellEnum(const char *name, T *ptr,
+                             const char *const (&labels)[N]) {
+  static_assert(std::is_enum<T>::value || std::is_integral<T>::value,
+                "unsupported variable type");
+  return Variable{name, ptr, VAR_ENUM, sizeof(T), 1,
+                  0, N - 1, labels, nullptr, nullptr};
+}
+
+/**
+ * Describe a probe: a read-only value computed by calling `probe`, such as
+ * a sensor reading. Probes can be read and sampled like variables.
+ */
+constexpr Variable shellProbe(const char *name, float (*probe)()) {
+  return Variable{name, nullptr, VAR_FLOAT, sizeof(float), 1,
+                  0, 0, nullptr, nullptr, probe};
+}
+
+/**
+ * Start updating a value guarded by a sequence counter.
+ */
+static inline void shellSeqWriteBegin(atomic_uint *seq) {
+  atomic_fetch_add_explicit(seq, 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+}
+
+/**
+ * Finish updating a value guarded by a sequence counter.
+ */
+static inline void shellSeqWriteEnd(atomic_uint *seq) {
+  atomic_fetch_add_explicit(seq, 1, memory_order_release);
+}
+
+/**
+ * Make a table of variables available to `get`, `set` and `watch`. The
+ * table must be sorted by name in dictionary order.
+ */
+void shellVariables(const Variable *vars, size_t count);
+
+/**
+ * Find a registered variable by name. Returns `nullptr` if there is none.
+ */
+const Variable *shellFindVariable(const char *name);
+
+/**
+ * Copy element `index` of a variable into `out`, which must have room for
+ * `var->size` bytes.
+ */
+void shellLoadVariable(const Variable *var, size_t index, void *out);
+
+/**
+ * Read element `index` of a numeric, boolean or enumerated variable as a
+ * `double`.
+ */
+double shellVariableValue(const Variable *var, size_t index);
+
+/**
+ * Print element `index` of a variable in the form `set` accepts.
+ */
+void shellPrintVariable(Stream *serial, const Variable *var, size_t index);
+
+/**
+ * `get [name]`: print the value of a variable, or of every variable.
+ */
+int cmdGet(int argc, const char *const *argv, Stream *serial);
+
+/**
+ * `set name value...`: assign a variable. Arrays take one value per
+ * element, starting from the first.
+ */
+int cmdSet(int argc, const char *const *argv, Stream *serial);
+
+/**
+ * `watch name [ms]`: print a variable whenever it changes, checking every
+ * `ms` milliseconds (100 by default), until a key is pressed.
+ */
+int cmdWatch(int argc, const char *const *argv, Stream *serial);
+
+#endif
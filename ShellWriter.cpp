@@ -0,0 +1,359 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Structured output, rendered as text, JSON or CBOR.
+ *
+ * This is the implementation. See `"ShellWriter.h"` for documentation.
+ */
+#include "ShellWriter.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ToyShell.h"
+
+struct Session {
+  Stream *stream;
+  ShellFormat format;
+};
+
+static Session sessions[SHELL_FORMAT_STREAMS];
+
+static const char *const FORMATS[] = {"text", "json", "cbor"};
+
+bool shellSetFormat(Stream *stream, ShellFormat format) {
+  Session *slot = nullptr;
+  for (Session &session : sessions) {
+    if (session.stream == stream) {
+      slot = &session;
+      break;
+    }
+    if (!session.stream && !slot) slot = &session;
+  }
+  if (!slot) return false;
+
+  // text is what streams get anyway; keep the slot free for others
+  slot->stream = format == SHELL_FORMAT_TEXT ? nullptr : stream;
+  slot->format = format;
+  return true;
+}
+
+ShellFormat shellGetFormat(Stream *stream) {
+  stream = Shell::target(stream);
+  for (const Session &session : sessions) {
+    if (session.stream == stream) return session.format;
+  }
+  return SHELL_FORMAT_TEXT;
+}
+
+ShellWriter::ShellWriter(Stream *stream)
+    : out(stream), format(shellGetFormat(stream)) {}
+
+ShellWriter::~ShellWriter() {
+  while (depth > 0 || skipped > 0)
+    close();
+}
+
+bool ShellWriter::inArray() const {
+  return depth > 0 && (arrays >> (depth - 1) & 1);
+}
+
+/*
+ * CBOR: the head of a data item, with its argument in as few bytes as
+ * possible.
+ */
+void ShellWriter::head(uint8_t major, uint64_t value) {
+  uint8_t bytes[9];
+  size_t len;
+  major <<= 5;
+  if (value < 24) {
+    bytes[0] = major | value;
+    len = 1;
+  } else {
+    int size = value <= 0xff ? 1 : value <= 0xffff ? 2 : value <= 0xffffffff ? 4 : 8;
+    bytes[0] = major | (size == 1 ? 24 : size == 2 ? 25 : size == 4 ? 26 : 27);
+    for (int i = 0; i < size; i++)
+      bytes[size - i] = (uint8_t)(value >> (8 * i));
+    len = size + 1;
+  }
+  out->write(bytes, len);
+}
+
+/*
+ * A string in the current format.
+ */
+void ShellWriter::text(const char *text) {
+  size_t len = strlen(text);
+  if (format == SHELL_FORMAT_CBOR) {
+    head(3, len);
+    out->write((const uint8_t *)text, len);
+    return;
+  }
+  if (format == SHELL_FORMAT_TEXT) {
+    out->write((const uint8_t *)text, len);
+    return;
+  }
+
+  out->write('"');
+  const char *run = text;
+  for (const char *p = text; *p; p++) {
+    unsigned char c = *p;
+    if (c >= 0x20 && c != '"' && c != '\\') continue;
+    out->write((const uint8_t *)run, p - run);
+    run = p + 1;
+    if (c == '"' || c == '\\') {
+      out->write('\\');
+      out->write(c);
+    } else if (c == '\n') {
+      out->print("\\n");
+    } else if (c == '\t') {
+      out->print("\\t");
+    } else {
+      out->printf("\\u%04x", c);
+    }
+  }
+  out->write((const uint8_t *)run, text + len - run);
+  out->write('"');
+}
+
+/*
+ * Start an item: separate it from the one before, and write its key or
+ * list marker. `container` tells whether a record or array follows.
+ */
+void ShellWriter::item(const char *key, bool container) {
+  bool array = inArray();
+  if (array || depth == 0) key = nullptr;
+  else if (!key) key = "";
+  bool first = depth == 0 ? !f_started : !(filled >> (depth - 1) & 1);
+  if (depth == 0) f_started = true;
+  else filled |= 1u << (depth - 1);
+
+  switch (format) {
+  case SHELL_FORMAT_TEXT:
+    if (depth == 0) {
+      // a blank line between top-level values
+      if (!first) out->print('\n');
+      break;
+    }
+    if (f_listed) {
+      f_listed = false;
+    } else {
+      for (int i = 1; i < depth; i++) out->print("  ");
+    }
+    if (array) {
+      out->print("- ");
+      f_listed = container;
+    } else {
+      text(key);
+      out->print(container ? ":\n" : ": ");
+    }
+    break;
+
+  case SHELL_FORMAT_JSON:
+    if (!first && depth > 0) out->print(',');
+    if (key) {
+      text(key);
+      out->print(':');
+    }
+    break;
+
+  case SHELL_FORMAT_CBOR:
+    if (key) text(key);
+    break;
+  }
+}
+
+/*
+ * End an item: a scalar, or a container just closed. Text puts every
+ * scalar on a line of its own; JSON ends each top-level value with a
+ * newline.
+ */
+void ShellWriter::done(bool container) {
+  if (format == SHELL_FORMAT_TEXT) {
+    if (!container) out->print('\n');
+  } else if (format == SHELL_FORMAT_JSON && depth == 0) {
+    out->print('\n');
+  }
+}
+
+void ShellWriter::open(const char *key, bool array) {
+  if (skipped > 0 || depth == SHELL_WRITER_DEPTH) {
+    skipped++;
+    return;
+  }
+  item(key, true);
+  if (format == SHELL_FORMAT_TEXT && inArray() && array) {
+    // "- " then a nested list: start it on a line of its own
+    out->print('\n');
+    f_listed = false;
+  }
+  if (format == SHELL_FORMAT_JSON) out->print(array ? '[' : '{');
+  if (format == SHELL_FORMAT_CBOR) out->write(array ? 0x9f : 0xbf);
+
+  depth++;
+  uint32_t bit = 1u << (depth - 1);
+  arrays = array ? arrays | bit : arrays & ~bit;
+  filled &= ~bit;
+}
+
+void ShellWriter::close() {
+  if (skipped > 0) {
+    skipped--;
+    return;
+  }
+  if (depth == 0) return;
+  bool array = inArray();
+  depth--;
+  if (format == SHELL_FORMAT_TEXT) f_listed = false;
+  if (format == SHELL_FORMAT_JSON) out->print(array ? ']' : '}');
+  if (format == SHELL_FORMAT_CBOR) out->write(0xff);
+  done(true);
+}
+
+void ShellWriter::beginRecord(const char *key) {
+  open(key, false);
+}
+
+void ShellWriter::endRecord() {
+  close();
+}
+
+void ShellWriter::beginArray(const char *key) {
+  open(key, true);
+}
+
+void ShellWriter::endArray() {
+  close();
+}
+
+void ShellWriter::field(const char *key, const char *value) {
+  if (skipped > 0) return;
+  item(key, false);
+  text(value);
+  done(false);
+}
+
+void ShellWriter::field(const char *key, long value) {
+  if (skipped > 0) return;
+  item(key, false);
+  if (format == SHELL_FORMAT_CBOR) {
+    if (value >= 0) head(0, (uint64_t)value);
+    else head(1, (uint64_t)(-(value + 1)));
+  } else {
+    out->print(value);
+  }
+  done(false);
+}
+
+void ShellWriter::field(const char *key, unsigned long value) {
+  if (skipped > 0) return;
+  item(key, false);
+  if (format == SHELL_FORMAT_CBOR) {
+    head(0, value);
+  } else {
+    out->print(value);
+  }
+  done(false);
+}
+
+void ShellWriter::field(const char *key, double value) {
+  if (skipped > 0) return;
+  item(key, false);
+  if (format == SHELL_FORMAT_CBOR) {
+    float single = value;
+    uint8_t bytes[9];
+    size_t len;
+    if ((double)single == value || isnan(value)) {
+      uint32_t bits;
+      memcpy(&bits, &single, sizeof(bits));
+      bytes[0] = 0xfa;
+      for (int i = 0; i < 4; i++) bytes[4 - i] = (uint8_t)(bits >> (8 * i));
+      len = 5;
+    } else {
+      uint64_t bits;
+      memcpy(&bits, &value, sizeof(bits));
+      bytes[0] = 0xfb;
+      for (int i = 0; i < 8; i++) bytes[8 - i] = (uint8_t)(bits >> (8 * i));
+      len = 9;
+    }
+    out->write(bytes, len);
+  } else if (format == SHELL_FORMAT_JSON && !isfinite(value)) {
+    out->print("null");
+  } else {
+    // the fewest digits that read back as the same number
+    char text[32];
+    for (int digits = 15; digits <= 17; digits++) {
+      snprintf(text, sizeof(text), "%.*g", digits, value);
+      if (strtod(text, nullptr) == value) break;
+    }
+    out->print(text);
+  }
+  done(false);
+}
+
+void ShellWriter::field(const char *key, bool value) {
+  if (skipped > 0) return;
+  item(key, false);
+  if (format == SHELL_FORMAT_CBOR) {
+    out->write(value ? 0xf5 : 0xf4);
+  } else {
+    out->print(value ? "true" : "false");
+  }
+  done(false);
+}
+
+void ShellWriter::null(const char *key) {
+  if (skipped > 0 || format == SHELL_FORMAT_TEXT) return;
+  item(key, false);
+  if (format == SHELL_FORMAT_CBOR) out->write(0xf6);
+  else out->print("null");
+  done(false);
+}
+
+int cmdFormat(int argc, const char *const *argv, Stream *serial) {
+  Stream *stream = Shell::target(serial);
+  if (argc == 1) {
+    serial->printf("%s\n", FORMATS[shellGetFormat(stream)]);
+    return 0;
+  }
+  if (argc != 2) {
+    serial->print("usage: format [text|json|cbor]\n");
+    return 1;
+  }
+
+  for (size_t i = 0; i < sizeof(FORMATS) / sizeof(*FORMATS); i++) {
+    if (strcmp(argv[1], FORMATS[i])) continue;
+    if (!shellSetFormat(stream, (ShellFormat)i)) {
+      serial->printf("format: At most %d streams can have a format\n",
+                     SHELL_FORMAT_STREAMS);
+      return 1;
+    }
+    // output kept from before was rendered the old way
+    Shell *shell = Shell::current();
+    if (shell) shell->forget();
+    return 0;
+  }
+  serial->printf("format: Unknown format: %s\n", argv[1]);
+  return 1;
+}
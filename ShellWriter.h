@@ -0,0 +1,190 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Structured output, rendered as text for people or as JSON or CBOR for
+ * programs.
+ *
+ * Commands describe what they print as records, arrays and key-value
+ * pairs, and each session picks how that is rendered with `format`:
+ *
+ *     static int cmdSensors(int argc, const char *const *argv,
+ *                           Stream *serial) {
+ *       ShellWriter out(serial);
+ *       out.beginArray();
+ *       for (const Sensor &sensor : sensors) {
+ *         out.beginRecord();
+ *         out.field("name", sensor.name);
+ *         out.field("value", sensor.value);
+ *         out.field("ok", sensor.ok);
+ *         out.endRecord();
+ *       }
+ *       out.endArray();
+ *       return 0;
+ *     }
+ *
+ * With `format text`, the default, that reads
+ *
+ *     - name: adc0
+ *       value: 3.25
+ *       ok: true
+ *
+ * With `format json`, each top-level value is one line of JSON:
+ *
+ *     [{"name":"adc0","value":3.25,"ok":true}]
+ *
+ * With `format cbor`, top-level values follow one another as a CBOR
+ * sequence (RFC 8742). Maps and arrays have indefinite length, so nothing
+ * needs counting ahead; integers take as few bytes as they need, and
+ * floating-point numbers take 4 bytes when that loses nothing. In text and
+ * JSON, numbers are printed with the fewest digits that read back exactly.
+ *
+ * The writer sends everything as it goes, holding no more than a couple of
+ * machine words per level of nesting, up to `SHELL_WRITER_DEPTH`; it never
+ * allocates. Containers left open are closed when it goes out of scope.
+ *
+ * The format is kept for each stream, so the serial port and each network
+ * client can have their own. Output printed past the writer is passed
+ * through as it is, which machine clients will need to cope with.
+ */
+#ifndef TOYSHELL_WRITER_H
+#define TOYSHELL_WRITER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <Stream.h>
+
+#ifndef SHELL_WRITER_DEPTH
+#define SHELL_WRITER_DEPTH 16
+#endif
+#ifndef SHELL_FORMAT_STREAMS
+#define SHELL_FORMAT_STREAMS 8
+#endif
+
+static_assert(SHELL_WRITER_DEPTH <= 32, "SHELL_WRITER_DEPTH is at most 32");
+
+enum ShellFormat : uint8_t {
+  SHELL_FORMAT_TEXT,
+  SHELL_FORMAT_JSON,
+  SHELL_FORMAT_CBOR,
+};
+
+/**
+ * Set the format of output to `stream`. Returns false if formats are
+ * already kept for `SHELL_FORMAT_STREAMS` other streams.
+ */
+bool shellSetFormat(Stream *stream, ShellFormat format);
+
+/**
+ * The format of output to `stream`, the stream a command was given.
+ */
+ShellFormat shellGetFormat(Stream *stream);
+
+/**
+ * Writes structured output to a stream in one of the formats.
+ */
+class ShellWriter {
+private:
+  Stream *out;
+  ShellFormat format;
+  uint8_t depth = 0;
+  uint8_t skipped = 0;   // levels opened past `SHELL_WRITER_DEPTH`
+  uint32_t arrays = 0;   // bit n: level n + 1 is an array
+  uint32_t filled = 0;   // bit n: level n + 1 has something in it already
+  bool f_started = false; // something was written at the top level
+  bool f_listed = false;  // text: a "- " was just written for an element
+
+  bool inArray() const;
+  void item(const char *key, bool container);
+  void done(bool container);
+  void open(const char *key, bool array);
+  void close();
+  void head(uint8_t major, uint64_t value);
+  void text(const char *text);
+public:
+  /**
+   * Write to `stream` in the format chosen for it.
+   */
+  ShellWriter(Stream *stream);
+
+  /**
+   * Write to `stream` in `format`.
+   */
+  ShellWriter(Stream *stream, ShellFormat format)
+      : out(stream), format(format) {}
+  ShellWriter(ShellWriter &other) = delete;
+
+  /**
+   * Close whatever is still open.
+   */
+  ~ShellWriter();
+
+  /**
+   * Start a record (an object in JSON, a map in CBOR), as an element of
+   * the array or top level, or as the field named `key` of a record.
+   */
+  void beginRecord(const char *key = nullptr);
+  void endRecord();
+
+  /**
+   * Start an array, as an element of the array or top level, or as the
+   * field named `key` of a record.
+   */
+  void beginArray(const char *key = nullptr);
+  void endArray();
+
+  /**
+   * Write a field of a record.
+   */
+  void field(const char *key, const char *value);
+  void field(const char *key, long value);
+  void field(const char *key, unsigned long value);
+  void field(const char *key, int value) { field(key, (long)value); }
+  void field(const char *key, unsigned value) {
+    field(key, (unsigned long)value);
+  }
+  void field(const char *key, double value);
+  void field(const char *key, bool value);
+
+  /**
+   * Write an element of an array, or a value at the top level.
+   */
+  void value(const char *value) { field(nullptr, value); }
+  void value(long value) { field(nullptr, value); }
+  void value(unsigned long value) { field(nullptr, value); }
+  void value(int value) { field(nullptr, (long)value); }
+  void value(unsigned value) { field(nullptr, (unsigned long)value); }
+  void value(double value) { field(nullptr, value); }
+  void value(bool value) { field(nullptr, value); }
+  /**
+   * Write `null`, or nothing at all as text.
+   */
+  void null(const char *key = nullptr);
+};
+
+/**
+ * `format [text|json|cbor]`: show or set the format of structured output
+ * for this session.
+ */
+int cmdFormat(int argc, const char *const *argv, Stream *serial);
+
+#endif
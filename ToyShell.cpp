@@ -29,23 +29,184 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <Arduino.h>
+
+#include "ShellHeap.h"
+
 #if defined(ARDUINO_ARCH_ESP32)
 // The ESP32 core puts FreeRTOS headers in a custom location. Make it happy.
 #include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
 #include <freertos/task.h>
 #else
 // Include the usual FreeRTOS central header.
 #include <Arduino_FreeRTOS.h>
+#include <queue.h>
+#include <semphr.h>
+#endif
+
+// Running shells, for `Shell::current`.
+static Shell *shells[SHELL_INSTANCE_MAX];
+
+#if SHELL_STACK_POOL
+/*
+ * A task lending its stack to `SHELL_LARGE_STACK` commands, of any shell.
+ */
+struct StackWorker {
+  atomic_bool f_made; // the slot has a task
+  atomic_bool f_done; // the command has returned
+  TaskHandle_t task;
+  TaskHandle_t caller;
+  const Command *cmd; // `nullptr` ends the task
+  int argc;
+  char **argv;
+  Stream *out;
+  int result;
+};
+static StackWorker workers[SHELL_STACK_POOL];
+static atomic_uintptr_t idle_workers; // queue of `StackWorker *`
+
+static void lendStack(void *arg) {
+  StackWorker *worker = (StackWorker *)arg;
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    if (!worker->cmd) break;
+    worker->result = worker->cmd->entry(worker->argc, worker->argv,
+                                        worker->out);
+    // the worker may be handed out again as soon as it is done
+    TaskHandle_t caller = worker->caller;
+    atomic_store(&worker->f_done, 1);
+    xTaskNotifyGive(caller);
+  }
+  atomic_store(&worker->f_made, 0);
+  vTaskDelete(NULL);
+}
+
+static QueueHandle_t idleWorkers() {
+  QueueHandle_t queue = (QueueHandle_t)atomic_load(&idle_workers);
+  if (queue) return queue;
+  QueueHandle_t made = xQueueCreate(SHELL_STACK_POOL, sizeof(StackWorker *));
+  if (!made) return nullptr;
+  uintptr_t none = 0;
+  if (atomic_compare_exchange_strong(&idle_workers, &none, (uintptr_t)made))
+    return made;
+  // another shell got there first
+  vQueueDelete(made);
+  return (QueueHandle_t)none;
+}
+
+/*
+ * Take an idle worker, start one if the pool is not full, or else wait for
+ * one. Returns `nullptr` if no task can be started.
+ */
+static StackWorker *takeWorker(int core) {
+  QueueHandle_t queue = idleWorkers();
+  if (!queue) return nullptr;
+  StackWorker *worker;
+  if (xQueueReceive(queue, &worker, 0) == pdTRUE) return worker;
+  for (StackWorker &slot : workers) {
+    bool made = false;
+    if (!atomic_compare_exchange_strong(&slot.f_made, &made, 1)) continue;
+    if (shellCreateTask(lendStack, "shell-stack", SHELL_POOL_STACK, &slot,
+                        uxTaskPriorityGet(NULL), (void **)&slot.task, core)) {
+      return &slot;
+    }
+    atomic_store(&slot.f_made, 0);
+    return nullptr;
+  }
+  xQueueReceive(queue, &worker, portMAX_DELAY);
+  return worker;
+}
+
+/*
+ * End the idle workers, once no shell is left to need them.
+ */
+static void endWorkers() {
+  QueueHandle_t queue = (QueueHandle_t)atomic_load(&idle_workers);
+  if (!queue) return;
+  StackWorker *worker;
+  while (xQueueReceive(queue, &worker, 0) == pdTRUE) {
+    worker->cmd = nullptr;
+    xTaskNotifyGive(worker->task);
+  }
+}
 #endif
 
+static void prompt(Stream &stream) {
+  stream.setTimeout(20);
+  stream.print("shell> ");
+}
+
 Shell::~Shell() {
   end();
+#if SHELL_READ_AHEAD
+  if (output) vSemaphoreDelete((SemaphoreHandle_t)output);
+#endif
+}
+
+/*
+ * Keep writes to the port whole while the shell's task and the receive
+ * task both write. Only needed when reading ahead.
+ */
+void Shell::lockOutput() {
+#if SHELL_READ_AHEAD
+  if (output) xSemaphoreTakeRecursive((SemaphoreHandle_t)output, portMAX_DELAY);
+#endif
+}
+
+void Shell::unlockOutput() {
+#if SHELL_READ_AHEAD
+  if (output) xSemaphoreGiveRecursive((SemaphoreHandle_t)output);
+#endif
+}
+
+void Shell::setFlowControl(uint8_t flow, int rtsPin) {
+  this->flow = flow;
+  rts_pin = rtsPin;
+  if ((flow & SHELL_FLOW_RTS) && rts_pin >= 0) {
+    pinMode(rts_pin, OUTPUT);
+    digitalWrite(rts_pin, LOW);
+  }
+}
+
+/*
+ * Pause or resume the sender. Only ever called from one task: the receive
+ * task if reading ahead, or else the shell's own.
+ */
+void Shell::throttle(bool stop) {
+  if (stop == f_throttled) return;
+  f_throttled = stop;
+  if (flow & SHELL_FLOW_XONXOFF) {
+    lockOutput();
+    stream->write(stop ? 0x13 : 0x11);
+    unlockOutput();
+  }
+  if ((flow & SHELL_FLOW_RTS) && rts_pin >= 0)
+    digitalWrite(rts_pin, stop ? HIGH : LOW);
+}
+
+bool shellCreateTask(void (*code)(void *), const char *name, uint32_t stack,
+                     void *arg, unsigned priority, void **handle, int core) {
+#if defined(ARDUINO_ARCH_ESP32)
+  BaseType_t affinity = core >= 0 && core < portNUM_PROCESSORS
+                            ? core
+                            : tskNO_AFFINITY;
+  return xTaskCreatePinnedToCore(code, name, stack, arg, priority,
+                                 (TaskHandle_t *)handle,
+                                 affinity) == pdPASS;
+#else
+  (void)core;
+  return xTaskCreate(code, name, stack, arg, priority,
+                     (TaskHandle_t *)handle) == pdPASS;
+#endif
 }
 
 void Shell::begin(Stream &stream) {
   if (!f_begin) {
     this->stream = &stream;
-    xTaskCreate(Shell::start, "shell", 4096, this, 1, nullptr);
+    shellCreateTask(Shell::start, "shell", SHELL_STACK, this, 1, nullptr,
+                    core);
   }
 }
 
@@ -55,9 +216,360 @@ void Shell::end() {
     taskYIELD();
 }
 
-static void prompt(Stream &stream) {
-  stream.setTimeout(20);
-  stream.print("shell> ");
+Shell *Shell::current() {
+  TaskHandle_t self = xTaskGetCurrentTaskHandle();
+  for (Shell *shell : shells) {
+    if (shell && (shell->task == self || shell->lender == self)) return shell;
+  }
+  return nullptr;
+}
+
+bool Shell::cancelled() {
+  Shell *shell = current();
+  return shell && atomic_load(&shell->f_cancel);
+}
+
+void *Shell::scratch(size_t size) {
+#if SHELL_SCRATCH
+  Shell *shell = current();
+  if (!shell) return nullptr;
+  size = (size + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+  if (size > SHELL_SCRATCH - shell->scratch_used) return nullptr;
+  void *memory = &shell->scratch_area[shell->scratch_used];
+  shell->scratch_used += size;
+  if (shell->scratch_used > shell->scratch_peak)
+    shell->scratch_peak = shell->scratch_used;
+  return memory;
+#else
+  return nullptr;
+#endif
+}
+
+size_t Shell::scratchPeak() const {
+#if SHELL_SCRATCH
+  return scratch_peak;
+#else
+  return 0;
+#endif
+}
+
+bool Shell::addService(void (*poll)(Shell &, void *), void *arg,
+                       void (*stop)(Shell &, void *)) {
+  ShellService *slot = nullptr;
+  for (ShellService &service : services) {
+    if (service.poll == poll && service.arg == arg) return true;
+    if (!service.poll && !slot) slot = &service;
+  }
+  if (!slot) return false;
+
+  slot->arg = arg;
+  slot->stop = stop;
+  slot->poll = poll;
+  return true;
+}
+
+void Shell::removeService(void (*poll)(Shell &, void *), void *arg) {
+  for (ShellService &service : services) {
+    if (service.poll == poll && service.arg == arg) service.poll = nullptr;
+  }
+}
+
+void Shell::poll() {
+  for (ShellService &service : services) {
+    if (service.poll) service.poll(*this, service.arg);
+  }
+}
+
+#if SHELL_READ_AHEAD
+static_assert((SHELL_READ_AHEAD & (SHELL_READ_AHEAD - 1)) == 0,
+              "SHELL_READ_AHEAD must be a power of two");
+
+#define CTRL_C 0x03
+
+// `xTaskCreate` counts words rather than bytes outside ESP32
+#if defined(ARDUINO_ARCH_ESP32)
+#define RECEIVE_STACK SHELL_RECEIVE_STACK
+#else
+#define RECEIVE_STACK (SHELL_RECEIVE_STACK / sizeof(StackType_t))
+#endif
+
+/*
+ * Copy up to `size` bytes the receive task has read ahead into `buffer`,
+ * waiting up to `wait` milliseconds if there are none. Returns the number
+ * of bytes copied.
+ */
+size_t Shell::receive(char *buffer, size_t size, uint32_t wait) {
+  if (f_direct) {
+    // no receive task; read the port as with read-ahead off
+    throttle(false);
+    int ready = stream->available();
+    if (ready < 0) {
+      atomic_store_explicit(&f_eof, 1, memory_order_release);
+      return 0;
+    }
+    if (ready == 0 && !wait) return 0;
+    if (ready > 0 && (size_t)ready < size) size = ready;
+    else if (ready == 0) size = 1;
+    return stream->readBytes(buffer, size);
+  }
+
+  unsigned tail = atomic_load_explicit(&ahead_tail, memory_order_relaxed);
+  unsigned head = atomic_load_explicit(&ahead_head, memory_order_acquire);
+  if (head == tail && wait) {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(wait));
+    head = atomic_load_explicit(&ahead_head, memory_order_acquire);
+  }
+
+  bool full = head - tail == SHELL_READ_AHEAD;
+  size_t count = 0;
+  while (tail != head && count < size) {
+    buffer[count++] = ahead[tail++ % SHELL_READ_AHEAD];
+  }
+  atomic_store_explicit(&ahead_tail, tail, memory_order_release);
+
+  // the receive task stops reading when the buffer fills up; at the end
+  // of input it may be gone already
+  if (full && count && atomic_load(&f_receiving))
+    xTaskNotifyGive((TaskHandle_t)receiver);
+  return count;
+}
+
+/*
+ * Find the urgent command named `text`, or if not `whole`, the first whose
+ * name starts with it.
+ */
+const Command *Shell::urgent(const char *text, size_t len, bool whole) {
+  for (size_t i = 0; i < cmd_count; i++) {
+    const Command *cmd = &commands[i];
+    if (!(cmd->flags & SHELL_URGENT)) continue;
+    if (strncmp(cmd->name, text, len) != 0) continue;
+    if (!whole || cmd->name[len] == '\0') return cmd;
+  }
+  return nullptr;
+}
+
+/*
+ * Run a line naming an urgent command, on the receive task.
+ */
+void Shell::runUrgent(const Command *cmd, char *text, size_t len) {
+  char *argv[SHELL_ARG_MAX];
+
+  // the command running writes meanwhile; keep this output together
+  lockOutput();
+  stream->write(text, len);
+  stream->print('\n');
+  if (cmd->flags & SHELL_CANCEL) atomic_store(&f_cancel, 1);
+  int argc = tokenize(text, text + len, argv);
+  cmd->entry(argc, argv, stream);
+  // the shell prompts again once the command running returns
+  if (!atomic_load(&f_running)) prompt(*stream);
+  unlockOutput();
+}
+
+/*
+ * Read the port into `ahead` for as long as the shell runs, whether or not
+ * a command is running.
+ */
+void Shell::receiveMain() {
+  // A line is held back while its first word could still name an urgent
+  // command, so that lines which do can be taken out and run here, ahead
+  // of everything else. Other lines go through as they come in.
+  enum { HOLD, URGENT, PASS } state = HOLD;
+  const Command *cmd = nullptr;
+  char text[SHELL_URGENT_LINE];
+  size_t len = 0;
+  unsigned line = 0; // where the line being held back starts
+  unsigned fill = 0; // where the next byte read goes
+
+  while (f_end == 0) {
+    unsigned tail = atomic_load_explicit(&ahead_tail, memory_order_acquire);
+    size_t room = SHELL_READ_AHEAD - (fill - tail);
+
+    // keep a quarter free for what is still on the way after pausing
+    if (room <= SHELL_READ_AHEAD / 4) throttle(true);
+    else if (room >= SHELL_READ_AHEAD * 3 / 4) throttle(false);
+
+    if (room == 0) {
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(20));
+      continue;
+    }
+
+    size_t at = fill % SHELL_READ_AHEAD;
+    if (room > SHELL_READ_AHEAD - at) room = SHELL_READ_AHEAD - at;
+    int ready = stream->available();
+    if (ready < 0) {
+      // hand over the rest, even a line held back
+      atomic_store_explicit(&ahead_head, fill, memory_order_release);
+      atomic_store_explicit(&f_eof, 1, memory_order_release);
+      xTaskNotifyGive((TaskHandle_t)task);
+      break;
+    }
+    if (ready == 0) {
+#if defined(ARDUINO_ARCH_ESP32)
+      // the UART driver waits for a byte without spinning
+      ready = 1;
+#else
+      // `readBytes` would spin here, starving the shell; check back later
+      vTaskDelay(1);
+      continue;
+#endif
+    }
+    if ((size_t)ready < room) room = ready;
+
+    size_t count = stream->readBytes(&ahead[at], room);
+    unsigned end = fill + count;
+    for (unsigned i = fill; i < end;) {
+      char c = ahead[i % SHELL_READ_AHEAD];
+      if (c == CTRL_C && atomic_load(&f_running)) {
+        // cancel the command now, rather than behind lines typed ahead
+        atomic_store(&f_cancel, 1);
+        for (unsigned j = i + 1; j < end; j++) {
+          ahead[(j - 1) % SHELL_READ_AHEAD] = ahead[j % SHELL_READ_AHEAD];
+        }
+        end -= 1;
+        continue;
+      }
+      if (state == HOLD && (c == ' ' || c == '\n')) {
+        cmd = urgent(text, len, true);
+        state = cmd ? URGENT : PASS;
+      }
+      if (state == URGENT && c == '\n') {
+        runUrgent(cmd, text, len);
+        // take the line out, moving up what came after it
+        unsigned gone = i + 1 - line;
+        for (unsigned j = i + 1; j < end; j++) {
+          ahead[(j - gone) % SHELL_READ_AHEAD] = ahead[j % SHELL_READ_AHEAD];
+        }
+        end -= gone;
+        i = line;
+        state = HOLD;
+        len = 0;
+        continue;
+      }
+      if (state != PASS) {
+        // a line too long to keep here runs in turn
+        if (len + 1 < SHELL_URGENT_LINE) text[len++] = c;
+        else state = PASS;
+        if (state == HOLD && !urgent(text, len, false)) state = PASS;
+      }
+      i++;
+      if (state == PASS && c == '\n') {
+        state = HOLD;
+        line = i;
+        len = 0;
+      }
+    }
+    fill = end;
+
+    // a key press held back as the start of a possible urgent name still
+    // shows in `available`, so commands waiting for a key see it
+    atomic_store_explicit(&ahead_fill, fill, memory_order_release);
+    unsigned head = atomic_load_explicit(&ahead_head, memory_order_relaxed);
+    unsigned visible = state == PASS ? fill : line;
+    if (visible != head) {
+      atomic_store_explicit(&ahead_head, visible, memory_order_release);
+      xTaskNotifyGive((TaskHandle_t)task);
+    }
+  }
+
+  throttle(false);
+  receiver = nullptr;
+  atomic_store(&f_receiving, 0);
+  vTaskDelete(NULL);
+}
+
+void Shell::startReceive(void *parameters) {
+  Shell *shell = (Shell *)parameters;
+  shell->receiveMain();
+}
+
+size_t Shell::Port::write(uint8_t c) {
+  shell->lockOutput();
+  size_t count = shell->stream->write(c);
+  shell->unlockOutput();
+  return count;
+}
+
+size_t Shell::Port::write(const uint8_t *buffer, size_t size) {
+  shell->lockOutput();
+  size_t count = shell->stream->write(buffer, size);
+  shell->unlockOutput();
+  return count;
+}
+
+int Shell::Port::availableForWrite() {
+  return shell->stream->availableForWrite();
+}
+
+void Shell::Port::flush() {
+  shell->stream->flush();
+}
+
+int Shell::Port::available() {
+  if (shell->f_direct) {
+    int ready = shell->stream->available();
+    return (shell->bufhead - shell->pending) + (ready > 0 ? ready : 0);
+  }
+
+  // count what is held back too; see `receiveMain`
+  unsigned fill = atomic_load_explicit(&shell->ahead_fill, memory_order_acquire);
+  unsigned tail = atomic_load_explicit(&shell->ahead_tail, memory_order_relaxed);
+  int ahead = (int)(fill - tail);
+  return (shell->bufhead - shell->pending) + (ahead > 0 ? ahead : 0);
+}
+
+int Shell::Port::read() {
+  if (shell->pending < shell->bufhead) return (unsigned char)*shell->pending++;
+
+  char c;
+  if (shell->receive(&c, 1, 0) != 1) return -1;
+  return (unsigned char)c;
+}
+
+int Shell::Port::peek() {
+  if (shell->pending < shell->bufhead) return (unsigned char)*shell->pending;
+  if (shell->f_direct) return shell->stream->peek();
+
+  unsigned head = atomic_load_explicit(&shell->ahead_head, memory_order_acquire);
+  unsigned tail = atomic_load_explicit(&shell->ahead_tail, memory_order_relaxed);
+  if (head == tail) return -1;
+  return (unsigned char)shell->ahead[tail % SHELL_READ_AHEAD];
+}
+
+/*
+ * Sleep until the receive task has more, rather than spin in `timedRead`.
+ */
+size_t Shell::Port::readBytes(char *buffer, size_t length) {
+  size_t count = 0;
+  while (count < length && shell->pending < shell->bufhead)
+    buffer[count++] = *shell->pending++;
+  if (shell->f_direct) {
+    return count + shell->stream->readBytes(&buffer[count], length - count);
+  }
+
+  unsigned long start = millis();
+  while (count < length) {
+    unsigned long waited = millis() - start;
+    if (waited >= _timeout) break;
+    bool eof = atomic_load_explicit(&shell->f_eof, memory_order_acquire);
+    size_t got = shell->receive(&buffer[count], length - count,
+                                _timeout - waited);
+    if (got == 0 && eof) break;
+    count += got;
+  }
+  return count;
+}
+#endif
+
+/*
+ * The stream handed to commands.
+ */
+Stream *Shell::io() {
+#if SHELL_READ_AHEAD
+  return &port;
+#else
+  return stream;
+#endif
 }
 
 static int cmp(const void *k, const void *e) {
@@ -66,80 +578,592 @@ static int cmp(const void *k, const void *e) {
   return strcmp(key, entry->name);
 }
 
+/*
+ * Split the text between `line` and `end` into arguments, in place.
+ * Returns the number of arguments found.
+ */
+int Shell::tokenize(char *line, char *end, char **argv) {
+  int argc = 0;
+  char *space;
+  char *i;
+
+  *end = '\0';
+  for (i = line; i < end; i += strlen(i) + 1) {
+    if (argc < SHELL_ARG_MAX) {
+      argv[argc] = i;
+      argc += 1;
+    } else {
+      lockOutput();
+      stream->printf(
+          "Too many arguments; discarding arguments after #%d\n",
+          SHELL_ARG_MAX - 1);
+      unlockOutput();
+      break;
+    }
+
+    space = (char *)memchr(i, ' ', end - i);
+    if (space) {
+      *space = '\0';
+    }
+  }
+  return argc;
+}
+
+#if SHELL_PARSE_CACHE
+#define HASH_BASIS 2166136261u
+
+/*
+ * Continue an FNV-1a hash over more of a line. Separators already cut to
+ * '\0' hash as the spaces they were, so lines split as they arrive and
+ * lines split at once land in the same slot.
+ */
+static uint32_t hashLine(uint32_t hash, const char *text, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    uint8_t c = text[i] ? text[i] : ' ';
+    hash = (hash ^ c) * 16777619u;
+  }
+  return hash;
+}
+#endif
+
+/*
+ * Split the input received since the last call, stopping at the end of a
+ * line. Splitting as bytes come in spreads the work over the time the line
+ * takes to arrive, and looks up the command as soon as its name is
+ * complete. The result is the same as that of `tokenize`. Returns the
+ * newline ending the line, or `nullptr` if the line is not complete yet.
+ */
+char *Shell::scan() {
+  for (char *p = scanned; p < bufhead; p++) {
+    char c = *p;
+    if (c == '\n') {
+      *p = '\0';
+#if SHELL_PARSE_CACHE
+      // a line seen before needs no lookup; a new one goes into the cache
+      ParsedLine *entry = cached(input, p - input, line_hash);
+      if (entry && !cmd) cmd = entry->cmd;
+      if (argc > 0 && !cmd) cmd = lookup(argv[0]);
+      if (!entry && cmd && !f_toomany) {
+        remember(&cache[line_hash & (SHELL_PARSE_CACHE - 1)], input,
+                 p - input, line_hash, argc, argv, cmd);
+      }
+#else
+      if (argc > 0 && !cmd) cmd = lookup(argv[0]);
+#endif
+      scanned = p + 1;
+      return p;
+    }
+#if SHELL_PARSE_CACHE
+    line_hash = hashLine(line_hash, p, 1);
+#endif
+    if (f_toomany) continue;
+
+    if (f_split) {
+      f_split = false;
+      if (argc < SHELL_ARG_MAX) {
+        argv[argc] = p;
+        argc += 1;
+      } else {
+        lockOutput();
+        stream->printf(
+            "Too many arguments; discarding arguments after #%d\n",
+            SHELL_ARG_MAX - 1);
+        unlockOutput();
+        f_toomany = true;
+        continue;
+      }
+    }
+    if (c == ' ') {
+      *p = '\0';
+      f_split = true;
+      if (argc == 1 && !cmd) cmd = lookup(argv[0]);
+    }
+  }
+  scanned = bufhead;
+  return nullptr;
+}
+
+void Shell::resetLine() {
+  scanned = input;
+  argc = 0;
+  f_split = true;
+  f_toomany = false;
+  cmd = nullptr;
+#if SHELL_PARSE_CACHE
+  line_hash = HASH_BASIS;
+#endif
+}
+
+const Command *Shell::lookup(const char *name) {
+  const Command *cmd = (const Command *)bsearch(
+      name, commands, cmd_count, sizeof(Command), cmp);
+  // `@node ...` goes to the command named `@`, if there is one
+  if (!cmd && name[0] == '@') {
+    cmd = (const Command *)bsearch(
+        "@", commands, cmd_count, sizeof(Command), cmp);
+  }
+  return cmd;
+}
+
+void Shell::setCommands(const Command *commands, size_t count) {
+  this->commands = commands;
+  cmd_count = count;
+#if SHELL_PARSE_CACHE
+  // cached lines point into the old table
+  for (ParsedLine &entry : cache) entry.cmd = nullptr;
+#endif
+  forget();
+}
+
+void Shell::forget() {
+#if SHELL_MEMO
+  for (MemoEntry &entry : memo) entry.f_valid = false;
+#endif
+}
+
+Stream *Shell::target(Stream *stream) {
+#if SHELL_MEMO
+  Shell *shell = current();
+  if (!shell) return stream;
+  for (Tee *tee = shell->teeing; tee; tee = tee->outer) {
+    if (stream == tee) stream = tee->out;
+  }
+#endif
+  return stream;
+}
+
+#if SHELL_PARSE_CACHE
+/*
+ * Find `line` in the cache. Returns its entry, or `nullptr` if it is not
+ * there.
+ */
+Shell::ParsedLine *Shell::cached(const char *line, size_t len,
+                                 uint32_t hash) {
+  ParsedLine *entry = &cache[hash & (SHELL_PARSE_CACHE - 1)];
+  if (!entry->cmd || entry->hash != hash || entry->len != len) return nullptr;
+  for (size_t i = 0; i < len; i++) {
+    char c = line[i] ? line[i] : ' ';
+    if (c != entry->text[i]) return nullptr;
+  }
+  return entry;
+}
+
+/*
+ * Keep a line just split, if it fits, in place of whatever shared its
+ * slot.
+ */
+void Shell::remember(ParsedLine *entry, const char *line, size_t len,
+                     uint32_t hash, int argc, char **argv,
+                     const Command *cmd) {
+  if (len >= SHELL_CACHE_LINE || argc > SHELL_CACHE_ARGS ||
+      argc >= SHELL_ARG_MAX) {
+    return;
+  }
+  for (size_t i = 0; i < len; i++) entry->text[i] = line[i] ? line[i] : ' ';
+  entry->hash = hash;
+  entry->len = len;
+  entry->argc = argc;
+  for (int i = 0; i < argc; i++) entry->offsets[i] = argv[i] - line;
+  entry->cmd = cmd;
+}
+#endif
+
+#if SHELL_MEMO
+size_t Shell::Tee::write(uint8_t c) {
+  return write(&c, 1);
+}
+
+size_t Shell::Tee::write(const uint8_t *buffer, size_t size) {
+  if (!f_overflow) {
+    if (entry->len + size > sizeof(entry->output)) {
+      f_overflow = true;
+    } else {
+      memcpy(&entry->output[entry->len], buffer, size);
+      entry->len += size;
+    }
+  }
+  return out->write(buffer, size);
+}
+
+int Shell::Tee::availableForWrite() {
+  return out->availableForWrite();
+}
+
+void Shell::Tee::flush() {
+  out->flush();
+}
+
+int Shell::Tee::available() {
+  return out->available();
+}
+
+int Shell::Tee::read() {
+  return out->read();
+}
+
+int Shell::Tee::peek() {
+  return out->peek();
+}
+#endif
+
+/*
+ * Run a command, taking back the scratch memory it used and counting what
+ * it allocated.
+ */
+int Shell::call(const Command *cmd, int argc, char **argv, Stream *out) {
+#if SHELL_SCRATCH
+  size_t mark = scratch_used;
+#endif
+#if SHELL_HEAP_STATS
+  bool counting = shellHeapBegin(cmd);
+#endif
+  int result = (cmd->flags & SHELL_LARGE_STACK)
+                   ? borrow(cmd, argc, argv, out)
+                   : cmd->entry(argc, argv, out);
+#if SHELL_HEAP_STATS
+  if (counting) shellHeapEnd();
+#endif
+#if SHELL_SCRATCH
+  scratch_used = mark;
+#endif
+  return result;
+}
+
+/*
+ * Run a large-stack command on a task from the pool, and wait for it.
+ */
+int Shell::borrow(const Command *cmd, int argc, char **argv, Stream *out) {
+#if SHELL_STACK_POOL
+  TaskHandle_t self = xTaskGetCurrentTaskHandle();
+  // a command run by one on a borrowed stack has that stack already
+  if (self == lender) return cmd->entry(argc, argv, out);
+
+  StackWorker *worker = takeWorker(core);
+  if (!worker) {
+    out->printf("shell: Cannot start task for %s\n", cmd->name);
+    return -1;
+  }
+  worker->cmd = cmd;
+  worker->argc = argc;
+  worker->argv = argv;
+  worker->out = out;
+  worker->caller = self;
+  atomic_store(&worker->f_done, 0);
+  vTaskPrioritySet(worker->task, uxTaskPriorityGet(NULL));
+  lender = worker->task;
+  xTaskNotifyGive(worker->task);
+  // other tasks may notify the shell too
+  while (!atomic_load(&worker->f_done))
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(20));
+  lender = nullptr;
+
+  int result = worker->result;
+  xQueueSend(idleWorkers(), &worker, 0);
+  return result;
+#else
+  return cmd->entry(argc, argv, out);
+#endif
+}
+
+/*
+ * Run a command, or replay its output if it is idempotent and has not
+ * changed since it last ran with the same arguments.
+ */
+int Shell::invoke(const Command *cmd, int argc, char **argv, Stream *out) {
+#if SHELL_MEMO
+  if (!(cmd->flags & SHELL_IDEMPOTENT)) return call(cmd, argc, argv, out);
+
+  // the line, joined back together, is the key
+  char line[SHELL_MEMO_LINE];
+  size_t len = 0;
+  for (int i = 0; i < argc; i++) {
+    size_t n = strlen(argv[i]);
+    if (len + n + 1 > sizeof(line)) return call(cmd, argc, argv, out);
+    if (i > 0) line[len++] = ' ';
+    memcpy(&line[len], argv[i], n);
+    len += n;
+  }
+  line[len] = '\0';
+
+  unsigned generation =
+      cmd->generation ? atomic_load(cmd->generation) : 0;
+  for (MemoEntry &entry : memo) {
+    if (entry.f_valid && entry.cmd == cmd && entry.out == out &&
+        entry.generation == generation && !strcmp(entry.line, line)) {
+      out->write(entry.output, entry.len);
+      return entry.result;
+    }
+  }
+
+  // record this run over the oldest entry
+  MemoEntry &entry = memo[memo_next];
+  memo_next = (memo_next + 1) % SHELL_MEMO;
+  entry.f_valid = false;
+  entry.cmd = cmd;
+  entry.out = out;
+  entry.generation = generation;
+  entry.len = 0;
+  memcpy(entry.line, line, len + 1);
+
+  Tee tee;
+  tee.out = out;
+  tee.outer = teeing;
+  tee.entry = &entry;
+  teeing = &tee;
+  entry.result = call(cmd, argc, argv, &tee);
+  teeing = tee.outer;
+  entry.f_valid = !tee.f_overflow;
+  return entry.result;
+#else
+  return call(cmd, argc, argv, out);
+#endif
+}
+
+/*
+ * Split a command line and run the command.
+ */
+int Shell::run(char *line, char *end, char **argv, Stream *out) {
+  int argc;
+  const Command *cmd;
+
+#if SHELL_PARSE_CACHE
+  // a line seen before only needs its separators cut again
+  size_t len = end - line;
+  uint32_t hash = hashLine(HASH_BASIS, line, len);
+  ParsedLine *entry = cached(line, len, hash);
+  if (entry) {
+    *end = '\0';
+    argc = entry->argc;
+    argv[0] = line;
+    for (int i = 1; i < argc; i++) {
+      argv[i] = line + entry->offsets[i];
+      argv[i][-1] = '\0';
+    }
+    // and the space ending the last argument, if the line goes on
+    char *last = argv[argc - 1];
+    char *space = (char *)memchr(last, ' ', end - last);
+    if (space) *space = '\0';
+    return invoke(entry->cmd, argc, argv, out);
+  }
+#endif
+
+  argc = tokenize(line, end, argv);
+  if (argc == 0) return 0;
+  cmd = lookup(argv[0]);
+  if (!cmd) {
+    out->printf("shell: No such command: %s\n", argv[0]);
+    return -1;
+  }
+
+#if SHELL_PARSE_CACHE
+  remember(&cache[hash & (SHELL_PARSE_CACHE - 1)], line, len, hash, argc,
+           argv, cmd);
+#endif
+
+  return invoke(cmd, argc, argv, out);
+}
+
+int Shell::execute(char *line, Stream *out) {
+  char *argv[SHELL_ARG_MAX];
+  return run(line, line + strlen(line), argv, out ? out : io());
+}
+
+void Shell::wake() {
+  // the shell waits for this to finish before its task goes away
+  atomic_fetch_add(&wakers, 1);
+  void *handle = __atomic_load_n(&task, __ATOMIC_ACQUIRE);
+  if (atomic_load(&f_begin) && handle) xTaskNotifyGive((TaskHandle_t)handle);
+  atomic_fetch_sub(&wakers, 1);
+}
+
+int Shell::readLine(char *buffer, size_t size) {
+  size_t len = 0;
+  for (;;) {
+    char c;
+    if (pending < bufhead) {
+      c = *pending++;
+    } else if (f_end != 0 || atomic_load(&f_cancel)) {
+      return -1;
+    } else {
+#if SHELL_READ_AHEAD
+      if (receive(&c, 1, 20) != 1) continue;
+#else
+      // the command wants input after all
+      throttle(false);
+      if (stream->readBytes(&c, 1) != 1) continue;
+#endif
+    }
+
+    if (c == '\n') break;
+    if (c != '\r' && len + 1 < size) buffer[len++] = c;
+  }
+  if (size) buffer[len] = '\0';
+  return len;
+}
+
 void Shell::main() {
   atomic_store(&f_begin, 1);
+  atomic_store(&f_cancel, 0);
+#if SHELL_SCRATCH
+  scratch_used = 0;
+  scratch_peak = 0;
+#endif
+
+  // register for `current`
+  task = xTaskGetCurrentTaskHandle();
+  for (Shell *&slot : shells) {
+    Shell *empty = nullptr;
+    if (__atomic_compare_exchange_n(&slot, &empty, this, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+      break;
+    }
+  }
 
-  int argc;
   size_t count;
-  char *bufhead = input;
   char *end;
-  char *space;
-  char *i;
 
+#if SHELL_READ_AHEAD
+  // start reading ahead
+  port.shell = this;
+  atomic_store(&ahead_head, 0);
+  atomic_store(&ahead_tail, 0);
+  atomic_store(&ahead_fill, 0);
+  atomic_store(&f_eof, 0);
+  atomic_store(&f_running, 0);
+  atomic_store(&f_receiving, 1);
+  f_direct = false;
+  if (!output) output = xSemaphoreCreateRecursiveMutex();
+  if (!output ||
+      !shellCreateTask(Shell::startReceive, "shell-rx", RECEIVE_STACK, this,
+                       uxTaskPriorityGet(NULL) + 1, &receiver, core)) {
+    // carry on without reading ahead
+    atomic_store(&f_receiving, 0);
+    f_direct = true;
+  }
+#endif
+
+  lockOutput();
   prompt(*stream);
+  unlockOutput();
 
   while (f_end == 0) {
-    // read input
-    count = stream->readBytes(bufhead, SHELL_LINE_MAX - (bufhead - input));
-    end = (char *)memchr(bufhead, '\n', count);
+    // services only see input that is not part of a line
+    pending = bufhead;
+    poll();
+
+    // a previous read may have brought in more than one line
+    end = scan();
     if (!end) {
+      // read input; take whatever has arrived, or wait briefly for a byte,
+      // so a complete line is never held back waiting for more
+      size_t room = SHELL_LINE_MAX - (bufhead - input);
+#if SHELL_READ_AHEAD
+      bool eof = atomic_load_explicit(&f_eof, memory_order_acquire);
+      count = receive(bufhead, room, 20);
+      if (count == 0 && eof) break;
+#else
+      int ready = stream->available();
+      if (ready < 0) break;
+      if (ready > 0 && (size_t)ready < room) room = ready;
+      else if (ready == 0) room = 1;
+      count = stream->readBytes(bufhead, room);
+#endif
       bufhead += count;
-
+      end = scan();
+    }
+    if (!end) {
       // discard buffer if overrun
       if (bufhead >= &input[SHELL_LINE_MAX]) {
+        lockOutput();
         stream->print("\nshell: Command line too long; discarding\n");
         prompt(*stream);
+        unlockOutput();
         bufhead = input;
+        resetLine();
       }
 
       // continue to wait for input
       continue;
     }
 
-    // split arguments
-    *end = '\0';
-    argc = 0;
-    stream->printf("%s\n", input);
-
-    for (i = input; i < end; i += strlen(i) + 1) {
-      if (argc < SHELL_ARG_MAX) {
-        argv[argc] = i;
-        argc += 1;
-      } else {
-        stream->printf(
-            "Too many arguments; discarding arguments after #%d\n",
-            SHELL_ARG_MAX - 1);
-        break;
-      }
-
-      space = (char *)memchr(i, ' ', end - i);
-      if (space) {
-        *space = '\0';
+    // echo the line, putting back the spaces split off
+    lockOutput();
+    for (char *i = input; i < end;) {
+      size_t len = strlen(i);
+      stream->write(i, len);
+      i += len;
+      if (i < end) {
+        stream->print(' ');
+        i += 1;
       }
     }
+    stream->print('\n');
+    unlockOutput();
 
     // execute command
-    if (argc == 0) continue;
-    const Command *cmd = (const Command *)bsearch(
-        argv[0], commands, cmd_count, sizeof(Command), cmp);
+    pending = end + 1;
+#if !SHELL_READ_AHEAD
+    // nothing reads the port while the command runs
+    throttle(true);
+#endif
+    atomic_store(&f_cancel, 0);
     if (cmd) {
-      cmd->entry(argc, argv, stream);
-    } else {
+#if SHELL_READ_AHEAD
+      // nothing reads the port while the command runs, without the
+      // receive task
+      if (f_direct) throttle(true);
+      atomic_store(&f_running, 1);
+      invoke(cmd, argc, argv, io());
+      atomic_store(&f_running, 0);
+#else
+      invoke(cmd, argc, argv, io());
+#endif
+    } else if (argc > 0) {
+      lockOutput();
       stream->printf("shell: No such command: %s\n", argv[0]);
+      unlockOutput();
     }
+#if !SHELL_READ_AHEAD
+    throttle(false);
+#endif
 
-    // prepare for next command
-    bufhead += count;
-    count = bufhead - (end + 1);
+    // prepare for next command; the command may have consumed some input
+    count = bufhead - pending;
     if (count > 0) {
-      memmove(input, end + 1, count);
+      memmove(input, pending, count);
     }
 
     bufhead = input + count;
+    pending = bufhead;
+    resetLine();
+    lockOutput();
     prompt(*stream);
+    unlockOutput();
   }
 
   // cleanup
+#if SHELL_READ_AHEAD
+  while (f_receiving != 0)
+    vTaskDelay(1);
+#endif
+  for (ShellService &service : services) {
+    if (!service.poll || !service.stop) continue;
+    service.stop(*this, service.arg);
+    service.poll = nullptr;
+  }
+  for (Shell *&slot : shells) {
+    if (slot == this) __atomic_store_n(&slot, nullptr, __ATOMIC_RELEASE);
+  }
+#if SHELL_STACK_POOL
+  bool last = true;
+  for (Shell *&slot : shells) {
+    if (__atomic_load_n(&slot, __ATOMIC_ACQUIRE)) last = false;
+  }
+  if (last) endWorkers();
+#endif
+  __atomic_store_n(&task, nullptr, __ATOMIC_RELEASE);
+  while (atomic_load(&wakers) != 0)
+    taskYIELD();
   atomic_store(&f_end, 0);
   atomic_store(&f_begin, 0);
   vTaskDelete(NULL);
@@ -34,11 +34,18 @@
  * `<Arduino_FreeRTOS.h>` should be included in your sketch, and
  * `vTaskStartScheduler` should be called at the end of your `setup`
  * routine for the shell to actually start.
+ *
+ * For quicker test cycles, `extras/linux` builds a sketch and the shell as
+ * a Linux program, with FreeRTOS tasks on threads and `Serial` on standard
+ * input and output or a pseudo-terminal. Command tables build unchanged,
+ * and profilers and sanitizers see the same dispatch code as the board.
  */
 #ifndef TOYSHELL_H
 #define TOYSHELL_H
 
 #include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 #include <HardwareSerial.h>
@@ -46,6 +53,143 @@
 
 #define SHELL_LINE_MAX 2048
 #define SHELL_ARG_MAX 32
+#define SHELL_SERVICE_MAX 4
+#define SHELL_INSTANCE_MAX 4
+
+/*
+ * Command lines run repeatedly through `execute`, e.g. by scripts, triggers
+ * and scheduled jobs, skip splitting and command lookup if found in a small
+ * cache. Lines typed in are split as they arrive instead, then take their
+ * command from the cache, or go into it, once complete. The cache holds
+ * this many lines (a power of two; 0 turns it off) of at most
+ * `SHELL_CACHE_LINE` bytes and `SHELL_CACHE_ARGS` arguments each. On a
+ * 32-bit chip, each line takes `SHELL_CACHE_LINE + 2 * SHELL_CACHE_ARGS +
+ * 12` bytes of every shell: 224 bytes in all with the defaults.
+ */
+#ifndef SHELL_PARSE_CACHE
+#define SHELL_PARSE_CACHE 4
+#endif
+#ifndef SHELL_CACHE_LINE
+#define SHELL_CACHE_LINE 32
+#endif
+#ifndef SHELL_CACHE_ARGS
+#define SHELL_CACHE_ARGS 6
+#endif
+
+/*
+ * Commands flagged `SHELL_IDEMPOTENT` have their output kept, so asking
+ * again replays it instead of running the command. The shell keeps this
+ * many outputs (0 turns it off) of at most `SHELL_MEMO_OUTPUT` bytes, for
+ * command lines of less than `SHELL_MEMO_LINE` bytes. On a 32-bit chip,
+ * each output kept takes `SHELL_MEMO_OUTPUT + SHELL_MEMO_LINE + 20` bytes
+ * of every shell: 1.2 KB for four with the other defaults.
+ */
+#ifndef SHELL_MEMO
+#define SHELL_MEMO 0
+#endif
+#ifndef SHELL_MEMO_OUTPUT
+#define SHELL_MEMO_OUTPUT 256
+#endif
+#ifndef SHELL_MEMO_LINE
+#define SHELL_MEMO_LINE 32
+#endif
+
+/*
+ * The stack of a shell's task, in the units `xTaskCreate` takes. Commands
+ * that need much more can be flagged `SHELL_LARGE_STACK` instead of growing
+ * every shell's stack.
+ */
+#ifndef SHELL_STACK
+#define SHELL_STACK 4096
+#endif
+
+/*
+ * `SHELL_LARGE_STACK` commands borrow one of this many tasks, shared by all
+ * shells, with stacks of `SHELL_POOL_STACK`. Tasks are started as needed
+ * and end with the last shell. 0 runs such commands on the shell's task.
+ */
+#ifndef SHELL_STACK_POOL
+#define SHELL_STACK_POOL 1
+#endif
+#ifndef SHELL_POOL_STACK
+#define SHELL_POOL_STACK 8192
+#endif
+
+/*
+ * Count what each command allocates on the heap, and what it leaks; see
+ * `"ShellHeap.h"`. Off by default.
+ */
+#ifndef SHELL_HEAP_STATS
+#define SHELL_HEAP_STATS 0
+#endif
+
+/*
+ * Bytes of scratch memory a shell hands out to the command it runs, see
+ * `Shell::scratch`. Every shell holds all of it, used or not; 0 turns it
+ * off. `Shell::scratchPeak` tells how much the commands actually need.
+ */
+#ifndef SHELL_SCRATCH
+#define SHELL_SCRATCH 512
+#endif
+
+/*
+ * While a command runs, a receive task keeps reading the port into a
+ * buffer of this many bytes (a power of two), so input sent meanwhile is
+ * not lost to a shallow UART FIFO. The next line collects there while the
+ * current one executes, and moves over to the line buffer once the command
+ * returns. Ctrl-C arriving while a command runs cancels it, as a
+ * `SHELL_CANCEL` command would, even behind lines typed ahead. 0 turns
+ * read-ahead off; the shell then reads the port itself between commands,
+ * as it also does if the receive task cannot be created.
+ *
+ * Each shell holds the buffer, and its receive task takes a stack of
+ * `SHELL_RECEIVE_STACK` bytes, on every chip, from the heap while the
+ * shell runs: 2.3 KB in all with the defaults.
+ */
+#ifndef SHELL_READ_AHEAD
+#define SHELL_READ_AHEAD 256
+#endif
+#ifndef SHELL_RECEIVE_STACK
+#define SHELL_RECEIVE_STACK 2048
+#endif
+
+/*
+ * Lines naming a `SHELL_URGENT` command are run by the receive task if
+ * they are shorter than this many bytes; longer ones wait their turn.
+ */
+#ifndef SHELL_URGENT_LINE
+#define SHELL_URGENT_LINE 64
+#endif
+
+/*
+ * On dual-core ESP32s, the shell's task and the tasks working for it run
+ * on this core (0 or 1), keeping them off the core of a time-critical
+ * loop. `SHELL_ANY_CORE` lets the scheduler choose. Other chips ignore it.
+ * `Shell::setCore` overrides it for one shell.
+ */
+#define SHELL_ANY_CORE -1
+#ifndef SHELL_CORE
+#define SHELL_CORE SHELL_ANY_CORE
+#endif
+
+class Shell;
+
+/**
+ * Ways of telling the sender to pause, for `Shell::setFlowControl`. They
+ * may be combined.
+ */
+enum ShellFlow : uint8_t {
+  SHELL_FLOW_NONE = 0,
+  /**
+   * Send XOFF (Ctrl-S) to pause the sender and XON (Ctrl-Q) to resume.
+   */
+  SHELL_FLOW_XONXOFF = 1,
+  /**
+   * Drive an RTS pin high to pause the sender and low to resume. Wire it to
+   * the CTS input of the other end.
+   */
+  SHELL_FLOW_RTS = 2,
+};
 
 /**
  * The shell's event loop. Called by `Shell::begin()`. DO NOT CALL THIS
@@ -53,6 +197,45 @@
  */
 void shellMain(void *parameters);
 
+/**
+ * Flags for `Command::flags`.
+ */
+enum ShellCommandFlags : uint8_t {
+  /**
+   * Running the command changes nothing, and a line gives the same output
+   * and status every time until the command's `generation` changes. The
+   * shell then replays what it printed last time rather than running it;
+   * see `SHELL_MEMO`.
+   */
+  SHELL_IDEMPOTENT = 1,
+  /**
+   * Run the command as soon as its line is complete, ahead of the command
+   * running and of any lines waiting: the receive task takes the line out
+   * of the input and runs it itself, at a higher priority than the shell.
+   * Keep such commands short; they run alongside the current command, on
+   * a stack of `SHELL_RECEIVE_STACK` bytes, and the current command's
+   * writes wait until they return, so output does not mix. Without
+   * `SHELL_READ_AHEAD`, the command runs in turn like any other.
+   *
+   * Input that could still turn out to name such a command, e.g. `s` for
+   * `stop`, is held back from `read` until the line goes on, but counts in
+   * `available`, so a command waiting for any key stops on it.
+   */
+  SHELL_URGENT = 2,
+  /**
+   * With `SHELL_URGENT`, also ask the command running to stop; see
+   * `Shell::cancelled`.
+   */
+  SHELL_CANCEL = 4,
+  /**
+   * The command needs a larger stack than the shell's. It runs on a task
+   * borrowed from a pool shared by all shells, while the shell waits, so
+   * RAM goes to as many large stacks as are in use at once; see
+   * `SHELL_STACK_POOL`. The command may use the shell as usual.
+   */
+  SHELL_LARGE_STACK = 8,
+};
+
 /**
  * A command accepted by the shell.
  */
@@ -67,6 +250,9 @@ struct Command {
    * Consider implementing a command named `help` that prints a list of
    * all commands, in case you or some other developer forgot the name
    * of some debugging function.
+   *
+   * A command named `@` also runs for every line whose first word starts
+   * with `@` and is not a command itself; see `"ShellGateway.h"`.
    */
   const char *name;
   /**
@@ -78,13 +264,76 @@ struct Command {
    * in `argc`. The UART interface the shell is listening on is exposed
    * as the `serial` pointer; output should be written using `serial->print()`
    * and friends, and user input should be obtained from the same interface as
-   * well.
+   * well. With `SHELL_READ_AHEAD` on, reads return what the receive task has
+   * buffered: `read` and `peek` never wait, and `readBytes` sleeps until
+   * the receive task has more, up to the stream's timeout. Other blocking
+   * reads `Stream` provides, such as `parseInt`, spin in `timedRead`,
+   * which the cores do not let the shell replace; poll `available()` or
+   * use `Shell::readLine` rather than those. Commands that wait a long time
+   * can be written as coroutines instead, so the shell keeps taking
+   * commands meanwhile; see `"ShellCoroutine.h"`.
    *
    * This field expects a function. If you want to implement a command with
    * the entry point `cmdHelp`, you should put `cmdHelp` instead of `cmdHelp()`
    * here.
    */
   int (*entry)(int argc, const char *const *argv, Stream *serial);
+  /**
+   * A combination of `ShellCommandFlags`. Optional.
+   */
+  uint8_t flags = 0;
+  /**
+   * For `SHELL_IDEMPOTENT` commands whose output follows some state: a
+   * counter the application bumps whenever that state changes, so output
+   * kept from before is not replayed. A form of the command that changes
+   * the state itself, like `config set`, should bump it too; it is then
+   * never replayed. Optional.
+   */
+  const atomic_uint *generation = nullptr;
+};
+
+/**
+ * Create a FreeRTOS task, pinned to `core` where there is a choice of
+ * cores, or not pinned if it is `SHELL_ANY_CORE`. The handle is stored in
+ * `handle` unless it is `nullptr`. Returns false if the task could not be
+ * created.
+ */
+bool shellCreateTask(void (*code)(void *), const char *name, uint32_t stack,
+                     void *arg, unsigned priority, void **handle, int core);
+
+/**
+ * Compare two strings in dictionary order, like `strcmp`, but usable in
+ * constant expressions.
+ */
+constexpr int shellStrcmp(const char *a, const char *b) {
+  return (*a != *b || *a == '\0')
+             ? (unsigned char)*a - (unsigned char)*b
+             : shellStrcmp(a + 1, b + 1);
+}
+
+/**
+ * Check at compile time that a table of named entries (such as a list of
+ * `Command`s) is sorted by name in dictionary order. Tables ending with a
+ * null entry are accepted. Use it in a `static_assert` next to your table:
+ *
+ *     constexpr Command commands[] = { ... };
+ *     static_assert(shellSorted(commands), "commands must be sorted");
+ */
+template <typename T, size_t N>
+constexpr bool shellSorted(const T (&table)[N], size_t i = 1) {
+  return i >= N || table[i].name == nullptr ||
+         (shellStrcmp(table[i - 1].name, table[i].name) < 0 &&
+          shellSorted(table, i + 1));
+}
+
+/**
+ * Work the shell does in the background, between commands. See
+ * `Shell::addService`.
+ */
+struct ShellService {
+  void (*poll)(Shell &shell, void *arg);
+  void *arg;
+  void (*stop)(Shell &shell, void *arg);
 };
 
 /**
@@ -97,11 +346,143 @@ private:
   size_t cmd_count;
   atomic_bool f_begin;
   atomic_bool f_end;
+  void *task = nullptr;
+  atomic_uint wakers; // calls to `wake` under way, which hold on to `task`
+  void *lender = nullptr; // the task running a command on its stack
+  int core = SHELL_CORE;
 
   char input[SHELL_LINE_MAX];
   char *argv[SHELL_ARG_MAX];
+  char *bufhead = input;
+  char *pending = input;
+
+  // state of splitting the line coming in
+  char *scanned = input;
+  int argc = 0;
+  bool f_split = true;
+  bool f_toomany = false;
+  const Command *cmd = nullptr;
+
+  // set by a `SHELL_CANCEL` command, cleared as the next command starts
+  atomic_bool f_cancel;
+
+  ShellService services[SHELL_SERVICE_MAX] = {};
+
+  uint8_t flow = SHELL_FLOW_NONE;
+  int rts_pin = -1;
+  bool f_throttled = false;
+
+#if SHELL_READ_AHEAD
+  /*
+   * The stream commands get: output goes straight to the port, input comes
+   * from what the shell has received but not used yet.
+   */
+  class Port : public Stream {
+  public:
+    Shell *shell = nullptr;
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t *buffer, size_t size) override;
+    int availableForWrite() override;
+    void flush() override;
+    int available() override;
+    int read() override;
+    int peek() override;
+    // virtual on ESP32 and the host, but not on every core
+    size_t readBytes(char *buffer, size_t length);
+  };
+
+  Port port;
+  char ahead[SHELL_READ_AHEAD];
+  atomic_uint ahead_head; // advanced by the receive task
+  atomic_uint ahead_tail; // advanced by the shell task
+  atomic_uint ahead_fill; // read in, including a line held back
+  atomic_bool f_receiving;
+  atomic_bool f_eof; // the stream has no more input
+  atomic_bool f_running; // a command is running on the shell's task
+  bool f_direct = false; // no receive task; the shell reads the port
+  void *receiver = nullptr;
+  void *output = nullptr; // mutex keeping writes to the port whole
+
+  const Command *urgent(const char *text, size_t len, bool whole);
+  void runUrgent(const Command *cmd, char *text, size_t len);
+
+  size_t receive(char *buffer, size_t size, uint32_t wait);
+  void receiveMain();
+  static void startReceive(void *);
+#endif
+
+#if SHELL_PARSE_CACHE
+  struct ParsedLine {
+    uint32_t hash;
+    uint16_t len;
+    uint8_t argc;
+    const Command *cmd;
+    uint16_t offsets[SHELL_CACHE_ARGS];
+    char text[SHELL_CACHE_LINE];
+  };
+  ParsedLine cache[SHELL_PARSE_CACHE] = {};
+  uint32_t line_hash = 2166136261u; // of the line being split, so far
+
+  ParsedLine *cached(const char *line, size_t len, uint32_t hash);
+  void remember(ParsedLine *entry, const char *line, size_t len,
+                uint32_t hash, int argc, char **argv, const Command *cmd);
+#endif
+
+#if SHELL_MEMO
+  struct MemoEntry {
+    const Command *cmd;
+    Stream *out;
+    unsigned generation;
+    int result;
+    uint16_t len;
+    bool f_valid;
+    char line[SHELL_MEMO_LINE];
+    char output[SHELL_MEMO_OUTPUT];
+  };
+  MemoEntry memo[SHELL_MEMO] = {};
+  size_t memo_next = 0;
+
+  /*
+   * Passes everything on to the stream a command was given, keeping a copy
+   * of the output.
+   */
+  class Tee : public Stream {
+  public:
+    Stream *out;
+    Tee *outer; // the one in use before, when commands nest
+    MemoEntry *entry;
+    bool f_overflow = false;
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t *buffer, size_t size) override;
+    int availableForWrite() override;
+    void flush() override;
+    int available() override;
+    int read() override;
+    int peek() override;
+  };
+  Tee *teeing = nullptr; // the innermost one in use
+#endif
+
+#if SHELL_SCRATCH
+  alignas(max_align_t) char scratch_area[SHELL_SCRATCH];
+  size_t scratch_used = 0;
+  size_t scratch_peak = 0;
+#endif
 
   void main();
+  void poll();
+  int call(const Command *cmd, int argc, char **argv, Stream *out);
+  int borrow(const Command *cmd, int argc, char **argv, Stream *out);
+  int invoke(const Command *cmd, int argc, char **argv, Stream *out);
+  int tokenize(char *line, char *end, char **argv);
+  char *scan();
+  void resetLine();
+  const Command *lookup(const char *name);
+  int run(char *line, char *end, char **argv, Stream *out);
+  Stream *io();
+  void lockOutput();
+  void unlockOutput();
+  void throttle(bool stop);
   static void start(void *);
 public:
   /**
@@ -112,7 +493,8 @@ public:
    * This form requires the number of commands to be passed in a parameter.
    */
   Shell(const Command *commands, size_t count)
-      : stream(nullptr), commands(commands), cmd_count(count), f_begin(0), f_end(0) {}
+      : stream(nullptr), commands(commands), cmd_count(count), f_begin(0), f_end(0),
+        wakers(0) {}
 
   /**
    * Create a shell instance accepting the specified list of commands. The
@@ -122,7 +504,7 @@ public:
    * This form requires the list of commands to end with {nullptr, nullptr}.
    */
   Shell(const Command *commands)
-      : stream(nullptr), commands(commands), f_begin(0), f_end(0) {
+      : stream(nullptr), commands(commands), f_begin(0), f_end(0), wakers(0) {
     cmd_count = 0;
     while (commands[cmd_count].name) {
       cmd_count += 1;
@@ -131,6 +513,36 @@ public:
 
   Shell(Shell &other) = delete;
 
+  /**
+   * Replace the list of commands accepted. The same rules apply as for
+   * the constructor. Only call this while the shell is stopped, or from
+   * the shell's own task.
+   */
+  void setCommands(const Command *commands, size_t count);
+
+  /**
+   * Have the shell pause the sender while it cannot keep up, so text can be
+   * streamed at full speed without losing any. With `SHELL_READ_AHEAD` on,
+   * the sender is paused once the read-ahead buffer is three quarters full
+   * and resumed when it is down to a quarter; otherwise it is paused while
+   * each command runs. `rtsPin` is needed with `SHELL_FLOW_RTS`.
+   *
+   * Call this before `begin`.
+   */
+  void setFlowControl(uint8_t flow, int rtsPin = -1);
+
+  /**
+   * Run the shell, and the tasks it starts, on `core`, or on any core if it
+   * is `SHELL_ANY_CORE`. Only dual-core ESP32s take notice. Call this
+   * before `begin`.
+   */
+  void setCore(int core) { this->core = core; }
+
+  /**
+   * The core set by `setCore`, for tasks started on the shell's behalf.
+   */
+  int getCore() const { return core; }
+
   /**
    * Stop the shell and free all associated resources.
    */
@@ -140,6 +552,10 @@ public:
    * Start the shell and listen on the serial port specified. If no
    * serial port is specified, defaults to `Serial`.
    *
+   * Should the stream's `available()` turn negative, as host streams do at
+   * the end of their input, the shell runs the lines it already has and
+   * stops by itself.
+   *
    * This method fails if it is already accepting commands; call `end`
    * before calling `begin` again to change port.
    */
@@ -149,6 +565,110 @@ public:
    * Stop accepting commands.
    */
   void end();
+
+  /**
+   * Find the shell whose task is calling this method, e.g. from inside a
+   * command, including one running on a borrowed stack. Returns `nullptr`
+   * if called from any other task.
+   */
+  static Shell *current();
+
+  /**
+   * Whether a `SHELL_CANCEL` command has asked the command running on the
+   * calling task to stop. Commands that take long should check it now and
+   * then, along with `available()` for a key press. Always false outside
+   * a shell's task.
+   */
+  static bool cancelled();
+
+  /**
+   * Get `size` bytes of memory for the command running on the calling
+   * task, aligned for any type, or `nullptr` if there is not enough left
+   * or the caller is not a shell's task. Taking memory costs no more than
+   * an addition, and there is nothing to free: all of it is taken back
+   * once the command returns. Memory taken by a command run through
+   * `execute` goes back when that command returns, leaving the caller's.
+   * Coroutine commands lose it as soon as they first wait.
+   */
+  static void *scratch(size_t size);
+
+  /**
+   * The most scratch memory in use at any one time since the shell was
+   * started, for choosing `SHELL_SCRATCH`.
+   */
+  size_t scratchPeak() const;
+
+  /**
+   * The stream the shell is listening on.
+   */
+  Stream *getStream() const { return stream; }
+
+  /**
+   * Run a command line as if it had been typed in, with output going to
+   * the shell's stream, or to `out` if given. The line is split into
+   * arguments in place. Returns what the command returned, or -1 if there
+   * is no such command.
+   *
+   * Only call this from the shell's own task, such as from a command or a
+   * service.
+   */
+  int execute(char *line, Stream *out = nullptr);
+
+  /**
+   * Find the command a line starting with `name` would run, or `nullptr`.
+   * Only reads the command table, so it may be called from any task.
+   */
+  const Command *find(const char *name) { return lookup(name); }
+
+  /**
+   * The stream a command's output ends up on, given the stream the command
+   * was handed. Streams the shell puts in between for its own bookkeeping,
+   * like for keeping the output of idempotent commands, are seen through,
+   * so settings kept per stream are found.
+   */
+  static Stream *target(Stream *stream);
+
+  /**
+   * Drop the output kept for idempotent commands, e.g. because the way
+   * output is rendered has changed.
+   */
+  void forget();
+
+  /**
+   * Have the shell run its services as soon as possible, rather than at
+   * the next 20 millisecond mark. May be called from any task, and does
+   * nothing while the shell is not running.
+   */
+  void wake();
+
+  /**
+   * Read a line of input from inside a command, without the newline. Input
+   * the shell already received after the command line is returned first,
+   * so text pasted along with a command is not lost. Lines too long for
+   * `buffer` are cut short. Returns the length of the line, or -1 if the
+   * shell is stopping or the command was cancelled.
+   *
+   * Only call this from a command running on the shell's own task.
+   */
+  int readLine(char *buffer, size_t size);
+
+  /**
+   * Have the shell call `poll(shell, arg)` between commands, at least every
+   * 20 milliseconds or so while idle. Services run on the shell's task, so
+   * they may call `execute`. Adding a service already present does
+   * nothing. Returns false if there is no room for more services.
+   *
+   * If `stop` is given, the shell calls `stop(shell, arg)` on its task as
+   * it stops, and removes the service; modules keeping state for the shell
+   * let go of it there.
+   */
+  bool addService(void (*poll)(Shell &, void *), void *arg = nullptr,
+                  void (*stop)(Shell &, void *) = nullptr);
+
+  /**
+   * Stop calling a service added by `addService`.
+   */
+  void removeService(void (*poll)(Shell &, void *), void *arg = nullptr);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,70 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * The Arduino core of the Linux runtime.
+ */
+#include "Arduino.h"
+#include "Arduino_FreeRTOS.h"
+
+#include <time.h>
+
+static struct timespec now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now;
+}
+
+static struct timespec start = now();
+static uint8_t pins[256];
+
+unsigned long millis() {
+  return micros() / 1000;
+}
+
+unsigned long micros() {
+  struct timespec at = now();
+  return (unsigned long)((at.tv_sec - start.tv_sec) * 1000000 +
+                         (at.tv_nsec - start.tv_nsec) / 1000);
+}
+
+void delay(unsigned long ms) {
+  vTaskDelay(pdMS_TO_TICKS(ms));
+}
+
+void delayMicroseconds(unsigned int us) {
+  struct timespec length = {(time_t)(us / 1000000), (long)(us % 1000000) * 1000};
+  nanosleep(&length, nullptr);
+}
+
+void yield() {
+  taskYIELD();
+}
+
+void pinMode(uint8_t, uint8_t) {}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+  pins[pin] = value;
+}
+
+int digitalRead(uint8_t pin) {
+  return pins[pin];
+}
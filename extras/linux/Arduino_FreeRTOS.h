@@ -0,0 +1,86 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * The FreeRTOS API the shell and its commands use, mapped onto POSIX
+ * threads for the Linux runtime.
+ *
+ * Every task is a thread, named after the task so it shows up in `perf`
+ * and debuggers. Priorities are recorded but not enforced: the kernel
+ * schedules the threads, so tasks really do run in parallel. Stack sizes
+ * are ignored; threads get the usual 8 MiB. A tick is a millisecond.
+ * Tasks can only delete themselves.
+ */
+#ifndef TOYSHELL_HOST_FREERTOS_H
+#define TOYSHELL_HOST_FREERTOS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef struct HostTask *TaskHandle_t;
+typedef uint32_t TickType_t;
+typedef long BaseType_t;
+typedef unsigned long UBaseType_t;
+typedef uint8_t StackType_t; // stacks are the threads' own; depths are ignored
+typedef void (*TaskFunction_t)(void *);
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdFAIL 0
+#define pdPASS 1
+
+#define configTICK_RATE_HZ 1000
+#define portTICK_PERIOD_MS 1
+#define portMAX_DELAY ((TickType_t)0xffffffff)
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+
+#define configASSERT(x)                                                        \
+  do {                                                                         \
+    if (!(x)) abort();                                                         \
+  } while (0)
+
+#define pvPortMalloc malloc
+#define vPortFree free
+
+BaseType_t xTaskCreate(TaskFunction_t code, const char *name,
+                       uint32_t stackDepth, void *parameters,
+                       UBaseType_t priority, TaskHandle_t *created);
+void vTaskDelete(TaskHandle_t task);
+void vTaskDelay(TickType_t ticks);
+void vTaskDelayUntil(TickType_t *previousWake, TickType_t period);
+void taskYIELD();
+TaskHandle_t xTaskGetCurrentTaskHandle();
+const char *pcTaskGetName(TaskHandle_t task);
+UBaseType_t uxTaskPriorityGet(TaskHandle_t task);
+void vTaskPrioritySet(TaskHandle_t task, UBaseType_t priority);
+TickType_t xTaskGetTickCount();
+
+uint32_t ulTaskNotifyTake(BaseType_t clearOnExit, TickType_t ticks);
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+
+/*
+ * Wait for every task to end, then end the program. Tasks already run
+ * before this is called.
+ */
+void vTaskStartScheduler();
+
+#endif
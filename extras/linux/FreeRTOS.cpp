@@ -0,0 +1,621 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * FreeRTOS tasks, queues, mutexes and timers on POSIX threads, for the
+ * Linux runtime.
+ */
+#include "Arduino_FreeRTOS.h"
+#include "queue.h"
+#include "semphr.h"
+#include "timers.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+
+struct HostTask {
+  pthread_t thread;
+  TaskFunction_t code;
+  void *parameters;
+  UBaseType_t priority;
+  char name[16];
+
+  pthread_mutex_t lock;
+  pthread_cond_t notified;
+  uint32_t notification;
+
+  HostTask *next_deleted;
+};
+
+static __thread HostTask *self;
+
+// tasks created and not yet deleted
+static pthread_mutex_t tasks_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tasks_changed = PTHREAD_COND_INITIALIZER;
+static size_t tasks_alive;
+// deleted tasks whose handles are still to be freed; like the idle task of
+// FreeRTOS, this is done a little later, once their threads have let go
+static HostTask *tasks_deleted;
+
+static struct timespec deadline(TickType_t ticks) {
+  struct timespec at;
+  clock_gettime(CLOCK_MONOTONIC, &at);
+  at.tv_sec += ticks / 1000;
+  at.tv_nsec += (long)(ticks % 1000) * 1000000;
+  if (at.tv_nsec >= 1000000000) {
+    at.tv_sec += 1;
+    at.tv_nsec -= 1000000000;
+  }
+  return at;
+}
+
+static void initCond(pthread_cond_t *cond) {
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(cond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+static void initTask(HostTask *task, const char *name,
+                     UBaseType_t priority) {
+  strncpy(task->name, name ? name : "", sizeof(task->name) - 1);
+  task->priority = priority;
+  pthread_mutex_init(&task->lock, nullptr);
+  initCond(&task->notified);
+}
+
+static void freeTask(HostTask *task) {
+  pthread_mutex_destroy(&task->lock);
+  pthread_cond_destroy(&task->notified);
+  free(task);
+}
+
+/*
+ * Free the handles of the tasks deleted so far.
+ */
+static void reapTasks() {
+  pthread_mutex_lock(&tasks_lock);
+  HostTask *task = tasks_deleted;
+  tasks_deleted = nullptr;
+  pthread_mutex_unlock(&tasks_lock);
+  while (task) {
+    HostTask *next = task->next_deleted;
+    freeTask(task);
+    task = next;
+  }
+}
+
+static HostTask *newTask(const char *name, UBaseType_t priority) {
+  reapTasks();
+  HostTask *task = (HostTask *)calloc(1, sizeof(HostTask));
+  if (!task) return nullptr;
+  initTask(task, name, priority);
+  return task;
+}
+
+/*
+ * Find how many tasks are alive. The runtime ends once there are none, so
+ * then the handles left are freed too.
+ */
+size_t hostTasksAlive() {
+  pthread_mutex_lock(&tasks_lock);
+  size_t count = tasks_alive;
+  pthread_mutex_unlock(&tasks_lock);
+  if (count == 0) reapTasks();
+  return count;
+}
+
+/*
+ * Wait up to `ms` milliseconds for the number of live tasks to change.
+ */
+void hostTasksWait(unsigned long ms) {
+  struct timespec at = deadline(ms);
+  pthread_mutex_lock(&tasks_lock);
+  if (tasks_alive) pthread_cond_timedwait(&tasks_changed, &tasks_lock, &at);
+  pthread_mutex_unlock(&tasks_lock);
+}
+
+static void *startTask(void *parameters) {
+  self = (HostTask *)parameters;
+  pthread_setname_np(pthread_self(), self->name);
+  self->code(self->parameters);
+  // returning from a task is an error on FreeRTOS; end it tidily here
+  vTaskDelete(nullptr);
+  return nullptr;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t code, const char *name, uint32_t,
+                       void *parameters, UBaseType_t priority,
+                       TaskHandle_t *created) {
+  HostTask *task = newTask(name, priority);
+  if (!task) return pdFAIL;
+  task->code = code;
+  task->parameters = parameters;
+  if (created) *created = task;
+
+  pthread_mutex_lock(&tasks_lock);
+  tasks_alive += 1;
+  pthread_mutex_unlock(&tasks_lock);
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  int error = pthread_create(&task->thread, &attr, startTask, task);
+  pthread_attr_destroy(&attr);
+  if (error) {
+    pthread_mutex_lock(&tasks_lock);
+    tasks_alive -= 1;
+    pthread_mutex_unlock(&tasks_lock);
+    if (created) *created = nullptr;
+    freeTask(task);
+    return pdFAIL;
+  }
+  return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task) {
+  if (task && task != self) abort();
+
+  pthread_mutex_lock(&tasks_lock);
+  // threads not started by `xTaskCreate` have nothing to free
+  if (self->code) {
+    self->next_deleted = tasks_deleted;
+    tasks_deleted = self;
+  }
+  tasks_alive -= 1;
+  pthread_cond_broadcast(&tasks_changed);
+  pthread_mutex_unlock(&tasks_lock);
+  pthread_exit(nullptr);
+}
+
+void vTaskDelay(TickType_t ticks) {
+  struct timespec at = deadline(ticks);
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, nullptr))
+    ;
+}
+
+void vTaskDelayUntil(TickType_t *previousWake, TickType_t period) {
+  *previousWake += period;
+  TickType_t now = xTaskGetTickCount();
+  if ((int32_t)(*previousWake - now) > 0) vTaskDelay(*previousWake - now);
+}
+
+void taskYIELD() {
+  sched_yield();
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle() {
+  // threads not started by `xTaskCreate`, like the main thread, get a
+  // handle on first use; without allocating, as heap hooks ask for it
+  static __thread HostTask adopted;
+  if (!self) {
+    initTask(&adopted, "main", 1);
+    self = &adopted;
+  }
+  return self;
+}
+
+const char *pcTaskGetName(TaskHandle_t task) {
+  return (task ? task : xTaskGetCurrentTaskHandle())->name;
+}
+
+UBaseType_t uxTaskPriorityGet(TaskHandle_t task) {
+  return (task ? task : xTaskGetCurrentTaskHandle())->priority;
+}
+
+void vTaskPrioritySet(TaskHandle_t task, UBaseType_t priority) {
+  (task ? task : xTaskGetCurrentTaskHandle())->priority = priority;
+}
+
+TickType_t xTaskGetTickCount() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (TickType_t)(now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clearOnExit, TickType_t ticks) {
+  HostTask *task = xTaskGetCurrentTaskHandle();
+  struct timespec at = deadline(ticks);
+
+  pthread_mutex_lock(&task->lock);
+  while (task->notification == 0 && ticks != 0) {
+    int error = ticks == portMAX_DELAY
+                    ? pthread_cond_wait(&task->notified, &task->lock)
+                    : pthread_cond_timedwait(&task->notified, &task->lock, &at);
+    if (error) break;
+  }
+  uint32_t value = task->notification;
+  if (value) task->notification = clearOnExit ? 0 : value - 1;
+  pthread_mutex_unlock(&task->lock);
+  return value;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+  pthread_mutex_lock(&task->lock);
+  task->notification += 1;
+  pthread_cond_signal(&task->notified);
+  pthread_mutex_unlock(&task->lock);
+  return pdPASS;
+}
+
+void vTaskStartScheduler() {
+  while (hostTasksAlive()) hostTasksWait(1000);
+  exit(0);
+}
+
+/*
+ * Queues: a ring of items under a lock, with a condition for each side.
+ */
+struct HostQueue {
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  UBaseType_t length;
+  UBaseType_t item_size;
+  UBaseType_t head;
+  UBaseType_t count;
+  uint8_t items[];
+};
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize) {
+  if (length == 0) return nullptr;
+  HostQueue *queue =
+      (HostQueue *)calloc(1, sizeof(HostQueue) + length * itemSize);
+  if (!queue) return nullptr;
+  pthread_mutex_init(&queue->lock, nullptr);
+  initCond(&queue->not_empty);
+  initCond(&queue->not_full);
+  queue->length = length;
+  queue->item_size = itemSize;
+  return queue;
+}
+
+void vQueueDelete(QueueHandle_t queue) {
+  pthread_mutex_destroy(&queue->lock);
+  pthread_cond_destroy(&queue->not_empty);
+  pthread_cond_destroy(&queue->not_full);
+  free(queue);
+}
+
+/*
+ * Wait on `cond` until `done` says so or `ticks` pass. Called with the
+ * queue locked; returns whether `done` came true.
+ */
+static bool waitQueue(HostQueue *queue, pthread_cond_t *cond,
+                      bool (*done)(HostQueue *), TickType_t ticks) {
+  struct timespec at = deadline(ticks);
+  while (!done(queue)) {
+    if (ticks == 0) return false;
+    int error = ticks == portMAX_DELAY
+                    ? pthread_cond_wait(cond, &queue->lock)
+                    : pthread_cond_timedwait(cond, &queue->lock, &at);
+    if (error) return done(queue);
+  }
+  return true;
+}
+
+static bool hasRoom(HostQueue *queue) {
+  return queue->count < queue->length;
+}
+
+static bool hasItem(HostQueue *queue) {
+  return queue->count > 0;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t wait) {
+  pthread_mutex_lock(&queue->lock);
+  bool sent = waitQueue(queue, &queue->not_full, hasRoom, wait);
+  if (sent) {
+    UBaseType_t at = (queue->head + queue->count) % queue->length;
+    memcpy(&queue->items[at * queue->item_size], item, queue->item_size);
+    queue->count += 1;
+    pthread_cond_signal(&queue->not_empty);
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return sent ? pdPASS : pdFAIL;
+}
+
+static BaseType_t take(QueueHandle_t queue, void *item, TickType_t wait,
+                       bool remove) {
+  pthread_mutex_lock(&queue->lock);
+  bool got = waitQueue(queue, &queue->not_empty, hasItem, wait);
+  if (got) {
+    memcpy(item, &queue->items[queue->head * queue->item_size],
+           queue->item_size);
+    if (remove) {
+      queue->head = (queue->head + 1) % queue->length;
+      queue->count -= 1;
+      pthread_cond_signal(&queue->not_full);
+    }
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return got ? pdPASS : pdFAIL;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t wait) {
+  return take(queue, item, wait, true);
+}
+
+BaseType_t xQueuePeek(QueueHandle_t queue, void *item, TickType_t wait) {
+  return take(queue, item, wait, false);
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) {
+  pthread_mutex_lock(&queue->lock);
+  UBaseType_t count = queue->count;
+  pthread_mutex_unlock(&queue->lock);
+  return count;
+}
+
+/*
+ * Recursive mutexes: the thread holding one and how many times it took it,
+ * under a lock, with a condition for the others waiting.
+ */
+struct HostSemaphore {
+  pthread_mutex_t lock;
+  pthread_cond_t released;
+  pthread_t holder;
+  UBaseType_t depth;
+};
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex() {
+  HostSemaphore *semaphore = (HostSemaphore *)calloc(1, sizeof(HostSemaphore));
+  if (!semaphore) return nullptr;
+  pthread_mutex_init(&semaphore->lock, nullptr);
+  initCond(&semaphore->released);
+  return semaphore;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore) {
+  pthread_mutex_destroy(&semaphore->lock);
+  pthread_cond_destroy(&semaphore->released);
+  free(semaphore);
+}
+
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t semaphore,
+                                   TickType_t wait) {
+  pthread_t me = pthread_self();
+  struct timespec at = deadline(wait);
+  pthread_mutex_lock(&semaphore->lock);
+  bool taken = true;
+  if (!semaphore->depth || !pthread_equal(semaphore->holder, me)) {
+    while (semaphore->depth) {
+      int error = wait == 0 ? -1
+                  : wait == portMAX_DELAY
+                      ? pthread_cond_wait(&semaphore->released,
+                                          &semaphore->lock)
+                      : pthread_cond_timedwait(&semaphore->released,
+                                               &semaphore->lock, &at);
+      if (error && semaphore->depth) {
+        taken = false;
+        break;
+      }
+    }
+    if (taken) semaphore->holder = me;
+  }
+  if (taken) semaphore->depth += 1;
+  pthread_mutex_unlock(&semaphore->lock);
+  return taken ? pdPASS : pdFAIL;
+}
+
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t semaphore) {
+  pthread_mutex_lock(&semaphore->lock);
+  bool held =
+      semaphore->depth && pthread_equal(semaphore->holder, pthread_self());
+  if (held && --semaphore->depth == 0) {
+    pthread_cond_signal(&semaphore->released);
+  }
+  pthread_mutex_unlock(&semaphore->lock);
+  return held ? pdPASS : pdFAIL;
+}
+
+/*
+ * Timers. Other tasks only queue commands; the timer task alone touches
+ * the list of running timers, so a callback never races a deletion.
+ */
+struct HostTimer {
+  HostTimer *next;
+  const char *name;
+  TickType_t period;
+  TickType_t expiry;
+  bool reload;
+  bool running;
+  void *id;
+  TimerCallbackFunction_t callback;
+};
+
+enum TimerCommand { TIMER_START, TIMER_STOP, TIMER_PERIOD, TIMER_DELETE, TIMER_PEND };
+
+struct TimerMessage {
+  TimerMessage *next;
+  TimerCommand command;
+  HostTimer *timer;
+  TickType_t period;
+  PendedFunction_t function;
+  void *parameter1;
+  uint32_t parameter2;
+};
+
+static pthread_once_t timer_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t timer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t timer_wake;
+static TimerMessage *queue_head;
+static TimerMessage *queue_tail;
+static HostTimer *running; // touched by the timer task only
+
+static void startTimer(HostTimer *timer, TickType_t now) {
+  if (!timer->running) {
+    timer->running = true;
+    timer->next = running;
+    running = timer;
+  }
+  timer->expiry = now + timer->period;
+}
+
+static void stopTimer(HostTimer *timer) {
+  if (!timer->running) return;
+  timer->running = false;
+  for (HostTimer **p = &running; *p; p = &(*p)->next) {
+    if (*p == timer) {
+      *p = timer->next;
+      break;
+    }
+  }
+}
+
+static void *timerMain(void *) {
+  pthread_setname_np(pthread_self(), "Tmr Svc");
+  pthread_mutex_lock(&timer_lock);
+  for (;;) {
+    // commands first, in order
+    while (queue_head) {
+      TimerMessage *message = queue_head;
+      queue_head = message->next;
+      if (!queue_head) queue_tail = nullptr;
+      pthread_mutex_unlock(&timer_lock);
+
+      HostTimer *timer = message->timer;
+      TickType_t now = xTaskGetTickCount();
+      switch (message->command) {
+      case TIMER_START: startTimer(timer, now); break;
+      case TIMER_STOP: stopTimer(timer); break;
+      case TIMER_PERIOD:
+        timer->period = message->period;
+        startTimer(timer, now);
+        break;
+      case TIMER_DELETE:
+        stopTimer(timer);
+        free(timer);
+        break;
+      case TIMER_PEND:
+        message->function(message->parameter1, message->parameter2);
+        break;
+      }
+      free(message);
+      pthread_mutex_lock(&timer_lock);
+    }
+
+    // then whichever timer is due
+    TickType_t now = xTaskGetTickCount();
+    HostTimer *due = nullptr;
+    for (HostTimer *timer = running; timer; timer = timer->next) {
+      if (!due || (int32_t)(timer->expiry - due->expiry) < 0) due = timer;
+    }
+    if (due && (int32_t)(due->expiry - now) <= 0) {
+      pthread_mutex_unlock(&timer_lock);
+      if (due->reload) {
+        due->expiry += due->period;
+        if ((int32_t)(due->expiry - now) <= 0) due->expiry = now + due->period;
+      } else {
+        stopTimer(due);
+      }
+      due->callback(due);
+      pthread_mutex_lock(&timer_lock);
+      continue;
+    }
+
+    if (queue_head) continue;
+    if (due) {
+      struct timespec at = deadline(due->expiry - now);
+      pthread_cond_timedwait(&timer_wake, &timer_lock, &at);
+    } else {
+      pthread_cond_wait(&timer_wake, &timer_lock);
+    }
+  }
+  return nullptr;
+}
+
+static void startTimerTask() {
+  initCond(&timer_wake);
+  pthread_t thread;
+  pthread_create(&thread, nullptr, timerMain, nullptr);
+  pthread_detach(thread);
+}
+
+static BaseType_t post(TimerCommand command, HostTimer *timer,
+                       TickType_t period = 0, PendedFunction_t function = nullptr,
+                       void *parameter1 = nullptr, uint32_t parameter2 = 0) {
+  pthread_once(&timer_once, startTimerTask);
+  TimerMessage *message = (TimerMessage *)calloc(1, sizeof(TimerMessage));
+  if (!message) return pdFAIL;
+  message->command = command;
+  message->timer = timer;
+  message->period = period;
+  message->function = function;
+  message->parameter1 = parameter1;
+  message->parameter2 = parameter2;
+
+  pthread_mutex_lock(&timer_lock);
+  if (queue_tail) queue_tail->next = message;
+  else queue_head = message;
+  queue_tail = message;
+  pthread_cond_signal(&timer_wake);
+  pthread_mutex_unlock(&timer_lock);
+  return pdPASS;
+}
+
+TimerHandle_t xTimerCreate(const char *name, TickType_t period,
+                           UBaseType_t autoReload, void *id,
+                           TimerCallbackFunction_t callback) {
+  if (period == 0) return nullptr;
+  HostTimer *timer = (HostTimer *)calloc(1, sizeof(HostTimer));
+  if (!timer) return nullptr;
+  timer->name = name;
+  timer->period = period;
+  timer->reload = autoReload;
+  timer->id = id;
+  timer->callback = callback;
+  return timer;
+}
+
+BaseType_t xTimerStart(TimerHandle_t timer, TickType_t) {
+  return post(TIMER_START, timer);
+}
+
+BaseType_t xTimerStop(TimerHandle_t timer, TickType_t) {
+  return post(TIMER_STOP, timer);
+}
+
+BaseType_t xTimerReset(TimerHandle_t timer, TickType_t) {
+  return post(TIMER_START, timer);
+}
+
+BaseType_t xTimerChangePeriod(TimerHandle_t timer, TickType_t period,
+                              TickType_t) {
+  if (period == 0) return pdFAIL;
+  return post(TIMER_PERIOD, timer, period);
+}
+
+BaseType_t xTimerDelete(TimerHandle_t timer, TickType_t) {
+  return post(TIMER_DELETE, timer);
+}
+
+BaseType_t xTimerPendFunctionCall(PendedFunction_t function, void *parameter1,
+                                  uint32_t parameter2, TickType_t) {
+  return post(TIMER_PEND, nullptr, 0, function, parameter1, parameter2);
+}
+
+void *pvTimerGetTimerID(TimerHandle_t timer) {
+  return timer->id;
+}
@@ -0,0 +1,205 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * The serial port of the Linux runtime: standard input and output, or a
+ * pseudo-terminal.
+ */
+#include "HardwareSerial.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "Arduino.h"
+
+HardwareSerial Serial(STDIN_FILENO, STDOUT_FILENO);
+
+// the terminal as it was before `begin`, put back on the way out
+static int saved_fd = -1;
+static struct termios saved;
+
+static void restore() {
+  if (saved_fd >= 0) tcsetattr(saved_fd, TCSANOW, &saved);
+  saved_fd = -1;
+}
+
+static void restoreAndDie(int signal) {
+  restore();
+  ::signal(signal, SIG_DFL);
+  raise(signal);
+}
+
+void HardwareSerial::begin(unsigned long) {
+  if (saved_fd >= 0 || !isatty(in_fd)) return;
+  if (tcgetattr(in_fd, &saved) < 0) return;
+
+  struct termios raw = saved;
+  raw.c_lflag &= ~(ICANON | ECHO);
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+  if (tcsetattr(in_fd, TCSANOW, &raw) < 0) return;
+
+  saved_fd = in_fd;
+  atexit(restore);
+  signal(SIGINT, restoreAndDie);
+  signal(SIGTERM, restoreAndDie);
+  signal(SIGHUP, restoreAndDie);
+}
+
+void HardwareSerial::end() {
+  restore();
+}
+
+const char *HardwareSerial::openPty() {
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (master < 0) return nullptr;
+  if (grantpt(master) < 0 || unlockpt(master) < 0) {
+    close(master);
+    return nullptr;
+  }
+  const char *name = ptsname(master);
+
+  // hold the far end open, so the port survives terminal programs coming
+  // and going; and make it raw, so plain tools like `cat` work too
+  int slave = name ? open(name, O_RDWR | O_NOCTTY) : -1;
+  if (slave < 0) {
+    close(master);
+    return nullptr;
+  }
+  struct termios raw;
+  if (tcgetattr(slave, &raw) == 0) {
+    cfmakeraw(&raw);
+    tcsetattr(slave, TCSANOW, &raw);
+  }
+
+  restore();
+  in_fd = out_fd = master;
+  pty_slave = slave;
+  f_eof = false;
+  in_head = in_tail = 0;
+  return name;
+}
+
+/*
+ * Read what the input has, waiting up to `wait` milliseconds if there is
+ * nothing yet. Returns the number of bytes read.
+ */
+size_t HardwareSerial::fill(int wait) {
+  if (f_eof) return 0;
+  if (in_tail == in_head) in_head = in_tail = 0;
+  if (in_head == sizeof(in)) return 0;
+
+  struct pollfd fd = {in_fd, POLLIN, 0};
+  if (poll(&fd, 1, wait) <= 0) return 0;
+
+  ssize_t count = ::read(in_fd, &in[in_head], sizeof(in) - in_head);
+  if (count > 0) {
+    in_head += count;
+    return count;
+  }
+  if (count == 0 || (errno != EINTR && errno != EAGAIN && errno != EIO)) {
+    f_eof = true;
+  }
+  return 0;
+}
+
+size_t HardwareSerial::write(uint8_t c) {
+  return write(&c, 1);
+}
+
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size) {
+  if (source) source->write(buffer, size);
+  size_t done = 0;
+  while (done < size) {
+    ssize_t count = ::write(out_fd, buffer + done, size - done);
+    if (count < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN) {
+        struct pollfd fd = {out_fd, POLLOUT, 0};
+        poll(&fd, 1, -1);
+        continue;
+      }
+      break;
+    }
+    done += count;
+  }
+  return done;
+}
+
+int HardwareSerial::availableForWrite() {
+  return PIPE_BUF;
+}
+
+void HardwareSerial::flush() {
+  if (isatty(out_fd)) tcdrain(out_fd);
+}
+
+int HardwareSerial::available() {
+  if (source) return source->available();
+  if (in_tail == in_head) fill(0);
+  if (in_tail == in_head && f_eof) return -1;
+  return in_head - in_tail;
+}
+
+int HardwareSerial::read() {
+  if (source) return source->read();
+  if (in_tail == in_head) fill(0);
+  if (in_tail == in_head) return -1;
+  return in[in_tail++];
+}
+
+int HardwareSerial::peek() {
+  if (source) return source->peek();
+  if (in_tail == in_head) fill(0);
+  if (in_tail == in_head) return -1;
+  return in[in_tail];
+}
+
+size_t HardwareSerial::readBytes(char *buffer, size_t length) {
+  if (source) {
+    source->setTimeout(_timeout);
+    return source->readBytes(buffer, length);
+  }
+  unsigned long start = millis();
+  size_t count = 0;
+  while (count < length) {
+    if (in_tail == in_head) {
+      unsigned long waited = millis() - start;
+      if (f_eof || waited >= _timeout) break;
+      fill(_timeout - waited);
+      continue;
+    }
+    size_t n = in_head - in_tail;
+    if (n > length - count) n = length - count;
+    memcpy(buffer + count, &in[in_tail], n);
+    in_tail += n;
+    count += n;
+  }
+  return count;
+}
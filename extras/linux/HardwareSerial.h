@@ -0,0 +1,107 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * A `Stream` on file descriptors, standing in for a serial port in the
+ * Linux runtime.
+ *
+ * `Serial` is standard input and output, or a pseudo-terminal if the
+ * program is started with `--pty`. On a terminal, line editing and echo
+ * are turned off, as the shell echoes input itself; Ctrl-C still ends the
+ * program. Once the input ends, as when it is a file or a pipe,
+ * `available()` returns -1, and a shell listening on it stops after running
+ * the lines it has.
+ *
+ * `feed` hands the input over to another stream, such as a `ReplayStream`,
+ * which then also sees the output.
+ */
+#ifndef TOYSHELL_HOST_HARDWARESERIAL_H
+#define TOYSHELL_HOST_HARDWARESERIAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Stream.h"
+
+#ifndef HOST_SERIAL_BUFFER
+#define HOST_SERIAL_BUFFER 4096
+#endif
+
+class HardwareSerial : public Stream {
+private:
+  int in_fd;
+  int out_fd;
+  int pty_slave = -1;
+  Stream *source = nullptr;
+  bool f_eof = false;
+  size_t in_head = 0;
+  size_t in_tail = 0;
+  uint8_t in[HOST_SERIAL_BUFFER];
+
+  size_t fill(int wait);
+public:
+  /**
+   * A stream reading from `inFd` and writing to `outFd`.
+   */
+  HardwareSerial(int inFd, int outFd) : in_fd(inFd), out_fd(outFd) {}
+  HardwareSerial(HardwareSerial &other) = delete;
+
+  /**
+   * Put a terminal into raw mode. The baud rate is ignored. Does nothing
+   * to files and pipes.
+   */
+  void begin(unsigned long baud = 115200);
+  void end();
+
+  /**
+   * Switch to a new pseudo-terminal, and return the name of the device to
+   * connect a terminal program to, such as `/dev/pts/3`. Returns
+   * `nullptr` on failure.
+   */
+  const char *openPty();
+
+  /**
+   * The file descriptor input comes from.
+   */
+  int inputFd() const { return in_fd; }
+
+  /**
+   * Take input from `source` instead, and copy output to it as well as to
+   * the output file descriptor.
+   */
+  void feed(Stream *source) { this->source = source; }
+
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t *buffer, size_t size) override;
+  int availableForWrite() override;
+  void flush() override;
+  int available() override;
+  int read() override;
+  int peek() override;
+  size_t readBytes(char *buffer, size_t length) override;
+  using Stream::readBytes;
+
+  operator bool() const { return true; }
+};
+
+extern HardwareSerial Serial;
+
+#endif
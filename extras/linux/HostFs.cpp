@@ -0,0 +1,150 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * A filesystem for the commands of `"ShellFiles.h"`, in a host directory.
+ *
+ * This is the implementation. See `"HostFs.h"` for documentation.
+ */
+#include "HostFs.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+static char root_path[PATH_MAX];
+
+/*
+ * Find where `path` is on the host. Returns false for paths leaving the
+ * root, or too long.
+ */
+static bool resolve(const char *path, char *out) {
+  for (const char *p = path; (p = strstr(p, "..")); p += 2) {
+    bool starts = p == path || p[-1] == '/';
+    bool ends = p[2] == '\0' || p[2] == '/';
+    if (starts && ends) return false;
+  }
+  while (*path == '/') path++;
+  int len = snprintf(out, PATH_MAX, "%s/%s", root_path, path);
+  return len > 0 && len < PATH_MAX;
+}
+
+// handles are file descriptors plus one, so none is `nullptr`
+static int fdOf(void *file) {
+  return (int)(intptr_t)file - 1;
+}
+
+static void *hostOpen(const char *path, bool write) {
+  char full[PATH_MAX];
+  if (!resolve(path, full)) return nullptr;
+  int flags = write ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY;
+  int fd = ::open(full, flags | O_CLOEXEC, 0644);
+  if (fd < 0) return nullptr;
+  struct stat info;
+  if (fstat(fd, &info) < 0 || S_ISDIR(info.st_mode)) {
+    ::close(fd);
+    return nullptr;
+  }
+  return (void *)(intptr_t)(fd + 1);
+}
+
+static long hostRead(void *file, void *buffer, size_t size) {
+  ssize_t count;
+  do {
+    count = ::read(fdOf(file), buffer, size);
+  } while (count < 0 && errno == EINTR);
+  return count;
+}
+
+static long hostWrite(void *file, const void *buffer, size_t size) {
+  size_t done = 0;
+  while (done < size) {
+    ssize_t count = ::write(fdOf(file), (const char *)buffer + done,
+                            size - done);
+    if (count < 0 && errno == EINTR) continue;
+    if (count < 0) return -1;
+    done += count;
+  }
+  return done;
+}
+
+static long hostSize(void *file) {
+  struct stat info;
+  if (fstat(fdOf(file), &info) < 0) return -1;
+  return info.st_size;
+}
+
+static void hostClose(void *file) {
+  ::close(fdOf(file));
+}
+
+static bool hostList(const char *path,
+                 void (*each)(void *arg, const char *name, size_t size,
+                              bool dir),
+                 void *arg) {
+  char full[PATH_MAX];
+  if (!resolve(path, full)) return false;
+  DIR *dir = opendir(full);
+  if (!dir) return false;
+  while (struct dirent *entry = readdir(dir)) {
+    if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) continue;
+    struct stat info;
+    if (fstatat(dirfd(dir), entry->d_name, &info, 0) < 0) continue;
+    each(arg, entry->d_name, info.st_size, S_ISDIR(info.st_mode));
+  }
+  closedir(dir);
+  return true;
+}
+
+static bool hostRemove(const char *path) {
+  char full[PATH_MAX];
+  return resolve(path, full) && unlink(full) == 0;
+}
+
+static bool hostUsage(uint64_t *total, uint64_t *used) {
+  struct statvfs info;
+  if (statvfs(root_path, &info) < 0) return false;
+  *total = (uint64_t)info.f_blocks * info.f_frsize;
+  *used = (uint64_t)(info.f_blocks - info.f_bfree) * info.f_frsize;
+  return true;
+}
+
+static const ShellFs host = {
+    hostOpen, hostRead, hostWrite, hostSize,
+    hostClose, hostList, hostRemove, hostUsage,
+};
+
+const ShellFs *hostFs(const char *root) {
+  struct stat info;
+  if (stat(root, &info) < 0 || !S_ISDIR(info.st_mode)) return nullptr;
+  if (snprintf(root_path, sizeof(root_path), "%s", root) >=
+      (int)sizeof(root_path)) {
+    return nullptr;
+  }
+  return &host;
+}
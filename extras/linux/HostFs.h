@@ -0,0 +1,42 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * A filesystem for the commands of `"ShellFiles.h"`, keeping its files in
+ * a directory of the host, in place of the flash of a board.
+ *
+ * Paths are taken from `root`, so `/logs/today.txt` is the host's
+ * `root/logs/today.txt`; paths going up with `..` are refused. `df`
+ * reports the filesystem the directory is on.
+ *
+ * The runtime hands one to the shell with `--fs DIR`.
+ */
+#ifndef TOYSHELL_LINUX_HOSTFS_H
+#define TOYSHELL_LINUX_HOSTFS_H
+
+#include "ShellFiles.h"
+
+/**
+ * The filesystem rooted at `root`, or `nullptr` if it is not a directory.
+ */
+const ShellFs *hostFs(const char *root);
+
+#endif
@@ -0,0 +1,267 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Playing back a recording made with `RecordStream`.
+ *
+ * This is the implementation. See `"ReplayStream.h"` for documentation.
+ */
+#include "ReplayStream.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "Arduino.h"
+
+static const char PROMPT[] = "shell> ";
+
+static bool getVarint(const uint8_t *&p, const uint8_t *end,
+                      unsigned long &value) {
+  value = 0;
+  for (unsigned shift = 0; p < end && shift < 64; shift += 7) {
+    uint8_t b = *p++;
+    value |= (unsigned long)(b & 0x7f) << shift;
+    if (!(b & 0x80)) return true;
+  }
+  return false;
+}
+
+static int cmpLatency(const void *a, const void *b) {
+  unsigned long x = *(const unsigned long *)a;
+  unsigned long y = *(const unsigned long *)b;
+  return (x > y) - (x < y);
+}
+
+ReplayStream::~ReplayStream() {
+  free(data);
+  free(chunks);
+  free(lines);
+  free(latencies);
+}
+
+bool ReplayStream::open(const char *path, double speed) {
+  FILE *file = fopen(path, "rb");
+  if (!file) return false;
+  size_t size = 0, capacity = 4096;
+  uint8_t *raw = (uint8_t *)malloc(capacity);
+  while (raw) {
+    size += fread(raw + size, 1, capacity - size, file);
+    if (size < capacity) break;
+    capacity *= 2;
+    uint8_t *bigger = (uint8_t *)realloc(raw, capacity);
+    if (!bigger) free(raw);
+    raw = bigger;
+  }
+  bool failed = !raw || ferror(file);
+  fclose(file);
+  if (failed) {
+    errno = raw ? EIO : ENOMEM;
+    free(raw);
+    return false;
+  }
+
+  // a chunk takes at least two bytes, so there are at most half as many
+  // chunks as bytes, and no more data than bytes
+  free(data);
+  free(chunks);
+  data = (uint8_t *)malloc(size + 1);
+  chunks = (Chunk *)malloc((size / 2 + 1) * sizeof(Chunk));
+  chunk_count = 0;
+  bool valid = data && chunks && size >= 4 && !memcmp(raw, "TSR1", 4);
+
+  const uint8_t *p = raw + 4, *end = raw + size;
+  size_t used = 0;
+  double at = 0;
+  while (valid && p < end) {
+    unsigned long gap, len;
+    if (!getVarint(p, end, gap) || !getVarint(p, end, len) ||
+        len > (size_t)(end - p)) {
+      valid = false;
+      break;
+    }
+    at += speed > 0 ? gap / speed : 0;
+    memcpy(&data[used], p, len);
+    p += len;
+    used += len;
+    chunks[chunk_count++] = {(unsigned long)at, used};
+  }
+  free(raw);
+  if (!valid) {
+    errno = data && chunks ? EINVAL : ENOMEM;
+    return false;
+  }
+
+  // find the command lines
+  free(lines);
+  free(latencies);
+  line_count = 0;
+  for (size_t i = 0; i < used; i++)
+    line_count += data[i] == '\n';
+  lines = (Line *)malloc((line_count + 1) * sizeof(Line));
+  latencies = (unsigned long *)malloc((line_count + 1) * sizeof(*latencies));
+  if (!lines || !latencies) {
+    errno = ENOMEM;
+    return false;
+  }
+  size_t n = 0, from = 0, chunk = 0;
+  for (size_t i = 0; i < used; i++) {
+    while (chunks[chunk].end <= i)
+      chunk++;
+    if (data[i] != '\n') continue;
+    lines[n++] = {from, i, chunk};
+    from = i + 1;
+  }
+
+  f_started = false;
+  due = cursor = answered = matched = 0;
+  f_greeted = false;
+  return true;
+}
+
+/*
+ * Bring in the chunks whose time has come, and return the offset just past
+ * the last byte that has arrived. Called with `lock` held.
+ */
+size_t ReplayStream::arrived() {
+  unsigned long now = micros();
+  if (!f_started) {
+    start = now;
+    f_started = true;
+  }
+  while (due < chunk_count && chunks[due].at <= now - start)
+    due++;
+  return due > 0 ? chunks[due - 1].end : 0;
+}
+
+/*
+ * The shell has prompted again: the oldest outstanding line is done.
+ * Called with `lock` held.
+ */
+void ReplayStream::answer(unsigned long now) {
+  if (!f_greeted) {
+    f_greeted = true;
+    return;
+  }
+  if (answered >= line_count || lines[answered].chunk >= due) return;
+
+  const Line &line = lines[answered];
+  unsigned long latency = now - start - chunks[line.chunk].at;
+  latencies[answered++] = latency;
+  if (!report) return;
+  int len = line.end - line.start;
+  if (len > 0 && data[line.end - 1] == '\r') len--;
+  fprintf(report, "replay: %8.3f ms  %.*s\n", latency / 1000.0, len,
+          (const char *)&data[line.start]);
+}
+
+void ReplayStream::summary() {
+  if (!report) return;
+  pthread_mutex_lock(&lock);
+  size_t n = answered;
+  if (n == 0) {
+    fprintf(report, "replay: no command lines answered\n");
+  } else {
+    qsort(latencies, n, sizeof(*latencies), cmpLatency);
+    fprintf(report,
+            "replay: %zu of %zu lines; median %.3f ms, 99th percentile "
+            "%.3f ms, slowest %.3f ms\n",
+            n, line_count, latencies[n / 2] / 1000.0,
+            latencies[(n * 99) / 100] / 1000.0, latencies[n - 1] / 1000.0);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+size_t ReplayStream::write(uint8_t c) {
+  return write(&c, 1);
+}
+
+size_t ReplayStream::write(const uint8_t *buffer, size_t size) {
+  unsigned long now = micros();
+  pthread_mutex_lock(&lock);
+  for (size_t i = 0; i < size; i++) {
+    if (buffer[i] == (uint8_t)PROMPT[matched]) {
+      matched++;
+    } else {
+      matched = buffer[i] == (uint8_t)PROMPT[0];
+    }
+    if (matched == sizeof(PROMPT) - 1) {
+      matched = 0;
+      answer(now);
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  return size;
+}
+
+int ReplayStream::available() {
+  pthread_mutex_lock(&lock);
+  size_t end = arrived();
+  int count = end - cursor;
+  if (count == 0 && due == chunk_count) count = -1;
+  pthread_mutex_unlock(&lock);
+  return count;
+}
+
+int ReplayStream::read() {
+  pthread_mutex_lock(&lock);
+  int c = cursor < arrived() ? data[cursor++] : -1;
+  pthread_mutex_unlock(&lock);
+  return c;
+}
+
+int ReplayStream::peek() {
+  pthread_mutex_lock(&lock);
+  int c = cursor < arrived() ? data[cursor] : -1;
+  pthread_mutex_unlock(&lock);
+  return c;
+}
+
+size_t ReplayStream::readBytes(char *buffer, size_t length) {
+  unsigned long deadline = micros() + _timeout * 1000;
+  size_t count = 0;
+  pthread_mutex_lock(&lock);
+  while (count < length) {
+    size_t end = arrived();
+    if (cursor < end) {
+      size_t n = end - cursor;
+      if (n > length - count) n = length - count;
+      memcpy(buffer + count, &data[cursor], n);
+      cursor += n;
+      count += n;
+      continue;
+    }
+
+    // sleep until the next chunk or the timeout, whichever comes first
+    unsigned long now = micros();
+    if (due == chunk_count || (long)(deadline - now) <= 0) break;
+    unsigned long wait = deadline - now;
+    unsigned long next = start + chunks[due].at - now;
+    if ((long)next <= 0) continue;
+    if (next < wait) wait = next;
+    pthread_mutex_unlock(&lock);
+    usleep(wait);
+    pthread_mutex_lock(&lock);
+  }
+  pthread_mutex_unlock(&lock);
+  return count;
+}
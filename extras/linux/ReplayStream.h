@@ -0,0 +1,114 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Playing back a recording made with `RecordStream` (see
+ * `"ShellRecord.h"`), as the input of a shell in the Linux runtime.
+ *
+ * Bytes become available when they were recorded to have arrived, counting
+ * from the first time the shell looks; `speed` shrinks or stretches the
+ * gaps, and with a speed of 0 everything is there at once. Once the
+ * recording runs out, `available()` returns -1, and the shell stops after
+ * running the lines it has.
+ *
+ * What the shell writes is watched for its prompt. The first prompt is
+ * the shell starting; each later one ends the oldest command line that
+ * has arrived and not been answered yet. The time from the line's newline
+ * arriving to the prompt coming back, queueing behind earlier lines
+ * included, is reported as it happens:
+ *
+ *     replay:    0.212 ms  vars set x 1
+ *
+ * The runtime plays a recording into `Serial` with `--replay`.
+ */
+#ifndef TOYSHELL_HOST_REPLAYSTREAM_H
+#define TOYSHELL_HOST_REPLAYSTREAM_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "Stream.h"
+
+class ReplayStream : public Stream {
+private:
+  struct Chunk {
+    unsigned long at; // microseconds after the start, already scaled
+    size_t end;       // offset in `data` just past the chunk
+  };
+  struct Line {
+    size_t start;
+    size_t end; // offset of the newline
+    size_t chunk;
+  };
+
+  pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  FILE *report = nullptr;
+  uint8_t *data = nullptr;
+  Chunk *chunks = nullptr;
+  size_t chunk_count = 0;
+  Line *lines = nullptr;
+  size_t line_count = 0;
+
+  bool f_started = false;
+  unsigned long start = 0;
+  size_t due = 0;       // chunks that have arrived
+  size_t cursor = 0;    // offset of the next byte to read
+  size_t answered = 0;  // lines the shell has prompted after
+  bool f_greeted = false;
+  size_t matched = 0;   // bytes of the prompt seen so far
+  unsigned long *latencies = nullptr;
+
+  size_t arrived();
+  void answer(unsigned long now);
+public:
+  ReplayStream() {}
+  ReplayStream(ReplayStream &other) = delete;
+  ~ReplayStream();
+
+  /**
+   * Load the recording at `path`, to be played at `speed` times the
+   * original pace. Returns false, with `errno` set, if it cannot be read,
+   * or with `errno` set to `EINVAL` if it is not a recording.
+   */
+  bool open(const char *path, double speed = 1);
+
+  /**
+   * Report latencies to `out`, or nowhere if it is `nullptr`.
+   */
+  void setReport(FILE *out) { report = out; }
+
+  /**
+   * Report how many lines were answered and the spread of their latencies.
+   */
+  void summary();
+
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t *buffer, size_t size) override;
+  int available() override;
+  int read() override;
+  int peek() override;
+  size_t readBytes(char *buffer, size_t length) override;
+  using Stream::readBytes;
+};
+
+#endif
@@ -0,0 +1,330 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * A simulated serial link.
+ *
+ * This is the implementation. See `"SerialLink.h"` for documentation.
+ */
+#include "SerialLink.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "Arduino.h"
+
+bool SerialLink::Ring::allocate(bool timed) {
+  data = (uint8_t *)malloc(size);
+  if (timed) at = (double *)malloc(size * sizeof(*at));
+  return data && (!timed || at);
+}
+
+void SerialLink::Ring::push(uint8_t c, double when) {
+  size_t i = (head + count++) % size;
+  data[i] = c;
+  if (at) at[i] = when;
+}
+
+uint8_t SerialLink::Ring::pop() {
+  uint8_t c = data[head];
+  head = (head + 1) % size;
+  count--;
+  return c;
+}
+
+SerialLink::SerialLink(Stream &far) : far(&far) {
+  fifo.size = 128;
+  buffer.size = 256;
+  tx.size = 128;
+  irq_at = idle_at = INFINITY;
+}
+
+SerialLink::~SerialLink() {
+  free(fifo.data);
+  free(buffer.data);
+  free(tx.data);
+  free(tx.at);
+}
+
+bool SerialLink::configure(const char *options) {
+  while (*options) {
+    const char *equals = strchr(options, '=');
+    if (!equals) return false;
+    size_t len = equals - options;
+    char *end;
+    double value = strtod(equals + 1, &end);
+    if (end == equals + 1 || (*end && *end != ',') || value < 0) return false;
+
+    // sizes and counts must be whole and at least 1
+    bool whole = value >= 1 && value == floor(value);
+    if (len == 4 && !strncmp(options, "baud", len) && whole) {
+      baud = value;
+    } else if (len == 4 && !strncmp(options, "bits", len) && whole) {
+      bits = value;
+    } else if (len == 4 && !strncmp(options, "fifo", len) && whole) {
+      fifo.size = value;
+    } else if (len == 9 && !strncmp(options, "threshold", len) && whole) {
+      threshold = value;
+    } else if (len == 7 && !strncmp(options, "timeout", len) && whole) {
+      timeout = value;
+    } else if (len == 7 && !strncmp(options, "latency", len)) {
+      latency = value;
+    } else if (len == 6 && !strncmp(options, "buffer", len) && whole) {
+      buffer.size = value;
+    } else if (len == 2 && !strncmp(options, "tx", len) && whole) {
+      tx.size = value;
+    } else if (len == 3 && !strncmp(options, "ber", len) && value <= 1) {
+      ber = value;
+    } else if (len == 4 && !strncmp(options, "seed", len) && whole) {
+      random = value;
+    } else {
+      return false;
+    }
+    options = *end ? end + 1 : end;
+  }
+  return true;
+}
+
+void SerialLink::start() {
+  if (!fifo.allocate(false) || !buffer.allocate(false) || !tx.allocate(true)) {
+    perror("SerialLink");
+    abort();
+  }
+  char_time = 1e6 * bits / baud;
+  origin = micros();
+  f_started = true;
+}
+
+/*
+ * Microseconds since the link was first used.
+ */
+double SerialLink::now() {
+  if (!f_started) start();
+  return micros() - origin;
+}
+
+/*
+ * The time of the next event on the receiving side.
+ */
+double SerialLink::next() {
+  double t = flight >= 0 ? flight_at : INFINITY;
+  if (irq_at < t) t = irq_at;
+  if (idle_at < t) t = idle_at;
+  return t;
+}
+
+uint8_t SerialLink::corrupt(uint8_t c) {
+  if (ber == 0) return c;
+  uint8_t flips = 0;
+  for (int i = 0; i < 8; i++) {
+    // xorshift64
+    random ^= random << 13;
+    random ^= random >> 7;
+    random ^= random << 17;
+    if ((random >> 11) * 0x1.0p-53 < ber) flips |= 1 << i;
+  }
+  if (flips) corrupted++;
+  return c ^ flips;
+}
+
+/*
+ * A byte lands in the receive FIFO at time `at`.
+ */
+void SerialLink::arrive(uint8_t c, double at) {
+  received++;
+  // flip bits whether or not the byte is kept, so the errors a seed gives
+  // do not depend on when the reader comes by
+  c = corrupt(c);
+  if (fifo.count == fifo.size) {
+    overruns++;
+  } else {
+    fifo.push(c);
+  }
+  if (fifo.count >= threshold && isinf(irq_at)) irq_at = at + latency;
+  idle_at = at + timeout * char_time;
+}
+
+/*
+ * The interrupt handler moves what the driver's buffer has room for.
+ */
+void SerialLink::interrupt() {
+  interrupts++;
+  irq_at = INFINITY;
+  while (fifo.count > 0 && buffer.count < buffer.size)
+    buffer.push(fifo.pop());
+  f_held = fifo.count > 0;
+}
+
+/*
+ * Play events up to time `until`. Called with `lock` held.
+ */
+void SerialLink::advance(double until) {
+  for (;;) {
+    // the far end sends as soon as it has something and the wire is free
+    if (flight < 0 && !f_far_eof) {
+      int ready = far->available();
+      if (ready < 0) {
+        f_far_eof = true;
+      } else if (ready > 0) {
+        flight = far->read();
+        flight_at = fmax(rx_free, polled) + char_time;
+      }
+    }
+
+    double t = next();
+    if (t > until) break;
+    if (flight >= 0 && t == flight_at) {
+      arrive(flight, t);
+      flight = -1;
+      rx_free = t;
+    } else if (t == irq_at) {
+      interrupt();
+    } else {
+      idle_at = INFINITY;
+      if (fifo.count > 0 && isinf(irq_at)) irq_at = t + latency;
+    }
+  }
+  polled = until;
+
+  // hand over what has gone out on the wire
+  while (tx.count > 0 && tx.at[tx.head] <= until) {
+    size_t run = 0;
+    while (run < tx.count && run < tx.size - tx.head &&
+           tx.at[tx.head + run] <= until)
+      run++;
+    far->write(&tx.data[tx.head], run);
+    tx.head = (tx.head + run) % tx.size;
+    tx.count -= run;
+  }
+}
+
+void SerialLink::summary(FILE *out) {
+  pthread_mutex_lock(&lock);
+  fprintf(out,
+          "link: %lu bytes in, %lu out; %lu overruns, %lu corrupted, "
+          "%lu interrupts\n",
+          received, sent, overruns, corrupted, interrupts);
+  pthread_mutex_unlock(&lock);
+}
+
+size_t SerialLink::write(uint8_t c) {
+  return write(&c, 1);
+}
+
+size_t SerialLink::write(const uint8_t *data, size_t size) {
+  pthread_mutex_lock(&lock);
+  for (size_t i = 0; i < size; i++) {
+    double t = now();
+    advance(t);
+    while (tx.count == tx.size) {
+      // wait for the oldest byte to go
+      double wait = tx.at[tx.head] - t;
+      pthread_mutex_unlock(&lock);
+      usleep(wait > 1 ? wait : 1);
+      pthread_mutex_lock(&lock);
+      t = now();
+      advance(t);
+    }
+    tx_free = fmax(tx_free, t) + char_time;
+    tx.push(data[i], tx_free);
+    sent++;
+  }
+  pthread_mutex_unlock(&lock);
+  return size;
+}
+
+int SerialLink::availableForWrite() {
+  pthread_mutex_lock(&lock);
+  int room = tx.size - tx.count;
+  pthread_mutex_unlock(&lock);
+  return room;
+}
+
+void SerialLink::flush() {
+  pthread_mutex_lock(&lock);
+  for (;;) {
+    double t = now();
+    advance(t);
+    if (tx.count == 0) break;
+    pthread_mutex_unlock(&lock);
+    usleep(tx_free - t > 1 ? tx_free - t : 1);
+    pthread_mutex_lock(&lock);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+int SerialLink::available() {
+  pthread_mutex_lock(&lock);
+  advance(now());
+  int count = buffer.count;
+  if (count == 0 && f_far_eof && flight < 0 && fifo.count == 0) count = -1;
+  pthread_mutex_unlock(&lock);
+  return count;
+}
+
+int SerialLink::read() {
+  char c;
+  size_t timeout = _timeout;
+  _timeout = 0;
+  size_t count = readBytes(&c, 1);
+  _timeout = timeout;
+  return count ? (uint8_t)c : -1;
+}
+
+int SerialLink::peek() {
+  pthread_mutex_lock(&lock);
+  advance(now());
+  int c = buffer.count > 0 ? buffer.data[buffer.head] : -1;
+  pthread_mutex_unlock(&lock);
+  return c;
+}
+
+size_t SerialLink::readBytes(char *data, size_t length) {
+  pthread_mutex_lock(&lock);
+  double t = now();
+  double deadline = t + _timeout * 1000.0;
+  size_t count = 0;
+  for (;;) {
+    advance(t);
+    while (count < length && buffer.count > 0)
+      data[count++] = buffer.pop();
+    // a handler held off by a full buffer runs again once there is room
+    if (f_held && count > 0 && isinf(irq_at)) {
+      f_held = false;
+      irq_at = t + latency;
+    }
+
+    if (count == length || t >= deadline) break;
+    if (f_far_eof && flight < 0 && fifo.count == 0) break;
+
+    // sleep until the next event, checking back on an idle far end
+    double wait = fmin(next(), deadline) - t;
+    if (flight < 0 && wait > 1000) wait = 1000;
+    pthread_mutex_unlock(&lock);
+    usleep(wait > 1 ? wait : 1);
+    pthread_mutex_lock(&lock);
+    t = now();
+  }
+  pthread_mutex_unlock(&lock);
+  return count;
+}
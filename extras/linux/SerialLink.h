@@ -0,0 +1,155 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * A simulated serial link, for measuring what the shell would see on a
+ * real UART.
+ *
+ * The far end writes into a `SerialLink` as fast as it likes; the link
+ * passes each byte over the wire one character time after the last, into
+ * a receive FIFO. When the FIFO fills to a threshold, or the line has been
+ * idle for a few character times, an interrupt fires after some latency
+ * and moves the FIFO into the driver's buffer, which is what `available()`
+ * and `read()` see. A byte arriving at a full FIFO is lost, as an overrun;
+ * each data bit may be flipped at a given bit error rate. Output goes the
+ * other way through a transmit buffer drained at the baud rate, and
+ * `write` waits for room as a UART driver would.
+ *
+ * Events are computed in virtual time, to the fraction of a microsecond,
+ * from the baud rate and the settings below; the runtime's clock only
+ * decides which of them have happened yet.
+ *
+ * The runtime puts a link in front of `Serial` with `--link`, taking
+ * settings as a comma-separated list:
+ *
+ *     build/demo --replay session.tsr --speed 0 --link baud=9600,latency=50
+ *
+ *   - `baud`: bits per second (115200)
+ *   - `bits`: bits per character, start and stop bits included (10)
+ *   - `fifo`: depth of the receive FIFO (128)
+ *   - `threshold`: FIFO level that raises an interrupt (120)
+ *   - `timeout`: idle character times that raise an interrupt (10)
+ *   - `latency`: microseconds from an interrupt to its handler (20)
+ *   - `buffer`: size of the driver's receive buffer (256)
+ *   - `tx`: size of the transmit buffer and FIFO together (128)
+ *   - `ber`: chance of each data bit being flipped (0)
+ *   - `seed`: seed for the bit errors (1)
+ *
+ * The defaults are those of an ESP32 UART under the Arduino core. Building
+ * with `CXXFLAGS=-DSHELL_READ_AHEAD=0` compares the shell's input
+ * strategies over the same link.
+ */
+#ifndef TOYSHELL_HOST_SERIALLINK_H
+#define TOYSHELL_HOST_SERIALLINK_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "Stream.h"
+
+class SerialLink : public Stream {
+private:
+  // a ring of bytes, with the time each one leaves for transmit
+  struct Ring {
+    uint8_t *data = nullptr;
+    double *at = nullptr;
+    size_t size = 0;
+    size_t head = 0;
+    size_t count = 0;
+
+    bool allocate(bool timed);
+    void push(uint8_t c, double when = 0);
+    uint8_t pop();
+  };
+
+  pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  Stream *far;
+
+  unsigned long baud = 115200;
+  unsigned bits = 10;
+  unsigned threshold = 120;
+  unsigned timeout = 10;
+  unsigned long latency = 20;
+  double ber = 0;
+  uint64_t random = 1;
+  double char_time = 0;
+
+  Ring fifo, buffer, tx;
+  bool f_started = false;
+  bool f_far_eof = false;
+  bool f_held = false;  // the last handler found the buffer full
+  unsigned long origin = 0;
+  double polled = 0;    // when the far end was last checked
+  int flight = -1;      // the byte on the wire
+  double flight_at = 0; // when it lands in the FIFO
+  double rx_free = 0;   // when the wire is free for the next byte
+  double irq_at;        // when the pending interrupt is handled
+  double idle_at;       // when the line counts as idle
+  double tx_free = 0;   // when the transmitter catches up
+
+  unsigned long received = 0;
+  unsigned long sent = 0;
+  unsigned long overruns = 0;
+  unsigned long corrupted = 0;
+  unsigned long interrupts = 0;
+
+  void start();
+  double now();
+  void advance(double until);
+  void arrive(uint8_t c, double at);
+  void interrupt();
+  uint8_t corrupt(uint8_t c);
+  double next();
+public:
+  /**
+   * A link carrying what `far` sends to the shell, and the shell's output
+   * back to `far`.
+   */
+  SerialLink(Stream &far);
+  SerialLink(SerialLink &other) = delete;
+  ~SerialLink();
+
+  /**
+   * Apply settings like `baud=9600,fifo=16`, before the link is first
+   * used. Returns false at the first setting it does not know or whose
+   * value is out of range; those before it are applied.
+   */
+  bool configure(const char *options);
+
+  /**
+   * Print what went over the link to `out`.
+   */
+  void summary(FILE *out);
+
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t *buffer, size_t size) override;
+  int availableForWrite() override;
+  void flush() override;
+  int available() override;
+  int read() override;
+  int peek() override;
+  size_t readBytes(char *buffer, size_t length) override;
+  using Stream::readBytes;
+};
+
+#endif
@@ -0,0 +1,147 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * `Print` and `Stream` for the Linux runtime.
+ */
+#include "Stream.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "Arduino.h"
+
+size_t Print::write(const uint8_t *buffer, size_t size) {
+  size_t n = 0;
+  while (n < size && write(buffer[n])) n += 1;
+  return n;
+}
+
+size_t Print::printf(const char *format, ...) {
+  char small[128];
+  va_list ap;
+  va_start(ap, format);
+  int len = vsnprintf(small, sizeof(small), format, ap);
+  va_end(ap);
+  if (len < 0) return 0;
+  if ((size_t)len < sizeof(small)) return write(small, len);
+
+  char *large = (char *)malloc(len + 1);
+  if (!large) return 0;
+  va_start(ap, format);
+  vsnprintf(large, len + 1, format, ap);
+  va_end(ap);
+  size_t n = write(large, len);
+  free(large);
+  return n;
+}
+
+size_t Print::printNumber(unsigned long long n, int base) {
+  char buffer[8 * sizeof(n) + 1];
+  char *p = &buffer[sizeof(buffer)];
+  if (base < 2) base = 10;
+  do {
+    int digit = n % base;
+    *--p = digit < 10 ? '0' + digit : 'A' + digit - 10;
+    n /= base;
+  } while (n);
+  return write(p, &buffer[sizeof(buffer)] - p);
+}
+
+size_t Print::printNumber(unsigned long n, int base) {
+  return printNumber((unsigned long long)n, base);
+}
+
+size_t Print::print(unsigned char n, int base) {
+  return printNumber((unsigned long)n, base);
+}
+
+size_t Print::print(int n, int base) {
+  return print((long)n, base);
+}
+
+size_t Print::print(unsigned int n, int base) {
+  return printNumber((unsigned long)n, base);
+}
+
+size_t Print::print(long n, int base) {
+  return print((long long)n, base);
+}
+
+size_t Print::print(unsigned long n, int base) {
+  return printNumber(n, base);
+}
+
+size_t Print::print(long long n, int base) {
+  if (base == 10 && n < 0) {
+    return print('-') + printNumber(0ull - (unsigned long long)n, 10);
+  }
+  return printNumber((unsigned long long)n, base);
+}
+
+size_t Print::print(unsigned long long n, int base) {
+  return printNumber(n, base);
+}
+
+size_t Print::print(double n, int digits) {
+  return printf("%.*f", digits, n);
+}
+
+int Stream::timedRead() {
+  unsigned long start = millis();
+  do {
+    int c = read();
+    if (c >= 0) return c;
+    delay(1);
+  } while (millis() - start < _timeout);
+  return -1;
+}
+
+int Stream::timedPeek() {
+  unsigned long start = millis();
+  do {
+    int c = peek();
+    if (c >= 0) return c;
+    delay(1);
+  } while (millis() - start < _timeout);
+  return -1;
+}
+
+size_t Stream::readBytes(char *buffer, size_t length) {
+  size_t count = 0;
+  while (count < length) {
+    int c = timedRead();
+    if (c < 0) break;
+    buffer[count++] = (char)c;
+  }
+  return count;
+}
+
+size_t Stream::readBytesUntil(char terminator, char *buffer, size_t length) {
+  size_t count = 0;
+  while (count < length) {
+    int c = timedRead();
+    if (c < 0 || c == terminator) break;
+    buffer[count++] = (char)c;
+  }
+  return count;
+}
@@ -0,0 +1,182 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * A sketch to try the Linux runtime with. It is written as for a board,
+ * and built unchanged:
+ *
+ *     make && build/demo
+ *     build/demo < script.txt
+ *     build/demo --pty
+ *     build/demo --fs some/directory
+ */
+#include <Arduino.h>
+
+#include "ShellCoroutine.h"
+#include "ShellFiles.h"
+#include "ShellHeap.h"
+#include "ShellParallel.h"
+#include "ShellScheduler.h"
+#include "ShellScript.h"
+#include "ShellVars.h"
+#include "ShellWriter.h"
+#include "ToyShell.h"
+
+static int gain = 3;
+static bool led;
+
+static int cmdEcho(int argc, const char *const *argv, Stream *serial) {
+  for (int i = 1; i < argc; i++) {
+    serial->print(argv[i]);
+    serial->print(i + 1 < argc ? ' ' : '\n');
+  }
+  return 0;
+}
+
+static int cmdUptime(int argc, const char *const *argv, Stream *serial) {
+  serial->printf("%lu ms\n", millis());
+  return 0;
+}
+
+static ShellTask cmdBlink(int argc, const char *const *argv,
+                          Stream *serial) {
+  int times = argc > 1 ? atoi(argv[1]) : 10;
+  unsigned long ms = argc > 2 ? strtoul(argv[2], nullptr, 0) : 500;
+  for (int i = 0; i < times; i++) {
+    led = !led;
+    co_await shellDelay(ms);
+  }
+  serial->printf("blink: Done\n");
+  co_return 0;
+}
+
+static int cmdSieve(int argc, const char *const *argv, Stream *serial) {
+  // more than the shell's own stack could spare
+  bool composite[6000] = {};
+  int count = 0;
+  for (int i = 2; i < 6000; i++) {
+    if (composite[i]) continue;
+    count++;
+    for (int j = i * i; j < 6000; j += i) composite[j] = true;
+  }
+  serial->printf("sieve: %d primes below 6000\n", count);
+  return 0;
+}
+
+static int cmdSpin(int argc, const char *const *argv, Stream *serial) {
+  unsigned long ms = argc > 1 ? strtoul(argv[1], nullptr, 0) : 100;
+  unsigned long start = millis();
+  unsigned long rounds = 0;
+  while (millis() - start < ms && !Shell::cancelled()) rounds++;
+  serial->printf("spin: %lu rounds in %lu ms\n", rounds, millis() - start);
+  return 0;
+}
+
+static int cmdStatus(int argc, const char *const *argv, Stream *serial) {
+  int count = argc > 1 ? atoi(argv[1]) : 2;
+  ShellWriter out(serial);
+  out.beginRecord();
+  out.field("uptime", millis());
+  out.field("gain", gain);
+  out.field("led", led);
+  out.field("scratch", (unsigned long)Shell::current()->scratchPeak());
+  out.beginArray("channels");
+  for (int i = 0; i < count; i++) {
+    out.beginRecord();
+    out.field("id", i);
+    out.field("name", i % 2 ? "temp \"b\"" : "adc");
+    out.field("value", 0.25 * i - 1);
+    out.beginArray("samples");
+    for (int j = 0; j < 3; j++) out.value(i * 100 + j);
+    out.endArray();
+    out.endRecord();
+  }
+  out.endArray();
+  out.endRecord();
+  return 0;
+}
+
+static int cmdStop(int argc, const char *const *argv, Stream *serial) {
+  led = false;
+  serial->print("stop: LED off\n");
+  return 0;
+}
+
+static int cmdVersion(int argc, const char *const *argv, Stream *serial) {
+  serial->printf("demo for ToyShell, built %s %s\n", __DATE__, __TIME__);
+  return 0;
+}
+
+static int cmdHelp(int argc, const char *const *argv, Stream *serial);
+
+constexpr Command commands[] = {
+    {"after", cmdAfter},
+    {"blink", shellCoroutine<cmdBlink>},
+    {"cancel", cmdCancel},
+    {"cat", cmdCat},
+    {"cp", cmdCp},
+    {"df", cmdDf},
+    {"echo", cmdEcho},
+    {"every", cmdEvery},
+    {"format", cmdFormat},
+    {"get", cmdGet},
+    {"heap", cmdHeap},
+    {"help", cmdHelp},
+    {"hexdump", cmdHexdump},
+    {"jobs", cmdJobs},
+    {"kill", cmdKill},
+    {"ls", cmdLs},
+    {"parallel", cmdParallel},
+    {"ps", cmdPs},
+    {"rm", cmdRm},
+    {"script", cmdScript},
+    {"set", cmdSet},
+    {"sieve", cmdSieve, SHELL_LARGE_STACK},
+    {"spin", cmdSpin},
+    {"status", cmdStatus},
+    {"stop", cmdStop, SHELL_URGENT | SHELL_CANCEL},
+    {"uptime", cmdUptime},
+    {"version", cmdVersion, SHELL_IDEMPOTENT},
+    {"watch", cmdWatch},
+};
+static_assert(shellSorted(commands), "commands must be sorted");
+
+constexpr Variable variables[] = {
+    shellVar("gain", &gain, 0, 10),
+    shellVar("led", &led),
+};
+static_assert(shellSorted(variables), "variables must be sorted");
+
+static Shell shell(commands, sizeof(commands) / sizeof(Command));
+
+static int cmdHelp(int argc, const char *const *argv, Stream *serial) {
+  for (const Command &command : commands) {
+    serial->print(command.name);
+    serial->print('\n');
+  }
+  return 0;
+}
+
+void setup() {
+  Serial.begin(115200);
+  shellVariables(variables, sizeof(variables) / sizeof(Variable));
+  shell.begin(Serial);
+}
@@ -0,0 +1,132 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * The entry point of the Linux runtime.
+ *
+ * The program takes these options:
+ *
+ *   - `--pty` puts `Serial` on a new pseudo-terminal instead of standard
+ *     input and output, and prints its name on standard error.
+ *   - `--replay FILE` feeds `Serial` from a recording made with
+ *     `RecordStream`, reporting the latency of each command line on
+ *     standard error, and a summary at the end.
+ *   - `--speed N` plays the recording N times as fast; 0 means without
+ *     pauses.
+ *   - `--link OPTIONS` puts a simulated serial link between `Serial` and
+ *     its input, with settings as described in `"SerialLink.h"`, and
+ *     prints what went over it at the end. The output still appears right
+ *     away; the link paces the copy a recording being replayed sees.
+ *   - `--fs DIR` gives the commands of `"ShellFiles.h"` the files in DIR,
+ *     as described in `"HostFs.h"`.
+ *
+ * Then it runs the sketch, and ends when the last task has ended, e.g. once
+ * a shell reading from a file or a recording has run it through.
+ */
+#include "Arduino.h"
+#include "Arduino_FreeRTOS.h"
+#include "HostFs.h"
+#include "ReplayStream.h"
+#include "SerialLink.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+size_t hostTasksAlive();
+void hostTasksWait(unsigned long ms);
+
+__attribute__((weak)) void loop() {
+  hostTasksWait(1000);
+}
+
+static ReplayStream replay;
+
+int main(int argc, char **argv) {
+  const char *recording = nullptr;
+  const char *link_options = nullptr;
+  double speed = 1;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--replay") && i + 1 < argc) {
+      recording = argv[++i];
+    } else if (!strcmp(argv[i], "--speed") && i + 1 < argc) {
+      char *end;
+      speed = strtod(argv[++i], &end);
+      if (*end || speed < 0) {
+        fprintf(stderr, "%s: Invalid speed: %s\n", argv[0], argv[i]);
+        return 2;
+      }
+    } else if (!strcmp(argv[i], "--link") && i + 1 < argc) {
+      link_options = argv[++i];
+    } else if (!strcmp(argv[i], "--fs") && i + 1 < argc) {
+      const ShellFs *fs = hostFs(argv[++i]);
+      if (!fs) {
+        fprintf(stderr, "%s: Not a directory: %s\n", argv[0], argv[i]);
+        return 2;
+      }
+      shellSetFs(fs);
+    } else if (!strcmp(argv[i], "--pty")) {
+      const char *name = Serial.openPty();
+      if (!name) {
+        perror("openpty");
+        return 1;
+      }
+      fprintf(stderr, "%s: serial port on %s\n", argv[0], name);
+    } else {
+      fprintf(stderr,
+              "usage: %s [--pty] [--replay FILE [--speed N]] "
+              "[--link OPTIONS] [--fs DIR]\n",
+              argv[0]);
+      return 2;
+    }
+  }
+  if (recording) {
+    if (!replay.open(recording, speed)) {
+      perror(recording);
+      return 1;
+    }
+    replay.setReport(stderr);
+    Serial.feed(&replay);
+  }
+
+  // the far end of the link is the recording, or what `Serial` would read
+  static HardwareSerial wire(Serial.inputFd(), -1);
+  static SerialLink link(recording ? (Stream &)replay : (Stream &)wire);
+  if (link_options) {
+    if (!link.configure(link_options)) {
+      fprintf(stderr, "%s: Invalid link settings: %s\n", argv[0],
+              link_options);
+      return 2;
+    }
+    Serial.feed(&link);
+  }
+
+  Serial.begin();
+  setup();
+  while (hostTasksAlive()) loop();
+  Serial.end();
+  if (link_options) {
+    link.flush();
+    link.summary(stderr);
+  }
+  if (recording) replay.summary();
+  return 0;
+}
@@ -0,0 +1,165 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * The workstation end of a `ShellMux`:
+ *
+ *     shellmux [-b baud] device [channel=file]...
+ *
+ * Channel 0 goes to the terminal, so the shell on it can be used as usual.
+ * Other channels are appended to the files named, which may be FIFOs or
+ * `/dev/stderr`; channels not named are read and thrown away. Ctrl-C quits.
+ * Once standard input ends, as when it is a file, the program quits after
+ * a second without output on channel 0.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "Arduino.h"
+#include "Arduino_FreeRTOS.h"
+#include "ShellMux.h"
+
+static const struct {
+  unsigned long baud;
+  speed_t speed;
+} speeds[] = {
+    {9600, B9600},     {19200, B19200},   {38400, B38400},
+    {57600, B57600},   {115200, B115200}, {230400, B230400},
+    {460800, B460800}, {921600, B921600},
+};
+
+static ShellMux mux;
+
+static int usage(const char *name) {
+  fprintf(stderr, "usage: %s [-b baud] device [channel=file]...\n", name);
+  return 2;
+}
+
+static bool setSpeed(int fd, unsigned long baud) {
+  struct termios tty;
+  if (tcgetattr(fd, &tty) < 0) return true; // not a terminal; a pipe or pty
+  cfmakeraw(&tty);
+  for (auto &entry : speeds) {
+    if (entry.baud == baud) {
+      cfsetispeed(&tty, entry.speed);
+      cfsetospeed(&tty, entry.speed);
+      return tcsetattr(fd, TCSANOW, &tty) == 0;
+    }
+  }
+  return false;
+}
+
+/*
+ * Pass on what a channel has received. Returns whether there was any.
+ */
+static bool copy(MuxChannel &channel, int fd) {
+  uint8_t buffer[256];
+  size_t count = 0;
+  int c;
+  while (count < sizeof(buffer) && (c = channel.read()) >= 0) {
+    buffer[count++] = c;
+  }
+  if (count == 0) return false;
+  if (fd >= 0 && write(fd, buffer, count) < 0 && errno != EAGAIN) {
+    perror("shellmux: write");
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  unsigned long baud = 115200;
+  int opt;
+  while ((opt = getopt(argc, argv, "b:")) != -1) {
+    if (opt != 'b') return usage(argv[0]);
+    baud = strtoul(optarg, nullptr, 10);
+  }
+  if (optind >= argc) return usage(argv[0]);
+
+  int outputs[SHELL_MUX_CHANNELS];
+  outputs[0] = STDOUT_FILENO;
+  for (int i = 1; i < SHELL_MUX_CHANNELS; i++) outputs[i] = -1;
+  for (int i = optind + 1; i < argc; i++) {
+    char *end;
+    unsigned long id = strtoul(argv[i], &end, 10);
+    if (*end != '=' || id == 0 || id >= SHELL_MUX_CHANNELS) {
+      return usage(argv[0]);
+    }
+    outputs[id] = open(end + 1, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (outputs[id] < 0) {
+      perror(end + 1);
+      return 1;
+    }
+  }
+
+  int fd = open(argv[optind], O_RDWR | O_NOCTTY);
+  if (fd < 0) {
+    perror(argv[optind]);
+    return 1;
+  }
+  if (!setSpeed(fd, baud)) {
+    fprintf(stderr, "%s: Cannot set %lu baud\n", argv[0], baud);
+    return 1;
+  }
+
+  static HardwareSerial port(fd, fd);
+  Serial.begin();
+  mux.setPriority(0, 1);
+  if (!mux.begin(port)) {
+    fprintf(stderr, "%s: Cannot start\n", argv[0]);
+    return 1;
+  }
+
+  MuxChannel &shell = mux.channel(0);
+  unsigned long heard = millis();
+  for (;;) {
+    bool busy = false;
+
+    int ready = Serial.available();
+    if (ready > 0) {
+      uint8_t buffer[256];
+      size_t count = Serial.readBytes(
+          buffer, (size_t)ready < sizeof(buffer) ? ready : sizeof(buffer));
+      shell.write(buffer, count);
+      shell.flush();
+      busy = true;
+    }
+
+    if (copy(shell, outputs[0])) {
+      heard = millis();
+      busy = true;
+    }
+    for (int i = 1; i < SHELL_MUX_CHANNELS; i++) {
+      if (copy(mux.channel(i), outputs[i])) busy = true;
+    }
+
+    if (ready < 0 && millis() - heard >= 1000) break;
+    if (!busy) delay(1);
+  }
+
+  mux.end();
+  Serial.end();
+  return 0;
+}
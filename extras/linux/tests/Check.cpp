@@ -0,0 +1,170 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Helpers for the tests of the Linux runtime.
+ *
+ * This is the implementation. See `"Check.h"` for documentation.
+ */
+#include "Check.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static unsigned checks;
+static unsigned failures;
+
+bool checkThat(bool ok, const char *file, int line, const char *what) {
+  checks += 1;
+  if (!ok) {
+    failures += 1;
+    printf("%s:%d: check failed: %s\n", file, line, what);
+  }
+  return ok;
+}
+
+void checkNote(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  printf("  ");
+  vprintf(format, args);
+  printf("\n");
+  va_end(args);
+}
+
+void checkDone() {
+  if (failures) {
+    printf("%s: %u of %u checks failed\n", program_invocation_short_name,
+           failures, checks);
+  } else {
+    printf("%s: ok, %u checks\n", program_invocation_short_name, checks);
+  }
+  fflush(stdout);
+  exit(failures ? 1 : 0);
+}
+
+double checkSeconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void checkWire(HardwareSerial *&a, HardwareSerial *&b) {
+  int ab[2], ba[2];
+  if (pipe(ab) < 0 || pipe(ba) < 0) {
+    perror("pipe");
+    exit(2);
+  }
+  a = new HardwareSerial(ba[0], ab[1]);
+  b = new HardwareSerial(ab[0], ba[1]);
+}
+
+TestPort::TestPort() {
+  if (pipe(to_shell) < 0 || pipe(from_shell) < 0) {
+    perror("pipe");
+    exit(2);
+  }
+  port = new HardwareSerial(to_shell[0], from_shell[1]);
+}
+
+TestPort::~TestPort() {
+  close();
+  ::close(from_shell[0]);
+  // the shell may still hold its end; leave `port` and its descriptors
+}
+
+void TestPort::send(const void *data, size_t size) {
+  const char *p = (const char *)data;
+  while (size > 0) {
+    ssize_t count = write(to_shell[1], p, size);
+    if (count < 0) {
+      if (errno == EINTR) continue;
+      perror("write");
+      exit(2);
+    }
+    p += count;
+    size -= count;
+  }
+}
+
+void TestPort::send(const char *text) {
+  send(text, strlen(text));
+}
+
+void TestPort::close() {
+  if (to_shell[1] < 0) return;
+  ::close(to_shell[1]);
+  to_shell[1] = -1;
+}
+
+/*
+ * Read what the shell has printed, waiting up to `wait` milliseconds.
+ * Returns whether anything came.
+ */
+bool TestPort::fill(int wait) {
+  if (seen_len == sizeof(seen) - 1) {
+    // keep the text not yet matched
+    memmove(seen, &seen[matched], seen_len - matched);
+    seen_len -= matched;
+    matched = 0;
+    if (seen_len == sizeof(seen) - 1) return false;
+  }
+  struct pollfd fd = {from_shell[0], POLLIN, 0};
+  if (poll(&fd, 1, wait) <= 0) return false;
+  ssize_t count =
+      read(from_shell[0], &seen[seen_len], sizeof(seen) - 1 - seen_len);
+  if (count <= 0) return false;
+  seen_len += count;
+  seen[seen_len] = '\0';
+  return true;
+}
+
+bool TestPort::expect(const char *text, unsigned long ms) {
+  double until = checkSeconds() + ms / 1e3;
+  for (;;) {
+    seen[seen_len] = '\0';
+    char *at = strstr(&seen[matched], text);
+    if (at) {
+      before = &seen[matched];
+      before_len = at - before;
+      matched = at + strlen(text) - seen;
+      return true;
+    }
+    double left = until - checkSeconds();
+    if (left <= 0) break;
+    fill((int)(left * 1e3) + 1);
+  }
+  before = &seen[matched];
+  before_len = seen_len - matched;
+  return false;
+}
+
+void TestPort::skip() {
+  while (fill(0))
+    ;
+  matched = seen_len;
+}
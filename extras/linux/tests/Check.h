@@ -0,0 +1,117 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Helpers for the tests of the Linux runtime.
+ *
+ * Every test is a sketch of its own: `setup` runs the checks, printing a
+ * line for each that fails and for each measurement taken, then ends the
+ * program with `checkDone`. `make test` builds and runs them all.
+ *
+ * A `TestPort` stands in for the serial port of a shell under test: two
+ * pipes, one carrying what the test sends to the shell, the other what
+ * the shell prints back. `checkWire` makes such a pair for two ends of
+ * the library to talk over.
+ */
+#ifndef TOYSHELL_TEST_CHECK_H
+#define TOYSHELL_TEST_CHECK_H
+
+#include <stddef.h>
+
+#include "HardwareSerial.h"
+
+#define CHECK(condition) \
+  checkThat((condition), __FILE__, __LINE__, #condition)
+
+/**
+ * Count a check, complaining about it if `ok` is false. Returns `ok`.
+ */
+bool checkThat(bool ok, const char *file, int line, const char *what);
+
+/**
+ * Print a measurement, or a note on a check that failed.
+ */
+void checkNote(const char *format, ...)
+    __attribute__((format(printf, 1, 2)));
+
+/**
+ * Print how many checks failed, and end the program, successfully if none
+ * did.
+ */
+[[noreturn]] void checkDone();
+
+/**
+ * A monotonic clock in seconds, for timing.
+ */
+double checkSeconds();
+
+/**
+ * Make two streams wired back to back: what one writes, the other reads.
+ */
+void checkWire(HardwareSerial *&a, HardwareSerial *&b);
+
+class TestPort {
+private:
+  int to_shell[2];
+  int from_shell[2];
+  char seen[65536];
+  size_t seen_len = 0;
+  size_t matched = 0; // where the last text expected ended
+
+  bool fill(int wait);
+public:
+  /**
+   * The end to hand to the shell.
+   */
+  HardwareSerial *port;
+
+  TestPort();
+  TestPort(TestPort &other) = delete;
+  ~TestPort();
+
+  /**
+   * Send bytes to the shell.
+   */
+  void send(const void *data, size_t size);
+  void send(const char *text);
+
+  /**
+   * End the shell's input, so it stops once it has run what it has.
+   */
+  void close();
+
+  /**
+   * Read what the shell prints until `text` comes out, or `ms`
+   * milliseconds pass. Returns whether it came out; what came before it,
+   * since the text last expected, is then in `before`.
+   */
+  bool expect(const char *text, unsigned long ms = 2000);
+
+  /**
+   * Forget what the shell has printed so far.
+   */
+  void skip();
+
+  const char *before = "";
+  size_t before_len = 0;
+};
+
+#endif
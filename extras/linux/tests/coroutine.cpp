@@ -0,0 +1,180 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Coroutine commands on a simulated clock: a delay ends when the clock
+ * passes it and not before, however long the test waits; many run at
+ * once up to the limit; events and queue items resume the coroutines
+ * waiting on them; and `kill` runs the destructors of a coroutine's
+ * locals.
+ */
+#include <Arduino.h>
+
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "Check.h"
+#include "ShellCoroutine.h"
+#include "ToyShell.h"
+
+static atomic_ulong clock_ms;
+static ShellEvent event;
+static QueueHandle_t queue;
+static atomic_int released;
+
+static unsigned long simulated() {
+  return atomic_load(&clock_ms);
+}
+
+static void tick(unsigned long ms) {
+  atomic_fetch_add(&clock_ms, ms);
+}
+
+static ShellTask cmdNap(int argc, const char *const *argv, Stream *serial) {
+  co_await shellDelay(argc > 1 ? strtoul(argv[1], nullptr, 0) : 0);
+  serial->printf("woke %s\n", argc > 1 ? argv[1] : "0");
+  co_return 0;
+}
+
+static ShellTask cmdWait(int, const char *const *, Stream *serial) {
+  bool signalled = co_await event.wait();
+  serial->print(signalled ? "signalled\n" : "timed out\n");
+  co_return 0;
+}
+
+static ShellTask cmdTake(int, const char *const *, Stream *serial) {
+  int item;
+  if (co_await shellReceive(queue, &item, 500)) {
+    serial->printf("got %d\n", item);
+  } else {
+    serial->print("nothing\n");
+  }
+  co_return 0;
+}
+
+struct Guard {
+  ~Guard() { atomic_fetch_add(&released, 1); }
+};
+
+static ShellTask cmdHold(int, const char *const *, Stream *) {
+  Guard guard;
+  co_await shellDelay(SHELL_FOREVER);
+  co_return 0;
+}
+
+static ShellTask cmdFail(int, const char *const *, Stream *) {
+  co_await shellDelay(10);
+  co_return 3;
+}
+
+constexpr Command commands[] = {
+    {"fail", shellCoroutine<cmdFail>},
+    {"hold", shellCoroutine<cmdHold>},
+    {"kill", cmdKill},
+    {"nap", shellCoroutine<cmdNap>},
+    {"ps", cmdPs},
+    {"take", shellCoroutine<cmdTake>},
+    {"wait", shellCoroutine<cmdWait>},
+};
+
+static Shell shell(commands, sizeof(commands) / sizeof(Command));
+static TestPort test;
+
+void setup() {
+  atomic_store(&clock_ms, 1000);
+  shellCoroutineClock(simulated);
+  queue = xQueueCreate(4, sizeof(int));
+  shell.begin(*test.port);
+  CHECK(test.expect("shell> "));
+
+  // a delay waits for the clock, not for real time
+  test.send("nap 1000\n");
+  CHECK(test.expect("[0]\nshell> "));
+  delay(100);
+  test.send("ps\n");
+  CHECK(test.expect("[0] nap 1000, 1000ms left\n"));
+  tick(999);
+  CHECK(!test.expect("woke", 200));
+  test.send("ps\n");
+  CHECK(test.expect("[0] nap 1000, 1ms left\n"));
+  tick(1);
+  CHECK(test.expect("woke 1000\n"));
+
+  // as many at once as there are slots
+  test.skip();
+  for (int i = 1; i <= SHELL_COROUTINE_MAX; i++) {
+    char line[16];
+    snprintf(line, sizeof(line), "nap %d\n", i * 10);
+    test.send(line);
+  }
+  test.send("nap 1\n");
+  CHECK(test.expect("nap: At most 8 coroutines can run\n"));
+  tick(SHELL_COROUTINE_MAX * 10 - 5);
+  for (int i = 1; i < SHELL_COROUTINE_MAX; i++) {
+    char line[16];
+    snprintf(line, sizeof(line), "woke %d\n", i * 10);
+    CHECK(test.expect(line));
+  }
+  CHECK(!test.expect("woke", 200));
+  tick(5);
+  CHECK(test.expect("woke 80\n"));
+
+  // an event, raised from another task
+  test.send("wait\n");
+  CHECK(test.expect("[0]\nshell> "));
+  CHECK(!test.expect("signalled", 100));
+  event.signal();
+  CHECK(test.expect("signalled\n"));
+
+  // a queue, and a timeout on the simulated clock
+  test.send("take\n");
+  CHECK(test.expect("[0]\nshell> "));
+  int item = 42;
+  xQueueSend(queue, &item, 0);
+  CHECK(test.expect("got 42\n"));
+  test.send("take\n");
+  CHECK(test.expect("[0]\nshell> "));
+  tick(500);
+  CHECK(test.expect("nothing\n"));
+
+  // a coroutine's exit status
+  test.send("fail\n");
+  CHECK(test.expect("[0]\nshell> "));
+  tick(10);
+  CHECK(test.expect("[0] Exit 3\n"));
+
+  // killing one runs its destructors
+  test.send("hold\nhold\n");
+  CHECK(test.expect("[1]\nshell> "));
+  test.send("kill 0\n");
+  test.send("ps\n");
+  CHECK(test.expect("[1] hold\n"));
+  CHECK(atomic_load(&released) == 1);
+  test.send("kill 5\n");
+  CHECK(test.expect("kill: No such coroutine: 5\n"));
+  test.send("kill all\nps\nnap\n");
+  CHECK(test.expect("woke 0\n"));
+  CHECK(atomic_load(&released) == 2);
+
+  shell.end();
+  test.close();
+  checkDone();
+}
@@ -0,0 +1,212 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * The file commands over `HostFs`, in a scratch directory: `cat` streams a
+ * file of several megabytes in whole blocks, one write each rather than
+ * one per line, at a throughput measured here; `cat -r` frames binary
+ * data exactly; and `cp`, `ls` and `rm` do what they say, `cp` refusing
+ * to copy a file onto itself.
+ */
+#include <Arduino.h>
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "Check.h"
+#include "HostFs.h"
+#include "ShellFiles.h"
+#include "ToyShell.h"
+
+#define BIG (8 << 20) // bytes
+#define FLOOR_MBS 50  // far below any host, far above a line at a time
+
+/*
+ * A stream keeping everything written to it, and how many writes it took.
+ */
+class Capture : public Stream {
+public:
+  char *data = nullptr;
+  size_t size = 0;
+  size_t capacity = 0;
+  size_t writes = 0;
+
+  void reset() {
+    size = writes = 0;
+  }
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t *buffer, size_t len) override {
+    if (size + len > capacity) {
+      capacity = (size + len) * 2;
+      data = (char *)realloc(data, capacity);
+    }
+    memcpy(&data[size], buffer, len);
+    size += len;
+    writes++;
+    return len;
+  }
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+};
+
+static Capture capture;
+static double took; // seconds the last `measure` took
+
+/*
+ * `measure command...`: run a command with its output going to `capture`,
+ * timing it.
+ */
+static int cmdMeasure(int argc, const char *const *argv, Stream *) {
+  char line[128] = "";
+  for (int i = 1; i < argc; i++) {
+    strcat(line, argv[i]);
+    strcat(line, " ");
+  }
+  capture.reset();
+  double start = checkSeconds();
+  int result = Shell::current()->execute(line, &capture);
+  took = checkSeconds() - start;
+  return result;
+}
+
+constexpr Command commands[] = {
+    {"cat", cmdCat},
+    {"cp", cmdCp},
+    {"ls", cmdLs},
+    {"measure", cmdMeasure},
+    {"rm", cmdRm},
+};
+
+static Shell shell(commands, sizeof(commands) / sizeof(Command));
+static TestPort test;
+
+static bool writeFile(const char *path, const char *data, size_t size) {
+  FILE *file = fopen(path, "wb");
+  if (!file) return false;
+  bool ok = fwrite(data, 1, size, file) == size;
+  return fclose(file) == 0 && ok;
+}
+
+static bool sameFile(const char *path, const char *data, size_t size) {
+  FILE *file = fopen(path, "rb");
+  if (!file) return false;
+  char *copy = (char *)malloc(size + 1);
+  bool same = fread(copy, 1, size + 1, file) == size &&
+              !memcmp(copy, data, size);
+  free(copy);
+  fclose(file);
+  return same;
+}
+
+/*
+ * Time `cat` on `name`, and check it printed `data` in whole blocks.
+ */
+static void throughput(const char *name, const char *data, bool raw) {
+  char line[64];
+  snprintf(line, sizeof(line), "measure cat %s/%s\n", raw ? "-r " : "", name);
+  test.send(line);
+  CHECK(test.expect("shell> ", 10000));
+
+  size_t header = 0;
+  if (raw) {
+    char want[32];
+    header = snprintf(want, sizeof(want), "raw %d\n", BIG);
+    CHECK(capture.size > header && !memcmp(capture.data, want, header));
+  }
+  CHECK(capture.size == header + BIG);
+  CHECK(capture.size >= header + BIG &&
+        !memcmp(&capture.data[header], data, BIG));
+  // the header, and a block at a time
+  CHECK(capture.writes <= 1 + BIG / SHELL_FS_BLOCK + 1);
+  double rate = BIG / took / 1e6;
+  CHECK(rate > FLOOR_MBS);
+  checkNote("cat %s%s: %d MB in %.1f ms, %.0f MB/s, %zu writes",
+            raw ? "-r " : "", name, BIG >> 20, took * 1e3, rate,
+            capture.writes);
+}
+
+void setup() {
+  char root[] = "/tmp/toyshell-fs-XXXXXX";
+  if (!CHECK(mkdtemp(root))) checkDone();
+  char path[64];
+
+  // a text file of short lines, and binary data with every byte value
+  char *text = (char *)malloc(BIG);
+  char *binary = (char *)malloc(BIG);
+  for (size_t i = 0; i < BIG; i++)
+    text[i] = i % 32 == 31 ? '\n' : 'a' + i % 26;
+  uint32_t x = 1;
+  for (size_t i = 0; i < BIG; i++) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    binary[i] = (char)x;
+  }
+  snprintf(path, sizeof(path), "%s/big.txt", root);
+  CHECK(writeFile(path, text, BIG));
+  snprintf(path, sizeof(path), "%s/big.bin", root);
+  CHECK(writeFile(path, binary, BIG));
+
+  shellSetFs(hostFs(root));
+  shell.begin(*test.port);
+  CHECK(test.expect("shell> "));
+
+  throughput("big.txt", text, false);
+  throughput("big.bin", binary, true);
+
+  test.send("cp /big.bin /copy.bin\n");
+  CHECK(test.expect("shell> ", 10000));
+  snprintf(path, sizeof(path), "%s/copy.bin", root);
+  CHECK(sameFile(path, binary, BIG));
+  test.send("cp /copy.bin copy.bin\n");
+  CHECK(test.expect("cp: /copy.bin and copy.bin are the same file\n"
+                    "shell> "));
+  CHECK(sameFile(path, binary, BIG));
+
+  test.send("ls\n");
+  CHECK(test.expect("shell> "));
+  char listed[256];
+  snprintf(listed, sizeof(listed), "%.*s", (int)test.before_len, test.before);
+  CHECK(strstr(listed, "   8388608  big.bin\n"));
+  CHECK(strstr(listed, "   8388608  copy.bin\n"));
+
+  test.send("rm /copy.bin\ncat /copy.bin\n");
+  CHECK(test.expect("cat: Cannot open /copy.bin\n"));
+  CHECK(access(path, F_OK) != 0);
+  test.send("cat /../big.bin\n");
+  CHECK(test.expect("cat: Cannot open /../big.bin\n"));
+
+  shell.end();
+  test.close();
+  free(text);
+  free(binary);
+  free(capture.data);
+  snprintf(path, sizeof(path), "%s/big.txt", root);
+  unlink(path);
+  snprintf(path, sizeof(path), "%s/big.bin", root);
+  unlink(path);
+  rmdir(root);
+  checkDone();
+}
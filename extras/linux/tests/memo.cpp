@@ -0,0 +1,136 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Kept output of idempotent commands: asking again replays the output and
+ * status without running the command, until its `generation` moves on,
+ * the arguments or the stream differ, the output was too long to keep,
+ * or the shell is told to forget.
+ */
+#include <Arduino.h>
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "Check.h"
+#include "ToyShell.h"
+
+/*
+ * A stream keeping what is written to it.
+ */
+class Capture : public Stream {
+public:
+  char text[1024];
+  size_t len = 0;
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t *buffer, size_t size) override {
+    if (len + size >= sizeof(text)) size = sizeof(text) - 1 - len;
+    memcpy(&text[len], buffer, size);
+    len += size;
+    text[len] = '\0';
+    return size;
+  }
+  int available() override { return -1; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+};
+
+static atomic_uint generation;
+static int runs;
+
+static int cmdBig(int, const char *const *, Stream *serial) {
+  runs += 1;
+  for (int i = 0; i < SHELL_MEMO_OUTPUT / 10 + 1; i++)
+    serial->print("0123456789");
+  return 0;
+}
+
+static int cmdTemp(int argc, const char *const *argv, Stream *serial) {
+  runs += 1;
+  serial->printf("%s %d\n", argc > 1 ? argv[1] : "temp", runs);
+  return runs;
+}
+
+constexpr Command commands[] = {
+    {"big", cmdBig, SHELL_IDEMPOTENT},
+    {"plain", cmdTemp},
+    {"temp", cmdTemp, SHELL_IDEMPOTENT, &generation},
+};
+
+static Shell shell(commands, sizeof(commands) / sizeof(Command));
+
+/*
+ * Run `text` into `out`, checking it printed `want`, unless that is
+ * `nullptr`, and returned `status`.
+ */
+static bool run(const char *text, Capture &out, const char *want,
+                int status) {
+  char line[SHELL_LINE_MAX];
+  strcpy(line, text);
+  out.len = 0;
+  out.text[0] = '\0';
+  int result = shell.execute(line, &out);
+  if (result == status && (!want || !strcmp(out.text, want))) return true;
+  checkNote("%s: got %d, \"%s\"", text, result, out.text);
+  return false;
+}
+
+void setup() {
+  Capture a, b;
+
+  // replayed, status and all, until the generation moves on
+  CHECK(run("temp", a, "temp 1\n", 1));
+  CHECK(run("temp", a, "temp 1\n", 1));
+  CHECK(runs == 1);
+  atomic_fetch_add(&generation, 1);
+  CHECK(run("temp", a, "temp 2\n", 2));
+  CHECK(run("temp", a, "temp 2\n", 2));
+  CHECK(runs == 2);
+
+  // other arguments, and another stream, are other outputs
+  CHECK(run("temp x", a, "x 3\n", 3));
+  CHECK(run("temp", b, "temp 4\n", 4));
+  CHECK(run("temp x", a, "x 3\n", 3));
+  CHECK(run("temp", a, "temp 2\n", 2));
+  CHECK(runs == 4);
+
+  // commands not flagged, and output too long to keep, run every time
+  CHECK(run("plain", a, "temp 5\n", 5));
+  CHECK(run("plain", a, "temp 6\n", 6));
+  CHECK(run("big", a, nullptr, 0));
+  CHECK(run("big", a, nullptr, 0));
+  CHECK(runs == 8);
+
+  // more lines than kept push out the oldest
+  for (int i = 0; i < SHELL_MEMO; i++) {
+    char line[16];
+    snprintf(line, sizeof(line), "temp %d", i);
+    CHECK(run(line, a, nullptr, runs + 1));
+  }
+  CHECK(run("temp", a, "temp 13\n", 13));
+
+  // and forgetting drops them all
+  CHECK(run("temp", a, "temp 13\n", 13));
+  shell.forget();
+  CHECK(run("temp", a, "temp 14\n", 14));
+  checkDone();
+}
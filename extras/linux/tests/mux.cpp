@@ -0,0 +1,234 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * The channel multiplexer, with a board's end and a workstation's end
+ * wired together over a simulated 115200 baud link: data goes through
+ * intact both ways, a channel nobody reads stalls without holding up the
+ * others, and a keystroke on the interactive channel gets through a flood
+ * of bulk data within a few frame times.
+ */
+#include <Arduino.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Check.h"
+#include "SerialLink.h"
+#include "ShellMux.h"
+
+#define BAUD 115200
+#define TX_BUFFER 128 // the UART's, FIFO included
+#define TRANSFER 6000
+#define TRIPS 50
+// a full frame on the wire, in milliseconds
+#define FRAME_MS ((SHELL_MUX_PAYLOAD + 7) * 10 * 1000.0 / BAUD)
+// an echo queues behind what the UART holds already, and the frame the
+// mux is writing into it; another frame's time covers the way there and
+// the polling at both ends
+#define BOUND_MS (TX_BUFFER * 10 * 1000.0 / BAUD + 3 * FRAME_MS)
+
+static HardwareSerial *host_end;
+static HardwareSerial *far_end;
+static SerialLink *wire;
+static ShellMux board;
+static ShellMux host;
+
+static uint8_t pattern(size_t i, int seed) {
+  return (uint8_t)(i * 7 + seed * 31 + (i >> 8));
+}
+
+struct Writer {
+  MuxChannel *channel;
+  size_t size; // 0 writes until `f_stop`
+  int seed;
+  atomic_bool f_stop;
+};
+
+/*
+ * Write a pattern, waiting for room rather than letting writes drop.
+ */
+static void *writeMain(void *arg) {
+  Writer *writer = (Writer *)arg;
+  uint8_t chunk[48];
+  size_t sent = 0;
+  while (!atomic_load(&writer->f_stop) &&
+         (writer->size == 0 || sent < writer->size)) {
+    size_t n = sizeof(chunk);
+    if (writer->size && n > writer->size - sent) n = writer->size - sent;
+    if (writer->channel->availableForWrite() < (int)n) {
+      delay(1);
+      continue;
+    }
+    for (size_t i = 0; i < n; i++) chunk[i] = pattern(sent + i, writer->seed);
+    sent += writer->channel->write(chunk, n);
+  }
+  return nullptr;
+}
+
+static void startWriter(pthread_t *thread, Writer *writer, MuxChannel &channel,
+                        size_t size, int seed) {
+  writer->channel = &channel;
+  writer->size = size;
+  writer->seed = seed;
+  atomic_init(&writer->f_stop, 0);
+  pthread_create(thread, nullptr, writeMain, writer);
+}
+
+/*
+ * Read `size` bytes of the pattern from `channel`. Returns how many came
+ * before one was wrong or the time ran out.
+ */
+static size_t readPattern(MuxChannel &channel, size_t size, int seed) {
+  double until = checkSeconds() + 10;
+  size_t got = 0;
+  while (got < size && checkSeconds() < until) {
+    int c = channel.read();
+    if (c < 0) {
+      delay(1);
+      continue;
+    }
+    if (c != pattern(got, seed)) break;
+    got += 1;
+  }
+  return got;
+}
+
+static void checkBothWays() {
+  pthread_t thread;
+  Writer writer;
+
+  startWriter(&thread, &writer, board.channel(1), TRANSFER, 1);
+  double start = checkSeconds();
+  CHECK(readPattern(host.channel(1), TRANSFER, 1) == TRANSFER);
+  double took = checkSeconds() - start;
+  pthread_join(thread, nullptr);
+  checkNote("board to host: %.0f bytes/s of %d on the wire", TRANSFER / took,
+            BAUD / 10);
+
+  startWriter(&thread, &writer, host.channel(2), TRANSFER, 2);
+  CHECK(readPattern(board.channel(2), TRANSFER, 2) == TRANSFER);
+  pthread_join(thread, nullptr);
+}
+
+static void checkStalled() {
+  // nobody reads channel 3 at the host, and its writes time out
+  pthread_t stalled, thread;
+  Writer stuck, writer;
+  startWriter(&stalled, &stuck, board.channel(3), 0, 3);
+  startWriter(&thread, &writer, board.channel(1), TRANSFER, 4);
+  CHECK(readPattern(host.channel(1), TRANSFER, 4) == TRANSFER);
+  pthread_join(thread, nullptr);
+  atomic_store(&stuck.f_stop, 1);
+  pthread_join(stalled, nullptr);
+}
+
+static atomic_bool f_flooding;
+
+static void *drain(void *arg) {
+  MuxChannel *channel = (MuxChannel *)arg;
+  while (atomic_load(&f_flooding)) {
+    if (channel->read() < 0) delay(1);
+  }
+  return nullptr;
+}
+
+static void *echo(void *) {
+  while (atomic_load(&f_flooding)) {
+    int c = board.channel(0).read();
+    if (c < 0) {
+      delay(1);
+      continue;
+    }
+    board.channel(0).write((uint8_t)c);
+  }
+  return nullptr;
+}
+
+static int compare(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static void checkLatency() {
+  atomic_store(&f_flooding, 1);
+  pthread_t floods[2], drains[2], echoer;
+  Writer writers[2];
+  for (int i = 0; i < 2; i++) {
+    startWriter(&floods[i], &writers[i], board.channel(1 + i), 0, 5 + i);
+    pthread_create(&drains[i], nullptr, drain, &host.channel(1 + i));
+  }
+  pthread_create(&echoer, nullptr, echo, nullptr);
+  delay(200);
+
+  double trips[TRIPS];
+  int lost = 0;
+  for (int i = 0; i < TRIPS; i++) {
+    double start = checkSeconds();
+    host.channel(0).write((uint8_t)i);
+    int c = -1;
+    while (c < 0 && checkSeconds() - start < 1) {
+      c = host.channel(0).read();
+      if (c < 0) delayMicroseconds(100);
+    }
+    if (c != i) lost += 1;
+    trips[i] = (checkSeconds() - start) * 1e3;
+    delay(3);
+  }
+  qsort(trips, TRIPS, sizeof(double), compare);
+  CHECK(lost == 0);
+  CHECK(trips[TRIPS / 2] < BOUND_MS);
+  checkNote("keystroke round trip under a flood: %.1f ms median, %.1f ms "
+            "worst, bound %.1f ms",
+            trips[TRIPS / 2], trips[TRIPS - 1], BOUND_MS);
+
+  atomic_store(&f_flooding, 0);
+  for (int i = 0; i < 2; i++) {
+    atomic_store(&writers[i].f_stop, 1);
+    pthread_join(floods[i], nullptr);
+    pthread_join(drains[i], nullptr);
+  }
+  pthread_join(echoer, nullptr);
+}
+
+void setup() {
+  checkWire(host_end, far_end);
+  wire = new SerialLink(*far_end);
+  char options[32];
+  snprintf(options, sizeof(options), "baud=%d,tx=%d", BAUD, TX_BUFFER);
+  CHECK(wire->configure(options));
+
+  board.setPriority(0, 2);
+  host.setPriority(0, 2);
+  CHECK(board.begin(*wire));
+  CHECK(host.begin(*host_end));
+  delay(100);
+
+  checkBothWays();
+  checkStalled();
+  checkLatency();
+  board.end();
+  host.end();
+  checkDone();
+}
@@ -0,0 +1,97 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Parallel lines: they run at the same time, their outputs come out whole
+ * and in the order the lines were given whatever order they finish in,
+ * and the status is that of the first line that failed. Too many lines,
+ * and commands needing a large stack, are refused.
+ */
+#include <Arduino.h>
+
+#include <stdlib.h>
+
+#include "Check.h"
+#include "ShellParallel.h"
+#include "ToyShell.h"
+
+/*
+ * `wait ms word [status]`: print the word, wait, print it again, and
+ * return the status.
+ */
+static int cmdWait(int argc, const char *const *argv, Stream *serial) {
+  if (argc < 3) return 1;
+  serial->printf("%s 1\n", argv[2]);
+  delay(atoi(argv[1]));
+  serial->printf("%s 2\n", argv[2]);
+  return argc > 3 ? atoi(argv[3]) : 0;
+}
+
+static int cmdBig(int, const char *const *, Stream *) {
+  return 0;
+}
+
+/*
+ * `parallel`, then its status.
+ */
+static int cmdPar(int argc, const char *const *argv, Stream *serial) {
+  int status = cmdParallel(argc, argv, serial);
+  serial->printf("= %d\n", status);
+  return status;
+}
+
+constexpr Command commands[] = {
+    {"big", cmdBig, SHELL_LARGE_STACK},
+    {"par", cmdPar},
+    {"wait", cmdWait},
+};
+
+static Shell shell(commands, sizeof(commands) / sizeof(Command));
+
+void setup() {
+  TestPort test;
+  shell.begin(*test.port);
+  CHECK(test.expect("shell> "));
+
+  // the last line given finishes first
+  unsigned long start = millis();
+  test.send("par wait 300 alpha ; wait 200 bravo 3 ; "
+            "wait 100 charlie 4\n");
+  CHECK(test.expect("alpha 1\nalpha 2\nbravo 1\nbravo 2\n"
+                    "charlie 1\ncharlie 2\n= 3\n", 2000));
+  unsigned long elapsed = millis() - start;
+  checkNote("three lines of 300, 200 and 100 ms: %lu ms", elapsed);
+  CHECK(elapsed < 500);
+
+  test.send("par wait 0 delta ; nothing\n");
+  CHECK(test.expect("delta 1\ndelta 2\nshell: No such command: nothing\n"
+                    "= -1\n"));
+
+  test.send("par wait 0 a ; wait 0 b ; wait 0 c ; wait 0 d ; "
+            "wait 0 e\n");
+  CHECK(test.expect("parallel: At most 4 lines\n= 1\n"));
+  test.send("par wait 0 a ; big\n");
+  CHECK(test.expect("parallel: big needs a large stack\n= 1\n"));
+
+  shell.end();
+  test.close();
+  checkDone();
+}
@@ -0,0 +1,206 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * The cache of parsed command lines: a line run again gives the command
+ * the same arguments, lines typed in go through the cache too, changing
+ * the command table empties the cache, and how much a repeated line saves
+ * over a new one.
+ */
+#include <Arduino.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "Check.h"
+#include "ToyShell.h"
+
+#define RUNS 200000
+
+/*
+ * A stream that throws away what is written to it.
+ */
+class Sink : public Stream {
+public:
+  size_t write(uint8_t) override { return 1; }
+  size_t write(const uint8_t *, size_t size) override { return size; }
+  int available() override { return -1; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+};
+
+static char seen[256];
+static const char *table_used;
+static bool f_quiet = false; // while timing, leave out the recording
+
+static int record(int argc, const char *const *argv) {
+  if (f_quiet) return argc;
+  size_t len = 0;
+  for (int i = 0; i < argc; i++) {
+    len += snprintf(&seen[len], sizeof(seen) - len, "%s|", argv[i]);
+  }
+  return argc;
+}
+
+static int cmdA(int argc, const char *const *argv, Stream *) {
+  table_used = "a";
+  return record(argc, argv);
+}
+
+static int cmdB(int argc, const char *const *argv, Stream *) {
+  table_used = "b";
+  return record(argc, argv);
+}
+
+constexpr Command table_a[] = {
+    {"count", cmdA},
+    {"get", cmdA},
+    {"set", cmdA},
+};
+constexpr Command table_b[] = {
+    {"count", cmdB},
+};
+
+static int cmdSwap(int, const char *const *, Stream *) {
+  Shell::current()->setCommands(table_b, sizeof(table_b) / sizeof(Command));
+  return 0;
+}
+
+// for a shell taking lines typed in; names are changed below
+static Command table_c[] = {
+    {"count", cmdA},
+    {"swap", cmdSwap},
+};
+
+static Shell shell(table_a, sizeof(table_a) / sizeof(Command));
+static Sink sink;
+
+// lines a test script would send over and over
+static const char *const corpus[] = {
+    "set gain 3", "get gain", "count 1 2 3", "set led 1",
+    "get led",    "count ",   "set gain 4",  "get temp 0 1 2 3",
+};
+#define CORPUS (sizeof(corpus) / sizeof(corpus[0]))
+
+static int run(const char *text) {
+  char line[SHELL_LINE_MAX];
+  strcpy(line, text);
+  return shell.execute(line, &sink);
+}
+
+static void checkRepeats() {
+  for (const char *text : corpus) {
+    char first[sizeof(seen)];
+    int argc = run(text);
+    strcpy(first, seen);
+    for (int i = 0; i < 3; i++) {
+      CHECK(run(text) == argc);
+      CHECK(!strcmp(seen, first));
+    }
+  }
+
+  // lines too long to keep are split every time
+  char text[SHELL_CACHE_LINE * 2] = "count";
+  while (strlen(text) + 9 < sizeof(text)) strcat(text, " 12345678");
+  int argc = run(text);
+  CHECK(run(text) == argc);
+}
+
+static void checkInvalidation() {
+  run("count 1");
+  run("count 1");
+  CHECK(!strcmp(table_used, "a"));
+  shell.setCommands(table_b, sizeof(table_b) / sizeof(Command));
+  run("count 1");
+  CHECK(!strcmp(table_used, "b"));
+  CHECK(!strcmp(seen, "count|1|"));
+  shell.setCommands(table_a, sizeof(table_a) / sizeof(Command));
+}
+
+/*
+ * Lines typed in take their command from the cache once seen: with the
+ * command renamed behind the shell's back, a line seen before still runs
+ * and a new one does not.
+ */
+static void checkTyped() {
+  Shell typed(table_c, sizeof(table_c) / sizeof(Command));
+  TestPort test;
+  typed.begin(*test.port);
+  CHECK(test.expect("shell> "));
+
+  test.send("count 1  2\n");
+  CHECK(test.expect("shell> "));
+  CHECK(!strcmp(seen, "count|1||2|"));
+  table_c[0].name = "cpunt";
+  seen[0] = '\0';
+  test.send("count 1  2\n");
+  CHECK(test.expect("shell> "));
+  CHECK(!strcmp(seen, "count|1||2|"));
+  test.send("count 3\n");
+  CHECK(test.expect("shell: No such command: count\n"));
+  table_c[0].name = "count";
+
+  // a command changing the table empties the cache for lines typed next
+  test.send("swap\ncount 1  2\n");
+  CHECK(test.expect("count 1  2\nshell> "));
+  CHECK(!strcmp(table_used, "b"));
+
+  typed.end();
+  test.close();
+}
+
+/*
+ * Time lines seen before against lines of the same shape never seen.
+ */
+static void measure() {
+  f_quiet = true;
+  double start = checkSeconds();
+  for (unsigned i = 0; i < RUNS; i++) run(corpus[i % CORPUS]);
+  double repeated = (checkSeconds() - start) / RUNS;
+
+  char fresh[CORPUS][32];
+  start = checkSeconds();
+  for (unsigned i = 0; i < RUNS; i++) {
+    // a new number each time; copying it in is timed below too
+    snprintf(fresh[i % CORPUS], sizeof(fresh[0]), "count %u %u", i, i * 7);
+    run(fresh[i % CORPUS]);
+  }
+  double unseen = (checkSeconds() - start) / RUNS;
+
+  start = checkSeconds();
+  for (unsigned i = 0; i < RUNS; i++) {
+    snprintf(fresh[i % CORPUS], sizeof(fresh[0]), "count %u %u", i, i * 7);
+  }
+  unseen -= (checkSeconds() - start) / RUNS;
+
+  f_quiet = false;
+
+  checkNote("repeated lines: %.0f ns each", repeated * 1e9);
+  checkNote("new lines: %.0f ns each", unseen * 1e9);
+}
+
+void setup() {
+  checkRepeats();
+  checkInvalidation();
+  checkTyped();
+  measure();
+  checkDone();
+}
@@ -0,0 +1,136 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Reading ahead while a command runs: lines sent at full speed while a
+ * slow command holds the shell must all run, in order, with nothing lost
+ * to the UART's FIFO. The port is a simulated link with the buffers of an
+ * ESP32, which overruns once more than its FIFO and driver buffer hold
+ * has arrived unread; the lines sent add up to more than that, and less
+ * than the read-ahead buffer holds on top. A command waiting in
+ * `readBytes` sleeps rather than spins.
+ */
+#include <Arduino.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "Check.h"
+#include "SerialLink.h"
+#include "ToyShell.h"
+
+#define SLOW_MS 100
+#define TRAFFIC 520 // bytes; see above
+
+static int numbers[TRAFFIC];
+static size_t count;
+
+static int cmdSlow(int, const char *const *, Stream *) {
+  delay(SLOW_MS);
+  return 0;
+}
+
+static double cpu_ms;
+
+static int cmdTake(int, const char *const *, Stream *serial) {
+  char text[6] = {};
+  timespec begin, end;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &begin);
+  size_t got = serial->readBytes(text, 5);
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+  cpu_ms = (end.tv_sec - begin.tv_sec) * 1e3 +
+           (end.tv_nsec - begin.tv_nsec) / 1e6;
+  serial->printf("took %zu: %s\n", got, text);
+  return 0;
+}
+
+static int cmdN(int argc, const char *const *argv, Stream *) {
+  if (argc == 2 && count < TRAFFIC) numbers[count++] = atoi(argv[1]);
+  return 0;
+}
+
+constexpr Command commands[] = {
+    {"n", cmdN},
+    {"slow", cmdSlow},
+    {"take", cmdTake},
+};
+
+static Shell shell(commands, sizeof(commands) / sizeof(Command));
+static TestPort test;
+static SerialLink wire(*test.port);
+
+static unsigned long overruns() {
+  char *text = nullptr;
+  size_t size = 0;
+  FILE *out = open_memstream(&text, &size);
+  wire.summary(out);
+  fclose(out);
+  unsigned long in, sent, lost = -1;
+  sscanf(text, "link: %lu bytes in, %lu out; %lu overruns", &in, &sent,
+         &lost);
+  free(text);
+  return lost;
+}
+
+void setup() {
+  CHECK(wire.configure("baud=115200,fifo=128,buffer=256"));
+  shell.begin(wire);
+  CHECK(test.expect("shell> "));
+
+  // all of it arrives while `slow` runs
+  char traffic[TRAFFIC + 64] = "slow\n";
+  size_t len = strlen(traffic);
+  int lines = 0;
+  while (len + 8 < TRAFFIC) {
+    len += snprintf(&traffic[len], sizeof(traffic) - len, "n %d\n", lines++);
+  }
+  double start = checkSeconds();
+  test.send(traffic, len);
+
+  char last[16];
+  snprintf(last, sizeof(last), "n %d\n", lines - 1);
+  CHECK(test.expect(last, 5000));
+  CHECK(test.expect("shell> "));
+  checkNote("%zu bytes behind a %d ms command ran in %.0f ms", len, SLOW_MS,
+            (checkSeconds() - start) * 1e3);
+
+  CHECK(overruns() == 0);
+  CHECK(count == (size_t)lines);
+  bool ordered = true;
+  for (size_t i = 0; i < count; i++) {
+    if (numbers[i] != (int)i) ordered = false;
+  }
+  CHECK(ordered);
+
+  // the bytes come in slowly, within the stream's timeout
+  test.send("take\n");
+  CHECK(test.expect("take\n"));
+  for (const char *c = "hello"; *c; c++) {
+    delay(100);
+    test.send(c, 1);
+  }
+  CHECK(test.expect("took 5: hello\n"));
+  CHECK(cpu_ms < 50);
+  checkNote("readBytes over 500 ms used %.1f ms of CPU", cpu_ms);
+  checkDone();
+}
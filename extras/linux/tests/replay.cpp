@@ -0,0 +1,185 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Recording a session with `RecordStream` and playing it back with
+ * `ReplayStream`: the recording holds the lines typed, and played back at
+ * a speed of 1 or 2 the lines arrive with their gaps kept or halved, while
+ * at a speed of 0 they all arrive at once. The latency reported for each
+ * line covers the command it ran.
+ */
+#include <Arduino.h>
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "Check.h"
+#include "ReplayStream.h"
+#include "ShellRecord.h"
+#include "ToyShell.h"
+
+#define GAP_MS 200
+#define SLOW_MS 50
+
+class FilePrint : public Print {
+private:
+  FILE *file;
+public:
+  FilePrint(FILE *file) : file(file) {}
+  size_t write(uint8_t c) override { return fputc(c, file) == EOF ? 0 : 1; }
+  size_t write(const uint8_t *buffer, size_t size) override {
+    return fwrite(buffer, 1, size, file);
+  }
+  void flush() override { fflush(file); }
+};
+
+static int cmdEcho(int argc, const char *const *argv, Stream *serial) {
+  for (int i = 1; i < argc; i++) {
+    serial->print(argv[i]);
+    serial->print(i + 1 < argc ? ' ' : '\n');
+  }
+  return 0;
+}
+
+static int cmdSlow(int, const char *const *, Stream *) {
+  delay(SLOW_MS);
+  return 0;
+}
+
+constexpr Command commands[] = {
+    {"echo", cmdEcho},
+    {"slow", cmdSlow},
+};
+
+static Shell shell(commands, sizeof(commands) / sizeof(Command));
+static TestPort test;
+
+static const char *const typed[] = {"echo a", "echo b", "slow", "echo c"};
+#define TYPED (sizeof(typed) / sizeof(*typed))
+
+struct Report {
+  double at;      // seconds, when the line was reported
+  double latency; // milliseconds
+  char line[32];
+};
+
+/*
+ * Read one report line from `fd`, waiting up to two seconds.
+ */
+static bool readReport(int fd, Report &report) {
+  char text[128];
+  size_t len = 0;
+  while (len < sizeof(text) - 1) {
+    struct pollfd p = {fd, POLLIN, 0};
+    if (poll(&p, 1, 2000) <= 0 || read(fd, &text[len], 1) != 1) return false;
+    if (text[len++] == '\n') break;
+  }
+  text[len] = '\0';
+  report.at = checkSeconds();
+  return sscanf(text, "replay: %lf ms  %31[^\n]", &report.latency,
+                report.line) == 2;
+}
+
+/*
+ * Play the recording at `path` into the shell at `speed`, and check the
+ * lines come back in order, spaced as `speed` says.
+ */
+static void replay(const char *path, double speed) {
+  static ReplayStream stream;
+  int fds[2];
+  if (!CHECK(pipe(fds) == 0)) return;
+  FILE *report = fdopen(fds[1], "w");
+  setvbuf(report, nullptr, _IOLBF, 0);
+  CHECK(stream.open(path, speed));
+  stream.setReport(report);
+
+  Report reports[TYPED];
+  size_t count = 0;
+  shell.begin(stream);
+  while (count < TYPED && readReport(fds[0], reports[count]))
+    count++;
+  shell.end();
+  stream.setReport(nullptr);
+  fclose(report);
+  close(fds[0]);
+
+  if (!CHECK(count == TYPED)) return;
+  for (size_t i = 0; i < TYPED; i++)
+    CHECK(!strcmp(reports[i].line, typed[i]));
+  CHECK(reports[2].latency >= SLOW_MS);
+  CHECK(reports[0].latency < SLOW_MS);
+
+  // the gap between the first two lines, as played
+  double gap = (reports[1].at - reports[0].at) * 1e3;
+  if (speed > 0) {
+    double want = GAP_MS / speed;
+    CHECK(gap > want * 0.8 && gap < want * 1.25 + 20);
+    checkNote("speed %g: %.0f ms between lines typed %d ms apart", speed, gap,
+              GAP_MS);
+  } else {
+    double total = (reports[TYPED - 1].at - reports[0].at) * 1e3;
+    CHECK(total < GAP_MS);
+    checkNote("speed 0: %zu lines in %.0f ms", TYPED, total);
+  }
+}
+
+void setup() {
+  char path[] = "/tmp/toyshell-replay-XXXXXX";
+  int fd = mkstemp(path);
+  if (!CHECK(fd >= 0)) checkDone();
+  FILE *file = fdopen(fd, "wb");
+  FilePrint sink(file);
+  RecordStream recorder(*test.port, sink);
+
+  // record a session typed with pauses between the lines
+  recorder.begin();
+  shell.begin(recorder);
+  CHECK(test.expect("shell> "));
+  for (size_t i = 0; i < TYPED; i++) {
+    test.send(typed[i]);
+    test.send("\n");
+    CHECK(test.expect("shell> "));
+    delay(GAP_MS);
+  }
+  shell.end();
+  recorder.end();
+  fclose(file);
+
+  // the lines are in the recording, after the header
+  file = fopen(path, "rb");
+  char saved[256];
+  size_t size = fread(saved, 1, sizeof(saved), file);
+  fclose(file);
+  CHECK(size > 4 && !memcmp(saved, "TSR1", 4));
+  CHECK(memmem(saved, size, "echo a\n", 7));
+  CHECK(memmem(saved, size, "slow\n", 5));
+
+  replay(path, 0);
+  replay(path, 1);
+  replay(path, 2);
+
+  unlink(path);
+  test.close();
+  checkDone();
+}
@@ -0,0 +1,174 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * The scheduler's timer wheel, in real time: jobs due at once, or already
+ * overdue when scheduled, run on the next tick rather than a lap of the
+ * wheel later; later jobs run on time, including ones far enough out to
+ * start on a higher level of the wheel; a periodic job keeps its pace and
+ * skips the runs a busy shell missed; and a shell stopping drops its jobs.
+ */
+#include <Arduino.h>
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Check.h"
+#include "ShellScheduler.h"
+#include "ToyShell.h"
+
+#define SLACK_MS 40 // a couple of wheel ticks, plus scheduling
+#define MARKS 256
+
+struct Mark {
+  char label;
+  double at; // seconds
+};
+
+static Mark marks[MARKS];
+static atomic_uint mark_count;
+
+static int cmdBusy(int argc, const char *const *argv, Stream *) {
+  delay(argc > 1 ? atoi(argv[1]) : 0);
+  return 0;
+}
+
+static int cmdMark(int argc, const char *const *argv, Stream *) {
+  unsigned n = atomic_load(&mark_count);
+  if (argc == 2 && n < MARKS) {
+    marks[n] = {argv[1][0], checkSeconds()};
+    atomic_store(&mark_count, n + 1);
+  }
+  return 0;
+}
+
+constexpr Command commands[] = {
+    {"after", cmdAfter},
+    {"at", cmdAt},
+    {"busy", cmdBusy},
+    {"cancel", cmdCancel},
+    {"every", cmdEvery},
+    {"jobs", cmdJobs},
+    {"mark", cmdMark},
+};
+
+static Shell shell(commands, sizeof(commands) / sizeof(Command));
+static TestPort test;
+
+/*
+ * The milliseconds from `start` to the first mark labelled `label`, or -1
+ * if there is none within `ms` milliseconds.
+ */
+static double waitMark(char label, double start, unsigned long ms) {
+  for (unsigned long waited = 0; waited <= ms; waited += 5) {
+    for (size_t i = 0; i < atomic_load(&mark_count); i++) {
+      if (marks[i].label == label) return (marks[i].at - start) * 1e3;
+    }
+    delay(5);
+  }
+  return -1;
+}
+
+static size_t countMarks(char label, double from, double to) {
+  size_t n = 0;
+  for (size_t i = 0; i < atomic_load(&mark_count); i++) {
+    if (marks[i].label == label && marks[i].at >= from && marks[i].at < to)
+      n++;
+  }
+  return n;
+}
+
+void setup() {
+  shell.begin(*test.port);
+  CHECK(test.expect("shell> "));
+
+  // due at once, and in the past
+  double start = checkSeconds();
+  test.send("after 0 mark a\n");
+  double took = waitMark('a', start, 3000);
+  CHECK(took >= 0 && took < SLACK_MS);
+  checkNote("after 0: ran in %.1f ms", took);
+  start = checkSeconds();
+  test.send("at 1 mark b\n");
+  took = waitMark('b', start, 3000);
+  CHECK(took >= 0 && took < SLACK_MS);
+  checkNote("at a time past: ran in %.1f ms", took);
+
+  // on level 0, and on level 1, past the 2.56 s level 0 covers
+  start = checkSeconds();
+  test.send("after 100 mark c\nafter 3s mark d\n");
+  took = waitMark('c', start, 1000);
+  CHECK(took >= 100 - 10 && took < 100 + SLACK_MS);
+  checkNote("after 100: ran in %.1f ms", took);
+  test.send("jobs\n");
+  CHECK(test.expect(", every", 200) == false);
+  took = waitMark('d', start, 4000);
+  CHECK(took >= 3000 - 10 && took < 3000 + SLACK_MS);
+  checkNote("after 3s: ran in %.1f ms", took);
+
+  // keeping pace, then skipping what a busy shell missed
+  test.skip();
+  start = checkSeconds();
+  test.send("every 50 mark e\n");
+  CHECK(test.expect("every 50 mark e\n["));
+  delay(520);
+  size_t paced = countMarks('e', start, checkSeconds());
+  CHECK(paced >= 9 && paced <= 11);
+  checkNote("every 50: %zu runs in 520 ms", paced);
+  test.send("jobs\n");
+  CHECK(test.expect(", every 50ms: mark e\n"));
+  test.send("busy 300\n");
+  delay(150);
+  double busy = checkSeconds();
+  delay(250);
+  // the runs due while `busy` ran collapse into one
+  size_t after = countMarks('e', busy, busy + 0.2);
+  CHECK(after <= 2);
+  checkNote("every 50 behind a 300 ms command: %zu runs when it ended",
+            after);
+  test.send("cancel all\njobs\n");
+  delay(100);
+  size_t total = atomic_load(&mark_count);
+  delay(100);
+  CHECK(atomic_load(&mark_count) == total);
+
+  // bad times
+  test.send("after 25d mark f\n");
+  CHECK(test.expect("after: Bad time: 25d"));
+  test.send("after -1 mark f\n");
+  CHECK(test.expect("after: Bad time: -1"));
+
+  // a shell stopping drops its jobs; the next one starts afresh
+  test.send("after 200 mark g\n");
+  CHECK(test.expect("after 200 mark g\n["));
+  shell.end();
+  shell.begin(*test.port);
+  CHECK(test.expect("shell> "));
+  test.send("jobs\nafter 0 mark h\n");
+  CHECK(test.expect("[0]\n"));
+  CHECK(waitMark('h', checkSeconds(), 1000) >= 0);
+  CHECK(waitMark('g', checkSeconds(), 300) < 0);
+
+  shell.end();
+  test.close();
+  checkDone();
+}
@@ -0,0 +1,115 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Scratch memory: a command gets aligned memory up to `SHELL_SCRATCH` in
+ * all, and none past it; all of it comes back when the command returns,
+ * and what a command run through `execute` took comes back when that one
+ * returns; the peak records the most in use at once; and tasks other than
+ * the shell's get none.
+ */
+#include <Arduino.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "Check.h"
+#include "ToyShell.h"
+
+#define ALIGN alignof(max_align_t)
+#define ROUND(n) (((n) + ALIGN - 1) / ALIGN * ALIGN)
+
+static char *first, *second;
+static bool aligned = true;
+
+static char *take(size_t size) {
+  char *memory = (char *)Shell::scratch(size);
+  if ((uintptr_t)memory % ALIGN) aligned = false;
+  return memory;
+}
+
+static int cmdFill(int, const char *const *, Stream *serial) {
+  // odd sizes, rounded up, until nothing is left
+  size_t total = 0;
+  char *memory;
+  while ((memory = take(7)) != nullptr) {
+    memory[6] = 'x';
+    total += ROUND(7);
+  }
+  serial->printf("filled %zu\n", total);
+  return 0;
+}
+
+static int cmdInner(int, const char *const *, Stream *) {
+  second = take(100);
+  return second ? 0 : 1;
+}
+
+static int cmdOuter(int, const char *const *, Stream *serial) {
+  char *mine = take(100);
+  char line[] = "inner";
+  Shell::current()->execute(line);
+  first = take(100);
+  serial->printf("outer %s\n", mine && first == second ? "ok" : "bad");
+  return 0;
+}
+
+constexpr Command commands[] = {
+    {"fill", cmdFill},
+    {"inner", cmdInner},
+    {"outer", cmdOuter},
+};
+
+static Shell shell(commands, sizeof(commands) / sizeof(Command));
+static TestPort test;
+
+void setup() {
+  CHECK(Shell::scratch(16) == nullptr);
+
+  shell.begin(*test.port);
+  CHECK(test.expect("shell> "));
+  CHECK(shell.scratchPeak() == 0);
+
+  // all of it, twice over, since it comes back in between
+  char want[32];
+  snprintf(want, sizeof(want), "filled %zu\n",
+           SHELL_SCRATCH / ROUND(7) * ROUND(7));
+  test.send("fill\n");
+  CHECK(test.expect(want));
+  test.send("fill\n");
+  CHECK(test.expect(want));
+  CHECK(aligned);
+  CHECK(shell.scratchPeak() == SHELL_SCRATCH / ROUND(7) * ROUND(7));
+
+  // the inner command's memory is the outer one's again once it returns
+  shell.end();
+  shell.begin(*test.port);
+  CHECK(test.expect("shell> "));
+  test.send("outer\n");
+  CHECK(test.expect("outer ok\n"));
+  CHECK(shell.scratchPeak() == 2 * ROUND(100));
+  checkNote("%d bytes of scratch; peak %zu after nesting", SHELL_SCRATCH,
+            shell.scratchPeak());
+
+  shell.end();
+  test.close();
+  checkDone();
+}
@@ -0,0 +1,159 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Scripts: loops, conditions and substitutions work out as in C; Ctrl-C
+ * breaks out of a loop that runs no commands, even behind lines typed
+ * ahead; and compile errors name the line, including lines, or command
+ * lines with values filled in, too long to hold.
+ */
+#include <Arduino.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "Check.h"
+#include "ShellScript.h"
+#include "ShellVars.h"
+#include "ToyShell.h"
+
+static int limit = 10;
+static int said;
+
+static int cmdSay(int argc, const char *const *argv, Stream *serial) {
+  said += 1;
+  for (int i = 1; i < argc; i++)
+    serial->printf(i > 1 ? " %s" : "%s", argv[i]);
+  serial->print('\n');
+  return argc - 1;
+}
+
+constexpr Variable variables[] = {
+    shellVar("limit", &limit),
+};
+
+constexpr Script scripts[] = {
+    {"bad", "if 1\nsay never\n"},
+    {"count", "for i in 1..limit\nsay $i\nend\n"},
+};
+
+constexpr Command commands[] = {
+    {"run", cmdRun},
+    {"say", cmdSay},
+    {"script", cmdScript},
+};
+
+static Shell shell(commands, sizeof(commands) / sizeof(Command));
+static TestPort test;
+
+void setup() {
+  shellVariables(variables, sizeof(variables) / sizeof(Variable));
+  shellScripts(scripts, sizeof(scripts) / sizeof(Script));
+  shell.begin(*test.port);
+  CHECK(test.expect("shell> "));
+
+  // nested loops, conditions, and values in command lines
+  said = 0;
+  test.send("script\n"
+            "let total = 0\n"
+            "for i in 1..10\n"
+            "  j = 0\n"
+            "  while j < i\n"
+            "    if (i + j) % 3 == 0\n"
+            "      total = total + i * j\n"
+            "    else\n"
+            "      total = total - 1\n"
+            "    end\n"
+            "    j = j + 1\n"
+            "  end\n"
+            "end\n"
+            "say $total $x(total * 16) $(-7 / 2) $(1 << 31)\n"
+            "say $status\n"
+            ".\n");
+  int total = 0;
+  for (int i = 1; i <= 10; i++) {
+    for (int j = 0; j < i; j++)
+      total += (i + j) % 3 == 0 ? i * j : -1;
+  }
+  char want[64];
+  snprintf(want, sizeof(want), "\n%d 0x%x -3 -2147483648\n4\nshell> ", total,
+           total * 16);
+  CHECK(test.expect(want));
+  CHECK(said == 2);
+
+  // a stored script, reading a variable
+  test.send("run count\n");
+  CHECK(test.expect("\n1\n2\n3\n4\n5\n6\n7\n8\n9\n10\nshell> "));
+  test.send("run bad\n");
+  CHECK(test.expect("run: bad: Line 2: missing end\n"));
+
+  // a loop without commands, broken out of by Ctrl-C; the next line runs
+  test.skip();
+  double start = checkSeconds();
+  test.send("script\nlet n = 0\nwhile 1\nn = n + 1\nend\n.\n");
+  delay(300);
+  test.send("\x03say after\n");
+  CHECK(test.expect("script: Interrupted\n"));
+  CHECK(test.expect("say after\nafter\nshell> "));
+  checkNote("interrupted a tight loop after %.0f ms",
+            (checkSeconds() - start) * 1e3);
+
+  // and so with lines typed ahead of the key
+  test.send("script\nwhile 1\nend\n.\nsay next\n");
+  delay(300);
+  test.send("\x03");
+  CHECK(test.expect("script: Interrupted\n"));
+  CHECK(test.expect("say next\nnext\nshell> "));
+
+  // compile errors, which leave the rest of the script unread as commands
+  said = 0;
+  test.send("script\nif 1\nelse\nelse\nsay no\nend\n.\n");
+  CHECK(test.expect("script: Line 3: else without if\n"));
+  test.send("script\nx = (1 + 2\n.\n");
+  CHECK(test.expect("script: Line 1: missing )\n"));
+  test.send("script\nlet 5 = 1\n.\n");
+  CHECK(test.expect("script: Line 1: expected a variable\n"));
+  test.send("script\nx = nothing + 1\n.\n");
+  CHECK(test.expect("script: Line 1: unknown variable\n"));
+  test.send("script\nsay $(1 / 0)\n.\n");
+  CHECK(test.expect("script: Division by zero\n"));
+  CHECK(said == 0);
+
+  // too long to hold, as typed, or once values are filled in
+  char line[400] = "script\nsay ";
+  memset(line + strlen(line), 'a', 260);
+  strcat(line, "\n.\n");
+  test.send(line);
+  CHECK(test.expect("script: Line 1: line too long\n"));
+  strcpy(line, "script\nsay ");
+  memset(line + strlen(line), 'a', 220);
+  line[11 + 220] = '\0';
+  for (int i = 0; i < 4; i++)
+    strcat(line, " $limit");
+  strcat(line, "\n.\n");
+  test.send(line);
+  CHECK(test.expect("script: Line 1: command line too long\n"));
+  CHECK(said == 0);
+
+  shell.end();
+  test.close();
+  checkDone();
+}
@@ -0,0 +1,216 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * The simulated serial link: output leaves at the baud rate, a command
+ * line's round trip costs at least the character times of what crosses
+ * the wire, bytes arriving while nothing reads overrun a small FIFO, and
+ * bit errors corrupt about as many bytes as the error rate says.
+ */
+#include <Arduino.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Check.h"
+#include "SerialLink.h"
+#include "ToyShell.h"
+
+#define SPEW 480 // bytes, half a second at 9600 baud
+#define SLOW_MS 200
+#define NOISE 2000 // bytes
+#define BER 0.002
+
+static int cmdEcho(int argc, const char *const *argv, Stream *serial) {
+  for (int i = 1; i < argc; i++) {
+    serial->print(argv[i]);
+    serial->print(i + 1 < argc ? ' ' : '\n');
+  }
+  return 0;
+}
+
+static int cmdSpew(int, const char *const *, Stream *serial) {
+  char line[48];
+  memset(line, 'x', sizeof(line) - 1);
+  line[sizeof(line) - 1] = '\n';
+  for (int i = 0; i < SPEW / (int)sizeof(line); i++)
+    serial->write((const uint8_t *)line, sizeof(line));
+  return 0;
+}
+
+static int cmdSlow(int, const char *const *, Stream *) {
+  delay(SLOW_MS);
+  return 0;
+}
+
+constexpr Command commands[] = {
+    {"echo", cmdEcho},
+    {"slow", cmdSlow},
+    {"spew", cmdSpew},
+};
+
+static Shell shell(commands, sizeof(commands) / sizeof(Command));
+
+struct Counts {
+  unsigned long in, out, overruns, corrupted;
+};
+
+static Counts counts(SerialLink &link) {
+  char *text = nullptr;
+  size_t size = 0;
+  FILE *out = open_memstream(&text, &size);
+  link.summary(out);
+  fclose(out);
+  Counts c = {};
+  sscanf(text, "link: %lu bytes in, %lu out; %lu overruns, %lu corrupted",
+         &c.in, &c.out, &c.overruns, &c.corrupted);
+  free(text);
+  return c;
+}
+
+/*
+ * Time `spew` at `baud`, against the character time of its output.
+ */
+static void pacing(unsigned long baud) {
+  TestPort test;
+  SerialLink link(*test.port);
+  char options[32];
+  snprintf(options, sizeof(options), "baud=%lu", baud);
+  CHECK(link.configure(options));
+  shell.begin(link);
+  CHECK(test.expect("shell> "));
+
+  test.send("spew\n");
+  CHECK(test.expect("x\n", 5000));
+  double start = checkSeconds();
+  CHECK(test.expect("shell> ", 5000));
+  double took = checkSeconds() - start;
+  shell.end();
+
+  // from the first line out to the prompt
+  double want = (SPEW - 48 + 7) * 10.0 / baud;
+  CHECK(took > want * 0.9 && took < want * 1.2 + 0.01);
+  checkNote("%lu baud: %d bytes out in %.1f ms, %.1f ms on the wire", baud,
+            SPEW, took * 1e3, want * 1e3);
+}
+
+/*
+ * Time the round trip of a short line at `baud`, against the character
+ * time of everything that crossed the wire for it. The best of a few
+ * trips counts, so a host busy for a moment does not.
+ */
+static double roundTrip(unsigned long baud) {
+  TestPort test;
+  SerialLink link(*test.port);
+  char options[32];
+  snprintf(options, sizeof(options), "baud=%lu", baud);
+  CHECK(link.configure(options));
+  shell.begin(link);
+  CHECK(test.expect("shell> "));
+
+  double took = 1e9;
+  unsigned long bytes = 0;
+  for (int trip = 0; trip < 3; trip++) {
+    delay(20);
+    Counts before = counts(link);
+    double start = checkSeconds();
+    test.send("echo ok\n");
+    CHECK(test.expect("ok\n"));
+    CHECK(test.expect("shell> "));
+    double elapsed = checkSeconds() - start;
+    Counts after = counts(link);
+    if (elapsed < took) took = elapsed;
+    bytes = after.in - before.in + after.out - before.out;
+  }
+  shell.end();
+
+  double wire = bytes * 10.0 / baud;
+  // the link notices a byte sent when the shell next looks, and counts it
+  // as sent when it last looked, up to a tick of polling earlier
+  CHECK(took >= wire - 0.002);
+  // plus at most the idle timeout of ten characters, and scheduling
+  CHECK(took < wire + 10 * 10.0 / baud + 0.01);
+  checkNote("%lu baud: round trip %.2f ms, %lu bytes on the wire %.2f ms",
+            baud, took * 1e3, bytes, wire * 1e3);
+  return took;
+}
+
+void setup() {
+  pacing(9600);
+  pacing(57600);
+  double slow = roundTrip(9600);
+  double fast = roundTrip(115200);
+  CHECK(slow > fast * 4);
+
+  // nothing reads while `slow` runs, and a small FIFO overflows
+  {
+    TestPort test;
+    SerialLink link(*test.port);
+    CHECK(link.configure("baud=115200,fifo=16,threshold=8,buffer=32"));
+    shell.begin(link);
+    CHECK(test.expect("shell> "));
+    char traffic[400] = "slow\n";
+    memset(&traffic[5], ' ', sizeof(traffic) - 6);
+    traffic[sizeof(traffic) - 1] = '\n';
+    test.send(traffic, sizeof(traffic));
+    CHECK(test.expect("shell> "));
+    delay(50);
+    Counts c = counts(link);
+    shell.end();
+    CHECK(c.overruns > 0);
+    CHECK(c.in == sizeof(traffic));
+    checkNote("small FIFO: %lu of %zu bytes lost behind a %d ms command",
+              c.overruns, sizeof(traffic), SLOW_MS);
+  }
+
+  // bit errors, at a known rate
+  {
+    TestPort test;
+    SerialLink link(*test.port);
+    // with room for all of it, so nothing is lost to overruns
+    CHECK(link.configure("baud=1000000,fifo=4096,buffer=4096,ber=0.002,"
+                         "seed=7"));
+    shell.begin(link);
+    CHECK(test.expect("shell> "));
+    static char noise[NOISE];
+    for (size_t i = 0; i < NOISE; i++)
+      noise[i] = i % 40 == 39 ? '\n' : 'a' + i % 26;
+    test.send(noise, NOISE);
+    Counts c = {};
+    for (int wait = 0; wait < 200 && c.in < NOISE; wait++) {
+      delay(10);
+      c = counts(link);
+    }
+    shell.end();
+    CHECK(c.in == NOISE);
+    CHECK(c.overruns == 0);
+    // each byte has eight data bits that may flip; allow three standard
+    // deviations either way
+    double want = NOISE * (1 - pow(1 - BER, 8));
+    double spread = 3 * sqrt(want);
+    CHECK(fabs(c.corrupted - want) < spread);
+    checkNote("ber %g: %lu of %d bytes corrupted, %.0f expected", BER,
+              c.corrupted, NOISE, want);
+  }
+  checkDone();
+}
@@ -0,0 +1,205 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * The shell over TCP on loopback: several clients at once each get the
+ * output of their own lines, a client past `FD_SETSIZE` is turned away,
+ * and how many commands a second the listener serves across all clients.
+ */
+#include <Arduino.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "Check.h"
+#include "ShellSocket.h"
+#include "ToyShell.h"
+
+#define ROUNDS 2000
+
+static int cmdEcho(int argc, const char *const *argv, Stream *serial) {
+  for (int i = 1; i < argc; i++) {
+    serial->print(argv[i]);
+    serial->print(i + 1 < argc ? ' ' : '\n');
+  }
+  return 0;
+}
+
+constexpr Command commands[] = {
+    {"echo", cmdEcho},
+};
+
+static Shell shell(commands, sizeof(commands) / sizeof(Command));
+static ShellListener listener;
+static TestPort test;
+
+/*
+ * A socket that gives up on reads after a few seconds, so a test that
+ * fails does not hang.
+ */
+static int makeSocket() {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  timeval timeout = {5, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  return fd;
+}
+
+static int dial() {
+  int fd = makeSocket();
+  if (fd < 0) return -1;
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(listener.port());
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/*
+ * Read from `fd` until `text` ends what came, which is then in `buffer`.
+ */
+static bool await(int fd, const char *text, char *buffer, size_t size) {
+  size_t len = 0;
+  size_t n = strlen(text);
+  while (len + 1 < size) {
+    ssize_t count = recv(fd, &buffer[len], size - 1 - len, 0);
+    if (count <= 0) break;
+    len += count;
+    buffer[len] = '\0';
+    if (len >= n && !strcmp(&buffer[len - n], text)) return true;
+  }
+  buffer[len] = '\0';
+  return false;
+}
+
+struct Client {
+  int id;
+  unsigned wrong;
+};
+
+static void *talk(void *arg) {
+  Client *client = (Client *)arg;
+  char buffer[256];
+  int fd = dial();
+  if (fd < 0 || !await(fd, "shell> ", buffer, sizeof(buffer))) {
+    client->wrong = ROUNDS;
+    if (fd >= 0) close(fd);
+    return nullptr;
+  }
+  for (int i = 0; i < ROUNDS; i++) {
+    char line[64], answer[80];
+    snprintf(line, sizeof(line), "echo client %d line %d\n", client->id, i);
+    snprintf(answer, sizeof(answer), "%sshell> ", line + 5);
+    send(fd, line, strlen(line), MSG_NOSIGNAL);
+    if (!await(fd, "shell> ", buffer, sizeof(buffer)) ||
+        strcmp(buffer, answer)) {
+      client->wrong += 1;
+    }
+  }
+  close(fd);
+  return nullptr;
+}
+
+static void checkClients() {
+  Client clients[SHELL_SOCKET_CLIENTS];
+  pthread_t threads[SHELL_SOCKET_CLIENTS];
+  double start = checkSeconds();
+  for (int i = 0; i < SHELL_SOCKET_CLIENTS; i++) {
+    clients[i] = {i, 0};
+    pthread_create(&threads[i], nullptr, talk, &clients[i]);
+  }
+  unsigned wrong = 0;
+  for (int i = 0; i < SHELL_SOCKET_CLIENTS; i++) {
+    pthread_join(threads[i], nullptr);
+    wrong += clients[i].wrong;
+  }
+  double took = checkSeconds() - start;
+  CHECK(wrong == 0);
+  checkNote("%d clients: %.0f commands per second",
+            SHELL_SOCKET_CLIENTS, SHELL_SOCKET_CLIENTS * ROUNDS / took);
+}
+
+/*
+ * Fill the descriptors below `FD_SETSIZE`, so the next one accepted is
+ * past what `select` can watch.
+ */
+static void checkTooMany() {
+  rlimit limit;
+  getrlimit(RLIMIT_NOFILE, &limit);
+  if (limit.rlim_max < FD_SETSIZE + 16) {
+    checkNote("descriptor limit too low to go past FD_SETSIZE; skipped");
+    return;
+  }
+  rlimit raised = {FD_SETSIZE + 16, limit.rlim_max};
+  setrlimit(RLIMIT_NOFILE, &raised);
+
+  int fd = makeSocket();
+  int fillers[FD_SETSIZE];
+  int filled = 0;
+  for (;;) {
+    int filler = dup(0);
+    if (filler < 0) break;
+    fillers[filled++] = filler;
+    if (filler >= FD_SETSIZE - 1) break;
+  }
+
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(listener.port());
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  char buffer[256];
+  CHECK(connect(fd, (sockaddr *)&addr, sizeof(addr)) == 0);
+  CHECK(await(fd, "Too many open files\n", buffer, sizeof(buffer)));
+  close(fd);
+
+  for (int i = 0; i < filled; i++) close(fillers[i]);
+  setrlimit(RLIMIT_NOFILE, &limit);
+
+  // and the listener still works
+  fd = dial();
+  CHECK(fd >= 0 && await(fd, "shell> ", buffer, sizeof(buffer)));
+  if (fd >= 0) close(fd);
+}
+
+void setup() {
+  shell.begin(*test.port);
+  CHECK(listener.begin(shell, 0));
+  CHECK(listener.port() != 0);
+  checkClients();
+  checkTooMany();
+  shell.end();
+  listener.end();
+  checkDone();
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Splitting lines as they arrive: random lines, sent in random pieces,
+ * must reach the command with the same arguments as when the whole line
+ * is split at once by `Shell::execute`.
+ */
+#include <Arduino.h>
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Check.h"
+#include "ToyShell.h"
+
+#define LINES 2000
+
+static char seen[SHELL_LINE_MAX * 2];
+
+static int cmdArgs(int argc, const char *const *argv, Stream *) {
+  size_t len = snprintf(seen, sizeof(seen), "%d:", argc);
+  for (int i = 0; i < argc && len < sizeof(seen); i++) {
+    len += snprintf(&seen[len], sizeof(seen) - len, "[%s]", argv[i]);
+  }
+  return 0;
+}
+
+static int cmdIdle(int, const char *const *, Stream *) {
+  return 0;
+}
+
+constexpr Command commands[] = {
+    {"args", cmdArgs},
+    {"idle", cmdIdle},
+};
+
+static Shell shell(commands, sizeof(commands) / sizeof(Command));
+static TestPort test;
+
+/*
+ * A line for `args`, with words of random length, runs of spaces, and now
+ * and then more arguments than fit.
+ */
+static size_t makeLine(char *line) {
+  static const char chars[] = "ab1-_. ";
+  size_t len = strlen(strcpy(line, "args"));
+  if (rand() % 2) {
+    line[len++] = ' ';
+    size_t end = len + rand() % (rand() % 20 ? 40 : 120);
+    while (len < end) line[len++] = chars[rand() % (sizeof(chars) - 1)];
+  }
+  line[len] = '\0';
+  return len;
+}
+
+void setup() {
+  srand(57);
+  shell.begin(*test.port);
+  CHECK(test.expect("shell> "));
+
+  unsigned mismatches = 0;
+  for (unsigned n = 0; n < LINES; n++) {
+    char line[256];
+    size_t len = makeLine(line);
+    line[len] = '\n';
+
+    // send it in pieces, giving the shell a chance to read each one
+    seen[0] = '\0';
+    for (size_t sent = 0; sent <= len;) {
+      size_t piece = 1 + rand() % (rand() % 4 ? 4 : 64);
+      if (piece > len + 1 - sent) piece = len + 1 - sent;
+      test.send(&line[sent], piece);
+      sent += piece;
+      if (rand() % 2) sched_yield();
+    }
+    if (!CHECK(test.expect("shell> "))) break;
+    char scanned[sizeof(seen)];
+    strcpy(scanned, seen);
+
+    // the shell waits for the next line now, so it is safe to run one
+    line[len] = '\0';
+    shell.execute(line, test.port);
+    if (strcmp(scanned, seen) && mismatches++ < 3) {
+      checkNote("split as it came: %s", scanned);
+      checkNote("split at once:    %s", seen);
+    }
+  }
+  CHECK(mismatches == 0);
+
+  test.close();
+  checkDone();
+}
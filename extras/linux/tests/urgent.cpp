@@ -0,0 +1,150 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Urgent commands: `stop` gets through while a long command runs with a
+ * backlog of lines queued behind it, within a bound of the line being
+ * sent, its output whole between the running command's lines; it cancels
+ * the command running, and the backlog still runs, in order, afterwards.
+ * A single key that could start `stop` still stops a command waiting for
+ * any key, and the line it starts stays whole.
+ */
+#include <Arduino.h>
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Check.h"
+#include "ToyShell.h"
+
+#define TRIALS 20
+#define BACKLOG 10 // lines queued behind the running command
+#define BOUND_MS 10 // a tick of polling, plus scheduling on a busy host
+
+static atomic_ulong stopped_at; // micros()
+static int numbers[TRIALS * BACKLOG];
+static size_t count;
+static char set_to[16];
+
+static int cmdDump(int, const char *const *, Stream *serial) {
+  serial->print("dump started\n");
+  for (int i = 0; i < 5000 && !Shell::cancelled(); i++) {
+    serial->printf("%08x: 00 00 00 00 00 00 00 00\n", i * 8);
+    delay(2);
+  }
+  serial->print("dump stopped\n");
+  return 0;
+}
+
+static int cmdKeys(int, const char *const *, Stream *serial) {
+  for (int i = 0; i < 2000 && serial->available() <= 0; i++)
+    delay(1);
+  serial->print(serial->available() > 0 ? "key\n" : "timeout\n");
+  return 0;
+}
+
+static int cmdN(int argc, const char *const *argv, Stream *) {
+  if (argc == 2 && count < TRIALS * BACKLOG) numbers[count++] = atoi(argv[1]);
+  return 0;
+}
+
+static int cmdSet(int argc, const char *const *argv, Stream *serial) {
+  if (argc == 2) strncpy(set_to, argv[1], sizeof(set_to) - 1);
+  serial->printf("set %s\n", set_to);
+  return 0;
+}
+
+static int cmdStop(int, const char *const *, Stream *serial) {
+  atomic_store(&stopped_at, micros());
+  serial->print("stopped\n");
+  return 0;
+}
+
+constexpr Command commands[] = {
+    {"dump", cmdDump},
+    {"keys", cmdKeys},
+    {"n", cmdN},
+    {"set", cmdSet},
+    {"stop", cmdStop, SHELL_URGENT | SHELL_CANCEL},
+};
+
+static Shell shell(commands, sizeof(commands) / sizeof(Command));
+static TestPort test;
+
+static int cmpDouble(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+void setup() {
+  shell.begin(*test.port);
+  CHECK(test.expect("shell> "));
+
+  double latencies[TRIALS];
+  bool stopped = true;
+  for (int t = 0; t < TRIALS; t++) {
+    test.send("dump\n");
+    stopped &= test.expect("dump started\n");
+    for (int i = 0; i < BACKLOG; i++) {
+      char line[16];
+      snprintf(line, sizeof(line), "n %d\n", t * BACKLOG + i);
+      test.send(line);
+    }
+    delay(10);
+    atomic_store(&stopped_at, 0);
+    unsigned long start = micros();
+    test.send("stop\n");
+    // its echo and output come out whole, between lines of the dump
+    stopped &= test.expect("00\nstop\nstopped\n");
+    stopped &= test.expect("dump stopped\n");
+    latencies[t] = (long)(atomic_load(&stopped_at) - start) / 1000.0;
+  }
+  CHECK(stopped);
+  qsort(latencies, TRIALS, sizeof(*latencies), cmpDouble);
+  CHECK(latencies[0] > 0);
+  CHECK(latencies[TRIALS - 1] < BOUND_MS);
+  checkNote("stop behind a running command and %d lines: %.2f ms median, "
+            "%.2f ms worst, bound %d ms",
+            BACKLOG, latencies[TRIALS / 2], latencies[TRIALS - 1], BOUND_MS);
+
+  // the backlog ran afterwards, in order, and was not cancelled
+  test.send("set done\n");
+  CHECK(test.expect("set done\n", 5000));
+  CHECK(count == TRIALS * BACKLOG);
+  bool ordered = true;
+  for (size_t i = 0; i < count; i++) {
+    if (numbers[i] != (int)i) ordered = false;
+  }
+  CHECK(ordered);
+
+  // `s` could start `stop`, but a command waiting for a key sees it
+  test.send("keys\n");
+  delay(50);
+  test.send("s");
+  CHECK(test.expect("key\n"));
+  test.send("et 5\n");
+  CHECK(test.expect("set 5\n"));
+
+  shell.end();
+  test.close();
+  checkDone();
+}
@@ -0,0 +1,168 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Variables by name: reading and writing each kind, ranges and the width
+ * of the C++ type, boolean words, enumeration labels, arrays, read-only
+ * probes, and values that do not fit even in 64 bits. A rejected line
+ * leaves the variable as it was.
+ */
+#include <Arduino.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include "Check.h"
+#include "ShellVars.h"
+#include "ToyShell.h"
+
+/*
+ * A stream keeping what is written to it.
+ */
+class Capture : public Stream {
+public:
+  char text[512] = "";
+  size_t len = 0;
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t *buffer, size_t size) override {
+    if (len + size >= sizeof(text)) size = sizeof(text) - 1 - len;
+    memcpy(&text[len], buffer, size);
+    len += size;
+    text[len] = '\0';
+    return size;
+  }
+  int available() override { return -1; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+};
+
+enum class Mode : uint8_t { OFF, SLOW, FAST };
+
+static const char *const mode_labels[] = {"off", "slow", "fast"};
+
+static int64_t big;
+static uint8_t count;
+static float gain = 1.0f;
+static bool led;
+static int16_t levels[3];
+static Mode mode;
+static uint64_t wide;
+
+static float readBattery() { return 3.75f; }
+
+constexpr Variable variables[] = {
+    shellVar("big", &big),
+    shellVar("count", &count),
+    shellVar("gain", &gain, 0.0, 10.0),
+    shellVar("led", &led),
+    shellVar("levels", &levels, -100, 100),
+    shellEnum("mode", &mode, mode_labels),
+    shellProbe("vbat", readBattery),
+    shellVar("wide", &wide),
+};
+static_assert(shellSorted(variables), "variables must be sorted");
+
+constexpr Command commands[] = {
+    {"get", cmdGet},
+    {"set", cmdSet},
+};
+
+static Shell shell(commands, sizeof(commands) / sizeof(Command));
+
+/*
+ * Run `text`, checking it printed `want` and returned `status`.
+ */
+static bool run(const char *text, const char *want, int status = 0) {
+  Capture out;
+  char line[SHELL_LINE_MAX];
+  strcpy(line, text);
+  int result = shell.execute(line, &out);
+  if (result == status && !strcmp(out.text, want)) return true;
+  checkNote("%s: got %d, \"%s\"", text, result, out.text);
+  return false;
+}
+
+void setup() {
+  shellVariables(variables, sizeof(variables) / sizeof(Variable));
+
+  // each kind reads back what was set
+  CHECK(run("set count 200", ""));
+  CHECK(run("get count", "200\n"));
+  CHECK(run("set gain 2.5", ""));
+  CHECK(run("get gain", "2.5\n"));
+  CHECK(run("set big -0x10", ""));
+  CHECK(run("get big", "-16\n"));
+  CHECK(run("get count gain", "count = 200\ngain = 2.5\n"));
+  CHECK(run("get nothing", "get: No such variable: nothing\n", 1));
+  CHECK(run("set nothing 1", "set: No such variable: nothing\n", 1));
+
+  // the declared range, then the width of the type
+  CHECK(run("set gain 11", "set: 11 is out of range [0, 10]\n", 1));
+  CHECK(run("set gain fast", "set: Not a number: fast\n", 1));
+  CHECK(run("set count 256", "set: 256 does not fit in 8 bits\n", 1));
+  CHECK(run("set count -1", "set: Not an unsigned integer: -1\n", 1));
+  CHECK(run("get gain count", "gain = 2.5\ncount = 200\n"));
+
+  // booleans take words as well as digits
+  CHECK(run("set led on", ""));
+  CHECK(run("get led", "true\n"));
+  CHECK(run("set led FALSE", ""));
+  CHECK(run("get led", "false\n"));
+  CHECK(run("set led 1", ""));
+  CHECK(run("set led yes", "set: Not a boolean: yes\n", 1));
+  CHECK(led);
+
+  // enumerations take a label or its number
+  CHECK(run("set mode fast", ""));
+  CHECK(mode == Mode::FAST);
+  CHECK(run("get mode", "fast\n"));
+  CHECK(run("set mode 1", ""));
+  CHECK(run("get mode", "slow\n"));
+  CHECK(run("set mode 3", "set: 3 is out of range [0, 2]\n", 1));
+  CHECK(run("set mode fastest", "set: Not an integer: fastest\n", 1));
+
+  // arrays fill from the first element; every value is checked first
+  CHECK(run("set levels 5 -6", ""));
+  CHECK(run("get levels", "5 -6 0\n"));
+  CHECK(run("set levels 1 2 3 4", "set: levels holds only 3 value(s)\n", 1));
+  CHECK(run("set levels 7 8 200", "set: 200 is out of range [-100, 100]\n",
+            1));
+  CHECK(run("get levels", "5 -6 0\n"));
+
+  // probes are read, never written
+  CHECK(run("get vbat", "3.75\n"));
+  CHECK(run("set vbat 4", "set: vbat is read-only\n", 1));
+
+  // 64 bits hold their extremes, and nothing past them
+  CHECK(run("set big 9223372036854775807", ""));
+  CHECK(run("get big", "9223372036854775807\n"));
+  CHECK(run("set big -9223372036854775808", ""));
+  CHECK(run("set big 9223372036854775808",
+            "set: 9223372036854775808 does not fit in 64 bits\n", 1));
+  CHECK(run("set big -9223372036854775809",
+            "set: -9223372036854775809 does not fit in 64 bits\n", 1));
+  CHECK(run("get big", "-9223372036854775808\n"));
+  CHECK(run("set wide 18446744073709551615", ""));
+  CHECK(run("set wide 18446744073709551616",
+            "set: 18446744073709551616 does not fit in 64 bits\n", 1));
+  CHECK(wide == UINT64_MAX);
+  checkDone();
+}
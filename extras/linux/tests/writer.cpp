@@ -0,0 +1,214 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Structured output byte for byte: the same document as text, JSON and
+ * CBOR, numbers in the fewest digits or bytes, strings escaped, and what
+ * is left open closed when the writer goes away.
+ */
+#include <Arduino.h>
+
+#include <string.h>
+
+#include "Check.h"
+#include "ShellWriter.h"
+
+/*
+ * A stream keeping what is written to it.
+ */
+class Capture : public Stream {
+public:
+  uint8_t data[512];
+  size_t len = 0;
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t *buffer, size_t size) override {
+    if (len + size > sizeof(data)) size = sizeof(data) - len;
+    memcpy(&data[len], buffer, size);
+    len += size;
+    return size;
+  }
+  int available() override { return -1; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+};
+
+/*
+ * Check that `out` holds exactly the `len` bytes of `want`, noting the
+ * first difference if not.
+ */
+static bool same(const Capture &out, const void *want, size_t len) {
+  const uint8_t *bytes = (const uint8_t *)want;
+  size_t i = 0;
+  while (i < out.len && i < len && out.data[i] == bytes[i]) i++;
+  if (i == len && i == out.len) return true;
+  checkNote("byte %u of %u: got 0x%02x, want 0x%02x", (unsigned)i,
+            (unsigned)out.len, i < out.len ? out.data[i] : 0,
+            i < len ? bytes[i] : 0);
+  return false;
+}
+
+static bool same(const Capture &out, const char *want) {
+  return same(out, want, strlen(want));
+}
+
+/*
+ * Two records in an array, then a number on its own.
+ */
+static void sensors(Stream *stream, ShellFormat format) {
+  ShellWriter out(stream, format);
+  out.beginArray();
+  out.beginRecord();
+  out.field("name", "adc0");
+  out.field("value", 3.25);
+  out.field("ok", true);
+  out.endRecord();
+  out.beginRecord();
+  out.field("name", "x\ty");
+  out.field("value", 0.1);
+  out.field("ok", false);
+  out.beginArray("tags");
+  out.value(1);
+  out.value(-1);
+  out.value(300);
+  out.endArray();
+  out.null("none");
+  out.endRecord();
+  out.endArray();
+  out.value(7);
+}
+
+static void checkText() {
+  Capture out;
+  sensors(&out, SHELL_FORMAT_TEXT);
+  CHECK(same(out, "- name: adc0\n"
+                  "  value: 3.25\n"
+                  "  ok: true\n"
+                  "- name: x\ty\n"
+                  "  value: 0.1\n"
+                  "  ok: false\n"
+                  "  tags:\n"
+                  "    - 1\n"
+                  "    - -1\n"
+                  "    - 300\n"
+                  "\n"
+                  "7\n"));
+}
+
+static void checkJson() {
+  Capture out;
+  sensors(&out, SHELL_FORMAT_JSON);
+  CHECK(same(out, "[{\"name\":\"adc0\",\"value\":3.25,\"ok\":true},"
+                  "{\"name\":\"x\\ty\",\"value\":0.1,\"ok\":false,"
+                  "\"tags\":[1,-1,300],\"none\":null}]\n"
+                  "7\n"));
+
+  // escapes, and numbers JSON cannot hold
+  Capture more;
+  {
+    ShellWriter writer(&more, SHELL_FORMAT_JSON);
+    writer.value("\"\\\n\x01");
+    writer.value(0.1 + 0.2);
+    writer.value(1.0 / 0.0);
+    writer.value(4294967296ul);
+  }
+  CHECK(same(more, "\"\\\"\\\\\\n\\u0001\"\n"
+                   "0.30000000000000004\n"
+                   "null\n"
+                   "4294967296\n"));
+}
+
+static void checkCbor() {
+  Capture out;
+  sensors(&out, SHELL_FORMAT_CBOR);
+  static const uint8_t want[] = {
+      0x9f,                                       // array
+      0xbf,                                       // record
+      0x64, 'n', 'a', 'm', 'e', 0x64, 'a', 'd', 'c', '0',
+      0x65, 'v', 'a', 'l', 'u', 'e', 0xfa, 0x40, 0x50, 0x00, 0x00,
+      0x62, 'o', 'k', 0xf5,
+      0xff,
+      0xbf,                                       // record
+      0x64, 'n', 'a', 'm', 'e', 0x63, 'x', '\t', 'y',
+      0x65, 'v', 'a', 'l', 'u', 'e',
+      0xfb, 0x3f, 0xb9, 0x99, 0x99, 0x99, 0x99, 0x99, 0x9a,
+      0x62, 'o', 'k', 0xf4,
+      0x64, 't', 'a', 'g', 's', 0x9f, 0x01, 0x20, 0x19, 0x01, 0x2c, 0xff,
+      0x64, 'n', 'o', 'n', 'e', 0xf6,
+      0xff,
+      0xff,
+      0x07,                                       // then a number
+  };
+  CHECK(same(out, want, sizeof(want)));
+
+  // every size of integer head
+  Capture more;
+  {
+    ShellWriter writer(&more, SHELL_FORMAT_CBOR);
+    writer.value(23);
+    writer.value(24);
+    writer.value(-500);
+    writer.value(70000);
+    writer.value(4294967296ul);
+  }
+  static const uint8_t heads[] = {
+      0x17,
+      0x18, 0x18,
+      0x39, 0x01, 0xf3,
+      0x1a, 0x00, 0x01, 0x11, 0x70,
+      0x1b, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00,
+  };
+  CHECK(same(more, heads, sizeof(heads)));
+}
+
+/*
+ * Containers left open, and nested past the limit, are closed as the
+ * writer goes out of scope.
+ */
+static void checkClosing() {
+  Capture out;
+  {
+    ShellWriter writer(&out, SHELL_FORMAT_JSON);
+    writer.beginArray();
+    writer.beginRecord();
+    writer.field("n", 1);
+  }
+  CHECK(same(out, "[{\"n\":1}]\n"));
+
+  Capture deep;
+  {
+    ShellWriter writer(&deep, SHELL_FORMAT_JSON);
+    for (int i = 0; i < SHELL_WRITER_DEPTH + 2; i++) writer.beginArray();
+    writer.value(1);
+  }
+  char want[2 * SHELL_WRITER_DEPTH + 2];
+  memset(want, '[', SHELL_WRITER_DEPTH);
+  memset(&want[SHELL_WRITER_DEPTH], ']', SHELL_WRITER_DEPTH);
+  want[2 * SHELL_WRITER_DEPTH] = '\n';
+  CHECK(same(deep, want, 2 * SHELL_WRITER_DEPTH + 1));
+}
+
+void setup() {
+  checkText();
+  checkJson();
+  checkCbor();
+  checkClosing();
+  checkDone();
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright © 2024 Du Yijie.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the “Software”),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * FreeRTOS software timers for the Linux runtime. As on FreeRTOS, a single
+ * timer task runs every callback and pended function, in the order the
+ * calls were made.
+ */
+#ifndef TOYSHELL_HOST_TIMERS_H
+#define TOYSHELL_HOST_TIMERS_H
+
+#include "Arduino_FreeRTOS.h"
+
+typedef struct HostTimer *TimerHandle_t;
+typedef void (*TimerCallbackFunction_t)(TimerHandle_t timer);
+typedef void (*PendedFunction_t)(void *parameter1, uint32_t parameter2);
+
+TimerHandle_t xTimerCreate(const char *name, TickType_t period,
+                           UBaseType_t autoReload, void *id,
+                           TimerCallbackFunction_t callback);
+BaseType_t xTimerStart(TimerHandle_t timer, TickType_t wait);
+BaseType_t xTimerStop(TimerHandle_t timer, TickType_t wait);
+BaseType_t xTimerReset(TimerHandle_t timer, TickType_t wait);
+BaseType_t xTimerChangePeriod(TimerHandle_t timer, TickType_t period,
+                              TickType_t wait);
+BaseType_t xTimerDelete(TimerHandle_t timer, TickType_t wait);
+BaseType_t xTimerPendFunctionCall(PendedFunction_t function, void *parameter1,
+                                  uint32_t parameter2, TickType_t wait);
+void *pvTimerGetTimerID(TimerHandle_t timer);
+
+#endif